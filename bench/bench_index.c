@@ -0,0 +1,145 @@
+/* Compares the per-key hash index with per-segment fences and bloom filters
+ * (on the heap and mapped): heap bytes per key, and the time to route a
+ * lookup to the segment(s) that may hold the key. Segments are written to a
+ * fresh directory under ./logs/; clean up with `make delete`.
+ *
+ *   usage: bench_index [keys] [segments] [lookups]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "lsm_tree.h"
+
+static long heap_in_use() {
+	return (long) mallinfo2().uordblks;
+}
+
+static double seconds_since(struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int compare_ints(const void *a, const void *b) {
+	int x = *(const int*) a, y = *(const int*) b;
+	return (x > y) - (x < y);
+}
+
+/* Writes sorted keys to a new segment, one version each */
+static void write_segment(char *filename, int *keys, int count) {
+	IOOptions io = { IO_BUFFERED, NULL, IO_PRIORITY_HIGH };
+	SegmentWriter *writer = open_segment_writer(filename, CODEC_NONE, &io, NULL);
+	if (!writer)
+		exit(1);
+
+	char line[MAX_LINE_SIZE];
+	for (int i = 0; i < count; i++) {
+		snprintf(line, MAX_LINE_SIZE, "%d,1,value_%d", keys[i], keys[i]);
+		segment_writer_add(writer, line);
+	}
+	if (close_segment_writer(writer) != 0)
+		exit(1);
+}
+
+static void bench_filters(char **files, int segments, int num_keys, int *targets,
+		int lookups, int storage) {
+	long before = heap_in_use();
+	SegmentFences *fences[segments];
+	for (int s = 0; s < segments; s++) {
+		if (!(fences[s] = load_segment_fences(files[s], storage, false)))
+			exit(1);
+	}
+	long bytes = heap_in_use() - before;
+
+	// newest segment first, stopping at the first one that may hold the key
+	struct timespec start;
+	long candidates = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < lookups; i++) {
+		for (int s = segments - 1; s >= 0; s--) {
+			if (fences_may_contain(fences[s], targets[i])) {
+				candidates++;
+				if (targets[i] % segments == s)
+					break;
+			}
+		}
+	}
+	double elapsed = seconds_since(&start);
+
+	printf("%-14s %10.2f %12.1f %14.3f\n", storage == FENCES_MMAP ? "filters (mmap)"
+			: "filters (heap)", (double) bytes / num_keys, elapsed * 1e9 / lookups,
+			(double) candidates / lookups);
+	for (int s = 0; s < segments; s++)
+		free_segment_fences(fences[s]);
+}
+
+int main(int argc, char *argv[]) {
+	int num_keys = argc > 1 ? atoi(argv[1]) : 1000000;
+	int segments = argc > 2 ? atoi(argv[2]) : 8;
+	int lookups = argc > 3 ? atoi(argv[3]) : 1000000;
+
+	char directory[FILENAME_SIZE];
+	snprintf(directory, FILENAME_SIZE, "%sbench_index_%d/", SEGMENT_LOCATION, (int) getpid());
+	mkdir(SEGMENT_LOCATION, 0755);
+	if (mkdir(directory, 0755) != 0) {
+		fprintf(stderr, "could not create %s\n", directory);
+		return 1;
+	}
+
+	int *keys = (int*) malloc(num_keys * sizeof(int));
+	int *targets = (int*) malloc(lookups * sizeof(int));
+	if (!keys || !targets)
+		return 1;
+	unsigned int seed = 42;
+	for (int i = 0; i < lookups; i++)
+		targets[i] = rand_r(&seed) % num_keys;
+
+	// segment s holds the keys congruent to s, like flushes of uniformly
+	// spread writes: every segment covers the whole key range
+	char *files[segments];
+	for (int s = 0; s < segments; s++) {
+		int count = 0;
+		for (int key = s; key < num_keys; key += segments)
+			keys[count++] = key;
+		qsort(keys, count, sizeof(int), compare_ints);
+
+		files[s] = (char*) malloc(2 * FILENAME_SIZE);
+		snprintf(files[s], 2 * FILENAME_SIZE, "%ssegment_%d.log", directory, s);
+		write_segment(files[s], keys, count);
+	}
+
+	printf("%d keys in %d segments, %d lookups\n", num_keys, segments, lookups);
+	printf("%-14s %10s %12s %14s\n", "index", "bytes/key", "ns/lookup", "segments/get");
+
+	// the hash index, sized like a well-provisioned table (one slot per key)
+	long before = heap_in_use();
+	Index *index = init_index(num_keys);
+	for (int key = 0; key < num_keys; key++)
+		index_insert(index, key, files[key % segments]);
+	long bytes = heap_in_use() - before;
+
+	struct timespec start;
+	long found = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < lookups; i++)
+		found += index_lookup(index, targets[i]) != NULL;
+	double elapsed = seconds_since(&start);
+	printf("%-14s %10.2f %12.1f %14.3f\n", "hash", (double) bytes / num_keys,
+			elapsed * 1e9 / lookups, (double) found / lookups);
+
+	bench_filters(files, segments, num_keys, targets, lookups, FENCES_HEAP);
+	bench_filters(files, segments, num_keys, targets, lookups, FENCES_MMAP);
+
+	for (int s = 0; s < segments; s++) {
+		remove(files[s]);
+		free(files[s]);
+	}
+	rmdir(directory);
+	free(keys);
+	free(targets);
+	return 0;
+}
@@ -0,0 +1,69 @@
+/* Compares the lower-bound kernels used for in-block key search against
+ * plain binary search, over key arrays the size of segment blocks from 1KB
+ * to 64KB of lines (about 16 bytes of line per key).
+ *
+ *   usage: bench_lower_bound [lookups]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "key_search.h"
+
+#define BYTES_PER_KEY 16
+
+static double nanos_per_lookup(lower_bound_fn fn, int32_t *keys, int count,
+		int *targets, int lookups) {
+	struct timespec start, end;
+	long checksum = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < lookups; i++)
+		checksum += fn(keys, count, targets[i]);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	// keep the searches from being optimized away
+	if (checksum < 0)
+		printf("%ld\n", checksum);
+	return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / lookups;
+}
+
+int main(int argc, char *argv[]) {
+	int lookups = argc > 1 ? atoi(argv[1]) : 2000000;
+	int *targets = (int*) malloc(lookups * sizeof(int));
+	if (!targets)
+		return 1;
+
+	printf("dispatch picks: %s\n", lower_bound_kernel_name(active_lower_bound_kernel()));
+	printf("%10s %6s", "block", "keys");
+	for (int k = 0; k < NUM_SEARCH_KERNELS; k++)
+		printf(" %10s", lower_bound_kernel_name(k));
+	printf("   (ns/lookup)\n");
+
+	for (int block = 1024; block <= 65536; block *= 2) {
+		int count = block / BYTES_PER_KEY;
+		int32_t *keys = (int32_t*) malloc(count * sizeof(int32_t));
+		if (!keys)
+			return 1;
+
+		// sorted keys with gaps, so about half the lookups miss
+		for (int i = 0; i < count; i++)
+			keys[i] = i * 2;
+		unsigned int seed = block;
+		for (int i = 0; i < lookups; i++)
+			targets[i] = rand_r(&seed) % (count * 2 + 1);
+
+		printf("%9dB %6d", block, count);
+		for (int k = 0; k < NUM_SEARCH_KERNELS; k++) {
+			lower_bound_fn fn = lower_bound_kernel(k);
+			if (fn)
+				printf(" %10.1f", nanos_per_lookup(fn, keys, count, targets, lookups));
+			else
+				printf(" %10s", "n/a");
+		}
+		printf("\n");
+		free(keys);
+	}
+	free(targets);
+	return 0;
+}
@@ -0,0 +1,125 @@
+/* Times memtable inserts, lookups, in-order iteration and deletes for keys
+ * arriving in sequential, reverse and random order, and reports the height
+ * the tree ends up with and how many keys took the append fast path. For comparison, the same inserts go into a plain
+ * unbalanced binary search tree, like the memtable used to be, which
+ * degenerates into a list (quadratic time) on sorted input, so keep the key
+ * count modest.
+ *
+ *   usage: bench_memtable [keys]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+
+#include "memtable.h"
+
+typedef struct plain_node {
+	int key;
+	struct plain_node *left;
+	struct plain_node *right;
+} PlainNode;
+
+static double elapsed_ms(struct timespec *from, struct timespec *to) {
+	return (to->tv_sec - from->tv_sec) * 1e3 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+static void fill_keys(int *keys, int count, int order) {
+	for (int i = 0; i < count; i++)
+		keys[i] = order == 1 ? count - i : i + 1;
+	if (order == 2) {
+		unsigned int seed = 1;
+		for (int i = count - 1; i > 0; i--) {
+			int j = rand_r(&seed) % (i + 1);
+			int swap = keys[i];
+			keys[i] = keys[j];
+			keys[j] = swap;
+		}
+	}
+}
+
+/* Inserts into an unbalanced tree; returns its height */
+static int plain_inserts(int *keys, int count) {
+	PlainNode *nodes = (PlainNode*) calloc(count, sizeof(PlainNode));
+	PlainNode *root = NULL;
+	int tallest = 0;
+	for (int i = 0; i < count; i++) {
+		PlainNode **link = &root;
+		int depth = 1;
+		while (*link) {
+			link = keys[i] < (*link)->key ? &(*link)->left : &(*link)->right;
+			depth++;
+		}
+		*link = nodes + i;
+		(*link)->key = keys[i];
+		if (depth > tallest)
+			tallest = depth;
+	}
+	free(nodes);
+	return tallest;
+}
+
+int main(int argc, char *argv[]) {
+	int count = argc > 1 ? atoi(argv[1]) : 20000;
+	if (count < 1)
+		return 1;
+	int *keys = (int*) malloc(count * sizeof(int));
+	char *names[] = { "sequential", "reverse", "random" };
+	struct timespec start, end;
+
+	// hard deletes report each key on stdout; results go to stderr
+	if (!freopen("/dev/null", "w", stdout))
+		return 1;
+
+	fprintf(stderr, "%d keys\n", count);
+	fprintf(stderr, "%-11s %10s %10s %10s %10s %7s %9s | %13s %7s\n", "order", "insert ms",
+			"search ms", "iterate ms", "delete ms", "height", "appended", "unbalanced ms",
+			"height");
+	for (int order = 0; order < 3; order++) {
+		fill_keys(keys, count, order);
+		Memtable *memtable = init_memtable(LONG_MAX);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int i = 0; i < count; i++)
+			memtable_insert(memtable, keys[i], "value", i + 1);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double insert_ms = elapsed_ms(&start, &end);
+		int height = memtable->root ? memtable->root->height : 0;
+		int appended = memtable->tail_count;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		int found = 0;
+		for (int i = 0; i < count; i++)
+			found += search_memtable(memtable, keys[i]) != NULL;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double search_ms = elapsed_ms(&start, &end);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		MemtableIterator iterator;
+		memtable_iterator_seek(&iterator, memtable, INT_MIN);
+		int visited = 0;
+		while (memtable_iterator_next(&iterator))
+			visited++;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double iterate_ms = elapsed_ms(&start, &end);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int i = 0; i < count; i++)
+			memtable_delete(memtable, keys[i], true, NULL, 0);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double delete_ms = elapsed_ms(&start, &end);
+		if (found != count || visited != count || memtable->root != NULL)
+			fprintf(stderr, "memtable lost keys: found %d, visited %d\n", found, visited);
+		delete_memtable(memtable);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		int plain_height = plain_inserts(keys, count);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		fprintf(stderr, "%-11s %10.2f %10.2f %10.2f %10.2f %7d %9d | %13.2f %7d\n",
+				names[order], insert_ms, search_ms, iterate_ms, delete_ms, height, appended,
+				elapsed_ms(&start, &end), plain_height);
+	}
+	free(keys);
+	return 0;
+}
@@ -0,0 +1,108 @@
+/* Compares deleting a contiguous run of keys one DELETE at a time with a
+ * single range delete. Each run loads the same keys into a fresh tree under
+ * ./logs/, deletes the middle half of them, and reports the time and WAL
+ * bytes the delete took, then the time to confirm the keys are gone with
+ * point lookups and with a scan. Clean up with `make delete`.
+ *
+ *   usage: bench_range_delete [keys]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lsm_tree.h"
+
+typedef struct result {
+	double delete_ms;
+	long wal_bytes;
+	double get_ms;
+	double scan_ms;
+	int survivors;
+} Result;
+
+static double elapsed_ms(struct timespec *from, struct timespec *to) {
+	return (to->tv_sec - from->tv_sec) * 1e3 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+static Result run(int keys, bool ranged) {
+	char directory[FILENAME_SIZE];
+	snprintf(directory, FILENAME_SIZE, "%sbench_range_%d_%d/", SEGMENT_LOCATION,
+			(int) getpid(), ranged);
+	LSM_Tree *lsm_tree = init_lsm_tree(directory, NULL);
+	if (!lsm_tree)
+		exit(1);
+
+	char value[32];
+	for (int key = 1; key <= keys; key++) {
+		snprintf(value, sizeof(value), "value_%d", key);
+		Submission submission = { ADD, key, value, 0, 0 };
+		if (handle_submission(lsm_tree, &submission) != 0) {
+			fprintf(stderr, "write of key %d failed\n", key);
+			exit(1);
+		}
+	}
+
+	Result result = { 0 };
+	int start_key = keys / 4 + 1, end_key = keys / 4 * 3;
+	struct timespec start, end;
+	long wal_before = lsm_tree->wal->written;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (ranged) {
+		if (lsm_tree_delete_range(lsm_tree, start_key, end_key) != 0)
+			exit(1);
+	} else {
+		for (int key = start_key; key <= end_key; key++) {
+			Submission submission = { DELETE, key, NULL, 0, 0 };
+			if (handle_submission(lsm_tree, &submission) != 0)
+				exit(1);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	result.delete_ms = elapsed_ms(&start, &end);
+	result.wal_bytes = lsm_tree->wal->written - wal_before;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int key = start_key; key <= end_key; key++) {
+		char *found = lsm_tree_get(lsm_tree, key, NULL);
+		result.survivors += found != NULL;
+		free(found);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	result.get_ms = elapsed_ms(&start, &end);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ScanIterator *scan = lsm_tree_scan(lsm_tree, start_key, end_key, NULL);
+	if (!scan)
+		exit(1);
+	result.survivors += scan->count;
+	close_scan_iterator(scan);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	result.scan_ms = elapsed_ms(&start, &end);
+
+	shutdown_lsm_system(lsm_tree);
+	return result;
+}
+
+int main(int argc, char *argv[]) {
+	int keys = argc > 1 ? atoi(argv[1]) : 100000;
+	if (keys < 4) {
+		fprintf(stderr, "need at least 4 keys\n");
+		return 1;
+	}
+
+	// the engine reports flushes and compactions on stdout; results go to stderr
+	if (!freopen("/dev/null", "w", stdout))
+		return 1;
+
+	fprintf(stderr, "deleting %d of %d keys\n", keys / 2, keys);
+	fprintf(stderr, "%-12s %12s %12s %12s %12s %10s\n", "method", "delete ms", "wal bytes",
+			"gets ms", "scan ms", "survivors");
+	for (int ranged = 0; ranged <= 1; ranged++) {
+		Result result = run(keys, ranged);
+		fprintf(stderr, "%-12s %12.2f %12ld %12.2f %12.2f %10d\n",
+				ranged ? "range" : "per-key", result.delete_ms, result.wal_bytes,
+				result.get_ms, result.scan_ms, result.survivors);
+	}
+	return 0;
+}
@@ -0,0 +1,83 @@
+/* Measures write throughput of the sharded front end as the number of shards
+ * (and writer threads) grows from 1 to N. Each run writes into a fresh
+ * directory under ./logs/; clean up with `make delete`.
+ *
+ *   usage: bench_shards [max_shards] [writes_per_thread]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "shard.h"
+
+typedef struct writer_args {
+	ShardedLSM *sharded;
+	int writes;
+	unsigned int seed;
+} WriterArgs;
+
+static void* writer(void *arg) {
+	WriterArgs *args = (WriterArgs*) arg;
+	char value[32];
+
+	for (int i = 0; i < args->writes; i++) {
+		int key = rand_r(&args->seed) % 1000000;
+		snprintf(value, sizeof(value), "value_%d", key);
+		Submission submission = { ADD, key, value, 0 };
+		if (sharded_submit(args->sharded, &submission) != 0) {
+			fprintf(stderr, "write of key %d failed\n", key);
+			exit(1);
+		}
+	}
+	return NULL;
+}
+
+static double run(int shards, int writes_per_thread) {
+	char directory[FILENAME_SIZE];
+	snprintf(directory, FILENAME_SIZE, "%sbench_%d_%d/", SEGMENT_LOCATION, (int) getpid(),
+			shards);
+	ShardedLSM *sharded = init_sharded_lsm(directory, shards, shards, NULL);
+	if (!sharded)
+		exit(1);
+
+	pthread_t threads[shards];
+	WriterArgs args[shards];
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int i = 0; i < shards; i++) {
+		args[i] = (WriterArgs) { sharded, writes_per_thread, (unsigned int) i + 1 };
+		pthread_create(threads + i, NULL, writer, args + i);
+	}
+	for (int i = 0; i < shards; i++)
+		pthread_join(threads[i], NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	shutdown_sharded_lsm(sharded);
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	return (double) shards * writes_per_thread / seconds;
+}
+
+int main(int argc, char *argv[]) {
+	int max_shards = argc > 1 ? atoi(argv[1]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+	int writes = argc > 2 ? atoi(argv[2]) : 20000;
+	if (max_shards > MAX_SHARDS)
+		max_shards = MAX_SHARDS;
+
+	// the engine reports flushes and compactions on stdout; results go to stderr
+	if (!freopen("/dev/null", "w", stdout))
+		return 1;
+
+	double baseline = 0;
+	fprintf(stderr, "%8s %14s %9s\n", "shards", "writes/sec", "speedup");
+	for (int shards = 1; shards <= max_shards; shards *= 2) {
+		double throughput = run(shards, writes);
+		if (shards == 1)
+			baseline = throughput;
+		fprintf(stderr, "%8d %14.0f %8.2fx\n", shards, throughput, throughput / baseline);
+	}
+	return 0;
+}
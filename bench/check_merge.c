@@ -0,0 +1,154 @@
+/* Checks merge reads against a model while flushes and compaction fold
+ * operands into values. Each key gets a base value and then a stream of
+ * counter operands, with a new base now and then, in a tree under ./logs/
+ * with small memtables, so that memtables fill and flush while the writes
+ * go on. Every write is followed by a get and a slice read of a random
+ * key; reads made while a flushed memtable is still queued (its folded
+ * values already in a segment, under the same sequence numbers as its
+ * operands) are counted separately. The latest values, and a snapshot taken
+ * half way through, are checked once the last flush is done and again once
+ * every segment is compacted. Exits 1 if any read disagrees with the model.
+ * Clean up with `make delete`.
+ *
+ *   usage: check_merge [writes] [seed]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lsm_tree.h"
+
+#define CHECK_KEYS 64
+
+static LSM_Tree *lsm_tree;
+static long model[CHECK_KEYS];
+static long reads, queued_reads, mismatches;
+
+/* The number of full memtables waiting to be flushed; flushed is set if the
+ * oldest one's segment is already installed */
+static int queued_memtables(bool *flushed) {
+	pthread_rwlock_rdlock(&lsm_tree->memtable_lock);
+	int queued = lsm_tree->num_immutables;
+	*flushed = queued > 0 && atomic_load(&lsm_tree->immutables[0]->flushed);
+	pthread_rwlock_unlock(&lsm_tree->memtable_lock);
+	return queued;
+}
+
+static void check_key(int key, long want, Snapshot *snapshot, char *phase) {
+	bool queued;
+	queued_memtables(&queued);
+	char *value = lsm_tree_get(lsm_tree, key, snapshot);
+	if (!value || atol(value) != want) {
+		fprintf(stderr, "%s: get of key %d returned %s, want %ld\n", phase, key,
+				value ? value : "nothing", want);
+		mismatches++;
+	}
+	free(value);
+
+	ValueSlice slice;
+	bool found = lsm_tree_get_slice(lsm_tree, key, snapshot, &slice);
+	char copy[MAX_LEN_DATA + 1];
+	snprintf(copy, sizeof(copy), "%.*s", found ? slice.length : 0, found ? slice.data : "");
+	if (!found || atol(copy) != want) {
+		fprintf(stderr, "%s: slice of key %d returned %s, want %ld\n", phase, key,
+				found ? copy : "nothing", want);
+		mismatches++;
+	}
+	release_slice(&slice);
+	reads++;
+	queued_reads += queued;
+}
+
+static void check_all(long *expected, Snapshot *snapshot, char *phase) {
+	for (int key = 0; key < CHECK_KEYS; key++)
+		check_key(key, expected[key], snapshot, phase);
+}
+
+static void write_value(int key, long value, int action) {
+	char text[32];
+	snprintf(text, sizeof(text), "%ld", value);
+	Submission submission = { action, key, text, 0, 0, 0 };
+	if (handle_submission(lsm_tree, &submission) != 0) {
+		fprintf(stderr, "write of key %d failed\n", key);
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	int writes = argc > 1 ? atoi(argv[1]) : 20000;
+	unsigned int seed = argc > 2 ? atoi(argv[2]) : 1;
+
+	// compaction only runs when called below, so the flushed segments pile up
+	LSM_Options options;
+	lsm_default_options(&options);
+	options.merge = merge_add_operator;
+	options.write_buffer_size = 8 << 10;
+	options.wal_sync = WAL_SYNC_NONE;
+	options.max_segments = 1 << 20;
+	options.l0_slowdown_segments = 1 << 20;
+	options.l0_stop_segments = 1 << 20;
+	options.wasted_probe_limit = 0;
+	options.tombstone_compaction_pct = 0;
+	options.idle_ops_per_sec = 0;
+	options.compaction_check_ms = 0;
+
+	// the engine reports flushes and compactions on stdout; results go to stderr
+	if (!freopen("/dev/null", "w", stdout))
+		return 1;
+
+	char directory[FILENAME_SIZE];
+	snprintf(directory, FILENAME_SIZE, "%scheck_merge_%d/", SEGMENT_LOCATION, (int) getpid());
+	lsm_tree = init_lsm_tree(directory, &options);
+	if (!lsm_tree)
+		return 1;
+
+	for (int key = 0; key < CHECK_KEYS; key++) {
+		model[key] = rand_r(&seed) % 1000;
+		write_value(key, model[key], ADD);
+	}
+
+	Snapshot *snapshot = NULL;
+	long at_snapshot[CHECK_KEYS];
+	for (int i = 0; i < writes; i++) {
+		// an occasional new base lets a flush fold the operands above it
+		int key = rand_r(&seed) % CHECK_KEYS;
+		if (rand_r(&seed) % 16 == 0) {
+			model[key] = rand_r(&seed) % 1000;
+			write_value(key, model[key], ADD);
+		} else {
+			long operand = rand_r(&seed) % 10;
+			write_value(key, operand, MERGE);
+			model[key] += operand;
+		}
+		if (i == writes / 2) {
+			snapshot = lsm_tree_snapshot(lsm_tree);
+			memcpy(at_snapshot, model, sizeof(model));
+		}
+
+		int read_key = rand_r(&seed) % CHECK_KEYS;
+		check_key(read_key, model[read_key], NULL, "load");
+	}
+	if (!snapshot) {
+		snapshot = lsm_tree_snapshot(lsm_tree);
+		memcpy(at_snapshot, model, sizeof(model));
+	}
+
+	// keep reading until the last flush is done
+	bool flushed;
+	do {
+		check_all(model, NULL, "flush");
+	} while (queued_memtables(&flushed) > 0);
+	check_all(at_snapshot, snapshot, "flush snapshot");
+
+	if (run_compaction(lsm_tree) != 0)
+		return 1;
+	check_all(model, NULL, "compaction");
+	check_all(at_snapshot, snapshot, "compaction snapshot");
+
+	release_snapshot(lsm_tree, snapshot);
+	shutdown_lsm_system(lsm_tree);
+	fprintf(stderr, "%ld reads, %ld of them with a flushed memtable queued, %ld mismatches\n",
+			reads, queued_reads, mismatches);
+	return mismatches ? 1 : 0;
+}
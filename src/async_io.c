@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "async_io.h"
+#include "thread_pool.h"
+
+// prototypes for static functions
+static int setup_rings(IOContext *io, int queue_depth, int num_rings);
+static int setup_ring(IORing *ring, int queue_depth);
+static bool ring_supports_read(IORing *ring);
+static void teardown_ring(IORing *ring);
+static IORing* take_ring(IOContext *io);
+static void return_ring(IOContext *io, IORing *ring);
+static int ring_reads(IORing *ring, ReadRequest *requests, int count);
+static void pread_task(void *arg);
+static void finish_read(ReadRequest *request);
+
+
+/* Creates an I/O context for the preferred backend. io_uring gets a ring
+ * for each of num_threads concurrent batches. If it can't be set up (old
+ * kernel, seccomp, no IORING_OP_READ, ...), falls back to a pool of
+ * num_threads pread workers. */
+IOContext* init_io_context(int backend, int queue_depth, int num_threads) {
+	IOContext *io = (IOContext*) malloc(sizeof(IOContext));
+	if (io == NULL) {
+		printf("Allocation of memory for I/O context failed.\n");
+		return NULL;
+	}
+	io->backend = backend;
+	io->rings = NULL;
+	io->num_rings = 0;
+	io->idle_rings = NULL;
+	io->num_idle = 0;
+	io->pool = NULL;
+	pthread_mutex_init(&io->ring_lock, NULL);
+	pthread_cond_init(&io->ring_free, NULL);
+
+	if (io->backend == IO_URING
+			&& setup_rings(io, queue_depth, num_threads > 0 ? num_threads : 1) != 0) {
+		printf("> LSM System Alert: io_uring unavailable, reading with a thread pool.\n");
+		io->backend = IO_THREADS;
+	}
+	if (io->backend == IO_THREADS && !(io->pool = init_thread_pool(num_threads))) {
+		free(io->rings);
+		free(io->idle_rings);
+		pthread_mutex_destroy(&io->ring_lock);
+		pthread_cond_destroy(&io->ring_free);
+		free(io);
+		return NULL;
+	}
+	return io;
+}
+
+/* Reads every request, issuing them all before waiting on any. Returns 0
+ * if each request read its full length, otherwise -1 (see each result).
+ * A NULL context reads synchronously, one request after another, and so
+ * does a batch of one, which a single pread serves as well as a ring. */
+int submit_reads(IOContext *io, ReadRequest *requests, int count) {
+	int backend = io ? io->backend : IO_SYNC;
+
+	if (backend == IO_URING && count > 1) {
+		IORing *ring = take_ring(io);
+		int error = ring_reads(ring, requests, count);
+		return_ring(io, ring);
+		if (error)
+			return -1;
+
+	} else if (backend == IO_THREADS && count > 1) {
+		TaskGroup group;
+		init_task_group(&group);
+		for (int i = 0; i < count; i++) {
+			if (thread_pool_submit(io->pool, &group, pread_task, requests + i) != 0)
+				pread_task(requests + i);
+		}
+		task_group_wait(&group);
+		destroy_task_group(&group);
+
+	} else {
+		for (int i = 0; i < count; i++)
+			pread_task(requests + i);
+	}
+
+	int error = 0;
+	for (int i = 0; i < count; i++) {
+		if ((requests + i)->result >= 0 && (requests + i)->result < (requests + i)->length)
+			finish_read(requests + i);
+		if ((requests + i)->result != (requests + i)->length)
+			error = -1;
+	}
+	return error;
+}
+
+void close_io_context(IOContext *io) {
+	for (int i = 0; i < io->num_rings; i++)
+		teardown_ring(io->rings + i);
+	free(io->rings);
+	free(io->idle_rings);
+	if (io->pool)
+		shutdown_thread_pool(io->pool);
+	pthread_mutex_destroy(&io->ring_lock);
+	pthread_cond_destroy(&io->ring_free);
+	free(io);
+}
+
+/* Sets up the pool of rings, all idle. Fails unless the first ring can be
+ * set up and the kernel reads through it; after that, as many rings as
+ * the kernel allows will do. */
+static int setup_rings(IOContext *io, int queue_depth, int num_rings) {
+	io->rings = (IORing*) malloc(num_rings * sizeof(IORing));
+	io->idle_rings = (IORing**) malloc(num_rings * sizeof(IORing*));
+	if (io->rings == NULL || io->idle_rings == NULL) {
+		printf("Allocation of memory for io_uring rings failed.\n");
+		return -1;
+	}
+
+	if (setup_ring(io->rings, queue_depth) != 0)
+		return -1;
+	if (!ring_supports_read(io->rings)) {
+		teardown_ring(io->rings);
+		return -1;
+	}
+	io->num_rings = 1;
+	while (io->num_rings < num_rings && setup_ring(io->rings + io->num_rings, queue_depth) == 0)
+		io->num_rings++;
+
+	for (int i = 0; i < io->num_rings; i++)
+		*(io->idle_rings + i) = io->rings + i;
+	io->num_idle = io->num_rings;
+	return 0;
+}
+
+/* Creates the ring and maps its submission queue, completion queue and
+ * submission entries into our address space */
+static int setup_ring(IORing *ring, int queue_depth) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	ring->fd = syscall(__NR_io_uring_setup, queue_depth, &params);
+	if (ring->fd < 0)
+		return -1;
+
+	ring->entries = params.sq_entries;
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes
+			+ params.cq_entries * sizeof(struct io_uring_cqe);
+	bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single_mmap && ring->cq_ring_size > ring->sq_ring_size)
+		ring->sq_ring_size = ring->cq_ring_size;
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = single_mmap ? ring->sq_ring : mmap(NULL, ring->cq_ring_size,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED
+			|| ring->sqes == MAP_FAILED) {
+		printf("Failed to map io_uring queues.\n");
+		if (ring->sq_ring != MAP_FAILED)
+			munmap(ring->sq_ring, ring->sq_ring_size);
+		if (!single_mmap && ring->cq_ring != MAP_FAILED)
+			munmap(ring->cq_ring, ring->cq_ring_size);
+		if (ring->sqes != MAP_FAILED)
+			munmap(ring->sqes, ring->sqes_size);
+		close(ring->fd);
+		return -1;
+	}
+	if (single_mmap)
+		ring->cq_ring_size = 0;   // shares the submission queue's mapping
+
+	char *sq = (char*) ring->sq_ring;
+	ring->sq_head = (unsigned*) (sq + params.sq_off.head);
+	ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+
+	char *cq = (char*) ring->cq_ring;
+	ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+	ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+	ring->cqes = cq + params.cq_off.cqes;
+	return 0;
+}
+
+/* Asks the kernel whether it supports IORING_OP_READ, which came after
+ * io_uring itself; kernels too old for the probe are too old for the op */
+static bool ring_supports_read(IORing *ring) {
+	int num_ops = IORING_OP_READ + 1;
+	struct io_uring_probe *probe = (struct io_uring_probe*) calloc(1,
+			sizeof(struct io_uring_probe) + num_ops * sizeof(struct io_uring_probe_op));
+	if (probe == NULL)
+		return false;
+
+	bool supported = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE,
+			probe, num_ops) == 0
+			&& probe->last_op >= IORING_OP_READ
+			&& (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return supported;
+}
+
+static void teardown_ring(IORing *ring) {
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring_size)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+}
+
+/* Takes an idle ring for one batch, waiting while every ring is busy */
+static IORing* take_ring(IOContext *io) {
+	pthread_mutex_lock(&io->ring_lock);
+	while (io->num_idle == 0)
+		pthread_cond_wait(&io->ring_free, &io->ring_lock);
+	IORing *ring = *(io->idle_rings + --io->num_idle);
+	pthread_mutex_unlock(&io->ring_lock);
+	return ring;
+}
+
+static void return_ring(IOContext *io, IORing *ring) {
+	pthread_mutex_lock(&io->ring_lock);
+	*(io->idle_rings + io->num_idle++) = ring;
+	pthread_cond_signal(&io->ring_free);
+	pthread_mutex_unlock(&io->ring_lock);
+}
+
+/* Queues up to a ring's worth of reads, submits them with one system call
+ * and reaps every completion before moving on to the next ring's worth. */
+static int ring_reads(IORing *ring, ReadRequest *requests, int count) {
+	for (int done = 0; done < count; ) {
+		int batch = count - done < (int) ring->entries ? count - done : (int) ring->entries;
+
+		unsigned tail = *ring->sq_tail;
+		for (int i = 0; i < batch; i++) {
+			ReadRequest *request = requests + done + i;
+			unsigned slot = tail & *ring->sq_mask;
+			struct io_uring_sqe *sqe = (struct io_uring_sqe*) ring->sqes + slot;
+
+			memset(sqe, 0, sizeof(struct io_uring_sqe));
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = request->fd;
+			sqe->addr = (uint64_t) (uintptr_t) request->buffer;
+			sqe->len = request->length;
+			sqe->off = request->offset;
+			sqe->user_data = done + i;
+			*(ring->sq_array + slot) = slot;
+			tail++;
+		}
+		// the kernel must see the entries before it sees the new tail
+		__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+		int submitted = 0, reaped = 0;
+		while (reaped < batch) {
+			int result = syscall(__NR_io_uring_enter, ring->fd, batch - submitted,
+					batch - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+			if (result < 0 && errno != EINTR) {
+				printf("io_uring submission failed (errno %d).\n", errno);
+				return -1;
+			}
+			if (result > 0)
+				submitted += result;
+
+			unsigned head = *ring->cq_head;
+			while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+				struct io_uring_cqe *cqe = (struct io_uring_cqe*) ring->cqes
+						+ (head & *ring->cq_mask);
+				(requests + cqe->user_data)->result = cqe->res;
+				head++;
+				reaped++;
+			}
+			__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+		}
+		done += batch;
+	}
+	return 0;
+}
+
+/* Thread pool task (and synchronous path): one blocking positioned read */
+static void pread_task(void *arg) {
+	ReadRequest *request = (ReadRequest*) arg;
+	request->result = 0;
+	finish_read(request);
+}
+
+/* Reads whatever part of a request is still missing; regular files only
+ * come up short at end of file, so this rarely loops. */
+static void finish_read(ReadRequest *request) {
+	while (request->result < request->length) {
+		ssize_t got = pread(request->fd, request->buffer + request->result,
+				request->length - request->result, request->offset + request->result);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0) {
+			if (got < 0)
+				request->result = -errno;
+			return;
+		}
+		request->result += got;
+	}
+}
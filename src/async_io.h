@@ -0,0 +1,65 @@
+#ifndef CUSTOM_ASYNC_IO_H
+#define CUSTOM_ASYNC_IO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "thread_pool.h"
+
+enum io_backends {
+	IO_SYNC = 0, IO_URING = 1, IO_THREADS = 2
+};
+
+/* one positioned read; result is the number of bytes read, or -errno */
+typedef struct read_request {
+	int fd;
+	int64_t offset;
+	int length;
+	char *buffer;
+	int result;
+} ReadRequest;
+
+/* the shared memory rings of an io_uring instance, set up without liburing;
+ * the entry types come from <linux/io_uring.h>, which only async_io.c needs */
+typedef struct io_ring {
+	int fd;
+	unsigned entries;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	void *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	void *cqes;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+} IORing;
+
+/* Issues batches of reads together and waits for the whole batch, so a
+ * batch costs about one I/O round trip. Uses io_uring where the kernel
+ * allows it, with a pool of rings so that concurrent batches don't wait on
+ * one another; otherwise a thread pool issuing preads in parallel. */
+typedef struct io_context {
+	int backend;
+	IORing *rings;
+	int num_rings;
+	IORing **idle_rings;         // a batch takes one for its whole round trip
+	int num_idle;
+	pthread_mutex_t ring_lock;   // guards the idle rings
+	pthread_cond_t ring_free;
+	ThreadPool *pool;
+} IOContext;
+
+IOContext* init_io_context(int backend, int queue_depth, int num_threads);
+
+int submit_reads(IOContext *io, ReadRequest *requests, int count);
+
+void close_io_context(IOContext *io);
+
+#endif
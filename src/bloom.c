@@ -0,0 +1,54 @@
+#include <string.h>
+
+#include "bloom.h"
+
+/* Bloom filters over the keys of a segment, so a lookup can tell (almost
+ * always) that a segment doesn't hold a key without reading any of it. Each
+ * key sets BLOOM_PROBES bits, found by double hashing one 64-bit hash. */
+
+/* prototypes for static functions */
+static uint64_t probe_bit(uint64_t hash, int probe, uint64_t num_bits);
+
+
+/* Mixes a key into 64 well-spread bits (the splitmix64 finalizer) */
+uint64_t bloom_hash(int key) {
+	uint64_t x = (uint32_t) key + 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+/* Bytes of filter needed for num_keys keys */
+int bloom_filter_size(int num_keys) {
+	int bits = num_keys * BLOOM_BITS_PER_KEY;
+	return bits < 64 ? 8 : (bits + 7) / 8;
+}
+
+/* Sets the bits of every hashed key in a zeroed-out filter of size bytes */
+void bloom_build(uint64_t *hashes, int num_keys, uint8_t *filter, int size) {
+	uint64_t num_bits = (uint64_t) size * 8;
+	memset(filter, 0, size);
+	for (int i = 0; i < num_keys; i++) {
+		for (int p = 0; p < BLOOM_PROBES; p++) {
+			uint64_t bit = probe_bit(hashes[i], p, num_bits);
+			filter[bit / 8] |= 1 << (bit % 8);
+		}
+	}
+}
+
+/* False if the key was certainly not added to the filter */
+bool bloom_may_contain(const uint8_t *filter, int size, int key) {
+	uint64_t hash = bloom_hash(key);
+	uint64_t num_bits = (uint64_t) size * 8;
+	for (int p = 0; p < BLOOM_PROBES; p++) {
+		uint64_t bit = probe_bit(hash, p, num_bits);
+		if (!(filter[bit / 8] & (1 << (bit % 8))))
+			return false;
+	}
+	return true;
+}
+
+static uint64_t probe_bit(uint64_t hash, int probe, uint64_t num_bits) {
+	uint64_t h1 = hash, h2 = (hash >> 32) | 1;
+	return (h1 + probe * h2) % num_bits;
+}
@@ -0,0 +1,18 @@
+#ifndef CUSTOM_BLOOM_H
+#define CUSTOM_BLOOM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BLOOM_BITS_PER_KEY 10        // ~1% false positives
+#define BLOOM_PROBES 7               // bits set per key (bits per key * ln 2)
+
+uint64_t bloom_hash(int key);
+
+int bloom_filter_size(int num_keys);
+
+void bloom_build(uint64_t *hashes, int num_keys, uint8_t *filter, int size);
+
+bool bloom_may_contain(const uint8_t *filter, int size, int key);
+
+#endif
@@ -0,0 +1,351 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "buffered_io.h"
+
+// prototypes for static functions
+static int open_file(char *filename, int open_flags, int flags, bool *direct);
+static int hand_off(OutputFile *out);
+static int wait_for_writer(OutputFile *out);
+static void* write_behind(void *arg);
+static int write_out(OutputFile *out, char *data, int length, int64_t offset);
+static int write_fully(int fd, char *data, int length, int64_t offset);
+
+
+/* Creates (or truncates) filename for sequential writing */
+OutputFile* open_output_file(char *filename, IOOptions *options) {
+	OutputFile *out = (OutputFile*) malloc(sizeof(OutputFile));
+	if (out == NULL) {
+		printf("Failed to allocate memory for output file.\n");
+		return NULL;
+	}
+
+	out->fd = open_file(filename, O_WRONLY | O_CREAT | O_TRUNC, options->flags,
+			&out->direct);
+	if (out->fd < 0) {
+		free(out);
+		return NULL;
+	}
+	out->limiter = options->limiter;
+	out->priority = options->priority;
+
+	out->buffers[0] = NULL;
+	out->buffers[1] = NULL;
+	if (posix_memalign((void**) &out->buffers[0], IO_ALIGNMENT, IO_BUFFER_SIZE) != 0
+			|| posix_memalign((void**) &out->buffers[1], IO_ALIGNMENT, IO_BUFFER_SIZE) != 0) {
+		printf("Failed to allocate output buffers.\n");
+		free(out->buffers[0]);
+		close(out->fd);
+		free(out);
+		return NULL;
+	}
+
+	out->filling = 0;
+	out->used = 0;
+	out->offset = 0;
+	out->writer_started = false;
+	out->pending = NULL;
+	out->pending_length = 0;
+	out->pending_offset = 0;
+	out->stopping = false;
+	out->error = 0;
+	pthread_mutex_init(&out->lock, NULL);
+	pthread_cond_init(&out->changed, NULL);
+	return out;
+}
+
+/* Appends bytes to the file; full buffers are written in the background.
+ * Returns 0 on success, -1 if this or an earlier write failed. */
+int output_write(OutputFile *out, void *data, int length) {
+	char *bytes = (char*) data;
+
+	while (length > 0) {
+		int room = IO_BUFFER_SIZE - out->used;
+		int n = length < room ? length : room;
+		memcpy(out->buffers[out->filling] + out->used, bytes, n);
+		out->used += n;
+		bytes += n;
+		length -= n;
+
+		if (out->used == IO_BUFFER_SIZE && hand_off(out) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Writes out whatever is buffered, stops the background writer and closes
+ * the file. Frees out either way; returns 0 if every write succeeded. */
+int close_output_file(OutputFile *out) {
+	int error = wait_for_writer(out);
+
+	if (out->writer_started) {
+		pthread_mutex_lock(&out->lock);
+		out->stopping = true;
+		pthread_cond_broadcast(&out->changed);
+		pthread_mutex_unlock(&out->lock);
+		pthread_join(out->writer, NULL);
+	}
+
+	// direct writes must be whole aligned blocks; pad, then cut the padding off
+	int64_t size = out->offset + out->used;
+	int length = out->used;
+	if (out->direct && length % IO_ALIGNMENT != 0) {
+		int padded = (length / IO_ALIGNMENT + 1) * IO_ALIGNMENT;
+		memset(out->buffers[out->filling] + length, 0, padded - length);
+		length = padded;
+	}
+	if (!error && length > 0
+			&& write_out(out, out->buffers[out->filling], length, out->offset) != 0)
+		error = -1;
+	if (!error && length != out->used && ftruncate(out->fd, size) != 0) {
+		printf("Failed to trim padding off output file.\n");
+		error = -1;
+	}
+	if (close(out->fd) != 0)
+		error = -1;
+
+	pthread_mutex_destroy(&out->lock);
+	pthread_cond_destroy(&out->changed);
+	free(out->buffers[0]);
+	free(out->buffers[1]);
+	free(out);
+	return error;
+}
+
+/* Opens filename for sequential reading */
+InputFile* open_input_file(char *filename, int flags) {
+	InputFile *in = (InputFile*) malloc(sizeof(InputFile));
+	if (in == NULL) {
+		printf("Failed to allocate memory for input file.\n");
+		return NULL;
+	}
+
+	in->fd = open_file(filename, O_RDONLY, flags, &in->direct);
+	if (in->fd < 0) {
+		free(in);
+		return NULL;
+	}
+
+	struct stat info;
+	in->window = NULL;
+	if (fstat(in->fd, &info) != 0
+			|| posix_memalign((void**) &in->window, IO_ALIGNMENT, IO_BUFFER_SIZE) != 0) {
+		printf("Failed to set up input file: %s\n", filename);
+		close(in->fd);
+		free(in);
+		return NULL;
+	}
+	in->size = info.st_size;
+	in->window_offset = 0;
+	in->window_length = 0;
+
+	if (!in->direct)
+		posix_fadvise(in->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	return in;
+}
+
+/* Returns a pointer to length bytes at offset, refilling the window if they
+ * aren't in it. The pointer is only good until the next call. Returns NULL
+ * if the bytes are past the end of the file or can't be read. */
+char* input_at(InputFile *in, int64_t offset, int length) {
+	if (offset < 0 || offset + length > in->size)
+		return NULL;
+
+	if (offset < in->window_offset
+			|| offset + length > in->window_offset + in->window_length) {
+		int64_t start = offset - offset % IO_ALIGNMENT;
+		if (offset + length - start > IO_BUFFER_SIZE) {
+			printf("Read of %d bytes is larger than the input window.\n", length);
+			return NULL;
+		}
+
+		int64_t remaining = in->size - start;
+		int want = remaining < IO_BUFFER_SIZE ? remaining : IO_BUFFER_SIZE;
+		if (in->direct && want % IO_ALIGNMENT != 0)
+			want = (want / IO_ALIGNMENT + 1) * IO_ALIGNMENT;
+
+		int got = 0;
+		while (got < want) {
+			ssize_t n = pread(in->fd, in->window + got, want - got, start + got);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0) {
+				printf("Failed to read input file (errno %d).\n", errno);
+				return NULL;
+			}
+			if (n == 0)
+				break;
+			got += n;
+		}
+		in->window_offset = start;
+		in->window_length = got;
+		if (offset + length > start + got)
+			return NULL;
+	}
+	return in->window + (offset - in->window_offset);
+}
+
+void close_input_file(InputFile *in) {
+	close(in->fd);
+	free(in->window);
+	free(in);
+}
+
+/* Gives an immutable file a second name, e.g. in a checkpoint, without
+ * copying it; across file systems, where that can't be done, it is copied.
+ * Returns 0 on success, -1 on failure. */
+int link_file(char *from, char *to) {
+	if (link(from, to) == 0)
+		return 0;
+	if (errno != EXDEV && errno != EPERM) {
+		printf("Could not link %s to %s (errno %d).\n", from, to, errno);
+		return -1;
+	}
+	return copy_file(from, to, -1);
+}
+
+/* Copies the first length bytes of a file (all of it if length is -1) to a
+ * new file, synced before returning. Returns 0 on success, -1 on failure. */
+int copy_file(char *from, char *to, int64_t length) {
+	int in = open(from, O_RDONLY);
+	int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	int error = in < 0 || out < 0 ? -1 : 0;
+	char buffer[IO_ALIGNMENT];
+	int64_t offset = 0;
+	while (!error && (length < 0 || offset < length)) {
+		int wanted = length < 0 || length - offset > sizeof(buffer) ? sizeof(buffer)
+				: (int) (length - offset);
+		ssize_t n = pread(in, buffer, wanted, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			error = n < 0 || length >= 0 ? -1 : 0;
+			break;
+		}
+		error = write_fully(out, buffer, n, offset);
+		offset += n;
+	}
+	if (!error && fsync(out) != 0)
+		error = -1;
+	if (error)
+		printf("Could not copy %s to %s.\n", from, to);
+	if (in >= 0)
+		close(in);
+	if (out >= 0)
+		close(out);
+	return error;
+}
+
+/* Opens with O_DIRECT if asked, falling back to buffered I/O on file
+ * systems that don't support it */
+static int open_file(char *filename, int open_flags, int flags, bool *direct) {
+	int fd = -1;
+	*direct = false;
+
+	if (flags & IO_DIRECT) {
+		fd = open(filename, open_flags | O_DIRECT, 0644);
+		*direct = fd >= 0;
+	}
+	if (fd < 0)
+		fd = open(filename, open_flags, 0644);
+	if (fd < 0)
+		printf("Could not open file: %s\n", filename);
+	return fd;
+}
+
+/* Gives the full buffer to the background writer and switches to the other */
+static int hand_off(OutputFile *out) {
+	if (wait_for_writer(out) != 0)
+		return -1;
+
+	if (!out->writer_started) {
+		if (pthread_create(&out->writer, NULL, write_behind, out) != 0) {
+			// no thread to spare; write synchronously instead, the error sticking
+			// as the writer's would, so that close_output_file() still fails
+			int error = write_out(out, out->buffers[out->filling], out->used, out->offset);
+			if (error)
+				out->error = -1;
+			out->offset += out->used;
+			out->used = 0;
+			return error;
+		}
+		out->writer_started = true;
+	}
+
+	pthread_mutex_lock(&out->lock);
+	out->pending = out->buffers[out->filling];
+	out->pending_length = out->used;
+	out->pending_offset = out->offset;
+	pthread_cond_broadcast(&out->changed);
+	pthread_mutex_unlock(&out->lock);
+
+	out->offset += out->used;
+	out->used = 0;
+	out->filling = 1 - out->filling;
+	return 0;
+}
+
+/* Waits until the background writer is idle; returns its error status */
+static int wait_for_writer(OutputFile *out) {
+	pthread_mutex_lock(&out->lock);
+	while (out->pending)
+		pthread_cond_wait(&out->changed, &out->lock);
+	int error = out->error;
+	pthread_mutex_unlock(&out->lock);
+	return error;
+}
+
+static void* write_behind(void *arg) {
+	OutputFile *out = (OutputFile*) arg;
+
+	pthread_mutex_lock(&out->lock);
+	while (1) {
+		while (!out->pending && !out->stopping)
+			pthread_cond_wait(&out->changed, &out->lock);
+		if (!out->pending)
+			break;
+
+		char *data = out->pending;
+		int length = out->pending_length;
+		int64_t offset = out->pending_offset;
+		pthread_mutex_unlock(&out->lock);
+
+		int error = write_out(out, data, length, offset);
+
+		pthread_mutex_lock(&out->lock);
+		if (error)
+			out->error = -1;
+		out->pending = NULL;
+		pthread_cond_broadcast(&out->changed);
+	}
+	pthread_mutex_unlock(&out->lock);
+	return NULL;
+}
+
+/* Writes a buffer once the rate limiter allows it */
+static int write_out(OutputFile *out, char *data, int length, int64_t offset) {
+	if (out->limiter)
+		rate_limiter_request(out->limiter, length, out->priority);
+	return write_fully(out->fd, data, length, offset);
+}
+
+static int write_fully(int fd, char *data, int length, int64_t offset) {
+	while (length > 0) {
+		ssize_t n = pwrite(fd, data, length, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			printf("Failed to write output file (errno %d).\n", errno);
+			return -1;
+		}
+		data += n;
+		length -= n;
+		offset += n;
+	}
+	return 0;
+}
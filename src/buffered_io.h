@@ -0,0 +1,76 @@
+#ifndef CUSTOM_BUFFERED_IO_H
+#define CUSTOM_BUFFERED_IO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "rate_limiter.h"
+
+#define IO_BUFFER_SIZE (1 << 20)     // bytes per read-ahead window or write-behind buffer
+#define IO_ALIGNMENT 4096            // O_DIRECT alignment of buffers, offsets and lengths
+
+enum io_flags {
+	IO_BUFFERED = 0, IO_DIRECT = 1
+};
+
+/* how a file is written: whether to bypass the page cache, and which rate
+ * limiter (if any) paces the writes, at what priority */
+typedef struct io_options {
+	int flags;
+	RateLimiter *limiter;
+	int priority;
+} IOOptions;
+
+/* A file written sequentially through two large buffers: while one fills,
+ * the other is written out by a background thread. With IO_DIRECT the file
+ * bypasses the page cache; the final partial buffer is padded to the
+ * alignment and the padding truncated away on close. */
+typedef struct output_file {
+	int fd;
+	bool direct;
+	RateLimiter *limiter;
+	int priority;
+	char *buffers[2];
+	int filling;
+	int used;
+	int64_t offset;
+	bool writer_started;
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	char *pending;           // buffer handed to the writer thread, NULL when idle
+	int pending_length;
+	int64_t pending_offset;
+	bool stopping;
+	int error;
+} OutputFile;
+
+/* A file read through a large window that is refilled as reads move past
+ * it; the kernel is told to read ahead sequentially. */
+typedef struct input_file {
+	int fd;
+	bool direct;
+	int64_t size;
+	char *window;
+	int64_t window_offset;
+	int window_length;
+} InputFile;
+
+OutputFile* open_output_file(char *filename, IOOptions *options);
+
+int output_write(OutputFile *out, void *data, int length);
+
+int close_output_file(OutputFile *out);
+
+InputFile* open_input_file(char *filename, int flags);
+
+char* input_at(InputFile *in, int64_t offset, int length);
+
+void close_input_file(InputFile *in);
+
+int link_file(char *from, char *to);
+
+int copy_file(char *from, char *to, int64_t length);
+
+#endif
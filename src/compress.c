@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "compress.h"
+
+/* A small LZ77-family block codec, in the spirit of LZ4. A compressed block is
+ * a series of sequences; each sequence is a token byte (high nibble: literal
+ * length, low nibble: match length - LZ_MIN_MATCH, 15 meaning "more bytes
+ * follow"), the literals themselves, then a two-byte little-endian offset and
+ * any extra match length bytes. The final sequence carries literals only. */
+
+/* prototypes for static functions */
+static uint32_t read32(const char *p);
+static int hash_sequence(uint32_t sequence);
+static int write_length(char *dst, int out, int dst_capacity, int length);
+static int emit_sequence(char *dst, int out, int dst_capacity, const char *literals,
+						 int literal_len, int offset, int match_len);
+
+
+/* Worst case size of compressing src_len bytes of incompressible data */
+int lz_max_compressed_size(int src_len) {
+	return src_len + (src_len / 255) + 16;
+}
+
+/* Compresses src into dst; returns the compressed size, or -1 if the
+ * output would not fit in dst_capacity bytes. */
+int lz_compress(const char *src, int src_len, char *dst, int dst_capacity) {
+	int table[1 << LZ_HASH_BITS];
+	for (int i = 0; i < (1 << LZ_HASH_BITS); i++)
+		table[i] = -1;
+
+	int anchor = 0, pos = 0, out = 0;
+
+	while (pos + LZ_MIN_MATCH <= src_len) {
+		uint32_t sequence = read32(src + pos);
+		int slot = hash_sequence(sequence);
+		int candidate = table[slot];
+		table[slot] = pos;
+
+		if (candidate < 0 || pos - candidate > LZ_MAX_OFFSET
+				|| read32(src + candidate) != sequence) {
+			pos++;
+			continue;
+		}
+
+		// extend the match as far as the input allows
+		int match_len = LZ_MIN_MATCH;
+		while (pos + match_len < src_len
+				&& src[candidate + match_len] == src[pos + match_len])
+			match_len++;
+
+		out = emit_sequence(dst, out, dst_capacity, src + anchor,
+				pos - anchor, pos - candidate, match_len);
+		if (out < 0)
+			return -1;
+
+		pos += match_len;
+		anchor = pos;
+	}
+
+	// trailing literals close out the block
+	return emit_sequence(dst, out, dst_capacity, src + anchor,
+			src_len - anchor, 0, 0);
+}
+
+/* Decompresses src into dst; returns the decompressed size, or -1 if the
+ * input is malformed or does not fit in dst_capacity bytes. */
+int lz_decompress(const char *src, int src_len, char *dst, int dst_capacity) {
+	const unsigned char *ip = (const unsigned char*) src;
+	const unsigned char *in_end = ip + src_len;
+	int out = 0;
+
+	while (ip < in_end) {
+		int token = *ip++;
+
+		int literal_len = token >> 4;
+		if (literal_len == 15) {
+			while (ip < in_end) {
+				int extra = *ip++;
+				literal_len += extra;
+				if (extra != 255)
+					break;
+			}
+		}
+		if (literal_len > in_end - ip || literal_len > dst_capacity - out)
+			return -1;
+		memcpy(dst + out, ip, literal_len);
+		ip += literal_len;
+		out += literal_len;
+
+		// the final sequence has no match part
+		if (ip == in_end)
+			break;
+
+		if (in_end - ip < 2)
+			return -1;
+		int offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		int match_len = token & 0x0F;
+		if (match_len == 15) {
+			while (ip < in_end) {
+				int extra = *ip++;
+				match_len += extra;
+				if (extra != 255)
+					break;
+			}
+		}
+		match_len += LZ_MIN_MATCH;
+
+		if (offset == 0 || offset > out || match_len > dst_capacity - out)
+			return -1;
+
+		// byte by byte, since the match may overlap what it is copying
+		for (int i = 0; i < match_len; i++, out++)
+			dst[out] = dst[out - offset];
+	}
+	return out;
+}
+
+static uint32_t read32(const char *p) {
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+/* Multiplicative (Fibonacci) hash of four bytes of input */
+static int hash_sequence(uint32_t sequence) {
+	return (int) ((sequence * 2654435761U) >> (32 - LZ_HASH_BITS));
+}
+
+/* Writes the continuation bytes of a length that overflowed its nibble */
+static int write_length(char *dst, int out, int dst_capacity, int length) {
+	while (length >= 255) {
+		if (out >= dst_capacity)
+			return -1;
+		dst[out++] = (char) 255;
+		length -= 255;
+	}
+	if (out >= dst_capacity)
+		return -1;
+	dst[out++] = (char) length;
+	return out;
+}
+
+/* Appends one sequence to dst; a match_len of 0 marks the final,
+ * literal-only sequence. Returns the new output size or -1 if full. */
+static int emit_sequence(char *dst, int out, int dst_capacity, const char *literals,
+						 int literal_len, int offset, int match_len) {
+	if (out >= dst_capacity)
+		return -1;
+
+	int token_pos = out++;
+	int token = (literal_len >= 15 ? 15 : literal_len) << 4;
+
+	if (literal_len >= 15 && (out = write_length(dst, out, dst_capacity,
+			literal_len - 15)) < 0)
+		return -1;
+
+	if (literal_len > dst_capacity - out)
+		return -1;
+	memcpy(dst + out, literals, literal_len);
+	out += literal_len;
+
+	if (match_len) {
+		int extra = match_len - LZ_MIN_MATCH;
+		token |= (extra >= 15 ? 15 : extra);
+
+		if (dst_capacity - out < 2)
+			return -1;
+		dst[out++] = (char) (offset & 0xFF);
+		dst[out++] = (char) (offset >> 8);
+
+		if (extra >= 15 && (out = write_length(dst, out, dst_capacity,
+				extra - 15)) < 0)
+			return -1;
+	}
+	dst[token_pos] = (char) token;
+	return out;
+}
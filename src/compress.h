@@ -0,0 +1,18 @@
+#ifndef CUSTOM_COMPRESS_H
+#define CUSTOM_COMPRESS_H
+
+#define LZ_MIN_MATCH 4             // shortest back-reference worth encoding
+#define LZ_HASH_BITS 12            // size of the match finder table (2^bits)
+#define LZ_MAX_OFFSET 65535        // back-references are encoded in two bytes
+
+enum block_codecs {
+	CODEC_NONE = 0, CODEC_LZ = 1
+};
+
+int lz_compress(const char *src, int src_len, char *dst, int dst_capacity);
+
+int lz_decompress(const char *src, int src_len, char *dst, int dst_capacity);
+
+int lz_max_compressed_size(int src_len);
+
+#endif
@@ -97,11 +97,12 @@ int index_remove(Index *index, int key) {
 	while (entries) {
 		if (entries->key == key) {
 			if (trail)
-				trail->next = NULL;
-			if (entries->next)
 				trail->next = entries->next;
+			else
+				*(index->contents + position) = entries->next;
 
-			*(index->contents + position) = trail;
+			if (!*(index->contents + position))
+				index->positions_filled--;
 			free(entries);
 			return 0;
 		}
@@ -114,6 +115,37 @@ int index_remove(Index *index, int key) {
 	return -1;
 }
 
+/* Points every entry for a key in [low_key, high_key] that refers to
+ * old_value at new_value instead, or removes it if new_value is NULL; used
+ * when compaction replaces segment files that keys were indexed against. */
+void index_replace_value(Index *index, char *old_value, char *new_value,
+		int low_key, int high_key) {
+	for (int i = 0; i < index->capacity; i++) {
+		Entry *entries = *(index->contents + i);
+		Entry *trail = NULL;
+		bool filled = entries != NULL;
+		while (entries) {
+			Entry *next = entries->next;
+			if (entries->value != old_value || entries->key < low_key
+					|| entries->key > high_key) {
+				trail = entries;
+			} else if (new_value) {
+				entries->value = new_value;
+				trail = entries;
+			} else {
+				if (trail)
+					trail->next = next;
+				else
+					*(index->contents + i) = next;
+				free(entries);
+			}
+			entries = next;
+		}
+		if (filled && !*(index->contents + i))
+			index->positions_filled--;
+	}
+}
+
 bool index_is_full(Index *index) {
 	if (index->positions_filled == index->capacity) {
 		return true;
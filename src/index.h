@@ -26,6 +26,9 @@ char* index_lookup(Index *index, int key);
 
 int index_remove(Index *index, int key);
 
+void index_replace_value(Index *index, char *old_value, char *new_value,
+		int low_key, int high_key);
+
 bool index_is_full(Index *index);
 
 int hash(int key, int m);
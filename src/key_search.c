@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+#include "key_search.h"
+
+/* Lower-bound search over the sorted fixed-width key arrays stored in segment
+ * blocks. Binary search narrows the range to SEARCH_LINEAR_WINDOW keys; the
+ * vector kernels then compare 4 (SSE4.1) or 8 (AVX2) keys per instruction,
+ * counting how many are below the key, since in a sorted array those form a
+ * prefix. The kernel is picked once, by what the CPU supports. */
+
+/* prototypes for static functions */
+static int lower_bound_scalar(const int32_t *keys, int count, int key);
+static int narrow(const int32_t *keys, int count, int key, int *high);
+static void pick_kernel();
+#ifdef HAVE_X86_KERNELS
+static int lower_bound_sse41(const int32_t *keys, int count, int key);
+static int lower_bound_avx2(const int32_t *keys, int count, int key);
+#endif
+
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+static int active_kernel = SEARCH_SCALAR;
+static lower_bound_fn active_fn = lower_bound_scalar;
+
+
+/* Position of the first key >= key, using the fastest kernel available */
+int key_lower_bound(const int32_t *keys, int count, int key) {
+	pthread_once(&kernel_once, pick_kernel);
+	return active_fn(keys, count, key);
+}
+
+/* Returns the given kernel, or NULL if this CPU (or build) can't run it;
+ * lets benchmarks compare kernels directly */
+lower_bound_fn lower_bound_kernel(int kernel) {
+	switch (kernel) {
+	case SEARCH_SCALAR:
+		return lower_bound_scalar;
+#ifdef HAVE_X86_KERNELS
+	case SEARCH_SSE41:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sse4.1") ? lower_bound_sse41 : NULL;
+	case SEARCH_AVX2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") ? lower_bound_avx2 : NULL;
+#endif
+	default:
+		return NULL;
+	}
+}
+
+const char* lower_bound_kernel_name(int kernel) {
+	switch (kernel) {
+	case SEARCH_SSE41:
+		return "sse4.1";
+	case SEARCH_AVX2:
+		return "avx2";
+	default:
+		return "scalar";
+	}
+}
+
+int active_lower_bound_kernel() {
+	pthread_once(&kernel_once, pick_kernel);
+	return active_kernel;
+}
+
+static void pick_kernel() {
+	for (int kernel = NUM_SEARCH_KERNELS - 1; kernel > SEARCH_SCALAR; kernel--) {
+		lower_bound_fn fn = lower_bound_kernel(kernel);
+		if (fn) {
+			active_kernel = kernel;
+			active_fn = fn;
+			return;
+		}
+	}
+}
+
+/* Plain binary search; the fallback kernel and the benchmark baseline */
+static int lower_bound_scalar(const int32_t *keys, int count, int key) {
+	int low = 0, high = count;
+	while (low < high) {
+		int mid = low + (high - low) / 2;
+		if (keys[mid] < key)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+/* Binary search until at most SEARCH_LINEAR_WINDOW keys remain; the answer
+ * lies in [returned low, *high] */
+static int narrow(const int32_t *keys, int count, int key, int *high) {
+	int low = 0;
+	*high = count;
+	while (*high - low > SEARCH_LINEAR_WINDOW) {
+		int mid = low + (*high - low) / 2;
+		if (keys[mid] < key)
+			low = mid + 1;
+		else
+			*high = mid;
+	}
+	return low;
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse4.1")))
+static int lower_bound_sse41(const int32_t *keys, int count, int key) {
+	int high;
+	int low = narrow(keys, count, key, &high);
+	__m128i target = _mm_set1_epi32(key);
+
+	// each lane below the key adds one; stop at the first lane that isn't
+	for (; low + 4 <= high; low += 4) {
+		__m128i chunk = _mm_loadu_si128((const __m128i*) (keys + low));
+		int below = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(target, chunk)));
+		if (below != 0xF)
+			return low + __builtin_popcount(below);
+	}
+	while (low < high && keys[low] < key)
+		low++;
+	return low;
+}
+
+__attribute__((target("avx2")))
+static int lower_bound_avx2(const int32_t *keys, int count, int key) {
+	int high;
+	int low = narrow(keys, count, key, &high);
+	__m256i target = _mm256_set1_epi32(key);
+
+	for (; low + 8 <= high; low += 8) {
+		__m256i chunk = _mm256_loadu_si256((const __m256i*) (keys + low));
+		int below = _mm256_movemask_ps(_mm256_castsi256_ps(
+				_mm256_cmpgt_epi32(target, chunk)));
+		if (below != 0xFF)
+			return low + __builtin_popcount(below);
+	}
+	while (low < high && keys[low] < key)
+		low++;
+	return low;
+}
+#endif
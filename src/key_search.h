@@ -0,0 +1,24 @@
+#ifndef CUSTOM_KEY_SEARCH_H
+#define CUSTOM_KEY_SEARCH_H
+
+#include <stdint.h>
+
+#define SEARCH_LINEAR_WINDOW 64      // keys left when binary search hands off to a scan
+
+enum search_kernels {
+	SEARCH_SCALAR, SEARCH_SSE41, SEARCH_AVX2, NUM_SEARCH_KERNELS
+};
+
+/* finds the position of the first key >= key in a sorted array of count
+ * keys (count if there is none) */
+typedef int (*lower_bound_fn)(const int32_t *keys, int count, int key);
+
+int key_lower_bound(const int32_t *keys, int count, int key);
+
+lower_bound_fn lower_bound_kernel(int kernel);
+
+const char* lower_bound_kernel_name(int kernel);
+
+int active_lower_bound_kernel();
+
+#endif
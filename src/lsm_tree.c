@@ -3,6 +3,10 @@
 #include <string.h>
 #include <time.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "lsm_tree.h"
 #include "error.h"
@@ -10,70 +14,500 @@
 #include "segment.h"
 #include "wal.h"
 #include "index.h"
+#include "value_log.h"
+#include "version.h"
+
+/* the versions of a key gathered to fold its merge operands: the operands,
+ * newest first, down to the base beneath them (a copy of a value, delete or
+ * value log pointer, or NULL if there is none) */
+typedef struct merge_walk {
+	int key;
+	long sequence;          // reading as of
+	long last;              // sequence of the last version taken
+	char **operands;
+	int count;
+	int capacity;
+	char *base;
+	bool done;
+	int error;
+} MergeWalk;
+
+/* why compaction is to run now; the first is the only reason it ever had */
+enum compaction_triggers {
+	TRIGGER_NONE, TRIGGER_RUNS, TRIGGER_WASTED_PROBES, TRIGGER_TOMBSTONES, TRIGGER_IDLE
+};
 
 // prototypes for static functions here
+static int apply_submission(LSM_Tree *lsm_tree, Submission *submission, int sync);
 static int execute_action(LSM_Tree *lsm_tree, Submission *submission);
-static char* generate_new_segment_name();
+static int check_options(LSM_Options *options);
+static int rotate_memtable(LSM_Tree *lsm_tree);
+static int write_manifest(char *directory, Version *version, char *tree_directory,
+		long sequence, int *vlogs, int num_vlogs, long first_wal, long last_wal);
+static int open_checkpoint(LSM_Tree *lsm_tree, char *manifest);
+static int install_segments(LSM_Tree *lsm_tree, Segment **segments, int count);
+static int replay_write(void *lsm_tree, long sequence, int action, int key, char *value);
+static void* flush_worker(void *arg);
+static int sync_segment(LSM_Tree *lsm_tree, char *filename);
+static void* compaction_worker(void *arg);
+static int compaction_trigger(LSM_Tree *lsm_tree, bool idle);
+static long elapsed_ms(struct timespec *since);
+static void deadline_after(struct timespec *deadline, struct timespec *from, long ms);
+static void wake_background_work(LSM_Tree *lsm_tree);
+static void update_write_debt(LSM_Tree *lsm_tree);
+static char* memtables_lookup(LSM_Tree *lsm_tree, int key, long sequence, bool *answered);
+static long version_range_deleted(Version *version, int key, long sequence);
+static bool segment_extent(Segment *segment, int *low_key, int *high_key);
+static bool segment_wholly_deleted(Version *version, int i, Retention *retention);
+static bool segment_expired(Version *version, int i, bool *dropped, long now);
+static bool segment_disjoint(Version *version, int i, bool *dropped, int count);
+static void sort_by_key_range(Segment **segments, int count);
+static char* generate_new_segment_name(LSM_Tree *lsm_tree);
+static void path_in_tree(LSM_Tree *lsm_tree, char *name, char *buf, int buf_size);
 static int update_index(Index *index, Memtable *memtable, char *filename);
-static int add_key_to_index(Index *index, MNode *node, char *filename);
-static int remove_deleted_keys_from_index(Index *index, MNode *root);
+static int remove_deleted_keys_from_index(Index *index, Memtable *memtable);
+static void discard_value(void *lsm_tree, char *value);
+static int init_retention(LSM_Tree *lsm_tree, Retention *retention);
+static int relocate_if_live(void *lsm_tree, int key, char *value, char *pointer);
+static int probe_version(LSM_Tree *lsm_tree, Version *version, int *keys, int count,
+		long sequence, char **values, bool *resolved);
+static char* resolve_value(LSM_Tree *lsm_tree, int key, char *value, long sequence);
+static bool is_merge_operand(char *value);
+static bool stored_marker(char *value);
+static bool value_expired(char *value);
+static void gather_merges(LSM_Tree *lsm_tree, int key, long sequence, MergeWalk *walk);
+static void walk_segment(LSM_Tree *lsm_tree, Segment *segment, MergeWalk *walk,
+		long deleted);
+static void take_version(MergeWalk *walk, long sequence, char *value, long deleted);
+static char* fold_merges(LSM_Tree *lsm_tree, MergeWalk *walk);
+static char* merge_value(void *lsm_tree, int key, char *existing, char *operand);
+static SegmentFences* fences_of(Version *version, char *filename);
+static Segment* segment_named(Version *version, char *filename);
+static bool segment_may_hold(Segment *segment, int key);
+static void count_probe(Segment *segment, bool found);
+static long elapsed_ns(struct timespec *start);
+static ScanIterator* new_scan_iterator();
+static int scan_append(ScanIterator *iterator, int key, char *value);
+static int scan_memtable(Memtable *memtable, int start_key, int end_key, long sequence,
+		ScanIterator *iterator);
+static ScanIterator* scan_segment(LSM_Tree *lsm_tree, Segment *segment, int start_key,
+		int end_key, long sequence);
+static int hide_ranges(RangeTombstone **hiding, int *count, RangeTombstone *ranges,
+		int num_ranges, long sequence);
+static void drop_hidden(ScanIterator *run, RangeTombstone *hiding, int count, long sequence);
+static ScanIterator* merge_scans(ScanIterator *newer, ScanIterator *older);
+
+
+/* Fills in options with the compile-time defaults from lsm_tree.h */
+void lsm_default_options(LSM_Options *options) {
+	options->write_buffer_size = WRITE_BUFFER_SIZE;
+	options->max_immutable_memtables = MAX_IMMUTABLE_MEMTABLES;
+	options->vlog_threshold = VLOG_THRESHOLD;
+	options->wal_sync = WAL_SYNC;
 
+	options->max_segments = MAX_SEGMENTS;
+	options->max_subcompactions = MAX_SUBCOMPACTIONS;
+	options->wasted_probe_limit = COMPACTION_WASTED_PROBES;
+	options->tombstone_compaction_pct = COMPACTION_TOMBSTONE_PCT;
+	options->compaction_check_ms = COMPACTION_CHECK_MS;
+	options->idle_ops_per_sec = IDLE_OPS_PER_SEC;
+	options->level0_codec = LEVEL0_CODEC;
+	options->level1_codec = LEVEL1_CODEC;
+	options->compaction_io = COMPACTION_IO;
+	options->write_rate_limit = WRITE_RATE_LIMIT;
+	options->write_rate_auto_tune = WRITE_RATE_AUTO_TUNE;
+	options->target_read_latency_us = TARGET_READ_LATENCY_US;
+
+	options->slowdown_immutable_memtables = SLOWDOWN_IMMUTABLE_MEMTABLES;
+	options->l0_slowdown_segments = L0_SLOWDOWN_SEGMENTS;
+	options->l0_stop_segments = L0_STOP_SEGMENTS;
+	options->pending_compaction_slowdown_bytes = PENDING_COMPACTION_SLOWDOWN_BYTES;
+	options->pending_compaction_stop_bytes = PENDING_COMPACTION_STOP_BYTES;
+	options->max_write_delay_us = MAX_WRITE_DELAY_US;
+
+	options->key_index = KEY_INDEX;
+	options->index_size = INDEX_SIZE;
+	options->fence_storage = FENCE_STORAGE;
+	options->mmap_reads = MMAP_READS;
+	options->row_cache_bytes = ROW_CACHE_BYTES;
+	options->io_backend = IO_BACKEND;
+	options->io_queue_depth = IO_QUEUE_DEPTH;
+	options->io_read_threads = IO_READ_THREADS;
+
+	options->merge = NULL;
+	options->merge_arg = NULL;
+}
 
 /* Creates an LSM Tree for the program to use, initializing
- * everything properly */
-LSM_Tree* init_lsm_tree() {
+ * everything properly. The tree keeps its WAL, value log and segments
+ * in directory (which ends in '/'), creating it if needed. Settings come
+ * from options, or the defaults if it is NULL. */
+LSM_Tree* init_lsm_tree(char *directory, LSM_Options *options) {
+	LSM_Options defaults;
+	if (options == NULL) {
+		lsm_default_options(&defaults);
+		options = &defaults;
+	}
+	if (check_options(options) != 0)
+		return NULL;
+
+	if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+		printf("Could not create LSM Tree directory: %s\n", directory);
+		return NULL;
+	}
+
 	LSM_Tree *lsm_tree = (LSM_Tree*) malloc(sizeof(LSM_Tree));
 	if (lsm_tree == NULL) {
 		printf("Allocation of memory for LSM Tree failed.\n");
 		return NULL;
 	}
 
-	Memtable *memtable = init_memtable();
+	lsm_tree->options = *options;
+	lsm_tree->directory = strdup(directory);
+	lsm_tree->immutables = (Memtable**) malloc(options->max_immutable_memtables
+			* sizeof(Memtable*));
+	if (lsm_tree->directory == NULL || lsm_tree->immutables == NULL) {
+		free(lsm_tree->directory);
+		free(lsm_tree->immutables);
+		free(lsm_tree);
+		return NULL;
+	}
+
+	Memtable *memtable = init_memtable(options->write_buffer_size);
 	if (memtable == NULL) {
+		free(lsm_tree->directory);
+		free(lsm_tree->immutables);
 		free(lsm_tree);
 		return NULL;
 	}
 
-	char **segments = init_segment_list(MAX_SEGMENTS);
-	if (segments == NULL) {
+	Version *version = new_version(NULL, 0);
+	if (version == NULL) {
+		free(lsm_tree->directory);
+		free(lsm_tree->immutables);
 		free(lsm_tree);
 		free(memtable);
 		return NULL;
 	}
 
-	FILE *wal = init_wal(WRITE_AHEAD_LOG);
+	WAL *wal = init_wal(lsm_tree->directory);
 	if (wal == NULL) {
+		free(lsm_tree->directory);
+		free(lsm_tree->immutables);
+		free(lsm_tree);
+		free(memtable);
+		unref_version(version);
+		return NULL;
+	}
+
+	bool hashed = options->key_index == INDEX_HASH;
+	Index *index = hashed ? init_index(options->index_size) : NULL;
+	if (hashed && index == NULL) {
+		free(lsm_tree->directory);
+		free(lsm_tree->immutables);
+		free(lsm_tree);
+		free(memtable);
+		unref_version(version);
+		close_wal(wal);
+		return NULL;
+	}
+
+	ValueLog *vlog = init_value_log(directory);
+	if (vlog == NULL) {
+		free(lsm_tree->directory);
+		free(lsm_tree->immutables);
+		free(lsm_tree);
+		free(memtable);
+		unref_version(version);
+		close_wal(wal);
+		free(index);
+		return NULL;
+	}
+
+	IOContext *io = init_io_context(options->io_backend, options->io_queue_depth,
+			options->io_read_threads);
+	if (io == NULL) {
+		free(lsm_tree->directory);
+		free(lsm_tree->immutables);
+		free(lsm_tree);
+		free(memtable);
+		unref_version(version);
+		close_wal(wal);
+		free(index);
+		close_value_log(vlog);
+		return NULL;
+	}
+
+	RateLimiter *limiter = init_rate_limiter(options->write_rate_limit,
+			options->write_rate_auto_tune, options->target_read_latency_us);
+	if (limiter == NULL) {
+		free(lsm_tree->directory);
+		free(lsm_tree->immutables);
+		free(lsm_tree);
+		free(memtable);
+		unref_version(version);
+		close_wal(wal);
+		free(index);
+		close_value_log(vlog);
+		close_io_context(io);
+		return NULL;
+	}
+
+	// a budget of zero runs without a row cache
+	RowCache *cache = NULL;
+	if (options->row_cache_bytes > 0 && !(cache = init_row_cache(options->row_cache_bytes))) {
+		free(lsm_tree->directory);
+		free(lsm_tree->immutables);
 		free(lsm_tree);
 		free(memtable);
-		free(segments);
+		unref_version(version);
+		close_wal(wal);
+		free(index);
+		close_value_log(vlog);
+		close_io_context(io);
+		close_rate_limiter(limiter);
 		return NULL;
 	}
 
-	Index *index = init_index(INDEX_SIZE);
-	if (index == NULL) {
+	WriteDebt slowdown = { options->slowdown_immutable_memtables,
+			options->l0_slowdown_segments, options->pending_compaction_slowdown_bytes };
+	WriteDebt stop = { options->max_immutable_memtables, options->l0_stop_segments,
+			options->pending_compaction_stop_bytes };
+	WriteController *controller = init_write_controller(&slowdown, &stop,
+			options->max_write_delay_us);
+	if (controller == NULL) {
+		free(lsm_tree->directory);
+		free(lsm_tree->immutables);
 		free(lsm_tree);
 		free(memtable);
-		free(segments);
-		free(wal);
+		unref_version(version);
+		close_wal(wal);
+		free(index);
+		close_value_log(vlog);
+		close_io_context(io);
+		close_rate_limiter(limiter);
+		if (cache)
+			close_row_cache(cache);
 		return NULL;
 	}
 
+	memtable->wal = wal->number;
 	lsm_tree->memtable = memtable;
-	lsm_tree->segments = segments;
-	lsm_tree->full_segments = 0;
+	lsm_tree->num_immutables = 0;
+	lsm_tree->current = version;
 	lsm_tree->wal = wal;
 	lsm_tree->index = index;
+	lsm_tree->vlog = vlog;
+	lsm_tree->io = io;
+	lsm_tree->limiter = limiter;
+	lsm_tree->cache = cache;
+	lsm_tree->controller = controller;
+	atomic_init(&lsm_tree->sequence, 0);
+	lsm_tree->snapshots = NULL;
+	memset(&lsm_tree->stats, 0, sizeof(SegmentStats));
+
+	pthread_rwlock_init(&lsm_tree->memtable_lock, NULL);
+	pthread_rwlock_init(&lsm_tree->version_lock, NULL);
+	pthread_rwlock_init(&lsm_tree->vlog_lock, NULL);
+	pthread_mutex_init(&lsm_tree->snapshot_lock, NULL);
 
+	pthread_mutex_init(&lsm_tree->work_lock, NULL);
+	// the compaction thread waits on it with a timeout, to notice idle spells
+	pthread_condattr_t attributes;
+	pthread_condattr_init(&attributes);
+	pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&lsm_tree->work_ready, &attributes);
+	pthread_condattr_destroy(&attributes);
+	lsm_tree->stopping = false;
+	atomic_init(&lsm_tree->collect_due, false);
+	atomic_init(&lsm_tree->foreground_ops, 0);
+	atomic_init(&lsm_tree->early_compactions, 0);
+	atomic_init(&lsm_tree->idle_compactions, 0);
+	if (pthread_create(&lsm_tree->flusher, NULL, flush_worker, lsm_tree) != 0
+			|| pthread_create(&lsm_tree->compactor, NULL, compaction_worker, lsm_tree) != 0)
+		die("Fatal Error: Could not start background flush and compaction.\n");
+
+	// a directory a checkpoint was written to opens as the tree it copied
+	char manifest[FILENAME_SIZE];
+	path_in_tree(lsm_tree, MANIFEST, manifest, FILENAME_SIZE);
+	if (access(manifest, F_OK) == 0 && open_checkpoint(lsm_tree, manifest) != 0) {
+		printf("Could not open the checkpoint in %s\n", directory);
+		shutdown_lsm_system(lsm_tree);
+		return NULL;
+	}
 	return lsm_tree;
 }
 
+/* Rejects settings the tree can't run with */
+static int check_options(LSM_Options *options) {
+	if (options->write_buffer_size <= 0) {
+		printf("Write buffer size must be positive.\n");
+		return -1;
+	}
+	if (options->max_immutable_memtables < 1
+			|| options->slowdown_immutable_memtables > options->max_immutable_memtables) {
+		printf("Need room for at least one immutable memtable, and no more slowdown "
+				"than stop threshold.\n");
+		return -1;
+	}
+	if (options->max_segments < 1 || options->max_subcompactions < 1) {
+		printf("Segment and subcompaction limits must be at least 1.\n");
+		return -1;
+	}
+	if (options->wasted_probe_limit < 0 || options->tombstone_compaction_pct < 0
+			|| options->tombstone_compaction_pct > 100 || options->compaction_check_ms < 0
+			|| options->idle_ops_per_sec < 0) {
+		printf("Compaction triggers must not be negative, nor a share over 100%%.\n");
+		return -1;
+	}
+	// the limiter sleeps off debt at this rate, so it must be positive
+	if (options->write_rate_limit <= 0
+			|| (options->write_rate_auto_tune && options->target_read_latency_us <= 0)) {
+		printf("Write rate limit, and the read latency target it is tuned to, must be "
+				"positive.\n");
+		return -1;
+	}
+	// an inline value shares its segment line with the key and sequence number
+	if (options->vlog_threshold < 0
+			|| options->vlog_threshold >= MAX_LINE_SIZE - MAX_LEN_KEYS - 24) {
+		printf("Value log threshold must leave inline values room in a segment line.\n");
+		return -1;
+	}
+	if (options->wal_sync < WAL_SYNC_NONE || options->wal_sync > WAL_SYNC_FSYNC) {
+		printf("Unknown WAL sync policy %d.\n", options->wal_sync);
+		return -1;
+	}
+	if (options->key_index == INDEX_HASH && options->index_size < 1) {
+		printf("Hash index size must be positive.\n");
+		return -1;
+	}
+	return 0;
+}
+
 /* Handles the submission provided by user; returns 0 if all succeeds,
  * otherwise returns -1.  */
 int handle_submission(LSM_Tree *lsm_tree, Submission *submission) {
+	return apply_submission(lsm_tree, submission, lsm_tree->options.wal_sync);
+}
+
+/* Applies count writes in order as one batch. Each is checked, logged and
+ * applied as handle_submission() would, but the WAL is synced only once,
+ * after the last, so a batch costs one flush (or fsync) however many
+ * writes it holds. Stops at the first write that fails; those before it
+ * are applied and synced. Returns the number of writes applied. */
+int lsm_tree_write_batch(LSM_Tree *lsm_tree, Submission *batch, int count) {
+	int applied = 0;
+	while (applied < count && apply_submission(lsm_tree, batch + applied, WAL_SYNC_NONE) == 0)
+		applied++;
+	if (applied > 0 && wal_sync(lsm_tree->wal, lsm_tree->options.wal_sync) != 0) {
+		shutdown_lsm_system(lsm_tree);
+		die("Fatal Error: Could not sync WAL.\n");
+	}
+	return applied;
+}
+
+/* Checks, logs and applies a submission, syncing its WAL record as sync
+ * asks; returns 0 on success, -1 on failure */
+static int apply_submission(LSM_Tree *lsm_tree, Submission *submission, int sync) {
+
+	if (submission->action == ADD && is_value_pointer(submission->value)) {
+		printf("Cannot insert new record with a value starting with the "
+			   "value log marker for this system (%s)\n", VLOG_POINTER_PREFIX);
+		return -1;
+	}
+	if (submission->action == ADD && strncmp(submission->value, MERGE_PREFIX,
+			strlen(MERGE_PREFIX)) == 0) {
+		printf("Cannot insert new record with a value starting with the "
+			   "merge operand marker for this system (%s)\n", MERGE_PREFIX);
+		return -1;
+	}
+	if (submission->action == ADD && value_expiry(submission->value)) {
+		printf("Cannot insert new record with a value starting with the "
+			   "expiry marker for this system (%s)\n", EXPIRY_PREFIX);
+		return -1;
+	}
+	if (submission->action == ADD && submission->ttl < 0) {
+		printf("Time to live must not be negative (%d).\n", submission->ttl);
+		return -1;
+	}
+	if (submission->action == MERGE && !lsm_tree->options.merge) {
+		printf("Cannot merge into key %d without a merge operator.\n", submission->key);
+		return -1;
+	}
+	// operands are never moved to the value log, so they must fit inline
+	if (submission->action == MERGE && strlen(submission->value) + strlen(MERGE_PREFIX)
+			> lsm_tree->options.vlog_threshold) {
+		printf("Merge operands may be at most %d characters.\n",
+				lsm_tree->options.vlog_threshold - (int) strlen(MERGE_PREFIX));
+		return -1;
+	}
+	if (submission->action == DELETE_RANGE && submission->key > submission->end_key) {
+		printf("Range to delete starts after it ends (%d > %d).\n", submission->key,
+				submission->end_key);
+		return -1;
+	}
+
+	if (atomic_exchange(&lsm_tree->collect_due, false)
+			&& collect_value_log(lsm_tree) != 0)
+		printf("Warning: value log garbage collection failed.\n");
+
+	// writes are held back while flush and compaction are behind
+	bool is_write = submission->action == ADD || submission->action == DELETE
+			|| submission->action == DELETE_RANGE || submission->action == MERGE;
+	if (is_write) {
+		write_controller_admit(lsm_tree->controller);
+		atomic_fetch_add(&lsm_tree->foreground_ops, 1);
+	}
+
+	// a value with a TTL carries the time it expires in front of it
+	char expiry[KEY_DIGITS + 4];
+	int expiry_size = 0;
+	if (submission->action == ADD && submission->ttl > 0)
+		expiry_size = snprintf(expiry, sizeof(expiry), "%s%ld:", EXPIRY_PREFIX,
+				(long) time(NULL) + submission->ttl);
+
+	/* large values go to the value log first, so the WAL, memtable and
+	 * segments only ever carry a small pointer to them */
+	char pointer[VLOG_POINTER_SIZE];
+	Submission stored = *submission;
+	if (submission->action == ADD
+			&& strlen(submission->value) + expiry_size > lsm_tree->options.vlog_threshold) {
+		if (value_log_append(lsm_tree->vlog, submission->key, submission->value,
+				pointer) != 0) {
+			printf("Failed to write value to value log.\n");
+			return -1;
+		}
+		stored.value = pointer;
+	}
+
+	char expiring[MAX_LINE_SIZE];
+	if (expiry_size > 0) {
+		snprintf(expiring, sizeof(expiring), "%s%s", expiry, stored.value);
+		stored.value = expiring;
+	}
+
+	// a merge operand is marked as one wherever it is stored
+	char operand[MAX_LINE_SIZE];
+	if (submission->action == MERGE) {
+		snprintf(operand, sizeof(operand), "%s%s", MERGE_PREFIX, submission->value);
+		stored.value = operand;
+	}
+
+	// a range delete is logged as its first key and, in place of a value, its last
+	char range_end[KEY_DIGITS + 1];
+	if (submission->action == DELETE_RANGE) {
+		snprintf(range_end, sizeof(range_end), "%d", submission->end_key);
+		stored.value = range_end;
+	}
+	submission = &stored;
+
+	/* every write is tagged with the next sequence number, which is only
+	 * published (made visible to new snapshots) once the write is applied */
+	submission->sequence = atomic_load(&lsm_tree->sequence) + (is_write ? 1 : 0);
 
 	// start by writing directly to WAL
-	int error = submission_to_wal(lsm_tree->wal, submission->action,
-			submission->key, submission->value, MAX_LINE_SIZE, true);
+	int error = submission_to_wal(lsm_tree->wal, submission->sequence, submission->action,
+			submission->key, submission->value, MAX_LINE_SIZE, sync);
 	if (error) {
 		shutdown_lsm_system(lsm_tree);
 		die("Fatal Error: Submission to WAL Failed.\n");
@@ -85,46 +519,480 @@ int handle_submission(LSM_Tree *lsm_tree, Submission *submission) {
 		printf("Failed to execute requested user action.\n");
 		return -1;
 	}
+	if (is_write)
+		atomic_store(&lsm_tree->sequence, submission->sequence);
+
+	/* a full memtable is handed to the background flush, and a fresh one
+	 * takes its place, so the writer never waits on segment writes */
+	if (memtable_is_full(lsm_tree->memtable) && rotate_memtable(lsm_tree) != 0) {
+		shutdown_lsm_system(lsm_tree);
+		die("Fatal Error: Could not start a new memtable.\n");
+	}
+	return 0;
+}
+
+/* Deletes every key in [start_key, end_key] with a single range tombstone,
+ * however many keys the range holds. Returns 0 on success, -1 on failure. */
+int lsm_tree_delete_range(LSM_Tree *lsm_tree, int start_key, int end_key) {
+	Submission submission = { DELETE_RANGE, start_key, NULL, 0, end_key };
+	return handle_submission(lsm_tree, &submission);
+}
+
+/* Merges operand into the value of key without reading it: the operand is
+ * stored as is, and folded into the key's value by the merge operator when
+ * the key is read, or when compaction finds the value beneath it. Returns 0
+ * on success, -1 on failure. */
+int lsm_tree_merge(LSM_Tree *lsm_tree, int key, char *operand) {
+	Submission submission = { MERGE, key, operand, 0, 0 };
+	return handle_submission(lsm_tree, &submission);
+}
+
+/* Adds a key whose value expires ttl seconds from now, after which reads
+ * find it absent and compaction drops it. Returns 0 on success, -1 on
+ * failure. */
+int lsm_tree_put_ttl(LSM_Tree *lsm_tree, int key, char *value, int ttl) {
+	Submission submission = { ADD, key, value, 0, 0, ttl };
+	return handle_submission(lsm_tree, &submission);
+}
+
+/* Writes a checkpoint of the tree into directory (ending in '/', and not
+ * there yet): a consistent copy of it that init_lsm_tree() opens as a tree
+ * of its own. Segments never change once written, so they are hard linked
+ * rather than copied, and a checkpoint takes about as long however large
+ * the tree is; only the WAL records behind the memtables and the active
+ * value log file are copied. Called from the writer, like
+ * handle_submission(). Returns 0 on success, -1 on failure. */
+int lsm_tree_checkpoint(LSM_Tree *lsm_tree, char *directory) {
+	if (mkdir(directory, 0755) != 0) {
+		printf("Could not create checkpoint directory: %s\n", directory);
+		return -1;
+	}
+
+	// the segments are pinned along with the WAL files of the memtables not
+	// in them yet; the flush thread can't retire those while the memtable
+	// lock is held. A memtable whose segment is in the version is left out,
+	// or compaction might fold its merge operands into values at the same
+	// sequence numbers as the replayed operands.
+	pthread_rwlock_rdlock(&lsm_tree->memtable_lock);
+	pthread_rwlock_rdlock(&lsm_tree->version_lock);
+	Version *version = lsm_tree->current;
+	ref_version(version);
+	long first_wal = lsm_tree->memtable->wal;
+	for (int i = lsm_tree->num_immutables - 1; i >= 0; i--) {
+		if (!atomic_load(&lsm_tree->immutables[i]->flushed))
+			first_wal = lsm_tree->immutables[i]->wal;
+	}
+	pthread_rwlock_unlock(&lsm_tree->version_lock);
+	long sequence = atomic_load(&lsm_tree->sequence);
+	int error = wal_checkpoint(lsm_tree->wal, first_wal, directory, MAX_LINE_SIZE);
+	pthread_rwlock_unlock(&lsm_tree->memtable_lock);
+
+	int prefix = strlen(lsm_tree->directory);
+	for (int i = 0; i < version->num_segments && !error; i++) {
+		char *filename = (*(version->segments + i))->filename;
+		char linked[FILENAME_SIZE + strlen(directory)];
+		snprintf(linked, sizeof(linked), "%s%s", directory, filename + prefix);
+		error = link_file(filename, linked);
+	}
+
+	// no value is appended, and no value log file collected, while the
+	// writer is busy here
+	int *vlogs = NULL;
+	int num_vlogs = error ? -1 : value_log_checkpoint(lsm_tree->vlog, directory, &vlogs);
+	if (num_vlogs < 0 || write_manifest(directory, version, lsm_tree->directory, sequence,
+			vlogs, num_vlogs, first_wal, lsm_tree->wal->number) != 0)
+		error = -1;
+	free(vlogs);
+	int num_segments = version->num_segments;
+	release_version(version);
+
+	if (error) {
+		printf("Failed to write checkpoint to %s\n", directory);
+		return -1;
+	}
+	printf("> LSM System Alert: Checkpoint of %d segment(s) written to %s\n",
+			num_segments, directory);
+	return 0;
+}
+
+/* Lists what a checkpoint holds: the sequence number it was taken at, its
+ * segments oldest first (and whether compaction wrote them), its value log
+ * files and the WAL files to replay. The manifest is written under another
+ * name and renamed, so a directory with a MANIFEST holds a whole checkpoint. */
+static int write_manifest(char *directory, Version *version, char *tree_directory,
+		long sequence, int *vlogs, int num_vlogs, long first_wal, long last_wal) {
+	char manifest[strlen(directory) + 32], written[strlen(directory) + 32];
+	snprintf(manifest, sizeof(manifest), "%s%s", directory, MANIFEST);
+	snprintf(written, sizeof(written), "%s%s.tmp", directory, MANIFEST);
+
+	FILE *fp = fopen(written, "w");
+	if (fp == NULL) {
+		printf("Could not create manifest: %s\n", written);
+		return -1;
+	}
+	fprintf(fp, "sequence %ld\n", sequence);
+	for (int i = 0; i < version->num_segments; i++) {
+		Segment *segment = *(version->segments + i);
+		fprintf(fp, "segment %s %d\n", segment->filename + strlen(tree_directory),
+				(int) atomic_load(&segment->compacted));
+	}
+	for (int i = 0; i < num_vlogs; i++)
+		fprintf(fp, "vlog %d\n", *(vlogs + i));
+	for (long number = first_wal; number <= last_wal; number++)
+		fprintf(fp, "wal %ld\n", number);
+
+	int error = fflush(fp) != 0 || fsync(fileno(fp)) != 0 ? -1 : 0;
+	fclose(fp);
+	if (error || rename(written, manifest) != 0) {
+		printf("Could not write manifest: %s\n", manifest);
+		return -1;
+	}
 
-	/* make sure the system sends memtable to segment
-	 * and runs compaction without being asked. this should be
-	 * in the background, rather than sequential in future */
-	if (memtable_is_full(lsm_tree->memtable)) {
-		if (ready_for_compaction(lsm_tree)) {
-			int error = run_compaction(lsm_tree);
-			if (error != 0) {
-				shutdown_lsm_system(lsm_tree);
-				die("Fatal Error: Compaction step failed! "
-						"Please review logs for errors.\n");
+	int dir = open(directory, O_RDONLY | O_DIRECTORY);
+	error = dir < 0 || fsync(dir) != 0 ? -1 : 0;
+	if (dir >= 0)
+		close(dir);
+	return error;
+}
+
+/* Opens the checkpoint a manifest describes as this (new) tree: its
+ * segments become the current version, its value log files join the value
+ * log, and its WAL files are replayed into the memtable (and logged anew).
+ * From then on the tree owns the files, and the manifest is removed. */
+static int open_checkpoint(LSM_Tree *lsm_tree, char *manifest) {
+	FILE *fp = fopen(manifest, "r");
+	if (fp == NULL) {
+		printf("Could not open manifest: %s\n", manifest);
+		return -1;
+	}
+
+	Segment **segments = NULL;
+	long *wals = NULL;
+	int num_segments = 0, num_wals = 0, error = 0;
+	char line[FILENAME_SIZE + 32], name[FILENAME_SIZE];
+	while (!error && fgets(line, sizeof(line), fp)) {
+		long number;
+		int compacted;
+		if (sscanf(line, "sequence %ld", &number) == 1) {
+			atomic_store(&lsm_tree->sequence, number);
+		} else if (sscanf(line, "segment %63s %d", name, &compacted) == 2) {
+			Segment **grown = (Segment**) realloc(segments,
+					(num_segments + 1) * sizeof(Segment*));
+			char *filename = grown ? (char*) malloc(FILENAME_SIZE) : NULL;
+			segments = grown ? grown : segments;
+			if (!filename) {
+				error = -1;
+				break;
+			}
+			path_in_tree(lsm_tree, name, filename, FILENAME_SIZE);
+			Segment *segment = new_segment(filename, lsm_tree->options.fence_storage,
+					lsm_tree->options.mmap_reads);
+			if (!segment) {
+				free(filename);
+				error = -1;
+				break;
 			}
+			atomic_store(&segment->compacted, compacted != 0);
+			*(segments + num_segments++) = segment;
+			error = segment->fences ? 0 : -1;
+		} else if (sscanf(line, "vlog %ld", &number) == 1) {
+			error = value_log_adopt(lsm_tree->vlog, (int) number);
+		} else if (sscanf(line, "wal %ld", &number) == 1) {
+			long *grown = (long*) realloc(wals, (num_wals + 1) * sizeof(long));
+			if (!grown) {
+				error = -1;
+				break;
+			}
+			wals = grown;
+			*(wals + num_wals++) = number;
+		} else {
+			printf("Unrecognized manifest line: %s", line);
+			error = -1;
+		}
+	}
+	fclose(fp);
+
+	if (!error)
+		error = install_segments(lsm_tree, segments, num_segments);
+	for (int i = 0; i < num_segments; i++)
+		unref_segment(*(segments + i));
+	free(segments);
+
+	// replayed writes are logged again, so the old WAL files can be retired
+	// once the new one is on disk
+	for (int i = 0; i < num_wals && !error; i++)
+		error = wal_replay(lsm_tree->wal, *(wals + i), MAX_LINE_SIZE, replay_write, lsm_tree);
+	FILE *wal = lsm_tree->wal->file;
+	if (!error && (fflush(wal) != 0 || fdatasync(fileno(wal)) != 0))
+		error = -1;
+	for (int i = 0; i < num_wals && !error; i++)
+		wal_retire(lsm_tree->wal, *(wals + i));
+	free(wals);
+
+	if (!error && remove(manifest) != 0)
+		error = -1;
+	if (!error)
+		printf("> LSM System Alert: Opened checkpoint of %d segment(s).\n", num_segments);
+	return error;
+}
+
+/* Makes segments the tree's current version, indexing their keys newest
+ * last so that each key ends up with the newest segment holding it */
+static int install_segments(LSM_Tree *lsm_tree, Segment **segments, int count) {
+	Version *version = new_version(segments, count);
+	if (!version)
+		return -1;
+
+	int error = 0;
+	pthread_rwlock_wrlock(&lsm_tree->version_lock);
+	for (int i = 0; i < count && lsm_tree->index && !error; i++) {
+		char *filename = (*(segments + i))->filename;
+		SegmentReader *reader = open_segment_reader(filename, IO_BUFFERED, &lsm_tree->stats);
+		char line[MAX_LINE_SIZE];
+		error = reader ? 0 : -1;
+		while (!error && segment_reader_next(reader, line, MAX_LINE_SIZE))
+			error = index_insert(lsm_tree->index, atoi(line), filename);
+		if (reader)
+			close_segment_reader(reader);
+	}
+	Version *old = lsm_tree->current;
+	lsm_tree->current = version;
+	pthread_rwlock_unlock(&lsm_tree->version_lock);
+	unref_version(old);
+
+	update_write_debt(lsm_tree);
+	wake_background_work(lsm_tree);
+	return error;
+}
+
+/* WAL replay callback: applies a write from a checkpoint's WAL as the
+ * writer would have, logging it to the tree's own WAL first */
+static int replay_write(void *tree, long sequence, int action, int key, char *value) {
+	LSM_Tree *lsm_tree = (LSM_Tree*) tree;
+	if (action != ADD && action != MERGE && action != DELETE && action != DELETE_RANGE)
+		return 0;
+
+	Submission submission = { action, key, value, sequence, 0 };
+	if (action == DELETE_RANGE)
+		submission.end_key = atoi(value);
+	if (submission_to_wal(lsm_tree->wal, sequence, action, key, value, MAX_LINE_SIZE,
+			WAL_SYNC_NONE) != 0 || execute_action(lsm_tree, &submission) != 0)
+		return -1;
+	if (sequence > atomic_load(&lsm_tree->sequence))
+		atomic_store(&lsm_tree->sequence, sequence);
+
+	if (memtable_is_full(lsm_tree->memtable))
+		return rotate_memtable(lsm_tree);
+	return 0;
+}
+
+/* A merge operator for counters: adds the operand to the existing value,
+ * both read as integers (no value counts as 0). Returns NULL, leaving the
+ * key without a value, if either is not a number. */
+char* merge_add_operator(void *arg, int key, char *existing, char *operand) {
+	char *end;
+	long total = existing ? strtol(existing, &end, 10) : 0;
+	if (existing && (*existing == '\0' || *end != '\0'))
+		return NULL;
+	long addend = strtol(operand, &end, 10);
+	if (*operand == '\0' || *end != '\0')
+		return NULL;
+
+	char *sum = (char*) malloc(SEQUENCE_DIGITS + 1);
+	if (sum == NULL) {
+		printf("Failed to allocate memory for merged value.\n");
+		return NULL;
+	}
+	snprintf(sum, SEQUENCE_DIGITS + 1, "%ld", total + addend);
+	return sum;
+}
+
+/* Queues the full memtable for flushing and starts an empty one, with a
+ * WAL file of its own. The write controller keeps the queue from
+ * overflowing: writes stop while it holds max_immutable_memtables. */
+static int rotate_memtable(LSM_Tree *lsm_tree) {
+	Memtable *memtable = init_memtable(lsm_tree->options.write_buffer_size);
+	if (memtable == NULL)
+		return -1;
+	if (wal_rotate(lsm_tree->wal, lsm_tree->options.wal_sync) != 0) {
+		delete_memtable(memtable);
+		return -1;
+	}
+	memtable->wal = lsm_tree->wal->number;
+
+	pthread_rwlock_wrlock(&lsm_tree->memtable_lock);
+	lsm_tree->immutables[lsm_tree->num_immutables++] = lsm_tree->memtable;
+	lsm_tree->memtable = memtable;
+	pthread_rwlock_unlock(&lsm_tree->memtable_lock);
+
+	update_write_debt(lsm_tree);
+	wake_background_work(lsm_tree);
+	return 0;
+}
+
+/* Background thread: flushes immutable memtables, oldest first, retiring
+ * each one's WAL file once its segment is on stable storage. At shutdown it
+ * drains the queue before exiting. */
+static void* flush_worker(void *arg) {
+	LSM_Tree *lsm_tree = (LSM_Tree*) arg;
+
+	pthread_mutex_lock(&lsm_tree->work_lock);
+	while (true) {
+		pthread_rwlock_rdlock(&lsm_tree->memtable_lock);
+		Memtable *oldest = lsm_tree->num_immutables ? lsm_tree->immutables[0] : NULL;
+		pthread_rwlock_unlock(&lsm_tree->memtable_lock);
+		if (!oldest) {
+			if (lsm_tree->stopping)
+				break;
+			pthread_cond_wait(&lsm_tree->work_ready, &lsm_tree->work_lock);
+			continue;
 		}
-		char *filename = send_memtable_to_segment(lsm_tree);
-		if (!filename) {
-			shutdown_lsm_system(lsm_tree);
+		pthread_mutex_unlock(&lsm_tree->work_lock);
+
+		// readers find the keys in the new segment before the memtable goes
+		if (send_memtable_to_segment(lsm_tree, oldest) != 0)
 			die("Fatal Error: Could not send memtable to segment.\n");
+
+		pthread_rwlock_wrlock(&lsm_tree->memtable_lock);
+		lsm_tree->num_immutables--;
+		memmove(lsm_tree->immutables, lsm_tree->immutables + 1,
+				lsm_tree->num_immutables * sizeof(Memtable*));
+		pthread_rwlock_unlock(&lsm_tree->memtable_lock);
+		wal_retire(lsm_tree->wal, oldest->wal);
+		delete_memtable(oldest);
+
+		update_write_debt(lsm_tree);
+		wake_background_work(lsm_tree);
+		pthread_mutex_lock(&lsm_tree->work_lock);
+	}
+	pthread_mutex_unlock(&lsm_tree->work_lock);
+	return NULL;
+}
+
+/* Forces a flushed segment, and its name in the tree's directory, to stable
+ * storage, so that the WAL file holding the same writes can go */
+static int sync_segment(LSM_Tree *lsm_tree, char *filename) {
+	int fd = open(filename, O_RDONLY);
+	int dir = open(lsm_tree->directory, O_RDONLY | O_DIRECTORY);
+	int error = fd < 0 || dir < 0 || fsync(fd) != 0 || fsync(dir) != 0 ? -1 : 0;
+	if (fd >= 0)
+		close(fd);
+	if (dir >= 0)
+		close(dir);
+	return error;
+}
+
+/* Background thread: compacts whenever enough segments have been flushed.
+ * Value log garbage it leaves behind is collected by the writer, which owns
+ * the memtable that relocated values are written to. */
+static void* compaction_worker(void *arg) {
+	LSM_Tree *lsm_tree = (LSM_Tree*) arg;
+	long check_ms = lsm_tree->options.compaction_check_ms;
+	long ops_seen = atomic_load(&lsm_tree->foreground_ops);
+	struct timespec window, deadline;
+	clock_gettime(CLOCK_MONOTONIC, &window);
+	deadline_after(&deadline, &window, check_ms);
+
+	pthread_mutex_lock(&lsm_tree->work_lock);
+	while (!lsm_tree->stopping) {
+		int trigger = compaction_trigger(lsm_tree, false);
+		if (trigger == TRIGGER_NONE && check_ms == 0) {
+			pthread_cond_wait(&lsm_tree->work_ready, &lsm_tree->work_lock);
+			continue;
+		}
+		if (trigger == TRIGGER_NONE) {
+			if (pthread_cond_timedwait(&lsm_tree->work_ready, &lsm_tree->work_lock,
+					&deadline) != ETIMEDOUT)
+				continue;
+
+			// reads may have wasted enough by now; and if the foreground was
+			// quiet since the last check, merge whatever there is while
+			// nobody is waiting on reads
+			long ops = atomic_load(&lsm_tree->foreground_ops);
+			bool quiet = (ops - ops_seen) * 1000
+					< lsm_tree->options.idle_ops_per_sec * elapsed_ms(&window);
+			ops_seen = ops;
+			clock_gettime(CLOCK_MONOTONIC, &window);
+			deadline_after(&deadline, &window, check_ms);
+			if ((trigger = compaction_trigger(lsm_tree, quiet)) == TRIGGER_NONE)
+				continue;
 		}
+		pthread_mutex_unlock(&lsm_tree->work_lock);
 
-		// update index before clearing memtable
-		if (update_index(lsm_tree->index, lsm_tree->memtable, filename) != 0) {
-			shutdown_lsm_system(lsm_tree);
-			die("Fatal Error: Corrupted index.\n");
+		if (trigger == TRIGGER_WASTED_PROBES || trigger == TRIGGER_TOMBSTONES) {
+			printf("> LSM System Alert: Compacting early, %s.\n",
+					trigger == TRIGGER_WASTED_PROBES ? "lookups keep reading segments "
+					"that don't hold their keys" : "deletes fill too much of the segments");
+			atomic_fetch_add(&lsm_tree->early_compactions, 1);
+		} else if (trigger == TRIGGER_IDLE) {
+			printf("> LSM System Alert: Compacting while the tree is idle.\n");
+			atomic_fetch_add(&lsm_tree->idle_compactions, 1);
 		}
+		if (run_compaction(lsm_tree) != 0)
+			die("Fatal Error: Compaction step failed! Please review logs for errors.\n");
+		atomic_store(&lsm_tree->collect_due, true);
 
-		// clear the existing memtable; ready for new contents
-		clear_memtable(lsm_tree->memtable);
+		update_write_debt(lsm_tree);
+		pthread_mutex_lock(&lsm_tree->work_lock);
 	}
-	return 0;
+	pthread_mutex_unlock(&lsm_tree->work_lock);
+	return NULL;
+}
+
+static long elapsed_ms(struct timespec *since) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static void deadline_after(struct timespec *deadline, struct timespec *from, long ms) {
+	long nsec = from->tv_nsec + ms % 1000 * 1000000L;
+	deadline->tv_sec = from->tv_sec + ms / 1000 + nsec / 1000000000L;
+	deadline->tv_nsec = nsec % 1000000000L;
+}
+
+static void wake_background_work(LSM_Tree *lsm_tree) {
+	pthread_mutex_lock(&lsm_tree->work_lock);
+	pthread_cond_broadcast(&lsm_tree->work_ready);
+	pthread_mutex_unlock(&lsm_tree->work_lock);
+}
+
+/* Measures how far flush and compaction are behind, for the write controller */
+static void update_write_debt(LSM_Tree *lsm_tree) {
+	WriteDebt debt = { 0, 0, 0 };
+	pthread_rwlock_rdlock(&lsm_tree->memtable_lock);
+	debt.immutable_memtables = lsm_tree->num_immutables;
+	pthread_rwlock_unlock(&lsm_tree->memtable_lock);
+
+	Version *version = acquire_version(lsm_tree);
+	for (int i = 0; i < version->num_segments; i++) {
+		Segment *segment = *(version->segments + i);
+		if (!segment->compacted) {
+			debt.l0_segments++;
+			debt.pending_compaction_bytes += segment->size;
+		}
+	}
+	release_version(version);
+	write_controller_update(lsm_tree->controller, &debt);
 }
 
 /* Does the action that the user submitted. */
 static int execute_action(LSM_Tree *lsm_tree, Submission *submission) {
-	if (submission->action == ADD) {
+	// a merge operand goes in like any other value, to be folded on read
+	if (submission->action == ADD || submission->action == MERGE) {
 		if (strcmp(submission->value, TOMBSTONE) == 0) {
 			printf("Cannot insert new record with value equal to the "
 				   "tombstone for this system (%s)\n", TOMBSTONE);
 			return -1;
 		}
-		if (memtable_insert(lsm_tree->memtable, submission->key, submission->value) == 0) {
+		pthread_rwlock_wrlock(&lsm_tree->memtable_lock);
+		int error = memtable_insert(lsm_tree->memtable, submission->key,
+				submission->value, submission->sequence);
+		pthread_rwlock_unlock(&lsm_tree->memtable_lock);
+		if (lsm_tree->cache)
+			row_cache_invalidate(lsm_tree->cache, submission->key);
+
+		if (error == 0) {
 			lsm_tree->memtable->count_keys++;
 		} else {
 			printf("Insertion of new node failed.\n");
@@ -132,30 +1000,47 @@ static int execute_action(LSM_Tree *lsm_tree, Submission *submission) {
 		}
 
 	} else if (submission->action == SEARCH) {
-		// search memtable first
-		MNode *node = search_memtable(lsm_tree->memtable, submission->key);
-		char *value;
+		char *value = lsm_tree_get(lsm_tree, submission->key, NULL);
 
-		if (node == NULL) { // value wasn't in memtable, so look in segments
-			value = lsm_tree_search_with_index(lsm_tree, submission->key);
-		} else {
-			value = node->data;
-		}
 		if (value != NULL) {
 			printf("The value for key %d is %s.\n", submission->key, value);
 		} else {
 			printf("Key not found in LSM Tree system.\n");
 		}
+		free(value);
 
 	} else if (submission->action == DELETE) {
 		// always soft delete here; do not decrement keys in tree
-		if (memtable_delete(lsm_tree->memtable, submission->key, false, TOMBSTONE) != 0) {
+		pthread_rwlock_wrlock(&lsm_tree->memtable_lock);
+		int error = memtable_delete(lsm_tree->memtable, submission->key, false,
+				TOMBSTONE, submission->sequence);
+		pthread_rwlock_unlock(&lsm_tree->memtable_lock);
+		if (lsm_tree->cache)
+			row_cache_invalidate(lsm_tree->cache, submission->key);
+
+		if (error != 0) {
 			printf("Deletion of key %d failed.\n", submission->key);
 			return -1;
 		}
 
+	} else if (submission->action == DELETE_RANGE) {
+		pthread_rwlock_wrlock(&lsm_tree->memtable_lock);
+		int error = memtable_delete_range(lsm_tree->memtable, submission->key,
+				submission->end_key, submission->sequence);
+		pthread_rwlock_unlock(&lsm_tree->memtable_lock);
+		if (lsm_tree->cache)
+			row_cache_invalidate_range(lsm_tree->cache, submission->key, submission->end_key);
+
+		if (error != 0) {
+			printf("Deletion of keys %d to %d failed.\n", submission->key,
+					submission->end_key);
+			return -1;
+		}
+
 	} else if (submission->action == FLUSH) {
-		serialize_memtable(lsm_tree->memtable, LATEST_MEMTABLE);
+		char latest[FILENAME_SIZE];
+		path_in_tree(lsm_tree, LATEST_MEMTABLE, latest, FILENAME_SIZE);
+		serialize_memtable(lsm_tree->memtable, latest);
 
 	} else if (submission->action == PRINT_MEMTABLE) {
 		print_memtable(lsm_tree->memtable, "in_order_traversal");
@@ -167,171 +1052,1641 @@ static int execute_action(LSM_Tree *lsm_tree, Submission *submission) {
 	return 0;
 }
 
-/* Determines if the LSM System has enough segments to
- * warrant compaction step  */
+/* Determines if the LSM System has enough segments (or wasted reads, or
+ * deletes) to warrant compaction step  */
 bool ready_for_compaction(LSM_Tree *lsm_tree) {
-	if (lsm_tree->full_segments == MAX_SEGMENTS) {
-		return true;
+	return compaction_trigger(lsm_tree, false) != TRIGGER_NONE;
+}
+
+/* Decides whether compaction should run now, and why. Every compaction
+ * merges all the segments, so what the read statistics decide is when it
+ * runs, not what it merges: once max_segments sorted runs pile up, as
+ * ever; sooner if lookups have wasted wasted_probe_limit block reads on
+ * flushed segments that didn't hold their key (merged into the run, a key
+ * has one place to be), or if deletes, which compaction drops, make up
+ * tombstone_compaction_pct of the segments' lines; and, if the foreground
+ * is idle, whenever there are two runs to merge. */
+static int compaction_trigger(LSM_Tree *lsm_tree, bool idle) {
+	LSM_Options *options = &lsm_tree->options;
+	// the outputs of the last compaction make up one sorted run
+	int runs = 0;
+	bool have_compacted = false;
+	long wasted = 0, lines = 0, deletes = 0;
+	Version *version = acquire_version(lsm_tree);
+	for (int i = 0; i < version->num_segments; i++) {
+		Segment *segment = *(version->segments + i);
+		if (segment->fences) {
+			lines += segment->fences->num_lines + segment->fences->num_ranges;
+			deletes += segment->fences->num_tombstones + segment->fences->num_ranges;
+		}
+		if (segment->compacted) {
+			have_compacted = true;
+		} else {
+			runs++;
+			wasted += atomic_load(&segment->wasted_probes);
+		}
 	}
-	return false;
+	release_version(version);
+	runs += have_compacted;
+
+	if (runs >= options->max_segments)
+		return TRIGGER_RUNS;
+	// with a single run left there is nothing a compaction could improve
+	if (runs < 2)
+		return TRIGGER_NONE;
+	if (options->wasted_probe_limit > 0 && wasted >= options->wasted_probe_limit)
+		return TRIGGER_WASTED_PROBES;
+	if (options->tombstone_compaction_pct > 0 && lines > 0
+			&& deletes * 100 >= lines * options->tombstone_compaction_pct)
+		return TRIGGER_TOMBSTONES;
+	return idle ? TRIGGER_IDLE : TRIGGER_NONE;
 }
 
-static char* generate_new_segment_name() {
+static char* generate_new_segment_name(LSM_Tree *lsm_tree) {
 	char *filename = (char*) malloc(FILENAME_SIZE * sizeof(char));
 	if (filename == NULL) {
 		printf("Failed to allocate memory for new filename\n");
 		return NULL;
 	}
 
-	// time returns 10 digit number, plus underscore and another 2 digits
-	// + file suffix (3 char)  + \0 = min 17 digits
-	sprintf(filename, "%s%ld_%d.log", SEGMENT_LOCATION, time(NULL), rand() % 10);
+	// time returns 10 digit number, plus underscore and a counter that keeps
+	// names made within the same second from colliding, + file suffix (3 char)
+	static atomic_int segments_named = 0;
+	snprintf(filename, FILENAME_SIZE, "%s%ld_%d.log", lsm_tree->directory, time(NULL),
+			atomic_fetch_add(&segments_named, 1));
 	return filename;
 }
 
-/* Runs compaction of segments existing in LSM tree */
+/* Names a file inside the tree's directory */
+static void path_in_tree(LSM_Tree *lsm_tree, char *name, char *buf, int buf_size) {
+	snprintf(buf, buf_size, "%s%s", lsm_tree->directory, name);
+}
+
+/* Runs compaction of segments existing in LSM tree. The merged segment is
+ * installed as a new version, along with any segments flushed while it
+ * ran; the old segment files are deleted once no reader is using them
+ * any more. */
 int run_compaction(LSM_Tree *lsm_tree) {
 	printf("> LSM System Alert: Running compaction...\n");
 
-	char *new_segment = generate_new_segment_name();
-	if (!new_segment) {
-		printf("Couldn't run compaction without a new segment name.\n");
+	int max_outputs = lsm_tree->options.max_subcompactions;
+	CompactionOutput outputs[max_outputs];
+	int named = 0;
+	for (; named < max_outputs; named++) {
+		if (!((outputs + named)->filename = generate_new_segment_name(lsm_tree)))
+			break;
+	}
+	if (named < max_outputs) {
+		printf("Couldn't run compaction without new segment names.\n");
+		for (int i = 0; i < named; i++)
+			free((outputs + i)->filename);
 		return -1;
 	}
 
-	int error = compact_segments(lsm_tree->segments, MAX_SEGMENTS,
-			new_segment, MAX_LINE_SIZE, TOMBSTONE);
-	if (error) {
-		printf("Error occurred while compacting segment files\n");
+	Retention retention;
+	if (init_retention(lsm_tree, &retention) != 0) {
+		for (int i = 0; i < max_outputs; i++)
+			free((outputs + i)->filename);
 		return -1;
 	}
 
-	// assign new segment and clear existing segments
-	free_segment_list(lsm_tree->segments, MAX_SEGMENTS);
-	lsm_tree->segments = init_segment_list(MAX_SEGMENTS);
-	*(lsm_tree->segments) = new_segment;
-	lsm_tree->full_segments = 1;
+	Version *base = acquire_version(lsm_tree);
+	int num_inputs = base->num_segments;
+	char *segment_files[num_inputs];
+	char *merged_files[num_inputs];
+	bool dropped[num_inputs], moved[num_inputs];
+	int num_merged = 0, num_moved = 0;
 
-	return 0;
-}
+	// a segment a newer range delete covers end to end, or whose values have
+	// all expired, is dropped unread, save for releasing the value log space
+	// of its values
+	int num_expired = 0;
+	for (int i = 0; i < num_inputs; i++) {
+		segment_files[i] = (*(base->segments + i))->filename;
+		bool deleted = segment_wholly_deleted(base, i, &retention);
+		bool expired = !deleted && segment_expired(base, i, dropped, retention.now);
+		dropped[i] = (deleted || expired)
+				&& discard_segment_values(segment_files[i], MAX_LINE_SIZE, &retention,
+						&lsm_tree->stats) == 0;
+		num_expired += expired && dropped[i];
+	}
+	if (num_expired > 0)
+		printf("> LSM System Alert: Dropping %d expired segment(s) without reading them.\n",
+				num_expired);
 
-/* Sends in-memory memtable (binary tree) to a segment file,
- * while also reseting the memtable and updating the record
- * of segment files available within the system. */
-char* send_memtable_to_segment(LSM_Tree *lsm_tree) {
-	char *new_segment = generate_new_segment_name();
-	if (!new_segment) {
-		printf("Couldn't send memtable to segment.\n");
-		return NULL;
+	// one that overlaps no other (say, keys appended above all earlier ones)
+	// is moved into the run without being rewritten
+	for (int i = 0; i < num_inputs; i++) {
+		moved[i] = !dropped[i] && segment_disjoint(base, i, dropped, num_inputs);
+		num_moved += moved[i];
+		if (!dropped[i] && !moved[i])
+			merged_files[num_merged++] = segment_files[i];
 	}
+	if (num_moved > 0)
+		printf("> LSM System Alert: Moving %d segment(s) without rewriting them.\n",
+				num_moved);
 
-	int error = remove_deleted_keys_from_index(lsm_tree->index,
-			lsm_tree->memtable->root);
-	if (error)
-		printf("Error occurred in deleting removed keys from index.\n");
+	// compaction yields to flushes and, with auto-tuning, to slow reads
+	IOOptions io = { lsm_tree->options.compaction_io, lsm_tree->limiter, IO_PRIORITY_LOW };
+	int num_outputs = num_merged == 0 ? 0 : compact_segments(merged_files, num_merged,
+			outputs, max_outputs, MAX_LINE_SIZE, lsm_tree->options.level1_codec, &io,
+			&lsm_tree->stats, &retention);
+	free(retention.snapshots);
+	if (num_outputs < 0) {
+		printf("Error occurred while compacting segment files\n");
+		for (int i = 0; i < max_outputs; i++)
+			free((outputs + i)->filename);
+		release_version(base);
+		return -1;
+	}
 
-	error = memtable_to_segment(lsm_tree->memtable, new_segment);
+	// the outputs and the moved segments replace every input as one run, in
+	// key order. An output that can't be opened fails the whole compaction:
+	// the inputs it replaces would otherwise go with its keys still in it.
+	Segment *segments[max_outputs + num_inputs];
+	Segment *built[max_outputs];
+	int num_segments = 0, num_built = 0, error = 0;
+	for (int i = 0; i < max_outputs; i++) {
+		CompactionOutput *output = outputs + i;
+		bool written = i < num_outputs && !output->empty;
+		Segment *segment = written && !error ? new_segment(output->filename,
+				lsm_tree->options.fence_storage, lsm_tree->options.mmap_reads) : NULL;
+		if (!segment) {
+			if (written)
+				delete_segment(output->filename);
+			error |= written ? -1 : 0;
+			free(output->filename);
+			output->filename = NULL;
+			continue;
+		}
+		segment->compacted = true;
+		segments[num_segments++] = segment;
+		built[num_built++] = segment;
+	}
 	if (error) {
-		printf("Failed at saving memtable to segment.\n");
-		return NULL;
+		printf("Could not open the compacted segments; the inputs are kept.\n");
+		for (int i = 0; i < num_built; i++) {
+			atomic_store(&built[i]->obsolete, true);
+			unref_segment(built[i]);
+		}
+		release_version(base);
+		return -1;
 	}
-
-	// make new segment the next segment in list
-	*(lsm_tree->segments + lsm_tree->full_segments) = new_segment;
-	lsm_tree->full_segments += 1;
-	return new_segment;
-}
-
-/* Finds the value of a key using the LSM Tree Systems file system index. */
-char* lsm_tree_search_with_index(LSM_Tree *lsm_tree, int key) {
-	char *filename = index_lookup(lsm_tree->index, key);
-	if (!filename) {
-		return NULL;
+	for (int i = 0; i < num_inputs; i++) {
+		Segment *segment = *(base->segments + i);
+		if (!moved[i])
+			continue;
+		ref_segment(segment);
+		atomic_store(&segment->compacted, true);
+		segments[num_segments++] = segment;
 	}
-	return search_segment(filename, key, MAX_LINE_SIZE);
-}
+	sort_by_key_range(segments, num_segments);
 
-/* Searches existing segment files to see if the key exists.
- * Starts search with most recent segment (newest), but searches until found. */
-char* lsm_tree_linear_search(LSM_Tree *lsm_tree, int key) {
+	// flushes only ever append to the current version, so whatever it holds
+	// past the inputs was flushed meanwhile and is newer than the outputs
+	pthread_rwlock_wrlock(&lsm_tree->version_lock);
+	Version *old = lsm_tree->current;
+	int num_flushed = old->num_segments - num_inputs;
+	Segment *installed[num_segments + num_flushed + 1];
+	for (int i = 0; i < num_segments; i++)
+		installed[i] = segments[i];
+	for (int i = 0; i < num_flushed; i++)
+		installed[num_segments + i] = *(old->segments + num_inputs + i);
 
-	char **segment_files = lsm_tree->segments;
-	int full_segments = lsm_tree->full_segments;
-
-	if (full_segments == 0) {
-		return NULL;
+	// without a version to install them in, the outputs go with their files
+	Version *version = new_version(installed, num_segments + num_flushed);
+	for (int i = 0; i < num_built && !version; i++)
+		atomic_store(&built[i]->obsolete, true);
+	for (int i = 0; i < num_segments; i++)
+		unref_segment(segments[i]);
+	if (!version) {
+		pthread_rwlock_unlock(&lsm_tree->version_lock);
+		release_version(base);
+		return -1;
 	}
 
-	// full_segments -1 because segment 1 at index 0
-	for (int i = full_segments - 1; i >= 0; i--) {
-		char *value = search_segment(*(segment_files + i), key, MAX_LINE_SIZE);
-		if (value != NULL) {
-			return value;
+	// keys indexed against the merged segments now live in the output for
+	// their range, or nowhere if compaction dropped them; moved segments
+	// keep their keys
+	for (int i = 0; i < num_inputs && lsm_tree->index; i++) {
+		if (dropped[i])
+			index_replace_value(lsm_tree->index, segment_files[i], NULL, INT_MIN, INT_MAX);
+		for (int j = 0; j < num_outputs && !dropped[i] && !moved[i]; j++) {
+			index_replace_value(lsm_tree->index, segment_files[i], (outputs + j)->filename,
+					(outputs + j)->low_key, (outputs + j)->high_key);
 		}
 	}
-	return NULL;
-}
+
+	lsm_tree->current = version;
+	pthread_rwlock_unlock(&lsm_tree->version_lock);
+
+	for (int i = 0; i < num_inputs; i++) {
+		if (!moved[i])
+			atomic_store(&(*(base->segments + i))->obsolete, true);
+	}
+	unref_version(old);
+	release_version(base);
+
+	return 0;
+}
+
+/* Sends an in-memory memtable (binary tree) to a segment file, syncs it,
+ * then installs a version including it and points the index at it. The
+ * caller retires the memtable afterwards. The segment is durable before
+ * anything can see it: once installed, compaction may replace and delete it
+ * at any time. Returns 0 on success, -1 on failure. */
+int send_memtable_to_segment(LSM_Tree *lsm_tree, Memtable *memtable) {
+	char *new_segment_name = generate_new_segment_name(lsm_tree);
+	if (!new_segment_name) {
+		printf("Couldn't send memtable to segment.\n");
+		return -1;
+	}
+
+	Retention retention;
+	if (init_retention(lsm_tree, &retention) != 0) {
+		free(new_segment_name);
+		return -1;
+	}
+
+	IOOptions io = { IO_BUFFERED, lsm_tree->limiter, IO_PRIORITY_HIGH };
+	int error = memtable_to_segment(memtable, new_segment_name,
+			MAX_LINE_SIZE, lsm_tree->options.level0_codec, &io, &lsm_tree->stats, &retention);
+	free(retention.snapshots);
+	if (error) {
+		printf("Failed at saving memtable to segment.\n");
+		free(new_segment_name);
+		return -1;
+	}
+	if (sync_segment(lsm_tree, new_segment_name) != 0) {
+		printf("Could not sync new segment to disk: %s\n", new_segment_name);
+		free(new_segment_name);
+		return -1;
+	}
+
+	Segment *segment = new_segment(new_segment_name, lsm_tree->options.fence_storage,
+			lsm_tree->options.mmap_reads);
+	if (!segment)
+		return -1;
+
+	// make new segment the newest segment, and index its keys, in one step;
+	// the version is built under the lock, since compaction may swap it
+	pthread_rwlock_wrlock(&lsm_tree->version_lock);
+	Version *version = version_with_segment(lsm_tree->current, segment);
+	unref_segment(segment);
+	if (!version) {
+		pthread_rwlock_unlock(&lsm_tree->version_lock);
+		return -1;
+	}
+
+	error = lsm_tree->index ? remove_deleted_keys_from_index(lsm_tree->index,
+			memtable) : 0;
+	if (error)
+		printf("Error occurred in deleting removed keys from index.\n");
+
+	if (lsm_tree->index && update_index(lsm_tree->index, memtable,
+			segment->filename) != 0)
+		die("Fatal Error: Corrupted index.\n");
+
+	Version *old = lsm_tree->current;
+	lsm_tree->current = version;
+	atomic_store(&memtable->flushed, true);
+	pthread_rwlock_unlock(&lsm_tree->version_lock);
+
+	unref_version(old);
+	return 0;
+}
+
+/* Pins the current version (its segments stay on disk) for a reader;
+ * must be paired with release_version(). */
+Version* acquire_version(LSM_Tree *lsm_tree) {
+	pthread_rwlock_rdlock(&lsm_tree->version_lock);
+	Version *version = lsm_tree->current;
+	ref_version(version);
+	pthread_rwlock_unlock(&lsm_tree->version_lock);
+	return version;
+}
+
+void release_version(Version *version) {
+	unref_version(version);
+}
+
+/* Reads the value of a key as of a snapshot (or the latest value, if snapshot
+ * is NULL), resolving deletes and value log pointers. Returns a copy that the
+ * caller must free, or NULL if the key has no visible value. Latest reads are
+ * served from the row cache when they can be, and fill it when they had to
+ * go to the segments. */
+char* lsm_tree_get(LSM_Tree *lsm_tree, int key, Snapshot *snapshot) {
+	long sequence = snapshot ? snapshot->sequence : LATEST_SEQUENCE;
+	char *value = NULL;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	atomic_fetch_add(&lsm_tree->foreground_ops, 1);
+
+	RowCache *cache = snapshot ? NULL : lsm_tree->cache;
+	if (cache && row_cache_lookup(cache, key, &value)) {
+		rate_limiter_record_latency(lsm_tree->limiter, elapsed_ns(&start));
+		return value;
+	}
+	// taken before the memtable is read, so a write racing this get voids the fill
+	long generation = cache ? row_cache_generation(cache, key) : 0;
+
+	// value log files can't be collected out from under a get in progress
+	pthread_rwlock_rdlock(&lsm_tree->vlog_lock);
+
+	// search memtable (and those waiting to be flushed) first
+	bool in_memtable;
+	pthread_rwlock_rdlock(&lsm_tree->memtable_lock);
+	char *found = memtables_lookup(lsm_tree, key, sequence, &in_memtable);
+	if (found)
+		value = strdup(found);
+	pthread_rwlock_unlock(&lsm_tree->memtable_lock);
+
+	if (in_memtable) {
+		// found (or range deleted) in memtable
+	} else if (!snapshot) {
+		// the index always points at the segment holding the newest version
+		value = lsm_tree_search_with_index(lsm_tree, key);
+	} else {
+		value = lsm_tree_linear_search(lsm_tree, key, sequence);
+	}
+
+	bool pointer = is_value_pointer(value);
+	bool transient = value_expiry(value) || is_merge_operand(value);
+	value = resolve_value(lsm_tree, key, value, sequence);
+	pthread_rwlock_unlock(&lsm_tree->vlog_lock);
+
+	// memtable keys are likely to be written again soon, a pointer that could
+	// not be read says nothing about the key, and a value with a TTL (or one
+	// folded over such a value) would outlive its expiry in the cache
+	if (cache && !in_memtable && !(pointer && !value) && !transient)
+		row_cache_insert(cache, key, value, generation);
+
+	// foreground latency steers how much bandwidth compaction may use
+	rate_limiter_record_latency(lsm_tree->limiter, elapsed_ns(&start));
+	return value;
+}
+
+/* Reads the value of a key as lsm_tree_get() does, without copying it when
+ * it can. A latest read the row cache holds is served from it, as a copy.
+ * Otherwise a plain value found in a raw block of a mapped segment is left
+ * where it is, and the slice pins that segment, so the mapping outlives
+ * the file if compaction removes it meanwhile; a key no mapped segment
+ * holds is reported missing there and then. Anything else (a value from a
+ * memtable, a compressed block or the value log, or one with a TTL, merge
+ * operands or a range delete to resolve) is read through lsm_tree_get()
+ * into a copy, which also counts the block reads. Returns true if the key
+ * has a visible value; the slice must be released either way. */
+bool lsm_tree_get_slice(LSM_Tree *lsm_tree, int key, Snapshot *snapshot, ValueSlice *slice) {
+	long sequence = snapshot ? snapshot->sequence : LATEST_SEQUENCE;
+	memset(slice, 0, sizeof(ValueSlice));
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	RowCache *cache = snapshot ? NULL : lsm_tree->cache;
+	if (cache && row_cache_lookup(cache, key, &slice->copy)) {
+		atomic_fetch_add(&lsm_tree->foreground_ops, 1);
+		rate_limiter_record_latency(lsm_tree->limiter, elapsed_ns(&start));
+		slice->data = slice->copy;
+		slice->length = slice->copy ? strlen(slice->copy) : 0;
+		return slice->copy != NULL;
+	}
+
+	bool in_memtable;
+	pthread_rwlock_rdlock(&lsm_tree->memtable_lock);
+	memtables_lookup(lsm_tree, key, sequence, &in_memtable);
+	pthread_rwlock_unlock(&lsm_tree->memtable_lock);
+
+	// newest segment first; the first that holds a visible version decides
+	Version *version = in_memtable ? NULL : acquire_version(lsm_tree);
+	int num_segments = version ? version->num_segments : 0;
+	Segment *probed[num_segments + 1];
+	int num_probed = 0;
+	bool answered = version != NULL;
+	for (int i = num_segments - 1; i >= 0; i--) {
+		Segment *segment = *(version->segments + i);
+		char *value;
+		int length;
+		long found;
+		if (!segment_may_hold(segment, key))
+			continue;
+		int result = segment->fences ? search_mapped_segment(segment->fences, key,
+				sequence, &value, &length, &found) : -1;
+		if (result == 0) {
+			probed[num_probed++] = segment;
+			continue;
+		}
+		answered = result == 1 && !stored_marker(value)
+				&& found >= version_range_deleted(version, key, sequence);
+		if (answered) {
+			ref_segment(segment);
+			slice->segment = segment;
+			slice->data = value;
+			slice->length = length;
+		}
+		break;
+	}
+
+	// probes are counted by whichever path answers, so never twice
+	if (answered) {
+		for (int i = 0; i < num_probed; i++)
+			count_probe(probed[i], false);
+		if (slice->segment)
+			count_probe(slice->segment, true);
+	}
+	if (version)
+		release_version(version);
+
+	if (answered) {
+		atomic_fetch_add(&lsm_tree->foreground_ops, 1);
+		rate_limiter_record_latency(lsm_tree->limiter, elapsed_ns(&start));
+		return slice->segment != NULL;
+	}
+	slice->copy = lsm_tree_get(lsm_tree, key, snapshot);
+	slice->data = slice->copy;
+	slice->length = slice->copy ? strlen(slice->copy) : 0;
+	return slice->copy != NULL;
+}
+
+/* Lets go of a slice's value, and of the segment it was read from */
+void release_slice(ValueSlice *slice) {
+	if (slice->segment)
+		unref_segment(slice->segment);
+	free(slice->copy);
+	memset(slice, 0, sizeof(ValueSlice));
+}
+
+/* Reads many keys at once (as of a snapshot, or the latest values if NULL),
+ * setting values[i] to a copy of the value of keys[i] or NULL. Keys the
+ * memtable can't answer are looked up in the segments together, so their
+ * block reads are issued as one batch rather than one after another.
+ * Returns 0 on success, -1 if some segment reads failed. */
+int lsm_tree_multi_get(LSM_Tree *lsm_tree, int *keys, int count, Snapshot *snapshot,
+		char **values) {
+	long sequence = snapshot ? snapshot->sequence : LATEST_SEQUENCE;
+	bool resolved[count];
+	int error = 0;
+	atomic_fetch_add(&lsm_tree->foreground_ops, count);
+
+	pthread_rwlock_rdlock(&lsm_tree->vlog_lock);
+
+	pthread_rwlock_rdlock(&lsm_tree->memtable_lock);
+	for (int i = 0; i < count; i++) {
+		char *in_memtable = memtables_lookup(lsm_tree, keys[i], sequence, resolved + i);
+		values[i] = in_memtable ? strdup(in_memtable) : NULL;
+	}
+	pthread_rwlock_unlock(&lsm_tree->memtable_lock);
+
+	if (snapshot || !lsm_tree->index) {
+		Version *version = acquire_version(lsm_tree);
+		error = probe_version(lsm_tree, version, keys, count, sequence, values, resolved);
+		release_version(version);
+	} else {
+		// the index names the one segment holding each key's newest version
+		SegmentProbe probes[count];
+		int probe_of[count];
+		int num_probes = 0;
+
+		pthread_rwlock_rdlock(&lsm_tree->version_lock);
+		Version *version = lsm_tree->current;
+		ref_version(version);
+		for (int i = 0; i < count; i++) {
+			char *filename = resolved[i] ? NULL : index_lookup(lsm_tree->index, keys[i]);
+			probe_of[i] = filename ? num_probes : -1;
+			if (filename)
+				probes[num_probes++] = (SegmentProbe) { filename, keys[i], sequence, NULL,
+						fences_of(version, filename) };
+		}
+		pthread_rwlock_unlock(&lsm_tree->version_lock);
+
+		error = probe_segments(lsm_tree->io, probes, num_probes, MAX_LINE_SIZE,
+				&lsm_tree->stats);
+		for (int i = 0; i < count; i++) {
+			SegmentProbe *probe = probe_of[i] >= 0 ? probes + probe_of[i] : NULL;
+			Segment *segment = probe ? segment_named(version, probe->filename) : NULL;
+			if (segment)
+				count_probe(segment, probe->value != NULL);
+			if (probe && probe->value
+					&& probe->found < version_range_deleted(version, keys[i], sequence)) {
+				free(probe->value);
+				probe->value = NULL;
+			}
+			if (probe)
+				values[i] = probe->value;
+		}
+		release_version(version);
+	}
+
+	for (int i = 0; i < count; i++)
+		values[i] = resolve_value(lsm_tree, keys[i], values[i], sequence);
+	pthread_rwlock_unlock(&lsm_tree->vlog_lock);
+	return error;
+}
+
+/* Looks a key up in the memtable, then in the immutable memtables newest
+ * first. Returns the version visible at sequence, which belongs to the
+ * memtable; the caller holds memtable_lock. answered is set if the memtables
+ * settle the key: the first one holding a visible version or a visible range
+ * delete of it does, since everything in older memtables and the segments
+ * was written before. The value is NULL if the range delete is the newer.
+ * A memtable whose segment is installed is passed over: the segment may
+ * hold its operands folded into values, and any version acquired after
+ * this holds the segment. */
+static char* memtables_lookup(LSM_Tree *lsm_tree, int key, long sequence, bool *answered) {
+	for (int i = lsm_tree->num_immutables; i >= 0; i--) {
+		Memtable *memtable = i == lsm_tree->num_immutables ? lsm_tree->memtable
+				: lsm_tree->immutables[i];
+		if (atomic_load(&memtable->flushed))
+			continue;
+		MNode *node = search_memtable(memtable, key);
+		long found = 0;
+		char *value = node ? memtable_node_lookup(node, sequence, &found) : NULL;
+		long deleted = memtable_range_deleted(memtable, key, sequence);
+		if (value || deleted) {
+			*answered = true;
+			return found > deleted ? value : NULL;
+		}
+	}
+	*answered = false;
+	return NULL;
+}
+
+/* The sequence of the newest range delete of key in a version's segments
+ * visible at sequence, or 0 */
+static long version_range_deleted(Version *version, int key, long sequence) {
+	long newest = 0;
+	for (int i = 0; i < version->num_segments; i++) {
+		SegmentFences *fences = (*(version->segments + i))->fences;
+		long deleted = fences ? range_tombstones_cover(fences->ranges, fences->num_ranges,
+				key, sequence) : 0;
+		if (deleted > newest)
+			newest = deleted;
+	}
+	return newest;
+}
+
+/* The keys a segment has a say over: its own, and those its range deletes
+ * cover. Returns false if that isn't known or is empty. */
+static bool segment_extent(Segment *segment, int *low_key, int *high_key) {
+	SegmentFences *fences = segment->fences;
+	if (!fences)
+		return false;
+	*low_key = fences->low_key;
+	*high_key = fences->high_key;
+	for (int r = 0; r < fences->num_ranges; r++) {
+		if ((fences->ranges + r)->start_key < *low_key)
+			*low_key = (fences->ranges + r)->start_key;
+		if ((fences->ranges + r)->end_key > *high_key)
+			*high_key = (fences->ranges + r)->end_key;
+	}
+	return *low_key <= *high_key;
+}
+
+/* Whether a newer segment holds a range delete, visible to every reader, that
+ * covers segment i's keys and its own range deletes, so that none of its
+ * versions can be read again */
+static bool segment_wholly_deleted(Version *version, int i, Retention *retention) {
+	int low_key, high_key;
+	if (!segment_extent(*(version->segments + i), &low_key, &high_key))
+		return false;
+
+	for (int j = i + 1; j < version->num_segments; j++) {
+		SegmentFences *newer = (*(version->segments + j))->fences;
+		for (int r = 0; newer && r < newer->num_ranges; r++) {
+			RangeTombstone *range = newer->ranges + r;
+			if (range->start_key <= low_key && range->end_key >= high_key
+					&& !range_tombstone_needed(retention, range))
+				return true;
+		}
+	}
+	return false;
+}
+
+/* Whether every value in segment i has expired by now. Its footer only
+ * records an expiry when each of its lines has one, so it holds no deletes;
+ * still, it can only go if no older segment has versions of its keys that
+ * would resurface without it. */
+static bool segment_expired(Version *version, int i, bool *dropped, long now) {
+	SegmentFences *fences = (*(version->segments + i))->fences;
+	return fences && fences->expires > 0 && fences->expires <= now
+			&& segment_disjoint(version, i, dropped, i);
+}
+
+/* Whether none of the first count segments of a version (short of those
+ * being dropped) has a say over any of segment i's keys. Such a segment has
+ * nothing to merge with, and compaction can move it into the sorted run as
+ * it is; lookups find the same versions wherever it sits among the others. */
+static bool segment_disjoint(Version *version, int i, bool *dropped, int count) {
+	int low_key, high_key;
+	if (!segment_extent(*(version->segments + i), &low_key, &high_key))
+		return false;
+
+	for (int j = 0; j < count; j++) {
+		int other_low, other_high;
+		if (j == i || dropped[j])
+			continue;
+		if (!segment_extent(*(version->segments + j), &other_low, &other_high)) {
+			if ((*(version->segments + j))->fences == NULL)
+				return false;
+			continue;
+		}
+		if (other_low <= high_key && low_key <= other_high)
+			return false;
+	}
+	return true;
+}
+
+/* Orders segments with disjoint key ranges by key */
+static void sort_by_key_range(Segment **segments, int count) {
+	for (int i = 1; i < count; i++) {
+		Segment *segment = segments[i];
+		int j = i;
+		for (; j > 0 && segments[j - 1]->low_key > segment->low_key; j--)
+			segments[j] = segments[j - 1];
+		segments[j] = segment;
+	}
+}
+
+/* Looks up every unresolved key in every segment of a version as one batch
+ * of probes, keeping for each key the value from the newest segment that
+ * has a visible version of it. */
+static int probe_version(LSM_Tree *lsm_tree, Version *version, int *keys, int count,
+		long sequence, char **values, bool *resolved) {
+	int num_segments = version->num_segments;
+	int most_probes = count * num_segments;
+	long found[count];
+	SegmentProbe *probes = (SegmentProbe*) malloc((most_probes ? most_probes : 1)
+			* sizeof(SegmentProbe));
+	if (probes == NULL) {
+		printf("Failed to allocate memory for segment lookups.\n");
+		return -1;
+	}
+
+	// newest segment first, so each key's first hit is the one to keep;
+	// segments whose range or filter rule the key out are skipped
+	int num_probes = 0;
+	for (int i = 0; i < count; i++) {
+		for (int j = num_segments - 1; j >= 0 && !resolved[i]; j--) {
+			Segment *segment = *(version->segments + j);
+			if (!segment_may_hold(segment, keys[i]))
+				continue;
+			*(probes + num_probes++) = (SegmentProbe) {
+				segment->filename, keys[i], sequence, NULL, segment->fences };
+		}
+	}
+
+	int error = probe_segments(lsm_tree->io, probes, num_probes, MAX_LINE_SIZE,
+			&lsm_tree->stats);
+
+	int next = 0;
+	for (int i = 0; i < count; i++) {
+		for (int j = num_segments - 1; j >= 0 && !resolved[i]; j--) {
+			Segment *segment = *(version->segments + j);
+			if (!segment_may_hold(segment, keys[i]))
+				continue;
+			SegmentProbe *probe = probes + next++;
+			count_probe(segment, probe->value != NULL);
+			if (probe->value && !values[i]) {
+				values[i] = probe->value;
+				found[i] = probe->found;
+			} else {
+				free(probe->value);
+			}
+		}
+	}
+	free(probes);
+
+	// a newer range delete hides the version found
+	for (int i = 0; i < count; i++) {
+		if (!resolved[i] && values[i]
+				&& found[i] < version_range_deleted(version, keys[i], sequence)) {
+			free(values[i]);
+			values[i] = NULL;
+		}
+	}
+	return error;
+}
+
+/* The in-memory fences of the version's segment named filename (the very
+ * string the index holds), or NULL */
+static SegmentFences* fences_of(Version *version, char *filename) {
+	Segment *segment = segment_named(version, filename);
+	return segment ? segment->fences : NULL;
+}
+
+/* The version's segment named filename (the very string the index holds),
+ * or NULL */
+static Segment* segment_named(Version *version, char *filename) {
+	for (int i = 0; i < version->num_segments; i++) {
+		if ((*(version->segments + i))->filename == filename)
+			return *(version->segments + i);
+	}
+	return NULL;
+}
+
+static bool segment_may_hold(Segment *segment, int key) {
+	if (segment->fences)
+		return fences_may_contain(segment->fences, key);
+	return segment->low_key <= key && key <= segment->high_key;
+}
+
+/* Counts a lookup that read a block of segment, and whether it was wasted
+ * (the block held no version of the key the lookup could use) */
+static void count_probe(Segment *segment, bool found) {
+	atomic_fetch_add(&segment->probes, 1);
+	if (!found)
+		atomic_fetch_add(&segment->wasted_probes, 1);
+}
+
+static long elapsed_ns(struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000L + (now.tv_nsec - start->tv_nsec);
+}
+
+/* Turns a stored value of key, read as of sequence, into what a reader
+ * sees: NULL for a delete or an expired value, the value itself for a value
+ * log pointer, and the value its operands fold into for a merge operand.
+ * The caller holds vlog_lock. Consumes value. */
+static char* resolve_value(LSM_Tree *lsm_tree, int key, char *value, long sequence) {
+	if (value && (strcmp(value, TOMBSTONE) == 0 || value_expired(value))) {
+		free(value);
+		return NULL;
+	}
+	if (value_expiry(value)) {
+		char *payload = value_payload(value);
+		memmove(value, payload, strlen(payload) + 1);
+	}
+	if (is_merge_operand(value)) {
+		free(value);
+		MergeWalk walk;
+		gather_merges(lsm_tree, key, sequence, &walk);
+		value = fold_merges(lsm_tree, &walk);
+	} else if (is_value_pointer(value)) {
+		char *pointer = value;
+		value = value_log_read(lsm_tree->vlog, pointer);
+		free(pointer);
+	}
+	return value;
+}
+
+static bool is_merge_operand(char *value) {
+	return value && strncmp(value, MERGE_PREFIX, strlen(MERGE_PREFIX)) == 0;
+}
+
+/* Whether a value with a TTL has expired; reads check against the clock as
+ * they go, so a value expires for every snapshot at once */
+/* True if a stored value (which may run on past its end, as a line read in
+ * place does) starts with one of the markers reads have to resolve: a
+ * delete, a value log pointer, a merge operand or an expiry time */
+static bool stored_marker(char *value) {
+	return strncmp(value, TOMBSTONE, strlen(TOMBSTONE)) == 0 || is_value_pointer(value)
+			|| is_merge_operand(value) || value_expiry(value);
+}
+
+static bool value_expired(char *value) {
+	long expires = value_expiry(value);
+	return expires && expires <= time(NULL);
+}
+
+/* Gathers the merge operands of key visible at sequence, newest first, from
+ * the memtables and then the segments, down to the first version that isn't
+ * one or the range delete of them. The memtables and the version are pinned
+ * together under both locks, so a memtable flushed meanwhile is read from
+ * exactly one of them: its segment, once installed. The segment may hold the
+ * memtable's operands folded into values under the same sequence numbers,
+ * which the walk would drop as versions it already took. */
+static void gather_merges(LSM_Tree *lsm_tree, int key, long sequence, MergeWalk *walk) {
+	*walk = (MergeWalk) { key, sequence, LATEST_SEQUENCE, NULL, 0, 0, NULL, false, 0 };
+
+	pthread_rwlock_rdlock(&lsm_tree->memtable_lock);
+	pthread_rwlock_rdlock(&lsm_tree->version_lock);
+	Version *version = lsm_tree->current;
+	ref_version(version);
+	for (int i = lsm_tree->num_immutables; i >= 0 && !walk->done; i--) {
+		Memtable *memtable = i == lsm_tree->num_immutables ? lsm_tree->memtable
+				: lsm_tree->immutables[i];
+		if (atomic_load(&memtable->flushed))
+			continue;
+		MNode *node = search_memtable(memtable, key);
+		long deleted = memtable_range_deleted(memtable, key, sequence);
+		if (node)
+			take_version(walk, node->sequence, node->data, deleted);
+		for (MVersion *version = node ? node->older : NULL; version; version = version->next)
+			take_version(walk, version->sequence, version->data, deleted);
+		walk->done |= deleted > 0;
+	}
+	pthread_rwlock_unlock(&lsm_tree->version_lock);
+	pthread_rwlock_unlock(&lsm_tree->memtable_lock);
+
+	for (int i = version->num_segments - 1; i >= 0 && !walk->done; i--) {
+		Segment *segment = *(version->segments + i);
+		SegmentFences *fences = segment->fences;
+		long deleted = fences ? range_tombstones_cover(fences->ranges, fences->num_ranges,
+				key, sequence) : 0;
+		if (segment_may_hold(segment, key))
+			walk_segment(lsm_tree, segment, walk, deleted);
+		walk->done |= deleted > 0 || walk->error;
+	}
+	release_version(version);
+}
+
+/* Takes the versions of the walk's key stored in a segment, newest first */
+static void walk_segment(LSM_Tree *lsm_tree, Segment *segment, MergeWalk *walk,
+		long deleted) {
+	SegmentReader *reader = open_segment_reader(segment->filename, IO_BUFFERED,
+			&lsm_tree->stats);
+	if (!reader || segment_reader_seek(reader, walk->key) != 0) {
+		if (reader)
+			close_segment_reader(reader);
+		walk->error = -1;
+		return;
+	}
+
+	char line[MAX_LINE_SIZE];
+	Record record;
+	while (!walk->done && segment_reader_next(reader, line, MAX_LINE_SIZE)) {
+		if (parse_record(line, &record) != 0 || record.key < walk->key)
+			continue;
+		if (record.key > walk->key)
+			break;
+		take_version(walk, record.sequence, record.value, deleted);
+	}
+	close_segment_reader(reader);
+}
+
+/* Takes the next older version of the walk's key, unless it is newer than
+ * the walk reads or was already taken from another source. A version older
+ * than deleted (the range delete in its source) ends the walk with no base. */
+static void take_version(MergeWalk *walk, long sequence, char *value, long deleted) {
+	if (walk->done || sequence > walk->sequence || sequence >= walk->last)
+		return;
+	walk->last = sequence;
+	if (sequence < deleted) {
+		walk->done = true;
+		return;
+	}
+	if (!is_merge_operand(value)) {
+		walk->base = strdup(value);
+		walk->done = true;
+		walk->error |= walk->base ? 0 : -1;
+		return;
+	}
+
+	if (walk->count == walk->capacity) {
+		int capacity = walk->capacity ? walk->capacity * 2 : 8;
+		char **operands = (char**) realloc(walk->operands, capacity * sizeof(char*));
+		if (operands == NULL) {
+			printf("Failed to grow merge operands.\n");
+			walk->error = -1;
+			walk->done = true;
+			return;
+		}
+		walk->operands = operands;
+		walk->capacity = capacity;
+	}
+	char *operand = strdup(value + strlen(MERGE_PREFIX));
+	if (operand)
+		walk->operands[walk->count++] = operand;
+	walk->error |= operand ? 0 : -1;
+	walk->done |= walk->error;
+}
+
+/* Folds a walk's operands, oldest first, over its base with the merge
+ * operator, and frees the walk. The caller holds vlog_lock if the base may
+ * be a value log pointer. Returns the value, or NULL if the key has none
+ * (or the walk failed). */
+static char* fold_merges(LSM_Tree *lsm_tree, MergeWalk *walk) {
+	char *value = walk->base;
+	if (value && (strcmp(value, TOMBSTONE) == 0 || value_expired(value))) {
+		free(value);
+		value = NULL;
+	} else if (value_expiry(value)) {
+		char *payload = value_payload(value);
+		memmove(value, payload, strlen(payload) + 1);
+	}
+	if (is_value_pointer(value)) {
+		value = value_log_read(lsm_tree->vlog, walk->base);
+		free(walk->base);
+		walk->error |= value ? 0 : -1;
+	}
+
+	for (int i = walk->count - 1; i >= 0; i--) {
+		char *merged = walk->error || !lsm_tree->options.merge ? NULL
+				: lsm_tree->options.merge(lsm_tree->options.merge_arg, walk->key, value,
+						walk->operands[i]);
+		free(value);
+		value = merged;
+		free(walk->operands[i]);
+	}
+	free(walk->operands);
+	if (walk->error) {
+		free(value);
+		return NULL;
+	}
+	return value;
+}
+
+/* Compaction hook: folds a merge operand with the merge operator, reading an
+ * existing value that lives in the value log. Results are kept inline, so
+ * one too long for that, or one a reader would take for a marker, is
+ * refused and the operands are left to be folded on read; so are operands
+ * over a value that is yet to expire. */
+static char* merge_value(void *tree, int key, char *existing, char *operand) {
+	LSM_Tree *lsm_tree = (LSM_Tree*) tree;
+	char *stored = NULL;
+
+	// reads fold over a value with a TTL only while it lives
+	if (value_expiry(existing))
+		return NULL;
+	if (is_value_pointer(existing)) {
+		pthread_rwlock_rdlock(&lsm_tree->vlog_lock);
+		stored = value_log_read(lsm_tree->vlog, existing);
+		pthread_rwlock_unlock(&lsm_tree->vlog_lock);
+		if (stored == NULL)
+			return NULL;
+		existing = stored;
+	}
+
+	char *merged = lsm_tree->options.merge(lsm_tree->options.merge_arg, key, existing,
+			operand);
+	free(stored);
+	if (merged && (strlen(merged) > lsm_tree->options.vlog_threshold
+			|| strcmp(merged, TOMBSTONE) == 0 || is_value_pointer(merged)
+			|| is_merge_operand(merged) || value_expiry(merged))) {
+		free(merged);
+		return NULL;
+	}
+	return merged;
+}
+
+/* Takes a snapshot of the system as of the latest write; the caller must
+ * release it so compaction can drop the versions it was holding on to. */
+Snapshot* lsm_tree_snapshot(LSM_Tree *lsm_tree) {
+	Snapshot *snapshot = (Snapshot*) malloc(sizeof(Snapshot));
+	if (snapshot == NULL) {
+		printf("Failed to allocate memory for snapshot.\n");
+		return NULL;
+	}
+	snapshot->next = NULL;
+
+	// keep the list ordered oldest to newest; new snapshots are always newest
+	pthread_mutex_lock(&lsm_tree->snapshot_lock);
+	snapshot->sequence = atomic_load(&lsm_tree->sequence);
+	Snapshot **tail = &lsm_tree->snapshots;
+	while (*tail)
+		tail = &(*tail)->next;
+	*tail = snapshot;
+	pthread_mutex_unlock(&lsm_tree->snapshot_lock);
+	return snapshot;
+}
+
+/* Releases a snapshot taken with lsm_tree_snapshot() */
+void release_snapshot(LSM_Tree *lsm_tree, Snapshot *snapshot) {
+	pthread_mutex_lock(&lsm_tree->snapshot_lock);
+	Snapshot **trav = &lsm_tree->snapshots;
+	while (*trav && *trav != snapshot)
+		trav = &(*trav)->next;
+
+	if (*trav)
+		*trav = snapshot->next;
+	pthread_mutex_unlock(&lsm_tree->snapshot_lock);
+	free(snapshot);
+}
+
+/* Finds the value of a key using the LSM Tree Systems file system index
+ * (or, without one, the segments' filters). The value returned is a copy,
+ * and must be freed by the caller. */
+char* lsm_tree_search_with_index(LSM_Tree *lsm_tree, int key) {
+	if (!lsm_tree->index)
+		return lsm_tree_linear_search(lsm_tree, key, LATEST_SEQUENCE);
+
+	// the version acquired with the index keeps the indexed segment alive
+	pthread_rwlock_rdlock(&lsm_tree->version_lock);
+	char *filename = index_lookup(lsm_tree->index, key);
+	Version *version = lsm_tree->current;
+	ref_version(version);
+	pthread_rwlock_unlock(&lsm_tree->version_lock);
+
+	char *value = NULL;
+	long found = 0;
+	Segment *segment = filename ? segment_named(version, filename) : NULL;
+	if (filename) {
+		value = search_segment(filename, segment ? segment->fences : NULL, key,
+				LATEST_SEQUENCE, MAX_LINE_SIZE, &lsm_tree->stats, &found);
+	}
+	if (segment)
+		count_probe(segment, value != NULL);
+	// range deletes leave the index alone, so the key may since have been deleted
+	if (value && found < version_range_deleted(version, key, LATEST_SEQUENCE)) {
+		free(value);
+		value = NULL;
+	}
+	release_version(version);
+	return value;
+}
+
+/* Searches existing segment files to see if a version of the key written at
+ * or before sequence exists. All segments are probed with one batch of reads;
+ * the most recent segment (newest) holding a version wins. */
+char* lsm_tree_linear_search(LSM_Tree *lsm_tree, int key, long sequence) {
+	Version *version = acquire_version(lsm_tree);
+	char *value = NULL;
+	bool resolved = false;
+
+	// every segment is probed in one batch of reads, newest taking precedence
+	probe_version(lsm_tree, version, &key, 1, sequence, &value, &resolved);
+	release_version(version);
+	return value;
+}
+
+/* Collects the values visible (as of snapshot, or now if NULL) for every key
+ * in [start_key, end_key], in key order. The memtable and each segment of the
+ * current version yield a sorted run; runs are merged newest first, so a key's
+ * newest visible version wins. Each run loses the keys that the range deletes
+ * of newer runs cover. Deleted keys are left out and value log pointers
+ * resolved. Returns NULL on failure. */
+ScanIterator* lsm_tree_scan(LSM_Tree *lsm_tree, int start_key, int end_key,
+		Snapshot *snapshot) {
+	atomic_fetch_add(&lsm_tree->foreground_ops, 1);
+	// a snapshot of our own keeps flush and compaction from dropping versions
+	Snapshot *own = snapshot ? NULL : lsm_tree_snapshot(lsm_tree);
+	if (!snapshot && !own)
+		return NULL;
+	long sequence = snapshot ? snapshot->sequence : own->sequence;
+
+	ScanIterator *result = new_scan_iterator();
+	RangeTombstone *hiding = NULL;
+	int num_hiding = 0;
+	pthread_rwlock_rdlock(&lsm_tree->vlog_lock);
+
+	// read the memtables before pinning a version, so a flush in between
+	// can only make us see the same keys twice (never miss them); one whose
+	// segment is installed is read from the segment, as gets do
+	pthread_rwlock_rdlock(&lsm_tree->memtable_lock);
+	int error = result ? 0 : -1;
+	for (int i = lsm_tree->num_immutables; i >= 0 && !error; i--) {
+		Memtable *memtable = i == lsm_tree->num_immutables ? lsm_tree->memtable
+				: lsm_tree->immutables[i];
+		if (atomic_load(&memtable->flushed))
+			continue;
+		ScanIterator *run = new_scan_iterator();
+		if (run && scan_memtable(memtable, start_key, end_key, sequence,
+				run) != 0) {
+			close_scan_iterator(run);
+			run = NULL;
+		}
+		if (run)
+			drop_hidden(run, hiding, num_hiding, sequence);
+		result = merge_scans(result, run);
+		error = result ? hide_ranges(&hiding, &num_hiding, memtable->ranges,
+				memtable->num_ranges, sequence) : -1;
+	}
+	pthread_rwlock_unlock(&lsm_tree->memtable_lock);
+
+	Version *version = acquire_version(lsm_tree);
+	for (int i = version->num_segments - 1; i >= 0 && !error; i--) {
+		Segment *segment = *(version->segments + i);
+		if (segment->high_key >= start_key && segment->low_key <= end_key) {
+			ScanIterator *run = scan_segment(lsm_tree, segment, start_key, end_key,
+					sequence);
+			if (run) {
+				drop_hidden(run, hiding, num_hiding, sequence);
+				result = merge_scans(result, run);
+			} else {
+				close_scan_iterator(result);
+				result = NULL;
+			}
+		}
+		error = result ? 0 : -1;
+		if (!error && segment->fences)
+			error = hide_ranges(&hiding, &num_hiding, segment->fences->ranges,
+					segment->fences->num_ranges, sequence);
+	}
+	release_version(version);
+	free(hiding);
+
+	if (error) {
+		pthread_rwlock_unlock(&lsm_tree->vlog_lock);
+		if (result)
+			close_scan_iterator(result);
+		if (own)
+			release_snapshot(lsm_tree, own);
+		printf("Failed to scan keys %d to %d.\n", start_key, end_key);
+		return NULL;
+	}
+
+	// drop deleted and expired keys, swap value log pointers for their values and fold
+	// merge operands; like lsm_tree_get, a value that can't be read from the
+	// log is left out
+	int kept = 0;
+	for (int i = 0; i < result->count; i++) {
+		KeyValue item = *(result->items + i);
+		item.value = resolve_value(lsm_tree, item.key, item.value, sequence);
+		if (item.value)
+			*(result->items + kept++) = item;
+	}
+	result->count = kept;
+	pthread_rwlock_unlock(&lsm_tree->vlog_lock);
+
+	if (own)
+		release_snapshot(lsm_tree, own);
+	return result;
+}
+
+/* Returns the next key and value of a scan, or NULL once exhausted. The
+ * value belongs to the iterator. */
+KeyValue* scan_iterator_next(ScanIterator *iterator) {
+	if (iterator->position >= iterator->count)
+		return NULL;
+	return iterator->items + iterator->position++;
+}
+
+void close_scan_iterator(ScanIterator *iterator) {
+	for (int i = 0; i < iterator->count; i++)
+		free((iterator->items + i)->value);
+	free(iterator->items);
+	free(iterator);
+}
+
+static ScanIterator* new_scan_iterator() {
+	ScanIterator *iterator = (ScanIterator*) malloc(sizeof(ScanIterator));
+	if (iterator == NULL) {
+		printf("Failed to allocate memory for scan.\n");
+		return NULL;
+	}
+	iterator->items = NULL;
+	iterator->count = 0;
+	iterator->capacity = 0;
+	iterator->position = 0;
+	return iterator;
+}
+
+/* Adds a key to the end of a scan; the scan takes ownership of value */
+static int scan_append(ScanIterator *iterator, int key, char *value) {
+	if (value == NULL)
+		return -1;
+
+	if (iterator->count == iterator->capacity) {
+		int capacity = iterator->capacity ? iterator->capacity * 2 : 16;
+		KeyValue *items = (KeyValue*) realloc(iterator->items,
+				capacity * sizeof(KeyValue));
+		if (items == NULL) {
+			printf("Failed to grow scan results.\n");
+			free(value);
+			return -1;
+		}
+		iterator->items = items;
+		iterator->capacity = capacity;
+	}
+	(iterator->items + iterator->count)->key = key;
+	(iterator->items + iterator->count)->value = value;
+	iterator->count++;
+	return 0;
+}
+
+/* Walks the memtable's keys in range in order, adding each key's version as
+ * of sequence unless one of the memtable's own range deletes is newer */
+static int scan_memtable(Memtable *memtable, int start_key, int end_key, long sequence,
+		ScanIterator *iterator) {
+	MemtableIterator nodes;
+	memtable_iterator_seek(&nodes, memtable, start_key);
+	for (MNode *node; (node = memtable_iterator_next(&nodes)) && node->key <= end_key; ) {
+		long found = 0;
+		char *data = memtable_node_lookup(node, sequence, &found);
+		if (data && found > memtable_range_deleted(memtable, node->key, sequence)
+				&& scan_append(iterator, node->key, strdup(data)) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Reads the versions of a segment's keys in range that are visible at sequence;
+ * lines come newest version first, so the first visible line of a key wins,
+ * unless one of the segment's own range deletes is newer. */
+static ScanIterator* scan_segment(LSM_Tree *lsm_tree, Segment *segment, int start_key,
+		int end_key, long sequence) {
+	SegmentFences *fences = segment->fences;
+	ScanIterator *iterator = new_scan_iterator();
+	SegmentReader *reader = iterator ?
+			open_segment_reader(segment->filename, IO_BUFFERED, &lsm_tree->stats) : NULL;
+	if (!reader || segment_reader_seek(reader, start_key) != 0) {
+		if (reader)
+			close_segment_reader(reader);
+		free(iterator);
+		return NULL;
+	}
+
+	char line[MAX_LINE_SIZE];
+	Record record;
+	long last_key = (long) INT_MIN - 1;
+	int error = 0;
+	while (!error && segment_reader_next(reader, line, MAX_LINE_SIZE)) {
+		if (parse_record(line, &record) != 0 || record.key < start_key
+				|| record.sequence > sequence)
+			continue;
+		if (record.key > end_key)
+			break;
+		if (record.key == last_key)
+			continue;
+		last_key = record.key;
+		if (fences && record.sequence < range_tombstones_cover(fences->ranges,
+				fences->num_ranges, record.key, sequence))
+			continue;
+		error = scan_append(iterator, record.key, strdup(record.value));
+	}
+	close_segment_reader(reader);
+
+	if (error) {
+		close_scan_iterator(iterator);
+		return NULL;
+	}
+	return iterator;
+}
+
+/* Adds the range deletes visible at sequence to those hiding older runs */
+static int hide_ranges(RangeTombstone **hiding, int *count, RangeTombstone *ranges,
+		int num_ranges, long sequence) {
+	if (num_ranges == 0)
+		return 0;
+	RangeTombstone *grown = (RangeTombstone*) realloc(*hiding,
+			(*count + num_ranges) * sizeof(RangeTombstone));
+	if (grown == NULL) {
+		printf("Failed to allocate memory for range deletes.\n");
+		return -1;
+	}
+	*hiding = grown;
+	for (int i = 0; i < num_ranges; i++) {
+		if ((ranges + i)->sequence <= sequence)
+			*(grown + (*count)++) = *(ranges + i);
+	}
+	return 0;
+}
+
+/* Removes the keys of a run that a newer run's range deletes cover; every
+ * version in an older run was written before them */
+static void drop_hidden(ScanIterator *run, RangeTombstone *hiding, int count, long sequence) {
+	if (count == 0)
+		return;
+	int kept = 0;
+	for (int i = 0; i < run->count; i++) {
+		KeyValue item = *(run->items + i);
+		if (range_tombstones_cover(hiding, count, item.key, sequence))
+			free(item.value);
+		else
+			*(run->items + kept++) = item;
+	}
+	run->count = kept;
+}
+
+/* Merges two sorted runs into one, preferring newer's value when both have a
+ * key. Both runs are consumed; returns NULL on failure. */
+static ScanIterator* merge_scans(ScanIterator *newer, ScanIterator *older) {
+	ScanIterator *merged = newer && older ? new_scan_iterator() : NULL;
+	if (!merged) {
+		if (newer)
+			close_scan_iterator(newer);
+		if (older)
+			close_scan_iterator(older);
+		return NULL;
+	}
+
+	int i = 0, j = 0, error = 0;
+	while (!error && (i < newer->count || j < older->count)) {
+		KeyValue *a = i < newer->count ? newer->items + i : NULL;
+		KeyValue *b = j < older->count ? older->items + j : NULL;
+
+		if (a && (!b || a->key <= b->key)) {
+			if (b && a->key == b->key) {
+				free(b->value);
+				b->value = NULL;
+				j++;
+			}
+			error = scan_append(merged, a->key, a->value);
+			a->value = NULL;
+			i++;
+		} else {
+			error = scan_append(merged, b->key, b->value);
+			b->value = NULL;
+			j++;
+		}
+	}
+
+	close_scan_iterator(newer);
+	close_scan_iterator(older);
+	if (error) {
+		close_scan_iterator(merged);
+		return NULL;
+	}
+	return merged;
+}
+
+/* Garbage collects the value log: a file that is mostly garbage has its
+ * still-live values re-appended (and re-pointed to through the WAL and
+ * memtable), after which the file is deleted. */
+int collect_value_log(LSM_Tree *lsm_tree) {
+	VLogFile file;
+	int error;
+
+	// relocation only tracks the newest pointers; snapshots may need older ones
+	pthread_mutex_lock(&lsm_tree->snapshot_lock);
+	bool snapshots_live = lsm_tree->snapshots != NULL;
+	pthread_mutex_unlock(&lsm_tree->snapshot_lock);
+	if (snapshots_live)
+		return 0;
+
+	while (value_log_gc_candidate(lsm_tree->vlog, &file)) {
+		printf("> LSM System Alert: Collecting value log file %d (%ld of %ld "
+				"bytes garbage)...\n", file.number, file.garbage, file.size);
+
+		if (file.garbage < file.size
+				&& value_log_scan(lsm_tree->vlog, &file, relocate_if_live, lsm_tree) != 0) {
+			printf("Failed to relocate live values out of value log.\n");
+			return -1;
+		}
+		// wait out any get that might still be reading an old pointer
+		pthread_rwlock_wrlock(&lsm_tree->vlog_lock);
+		error = value_log_remove_file(lsm_tree->vlog, &file);
+		pthread_rwlock_unlock(&lsm_tree->vlog_lock);
+		if (error != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Compaction hook: a value dropped from the segments may free value log space */
+static void discard_value(void *lsm_tree, char *value) {
+	value_log_discard(((LSM_Tree*) lsm_tree)->vlog, value_payload(value));
+}
+
+/* Value log scan callback; moves a value to the active value log file if
+ * the key still points at it, leaving the old copy unreferenced. */
+static int relocate_if_live(void *tree, int key, char *value, char *pointer) {
+	LSM_Tree *lsm_tree = (LSM_Tree*) tree;
+	MNode *node = search_memtable(lsm_tree->memtable, key);
+
+	// the flush thread may retire an immutable memtable meanwhile
+	bool in_memtable;
+	pthread_rwlock_rdlock(&lsm_tree->memtable_lock);
+	char *current = memtables_lookup(lsm_tree, key, LATEST_SEQUENCE, &in_memtable);
+	current = current ? strdup(current) : NULL;
+	pthread_rwlock_unlock(&lsm_tree->memtable_lock);
+	if (!in_memtable)
+		current = lsm_tree_search_with_index(lsm_tree, key);
+
+	// beneath merge operands the pointer is live if they fold over it; the key
+	// then gets the value they fold into, since nothing can go under them.
+	// An expired value is dead, and one yet to expire keeps its expiry.
+	char *folded = NULL;
+	char *base = current;
+	MergeWalk walk;
+	if (is_merge_operand(current)) {
+		gather_merges(lsm_tree, key, LATEST_SEQUENCE, &walk);
+		base = walk.base;
+	}
+	bool live = base && !value_expired(base) && strcmp(value_payload(base), pointer) == 0;
+	char expiry[KEY_DIGITS + 4];
+	expiry[0] = '\0';
+	if (live)
+		snprintf(expiry, sizeof(expiry), "%.*s", (int) (value_payload(base) - base), base);
+	if (is_merge_operand(current)) {
+		folded = fold_merges(lsm_tree, &walk);
+		live = live && folded != NULL;
+		value = folded;
+	}
+	free(current);
+	if (!live) {
+		free(folded);
+		return 0;
+	}
+
+	// a relocation is a write like any other, and may fill the memtable
+	write_controller_admit(lsm_tree->controller);
+	char new_pointer[VLOG_POINTER_SIZE];
+	long sequence = atomic_load(&lsm_tree->sequence) + 1;
+	int error = value_log_append(lsm_tree->vlog, key, value, new_pointer);
+	free(folded);
+	char stored[MAX_LINE_SIZE];
+	snprintf(stored, sizeof(stored), "%s%s", expiry, new_pointer);
+	if (error != 0
+			|| submission_to_wal(lsm_tree->wal, sequence, ADD, key, stored,
+					MAX_LINE_SIZE, lsm_tree->options.wal_sync) != 0) {
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&lsm_tree->memtable_lock);
+	error = memtable_insert(lsm_tree->memtable, key, stored, sequence);
+	pthread_rwlock_unlock(&lsm_tree->memtable_lock);
+	if (error != 0)
+		return -1;
+	atomic_store(&lsm_tree->sequence, sequence);
+
+	if (!node)
+		lsm_tree->memtable->count_keys++;
+	if (memtable_is_full(lsm_tree->memtable))
+		return rotate_memtable(lsm_tree);
+	return 0;
+}
+
+/* Captures the live snapshots for a flush or compaction; the caller frees
+ * retention->snapshots when done. */
+static int init_retention(LSM_Tree *lsm_tree, Retention *retention) {
+	pthread_mutex_lock(&lsm_tree->snapshot_lock);
+	int count = 0;
+	for (Snapshot *snapshot = lsm_tree->snapshots; snapshot; snapshot = snapshot->next)
+		count++;
+
+	retention->snapshots = (long*) malloc((count ? count : 1) * sizeof(long));
+	if (retention->snapshots == NULL) {
+		pthread_mutex_unlock(&lsm_tree->snapshot_lock);
+		printf("Failed to allocate memory for live snapshots.\n");
+		return -1;
+	}
+
+	count = 0;
+	for (Snapshot *snapshot = lsm_tree->snapshots; snapshot; snapshot = snapshot->next)
+		retention->snapshots[count++] = snapshot->sequence;
+	pthread_mutex_unlock(&lsm_tree->snapshot_lock);
+
+	retention->num_snapshots = count;
+	retention->now = time(NULL);
+	retention->tombstone = TOMBSTONE;
+	retention->on_discard = discard_value;
+	retention->discard_arg = lsm_tree;
+	retention->merge_prefix = MERGE_PREFIX;
+	retention->merge = lsm_tree->options.merge ? merge_value : NULL;
+	retention->merge_arg = lsm_tree;
+	return 0;
+}
 
 /* Prints the status of the LSM Tree system (i.e., keys in memtable,
  * and full segments */
 void show_status(LSM_Tree *lsm_tree) {
-	printf("\n> LSM Tree System Alert: Memtable currently holds %d keys, File system "
-			"holds %d segment(s).\n", lsm_tree->memtable->count_keys,
-			lsm_tree->full_segments);
+	Version *version = acquire_version(lsm_tree);
+	pthread_rwlock_rdlock(&lsm_tree->memtable_lock);
+	int num_immutables = lsm_tree->num_immutables;
+	pthread_rwlock_unlock(&lsm_tree->memtable_lock);
+	printf("\n> LSM Tree System Alert: Memtable currently holds %d keys (%ld of %ld "
+			"bytes), %d more memtable(s) waiting to flush, File system holds %d "
+			"segment(s).\n", lsm_tree->memtable->count_keys, lsm_tree->memtable->bytes,
+			lsm_tree->memtable->capacity, num_immutables, version->num_segments);
+
+	long fence_bytes = 0, probes = 0, wasted = 0;
+	for (int i = 0; i < version->num_segments; i++) {
+		Segment *segment = *(version->segments + i);
+		if (segment->fences)
+			fence_bytes += segment_fences_memory(segment->fences);
+		probes += segment->probes;
+		wasted += segment->wasted_probes;
+	}
+	release_version(version);
+	if (fence_bytes > 0)
+		printf("> Fence pointers: %ld bytes in memory.\n", fence_bytes);
+	if (probes > 0 || lsm_tree->early_compactions + lsm_tree->idle_compactions > 0) {
+		printf("> Segment reads: %ld block probe(s) of live segments, %ld found nothing; "
+				"%ld compaction(s) run early, %ld while idle.\n", probes, wasted,
+				(long) lsm_tree->early_compactions, (long) lsm_tree->idle_compactions);
+	}
+
+	SegmentStats *stats = &lsm_tree->stats;
+	if (stats->raw_bytes > 0) {
+		printf("> Segment blocks: %ld compressed, %ld raw; %ld bytes stored for %ld "
+				"bytes of data (ratio %.2f).\n", stats->blocks_compressed,
+				stats->blocks_uncompressed, stats->stored_bytes, stats->raw_bytes,
+				(double) stats->raw_bytes / stats->stored_bytes);
+	}
+	if (stats->blocks_decoded > 0) {
+		printf("> Block decode cost: %ld blocks, %.1f us per block.\n",
+				stats->blocks_decoded,
+				stats->decode_ns / 1000.0 / stats->blocks_decoded);
+	}
+
+	RateLimiter *limiter = lsm_tree->limiter;
+	long flushed = limiter->bytes[IO_PRIORITY_HIGH], compacted = limiter->bytes[IO_PRIORITY_LOW];
+	if (flushed + compacted > 0) {
+		printf("> Write rate limit: %.1f MB/s; %ld bytes flushed, %ld bytes compacted, "
+				"%.1f ms throttled.\n", rate_limiter_rate(limiter) / 1048576.0, flushed, compacted,
+				limiter->throttled_ns / 1e6);
+	}
+
+	WriteController *controller = lsm_tree->controller;
+	if (controller->delayed_writes + controller->stopped_writes > 0) {
+		printf("> Write stalls: %ld writes delayed for %.1f ms, %ld stopped for %.1f ms; "
+				"currently at %.0f%% of a stop.\n", (long) controller->delayed_writes,
+				controller->delayed_ns / 1e6, (long) controller->stopped_writes,
+				controller->stopped_ns / 1e6, 100 * write_controller_pressure(controller));
+	}
+
+	RowCache *cache = lsm_tree->cache;
+	long lookups = cache ? cache->hits + cache->misses : 0;
+	if (lookups > 0) {
+		printf("> Row cache: %ld hits, %ld misses (%.1f%% hit rate); %ld admitted, "
+				"%ld rejected; %ld bytes in use.\n", (long) cache->hits,
+				(long) cache->misses, 100.0 * cache->hits / lookups,
+				(long) cache->admitted, (long) cache->rejected, row_cache_used(cache));
+	}
+
+	ValueLog *vlog = lsm_tree->vlog;
+	long vlog_bytes = 0, vlog_garbage = 0;
+	pthread_mutex_lock(&vlog->lock);
+	for (int i = 0; i < vlog->num_files; i++) {
+		vlog_bytes += vlog->files[i].size;
+		vlog_garbage += vlog->files[i].garbage;
+	}
+	pthread_mutex_unlock(&vlog->lock);
+	if (vlog_bytes > 0) {
+		printf("> Value log: %d file(s), %ld bytes, %ld bytes garbage.\n",
+				vlog->num_files, vlog_bytes, vlog_garbage);
+	}
 }
 
-/* Prints out all active segment files */
+/* Prints out all active segment files, with the key range and fence
+ * pointer memory of each, and how much of it lookups and deletes waste */
 void print_active_segments(LSM_Tree *lsm_tree) {
-	for (int i = 0; i < lsm_tree->full_segments; i++) {
-		printf("%s\n", lsm_tree->segments[i]);
+	Version *version = acquire_version(lsm_tree);
+	for (int i = 0; i < version->num_segments; i++) {
+		Segment *segment = *(version->segments + i);
+		if (segment->fences) {
+			printf("%s: keys %d to %d, %d block(s), %d range delete(s), %ld bytes of fences\n",
+					segment->filename, segment->low_key, segment->high_key,
+					segment->fences->num_blocks, segment->fences->num_ranges,
+					segment_fences_memory(segment->fences));
+			printf("    %d of %d line(s) deletes; %ld lookup(s) read it, %ld found nothing\n",
+					segment->fences->num_tombstones, segment->fences->num_lines,
+					(long) segment->probes, (long) segment->wasted_probes);
+		} else {
+			printf("%s\n", segment->filename);
+		}
 	}
+	release_version(version);
 }
 
-// wrapper function for recursively adding memtable keys to index */
+/* Points the index at filename for every key in the memtable */
 static int update_index(Index *index, Memtable *memtable, char *filename) {
-	return add_key_to_index(index, memtable->root, filename);
-}
-
-static int add_key_to_index(Index *index, MNode *node, char *filename) {
-	if (node) {
+	MemtableIterator iterator;
+	memtable_iterator_seek(&iterator, memtable, INT_MIN);
+	for (MNode *node; (node = memtable_iterator_next(&iterator)); ) {
 		if (index_insert(index, node->key, filename) != 0) {
 			printf("Update to index failed. Index may be incomplete.\n");
 			return -1;
 		}
-		add_key_to_index(index, node->left_child, filename);
-		add_key_to_index(index, node->right_child, filename);
 	}
 	return 0;
 }
 
-static int remove_deleted_keys_from_index(Index *index, MNode *root) {
-	if (!root)
-		return 0;
-
-	// if node value is delete marker, then remove it from index, if it exists
-	if (!strcmp(root->data,TOMBSTONE))
-		return index_remove(index, root->key);
+static int remove_deleted_keys_from_index(Index *index, Memtable *memtable) {
+	MemtableIterator iterator;
+	memtable_iterator_seek(&iterator, memtable, INT_MIN);
 
-	remove_deleted_keys_from_index(index, root->left_child);
-	remove_deleted_keys_from_index(index, root->right_child);
-
-	// val_left or val_right may be -1 if not found or 0; it's okay if it isn't in
-	// the index yet, so do not throw error
+	// if node value is delete marker, then remove it from index, if it exists;
+	// it's okay if it isn't in the index yet, so do not throw error
+	for (MNode *node; (node = memtable_iterator_next(&iterator)); ) {
+		if (!strcmp(node->data, TOMBSTONE))
+			index_remove(index, node->key);
+	}
 	return 0;
 }
 
 /* Call to deallocate all memory for LSM tree system*/
 void shutdown_lsm_system(LSM_Tree *lsm_tree) {
+	// let the flush thread drain the immutable memtables, then stop both
+	pthread_mutex_lock(&lsm_tree->work_lock);
+	lsm_tree->stopping = true;
+	pthread_cond_broadcast(&lsm_tree->work_ready);
+	pthread_mutex_unlock(&lsm_tree->work_lock);
+	pthread_join(lsm_tree->flusher, NULL);
+	pthread_join(lsm_tree->compactor, NULL);
+	write_controller_release(lsm_tree->controller);
+
 	// send what contents are left in memtable to disk
 	if (lsm_tree->memtable->count_keys != 0) {
+		char latest[FILENAME_SIZE];
+		path_in_tree(lsm_tree, LATEST_MEMTABLE, latest, FILENAME_SIZE);
 
-		if (serialize_memtable(lsm_tree->memtable, LATEST_MEMTABLE) != 0) {
+		if (serialize_memtable(lsm_tree->memtable, latest) != 0) {
 			printf("Warning, memtable contents were not successfully saved.\n");
 		}
 	}
 
-	fclose(lsm_tree->wal);
+	while (lsm_tree->snapshots)
+		release_snapshot(lsm_tree, lsm_tree->snapshots);
+
+	close_wal(lsm_tree->wal);
+	close_value_log(lsm_tree->vlog);
+	close_io_context(lsm_tree->io);
+	close_rate_limiter(lsm_tree->limiter);
+	if (lsm_tree->cache)
+		close_row_cache(lsm_tree->cache);
+	close_write_controller(lsm_tree->controller);
 	delete_memtable(lsm_tree->memtable);
-	free_segment_list(lsm_tree->segments, MAX_SEGMENTS);
+	unref_version(lsm_tree->current);
+
+	pthread_rwlock_destroy(&lsm_tree->memtable_lock);
+	pthread_rwlock_destroy(&lsm_tree->version_lock);
+	pthread_rwlock_destroy(&lsm_tree->vlog_lock);
+	pthread_mutex_destroy(&lsm_tree->snapshot_lock);
+	pthread_mutex_destroy(&lsm_tree->work_lock);
+	pthread_cond_destroy(&lsm_tree->work_ready);
+	free(lsm_tree->directory);
+	free(lsm_tree->immutables);
 	free(lsm_tree);
 }
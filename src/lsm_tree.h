@@ -2,53 +2,265 @@
 #define LSM_TREE_H
 
 #include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "wal.h"
 #include "memtable.h"
 #include "index.h"
+#include "row_cache.h"
+#include "segment.h"
+#include "compress.h"
+#include "value_log.h"
+#include "version.h"
+#include "async_io.h"
+#include "rate_limiter.h"
+#include "write_controller.h"
 
-#define NUM_OPTIONS 6          							// number of actions LSM tree can do
+#define NUM_OPTIONS 9          							// number of actions LSM tree can do
 #define STR_BUF 5              							// leave plenty of room for options
 #define MAX_LEN_KEYS 10        							// max size of key (10 digits)
-#define MAX_LEN_DATA 50        							// max length of data for value in database
-#define MAX_SEGMENTS 2         							// max # full segments before compaction
-#define FILENAME_SIZE 30       							// file name size
-#define MAX_LINE_SIZE 100      							// max number of characters in a single line of a segment file
+#define MAX_LEN_DATA 4096      							// max length of data for value in database
+#define VLOG_THRESHOLD 64      							// values longer than this go to the value log
+#define WRITE_BUFFER_SIZE (1L << 20)					// memtable bytes before it is flushed to a segment
+#define MAX_SEGMENTS 4         							// max # sorted runs before compaction, however reads fare
+#define FILENAME_SIZE 64       							// file name size, including the tree's directory
+#define MAX_LINE_SIZE 128      							// max number of characters in a single line of a segment file
 #define TOMBSTONE "*-*"        							// special marker, denoting a key was deleted
-#define WRITE_AHEAD_LOG "./logs/wal.log"   				// name of write-ahead-log
+#define MERGE_PREFIX "*+*"     							// marks a merge operand, not yet folded into a value
 #define INDEX_SIZE 91               					// size of index (hash map)
-#define LATEST_MEMTABLE "./logs/latest_memtable.log"    // name of file for latest memtable
-#define SEGMENT_LOCATION "./logs/"						// where do logs and segments go?
+#define KEY_INDEX INDEX_FILTERS     					// how lookups find a key's segment (see key_indexes)
+#define FENCE_STORAGE FENCES_HEAP   					// FENCES_MMAP maps segment fences and filters instead
+#define MMAP_READS true             					// map segments whole, so values can be read in place
+#define LATEST_MEMTABLE "latest_memtable.log"    		// name of file for latest memtable
+#define MANIFEST "MANIFEST"								// lists the files of a checkpoint, in its directory
+#define SEGMENT_LOCATION "./logs/"						// where do logs and segments go by default?
+#define LEVEL0_CODEC CODEC_NONE    						// codec for segments flushed from memtable
+#define LEVEL1_CODEC CODEC_LZ      						// codec for segments written by compaction
+#define MAX_SUBCOMPACTIONS 4       						// key ranges a large compaction is merged in, in parallel
+#define COMPACTION_WASTED_PROBES 4096					// block reads of flushed segments finding nothing, before compacting early
+#define COMPACTION_TOMBSTONE_PCT 25						// share of segment lines that are deletes, before compacting early
+#define COMPACTION_CHECK_MS 1000						// how often compaction rechecks reads and load between flushes
+#define IDLE_OPS_PER_SEC 100							// gets, scans and writes per second below which it is idle
+#define COMPACTION_IO IO_BUFFERED						// IO_DIRECT keeps compaction out of the page cache
+#define WRITE_RATE_LIMIT (64L << 20)					// bytes/sec budget for flush and compaction writes
+#define WRITE_RATE_AUTO_TUNE true						// lower the budget while reads are slow
+#define TARGET_READ_LATENCY_US 1000						// read latency auto-tuning aims to stay under
+#define IO_BACKEND IO_URING       						// async segment reads (falls back to IO_THREADS)
+#define IO_QUEUE_DEPTH 64          						// reads in flight per io_uring submission
+#define IO_READ_THREADS 4          						// io_uring rings, or pread workers without it
+#define ROW_CACHE_BYTES (8L << 20)   					// budget for cached latest values (0 disables)
+#define MAX_IMMUTABLE_MEMTABLES 4      					// full memtables waiting to flush; writes stop here
+#define SLOWDOWN_IMMUTABLE_MEMTABLES 2 					// writes are delayed from here on
+#define L0_SLOWDOWN_SEGMENTS 8         					// uncompacted segments before writes are delayed
+#define L0_STOP_SEGMENTS 16            					// uncompacted segments before writes stop
+#define PENDING_COMPACTION_SLOWDOWN_BYTES (64L << 20)	// uncompacted bytes before writes are delayed
+#define PENDING_COMPACTION_STOP_BYTES (256L << 20)		// uncompacted bytes before writes stop
+#define MAX_WRITE_DELAY_US 1000        					// delay per write just short of a stop
+#define WAL_SYNC WAL_SYNC_FLUSH        					// WAL_SYNC_FSYNC survives power loss, at a cost
+
+/* INDEX_HASH maps every key to the segment holding its newest version, at
+ * a heap entry per key; INDEX_FILTERS keeps only each segment's fences and
+ * bloom filter, and checks the segments newest first */
+enum key_indexes {
+	INDEX_HASH, INDEX_FILTERS
+};
 
 enum available_actions {
-	ADD = 1, SEARCH = 2, DELETE = 3, FLUSH = 4, PRINT_MEMTABLE = 5, EXIT = 6
+	ADD = 1, SEARCH = 2, DELETE = 3, FLUSH = 4, PRINT_MEMTABLE = 5, EXIT = 6,
+	DELETE_RANGE = 7, MERGE = 8
 };
 
+/* a DELETE_RANGE deletes every key from key to end_key; a MERGE's value is
+ * an operand for the merge operator; an ADD with a ttl expires that many
+ * seconds after it is written */
 typedef struct user_submission {
 	enum available_actions action;
 	int key;
 	char *value;
+	long sequence;
+	int end_key;
+	int ttl;
 } Submission;
 
+/* Folds one merge operand into the value of key before it (NULL if the key
+ * had none), returning the new value as a malloc'd string, or NULL if the
+ * key is left without one. Operands are folded oldest first, each into the
+ * result of the last, on reads and in flush and compaction threads alike. */
+typedef char* (*merge_operator)(void *arg, int key, char *existing, char *operand);
+
+/* a consistent point-in-time view; reads through it only see writes with
+ * sequence numbers at or below the snapshot's */
+typedef struct snapshot {
+	long sequence;
+	struct snapshot *next;
+} Snapshot;
+
+/* one key and its visible value, as produced by a scan */
+typedef struct key_value {
+	int key;
+	char *value;
+} KeyValue;
+
+/* a value read by lsm_tree_get_slice(): length bytes at data, not
+ * terminated. A value read in place points into a mapped segment file,
+ * which segment pins; any other is a copy, owned by the slice. Either way
+ * data stays valid until release_slice(). */
+typedef struct value_slice {
+	char *data;
+	int length;
+	Segment *segment;
+	char *copy;
+} ValueSlice;
+
+/* the visible contents of a key range, in key order */
+typedef struct scan_iterator {
+	KeyValue *items;
+	int count;
+	int capacity;
+	int position;
+} ScanIterator;
+
+/* Runtime settings of an LSM tree. lsm_default_options() fills them in from
+ * the compile-time defaults above; callers override what they need before
+ * passing them to init_lsm_tree(), which keeps its own copy. */
+typedef struct lsm_options {
+	// memtables
+	long write_buffer_size;
+	int max_immutable_memtables;
+	int vlog_threshold;
+	int wal_sync;                   // one of wal_sync_policies
+
+	// segments and compaction
+	int max_segments;
+	int max_subcompactions;
+	long wasted_probe_limit;        // 0 leaves compaction to max_segments
+	int tombstone_compaction_pct;   // 0 leaves compaction to max_segments
+	long compaction_check_ms;       // 0 checks only when a flush lands
+	long idle_ops_per_sec;          // 0 never compacts for idleness
+	int level0_codec;
+	int level1_codec;
+	int compaction_io;
+	long write_rate_limit;
+	bool write_rate_auto_tune;
+	long target_read_latency_us;
+
+	// write stalls
+	int slowdown_immutable_memtables;
+	int l0_slowdown_segments;
+	int l0_stop_segments;
+	long pending_compaction_slowdown_bytes;
+	long pending_compaction_stop_bytes;
+	long max_write_delay_us;
+
+	// reads
+	int key_index;
+	int index_size;
+	int fence_storage;
+	bool mmap_reads;                // lets lsm_tree_get_slice() skip the copy
+	long row_cache_bytes;
+	int io_backend;
+	int io_queue_depth;
+	int io_read_threads;
+
+	// merges
+	merge_operator merge;           // folds MERGE operands; NULL rejects MERGE
+	void *merge_arg;
+} LSM_Options;
+
+/* Writes (handle_submission) come from a single thread; any number of threads
+ * may read concurrently through lsm_tree_get(), lsm_tree_snapshot() and
+ * acquire_version(). A full memtable is queued as immutable and replaced by
+ * an empty one; a background thread flushes the queue oldest first, and
+ * another compacts segments. Both install a new Version rather than changing
+ * the segment list under a reader's feet. Writers are slowed, then stopped,
+ * while the background work falls behind (see WriteController). Compaction
+ * runs once max_segments sorted runs pile up, or sooner if reads waste
+ * block reads on flushed segments, deletes pile up, or the tree is idle. */
 typedef struct lsm_tree_system {
+	char *directory;
+	LSM_Options options;
 	Memtable *memtable;
-	char **segments;
-	int full_segments;
-	FILE *wal;
+	Memtable **immutables;            // oldest first, up to max_immutable_memtables
+	int num_immutables;
+	Version *current;
+	WAL *wal;                         // the writer appends and rotates; the flush thread retires
 	Index *index;
+	ValueLog *vlog;
+	IOContext *io;
+	RateLimiter *limiter;
+	RowCache *cache;
+	WriteController *controller;
+	atomic_long sequence;
+	Snapshot *snapshots;
+	SegmentStats stats;
+	pthread_rwlock_t memtable_lock;   // the memtable and immutable queue, vs. readers
+	pthread_rwlock_t version_lock;    // the current version and the index describing it
+	pthread_rwlock_t vlog_lock;       // held by gets; value log files are removed under it
+	pthread_mutex_t snapshot_lock;
+	pthread_t flusher;
+	pthread_t compactor;
+	pthread_mutex_t work_lock;        // background threads sleep on work_ready under it
+	pthread_cond_t work_ready;
+	bool stopping;
+	atomic_bool collect_due;          // compaction left value log garbage for the writer
+	atomic_long foreground_ops;       // gets, scans and writes, for telling when it is idle
+	atomic_long early_compactions;    // run for wasted reads or deletes, before max_segments
+	atomic_long idle_compactions;
 } LSM_Tree;
 
-LSM_Tree* init_lsm_tree();
+void lsm_default_options(LSM_Options *options);
+
+LSM_Tree* init_lsm_tree(char *directory, LSM_Options *options);
 
 int handle_submission(LSM_Tree *lsm_tree, Submission *submission);
 
+int lsm_tree_write_batch(LSM_Tree *lsm_tree, Submission *batch, int count);
+
+int lsm_tree_delete_range(LSM_Tree *lsm_tree, int start_key, int end_key);
+
+int lsm_tree_merge(LSM_Tree *lsm_tree, int key, char *operand);
+
+int lsm_tree_put_ttl(LSM_Tree *lsm_tree, int key, char *value, int ttl);
+
+int lsm_tree_checkpoint(LSM_Tree *lsm_tree, char *directory);
+
+char* merge_add_operator(void *arg, int key, char *existing, char *operand);
+
 bool ready_for_compaction(LSM_Tree *lsm_tree);
 
 int run_compaction(LSM_Tree *lsm_tree);
 
-char* send_memtable_to_segment(LSM_Tree *lsm_tree);
+int send_memtable_to_segment(LSM_Tree *lsm_tree, Memtable *memtable);
+
+char* lsm_tree_get(LSM_Tree *lsm_tree, int key, Snapshot *snapshot);
+
+bool lsm_tree_get_slice(LSM_Tree *lsm_tree, int key, Snapshot *snapshot, ValueSlice *slice);
+
+void release_slice(ValueSlice *slice);
+
+int lsm_tree_multi_get(LSM_Tree *lsm_tree, int *keys, int count, Snapshot *snapshot,
+		char **values);
+
+Snapshot* lsm_tree_snapshot(LSM_Tree *lsm_tree);
+
+void release_snapshot(LSM_Tree *lsm_tree, Snapshot *snapshot);
+
+Version* acquire_version(LSM_Tree *lsm_tree);
+
+void release_version(Version *version);
 
 char* lsm_tree_search_with_index(LSM_Tree *lsm_tree, int key);
 
-char* lsm_tree_linear_search(LSM_Tree *lsm_tree, int key);
+char* lsm_tree_linear_search(LSM_Tree *lsm_tree, int key, long sequence);
+
+ScanIterator* lsm_tree_scan(LSM_Tree *lsm_tree, int start_key, int end_key,
+		Snapshot *snapshot);
+
+KeyValue* scan_iterator_next(ScanIterator *iterator);
+
+void close_scan_iterator(ScanIterator *iterator);
+
+int collect_value_log(LSM_Tree *lsm_tree);
 
 void print_active_segments(LSM_Tree *lsm_tree);
 
@@ -1,13 +1,47 @@
-#include <stdio.h> 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "error.h"
 #include "user_io.h"
 #include "lsm_tree.h"
 #include "segment.h"
 
+/* usage: lsm-system [--batch [file]]
+ * With --batch, commands are read from file (or stdin) without menus, see
+ * run_batch(); results go to stdout and everything else to stderr. */
 int main(int argc, char *argv[]) {
+	bool batch = argc > 1 && strcmp(argv[1], "--batch") == 0;
+	FILE *in = stdin, *out = NULL;
+	if (batch) {
+		if (argc > 2 && !(in = fopen(argv[2], "r"))) {
+			fprintf(stderr, "Could not open command file: %s\n", argv[2]);
+			return 1;
+		}
+		// results keep stdout to themselves; the engine's messages go to stderr
+		int fd = dup(STDOUT_FILENO);
+		if (fd < 0 || !(out = fdopen(fd, "w")) || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+			fprintf(stderr, "Could not set up output for batch mode.\n");
+			return 1;
+		}
+		setvbuf(stdout, NULL, _IOLBF, 0);
+	}
+
 	printf("Database System Started!\n");
-	LSM_Tree *lsm_tree = init_lsm_tree();
+	// MERGE adds its operand to the key's value, as a counter
+	LSM_Options options;
+	lsm_default_options(&options);
+	options.merge = merge_add_operator;
+	LSM_Tree *lsm_tree = init_lsm_tree(SEGMENT_LOCATION, &options);
+
+	if (batch) {
+		if (lsm_tree == NULL)
+			return 1;
+		int errors = run_batch(lsm_tree, in, out);
+		fclose(out);
+		shutdown_lsm_system(lsm_tree);
+		return errors ? 1 : 0;
+	}
 
 	while (1) {
 		Submission *user_submission = next_submission();
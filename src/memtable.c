@@ -2,22 +2,35 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <limits.h>
 
 #include "memtable.h"
 #include "error.h"
 
 /* Prototypes for static functions for library */
-static void do_insert(MNode *root, MNode *to_insert);
-static MNode* do_search(MNode *root, int key);
-static MNode* do_hard_delete(MNode *to_delete, MNode *parent,
-		int is_right_child);
+static void add_version(MNode *node, char *data, long sequence);
+static int tail_position(Memtable *memtable, int key);
+static int append_to_tail(Memtable *memtable, MNode *node);
+static void spill_tail(Memtable *memtable);
+static MNode** tree_link(MNode **root, int key, MNode **path[], int *depth);
+static long node_bytes(MNode *node);
+static void do_hard_delete(MNode **path[], int depth);
+static int height(MNode *node);
+static void update_height(MNode *node);
+static MNode* rotate_left(MNode *node);
+static MNode* rotate_right(MNode *node);
+static MNode* rebalance(MNode *node);
+static void rebalance_path(MNode **path[], int depth);
 static void pre_order_print(MNode *root);
 static void post_order_print(MNode *root);
-static void in_order_print(MNode *root);
-static void delete_memtable_nodes(MNode *root);
-static void serialize_preorder(MNode *root, FILE *fp);
-
-Memtable* init_memtable() {
+static void in_order_print(Memtable *memtable);
+static void tail_print(Memtable *memtable);
+static void delete_memtable_nodes(Memtable *memtable);
+static void delete_versions(MVersion *version);
+static int serialize_preorder(Memtable *memtable, FILE *fp);
+
+/* Creates an empty memtable that is full once it holds capacity bytes */
+Memtable* init_memtable(long capacity) {
 	Memtable *memtable = (Memtable*) malloc(sizeof(Memtable));
 	if (memtable == NULL) {
 		printf("Allocation of memory for memtable failed.\n");
@@ -26,101 +39,187 @@ Memtable* init_memtable() {
 
 	// initialize values;
 	memtable->count_keys = 0;
+	memtable->bytes = 0;
+	memtable->capacity = capacity;
 	memtable->root = NULL;
+	memtable->tail = NULL;
+	memtable->tail_count = 0;
+	memtable->tail_capacity = 0;
+	memtable->high_key = LONG_MIN;
+	memtable->ranges = NULL;
+	memtable->num_ranges = 0;
+	memtable->ranges_capacity = 0;
+	memtable->wal = 0;
+	atomic_init(&memtable->flushed, false);
 	return memtable;
 }
 
-/* Insert a new node into the binary search memtable.
- * Returns -1 if an error occurred, returns 0 if success.*/
-int memtable_insert(Memtable *memtable, int key, char *data) {
-	MNode *new_node = create_node(key, data);
+/* Insert a new node into the memtable, tagged with the sequence number of
+ * the write. A key above every other is appended to the tail; any other new
+ * key goes into the tree, whose nodes above it are then rebalanced. An
+ * existing key keeps its node and gains an older version instead. Returns
+ * -1 if an error occurred, returns 0 if success.*/
+int memtable_insert(Memtable *memtable, int key, char *data, long sequence) {
+	bool ascending = key > memtable->high_key;
+	int position = ascending || memtable->tail_count == 0 || key < memtable->tail[0]->key ?
+			-1 : tail_position(memtable, key);
+	if (position >= 0 && position < memtable->tail_count
+			&& memtable->tail[position]->key == key) {
+		add_version(memtable->tail[position], data, sequence);
+		memtable->bytes += strlen(data) + 1 + sizeof(MVersion);
+		return 0;
+	}
+
+	if (ascending) {
+		MNode *new_node = create_node(key, data, sequence);
+		if (new_node == NULL || append_to_tail(memtable, new_node) != 0) {
+			free(new_node ? new_node->data : NULL);
+			free(new_node);
+			return -1;
+		}
+		memtable->bytes += strlen(data) + 1 + sizeof(MNode);
+		memtable->high_key = key;
+		return 0;
+	}
+
+	MNode **path[MEMTABLE_MAX_HEIGHT];
+	int depth = 0;
+	MNode **link = tree_link(&memtable->root, key, path, &depth);
+	if (*link) {
+		add_version(*link, data, sequence);
+		memtable->bytes += strlen(data) + 1 + sizeof(MVersion);
+		return 0;
+	}
+
+	MNode *new_node = create_node(key, data, sequence);
 	if (new_node == NULL) {
 		return -1;  // failed to allocate memory for new node
 	}
+	*link = new_node;
+	memtable->bytes += strlen(data) + 1 + sizeof(MNode);
+	rebalance_path(path, depth);
+	return 0;
+}
 
-	if (!memtable->root) {
-		// need to make root for memtable
-		memtable->root = new_node;
-	} else {
-		do_insert(memtable->root, new_node);
+/* Follows the tree down from root to key's node, or to the empty link where
+ * it would go, remembering the link to every node passed (to rebalance them
+ * on the way back up) */
+static MNode** tree_link(MNode **root, int key, MNode **path[], int *depth) {
+	MNode **link = root;
+	while (*link && (*link)->key != key) {
+		path[(*depth)++] = link;
+		link = key < (*link)->key ? &(*link)->left_child : &(*link)->right_child;
 	}
-	return 0;
+	return link;
 }
 
-/* Traverse memtable recursively in order to place new
- * node in correct location as new leaf node. */
-static void do_insert(MNode *root, MNode *to_insert) {
+/* Index of the first tail node whose key is at least key (tail_count if
+ * there is none) */
+static int tail_position(Memtable *memtable, int key) {
+	int low = 0, high = memtable->tail_count;
+	while (low < high) {
+		int middle = low + (high - low) / 2;
+		if (memtable->tail[middle]->key < key)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
 
-	// keep going until you find a leaf node
-	if (to_insert->key == root->key) {
-		// TODO: replace value, for now, then should implement as linked list
-		root->data = to_insert->data;
-	} else if (to_insert->key < root->key) {
-		if (root->left_child) {
-			do_insert(root->left_child, to_insert);
-		} else {
-			root->left_child = to_insert;
-		}
-	} else {
-		if (root->right_child) {
-			do_insert(root->right_child, to_insert);
-		} else {
-			root->right_child = to_insert;
+static int append_to_tail(Memtable *memtable, MNode *node) {
+	if (memtable->tail_count == memtable->tail_capacity) {
+		int capacity = memtable->tail_capacity ? memtable->tail_capacity * 2 : 64;
+		MNode **tail = (MNode**) realloc(memtable->tail, capacity * sizeof(MNode*));
+		if (tail == NULL) {
+			printf("Allocation of memory for memtable tail failed.\n");
+			return -1;
 		}
+		memtable->tail = tail;
+		memtable->tail_capacity = capacity;
+	}
+	memtable->tail[memtable->tail_count++] = node;
+	return 0;
+}
+
+/* The newest value goes in the node; the one it replaces becomes an older
+ * version */
+static void add_version(MNode *node, char *data, long sequence) {
+	MVersion *version = (MVersion*) malloc(sizeof(MVersion));
+	char *copy = (char*) malloc(strlen(data) + 1);
+	if (version == NULL || copy == NULL) {
+		die("Failed to allocate memory for older version of node.\n");
+	}
+	strcpy(copy, data);
+	version->sequence = node->sequence;
+	version->data = node->data;
+	version->next = node->older;
+
+	node->older = version;
+	node->data = copy;
+	node->sequence = sequence;
+}
+
+/* Moves every tail node into the tree. Each node is appended once and moved
+ * at most once, so this costs O(log n) per node over the memtable's life. */
+static void spill_tail(Memtable *memtable) {
+	for (int i = 0; i < memtable->tail_count; i++) {
+		MNode **path[MEMTABLE_MAX_HEIGHT];
+		int depth = 0;
+		*tree_link(&memtable->root, memtable->tail[i]->key, path, &depth) = memtable->tail[i];
+		rebalance_path(path, depth);
 	}
+	memtable->tail_count = 0;
 }
 
 /* Search to see if a node is in a memtable */
 MNode* search_memtable(Memtable *memtable, int key) {
-	if (memtable->root == NULL) {
-		return NULL;  // there is nothing in memory right now
+	int last = memtable->tail_count - 1;
+	if (last >= 0 && key >= memtable->tail[0]->key && key <= memtable->tail[last]->key) {
+		int position = tail_position(memtable, key);
+		if (memtable->tail[position]->key == key)
+			return memtable->tail[position];
 	}
-	return do_search(memtable->root, key);
+
+	MNode *node = memtable->root;
+	while (node != NULL && node->key != key)
+		node = node->key > key ? node->left_child : node->right_child;
+	return node;
 }
 
-/* Recursive helper function to do actual search */
-static MNode* do_search(MNode *root, int key) {
+/* Returns the data of the newest version of a node written at or before
+ * sequence, or NULL if every version in the memtable is newer than that.
+ * found (if not NULL) is set to the sequence of the version returned. */
+char* memtable_node_lookup(MNode *node, long sequence, long *found) {
+	if (node->sequence <= sequence) {
+		if (found)
+			*found = node->sequence;
+		return node->data;
+	}
 
-	if (root->key == key) {
-		return root;
-	} else if (root->key > key) {
-		if (root->left_child != NULL) {
-			return do_search(root->left_child, key);
-		}
-		return NULL;
-	} else {
-		if (root->right_child != NULL) {
-			return do_search(root->right_child, key);
+	for (MVersion *version = node->older; version; version = version->next) {
+		if (version->sequence <= sequence) {
+			if (found)
+				*found = version->sequence;
+			return version->data;
 		}
-		return NULL;
 	}
+	return NULL;
 }
 
 /* Remove a node from memtable. If hard_delete is specified,
  * then the entire node is removed from the memtable. If it is
- * a soft delete, then system replaces current value of node with specified
- * key with a "tombstone". Returns 0 if success, -1 if failure. */
-int memtable_delete(Memtable *memtable, int key, bool hard_delete, char *tombstone) {
-	MNode *parent = NULL;
-	MNode *trav = memtable->root;
-	int is_right_child = 0;
-
+ * a soft delete, then system writes a new version of the node with
+ * a "tombstone" value. Returns 0 if success, -1 if failure. */
+int memtable_delete(Memtable *memtable, int key, bool hard_delete, char *tombstone,
+		long sequence) {
 	// first find the node to delete, if possible
-	while (trav != NULL && trav->key != key) {
-		parent = trav;
-		if (trav->key > key) {
-			trav = trav->left_child;
-			is_right_child = 0;
-		} else {
-			trav = trav->right_child;
-			is_right_child = 1;
-		}
-	}
+	MNode *trav = search_memtable(memtable, key);
 
 	if (trav == NULL) {
 		// didn't find the node to delete, so mark deletion by creating a
 		// new node with delete marker;
-		int error = memtable_insert(memtable, key, tombstone);
+		int error = memtable_insert(memtable, key, tombstone, sequence);
 		if (error != 0)
 			return -1;
 		memtable->count_keys++;
@@ -128,109 +227,225 @@ int memtable_delete(Memtable *memtable, int key, bool hard_delete, char *tombsto
 	} else if (hard_delete) {
 		printf("Found node with key %d, value: %s. Hard deleting...\n", key,
 				trav->data);
-		MNode *new_root = do_hard_delete(trav, parent, is_right_child);
-
-		// if a new root was assigned, give it to the binary memtable
-		if (new_root != NULL) {
-			memtable->root = new_root;
-		} else if (parent == NULL) {
-			// no new root was assigned but we know the node deleted was the root
+		memtable->bytes -= node_bytes(trav);
+
+		// the tail can't have holes, so its nodes go into the tree first
+		spill_tail(memtable);
+		MNode **path[MEMTABLE_MAX_HEIGHT];
+		int depth = 0;
+		MNode **link = tree_link(&memtable->root, key, path, &depth);
+		path[depth++] = link;
+		do_hard_delete(path, depth);
+		if (memtable->root == NULL && memtable->tail_count == 0)
 			printf("\n> LSM System Alert: Memtable is empty.\n");
-			memtable->root = NULL;
+	} else { // soft delete, add a new version holding the delete marker
+		if (memtable_insert(memtable, key, tombstone, sequence) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Records the deletion of every key in [start_key, end_key] as a single
+ * range tombstone, rather than one tombstone per key */
+int memtable_delete_range(Memtable *memtable, int start_key, int end_key, long sequence) {
+	if (memtable->num_ranges == memtable->ranges_capacity) {
+		int capacity = memtable->ranges_capacity ? memtable->ranges_capacity * 2 : 4;
+		RangeTombstone *ranges = (RangeTombstone*) realloc(memtable->ranges,
+				capacity * sizeof(RangeTombstone));
+		if (ranges == NULL) {
+			printf("Allocation of memory for range tombstone failed.\n");
+			return -1;
 		}
-	} else { // soft delete, just change the value to the delete marker
-		trav->data = tombstone;
+		memtable->ranges = ranges;
+		memtable->ranges_capacity = capacity;
 	}
+
+	memtable->ranges[memtable->num_ranges++] = (RangeTombstone) { start_key, end_key,
+			sequence };
+	memtable->bytes += sizeof(RangeTombstone);
 	return 0;
 }
 
+/* The sequence of the newest range delete of key visible at sequence, or 0 */
+long memtable_range_deleted(Memtable *memtable, int key, long sequence) {
+	return range_tombstones_cover(memtable->ranges, memtable->num_ranges, key, sequence);
+}
+
+/* The newest sequence (at or below sequence) of the range tombstones that
+ * cover key, or 0 if none do. A version of the key older than that is
+ * deleted. */
+long range_tombstones_cover(RangeTombstone *ranges, int count, int key, long sequence) {
+	long newest = 0;
+	for (int i = 0; i < count; i++) {
+		RangeTombstone *range = ranges + i;
+		if (range->start_key <= key && key <= range->end_key
+				&& range->sequence <= sequence && range->sequence > newest)
+			newest = range->sequence;
+	}
+	return newest;
+}
+
 bool memtable_is_full(Memtable *memtable) {
-	if (memtable->count_keys == MAX_KEYS_IN_TREE) {
+	if (memtable->bytes >= memtable->capacity) {
 		return true;
 	}
 	return false;
 }
 
-static MNode* do_hard_delete(MNode *to_delete, MNode *parent,
-		int is_right_child) {
-
-	MNode *new_root = NULL;
+/* Memory held by a node and its older versions */
+static long node_bytes(MNode *node) {
+	long bytes = sizeof(MNode) + strlen(node->data) + 1;
+	for (MVersion *version = node->older; version; version = version->next)
+		bytes += sizeof(MVersion) + strlen(version->data) + 1;
+	return bytes;
+}
 
-	/* Case 1: Node has no Children */
-	if (to_delete->left_child == NULL && to_delete->right_child == NULL) {
-		printf("Node has no children...\n");
-		if (parent == NULL) {
-			// the node to delete is the root; it has no children, continue
-		} else if (is_right_child) {
-			parent->right_child = NULL;
-		} else {
-			parent->left_child = NULL;
+/* Unlinks the node at the end of path (the links followed from the root to
+ * it), then rebalances every node above the one removed. A node with two
+ * children first trades contents with the smallest node of its right
+ * subtree, which has no left child and is removed in its place. */
+static void do_hard_delete(MNode **path[], int depth) {
+	MNode *to_delete = *path[depth - 1];
+
+	if (to_delete->left_child != NULL && to_delete->right_child != NULL) {
+		MNode **link = &to_delete->right_child;
+		while ((*link)->left_child != NULL) {
+			path[depth++] = link;
+			link = &(*link)->left_child;
 		}
+		MNode *to_swap = *link;
+
+		// replace contents, swapping version chains so each gets freed once
+		MVersion *older = to_delete->older;
+		char *data = to_delete->data;
+		to_delete->key = to_swap->key;
+		to_delete->data = to_swap->data;
+		to_delete->sequence = to_swap->sequence;
+		to_delete->older = to_swap->older;
+		to_swap->data = data;
+		to_swap->older = older;
+
+		path[depth++] = link;
+		to_delete = to_swap;
 	}
-	/* Case 2: Node has 1 LEFT Child */
-	else if (to_delete->left_child != NULL && to_delete->right_child == NULL) {
-		printf("Node has 1 left child...\n");
-		if (parent == NULL) {
-			// root condition; send left child as new root node
-			new_root = to_delete->left_child;
-		} else if (is_right_child) {
-			parent->right_child = to_delete->left_child;
-		} else {
-			parent->left_child = to_delete->left_child;
-		}
+
+	// at most one child is left to take the node's place
+	*path[depth - 1] = to_delete->left_child ? to_delete->left_child
+			: to_delete->right_child;
+	free(to_delete->data);
+	delete_versions(to_delete->older);
+	free(to_delete);
+	rebalance_path(path, depth - 1);
+}
+
+static int height(MNode *node) {
+	return node ? node->height : 0;
+}
+
+static void update_height(MNode *node) {
+	int left = height(node->left_child), right = height(node->right_child);
+	node->height = 1 + (left > right ? left : right);
+}
+
+/* Lifts a node's right child into its place; returns the new subtree root */
+static MNode* rotate_left(MNode *node) {
+	MNode *right = node->right_child;
+	node->right_child = right->left_child;
+	right->left_child = node;
+	update_height(node);
+	update_height(right);
+	return right;
+}
+
+/* Lifts a node's left child into its place; returns the new subtree root */
+static MNode* rotate_right(MNode *node) {
+	MNode *left = node->left_child;
+	node->left_child = left->right_child;
+	left->right_child = node;
+	update_height(node);
+	update_height(left);
+	return left;
+}
+
+/* Restores the AVL balance of a node whose subtrees are balanced but may
+ * differ in height by two; returns the root of the rebalanced subtree */
+static MNode* rebalance(MNode *node) {
+	update_height(node);
+	int balance = height(node->left_child) - height(node->right_child);
+	if (balance > 1) {
+		if (height(node->left_child->left_child) < height(node->left_child->right_child))
+			node->left_child = rotate_left(node->left_child);
+		return rotate_right(node);
 	}
-	/* Case 3: Node has 1 RIGHT Child */
-	else if (to_delete->right_child != NULL && to_delete->left_child == NULL) {
-		printf("Node has 1 right child...\n");
-		if (parent == NULL) {
-			// root condition; send left child as new root node
-			new_root = to_delete->right_child;
-		} else if (is_right_child) {
-			parent->right_child = to_delete->right_child;
+	if (balance < -1) {
+		if (height(node->right_child->right_child) < height(node->right_child->left_child))
+			node->right_child = rotate_right(node->right_child);
+		return rotate_left(node);
+	}
+	return node;
+}
+
+/* Rebalances the nodes on a path of links from the root, deepest first */
+static void rebalance_path(MNode **path[], int depth) {
+	for (int i = depth - 1; i >= 0; i--)
+		*path[i] = rebalance(*path[i]);
+}
+
+/* Positions an iterator at the first node with a key of at least key */
+void memtable_iterator_seek(MemtableIterator *iterator, Memtable *memtable, int key) {
+	iterator->tail = memtable->tail;
+	iterator->tail_count = memtable->tail_count;
+	iterator->tail_position = tail_position(memtable, key);
+	iterator->depth = 0;
+	MNode *node = memtable->root;
+	while (node) {
+		if (node->key >= key) {
+			iterator->stack[iterator->depth++] = node;
+			node = node->left_child;
 		} else {
-			parent->left_child = to_delete->right_child;
+			node = node->right_child;
 		}
 	}
-	/* Case 4: Node has TWO Children */
-	else {
-		printf("Node has two children...\n");
-		// Best option is to replace "to_delete" node with the smallest node
-		// in the right subtree, then delete that node.
-		MNode *to_swap = to_delete->right_child;
-		MNode *trail = to_delete;
-		int is_right_child = 1; // we go right first in our search for smallest node
-
-		while (to_swap->left_child != NULL) {
-			trail = to_swap;
-			to_swap = to_swap->left_child;
-			is_right_child = 0;
-		}
-		// replace contents
-		to_delete->key = to_swap->key;
-		to_delete->data = to_swap->data;
+}
 
-		// this node can then be deleted with either case 1 or 2, but we don't free
-		// to_delete here, because it will happen on the next function call
-		return do_hard_delete(to_swap, trail, is_right_child);
+/* Returns the next node in key order, or NULL once every node has been
+ * visited. The iterator is done with a node once it is returned, so the
+ * caller may free it. */
+MNode* memtable_iterator_next(MemtableIterator *iterator) {
+	MNode *appended = iterator->tail_position < iterator->tail_count ?
+			iterator->tail[iterator->tail_position] : NULL;
+	if (appended && (iterator->depth == 0
+			|| appended->key < iterator->stack[iterator->depth - 1]->key)) {
+		iterator->tail_position++;
+		return appended;
 	}
-	free(to_delete);
-	return new_root;
+	if (iterator->depth == 0)
+		return NULL;
+
+	MNode *node = iterator->stack[--iterator->depth];
+	for (MNode *next = node->right_child; next; next = next->left_child)
+		iterator->stack[iterator->depth++] = next;
+	return node;
 }
 
 void print_memtable(Memtable *memtable, char *print_type) {
 	printf("\nCurrent Memtable:\n");
 
-	if (memtable->root == NULL) {
+	if (memtable->root == NULL && memtable->tail_count == 0) {
 		printf("memtable is empty\n");
 		return;
 	}
 
 	if (strcmp(print_type, "in_order_traversal") == 0) {
-		in_order_print(memtable->root);
+		in_order_print(memtable);
 	} else if (strcmp(print_type, "pre_order_traversal") == 0) {
-		pre_order_print(memtable->root);
+		if (memtable->root)
+			pre_order_print(memtable->root);
+		tail_print(memtable);
 	} else if (strcmp(print_type, "post_order_traversal") == 0) {
-		post_order_print(memtable->root);
+		if (memtable->root)
+			post_order_print(memtable->root);
+		tail_print(memtable);
 	} else {
 		printf("Print type %s not recognized", print_type);
 	}
@@ -241,39 +456,42 @@ static void pre_order_print(MNode *root) {
 	printf("( key: %d , value: %s)\n", root->key, root->data);
 
 	if (root->left_child != NULL) {
-		in_order_print(root->left_child);
+		pre_order_print(root->left_child);
 	}
 	if (root->right_child != NULL) {
-		in_order_print(root->right_child);
+		pre_order_print(root->right_child);
 	}
 }
 
 /* In order traversal of memtable */
-static void in_order_print(MNode *root) {
-	if (root->left_child != NULL) {
-		in_order_print(root->left_child);
-	}
-	printf("( key: %d, value: %s)\n", root->key, root->data);
+static void in_order_print(Memtable *memtable) {
+	MemtableIterator iterator;
+	memtable_iterator_seek(&iterator, memtable, INT_MIN);
+	for (MNode *node; (node = memtable_iterator_next(&iterator)); )
+		printf("( key: %d, value: %s)\n", node->key, node->data);
+}
 
-	if (root->right_child != NULL) {
-		in_order_print(root->right_child);
-	}
+/* Appended keys, which sit outside the tree */
+static void tail_print(Memtable *memtable) {
+	for (int i = 0; i < memtable->tail_count; i++)
+		printf("( key: %d, value: %s) appended\n", memtable->tail[i]->key,
+				memtable->tail[i]->data);
 }
 
 /* Postorder traversal of memtable */
 static void post_order_print(MNode *root) {
 
 	if (root->left_child != NULL) {
-		in_order_print(root->left_child);
+		post_order_print(root->left_child);
 	}
 	if (root->right_child != NULL) {
-		in_order_print(root->right_child);
+		post_order_print(root->right_child);
 	}
 	printf("( key: %d, value: %s )\n", root->key, root->data);
 }
 
 /* Allocates memory and creates new node struct */
-MNode* create_node(int key, char *data) {
+MNode* create_node(int key, char *data, long sequence) {
 
 	MNode *node = (MNode*) malloc(sizeof(MNode));
 	if (node == NULL) {
@@ -282,11 +500,14 @@ MNode* create_node(int key, char *data) {
 	}
 
 	node->key = key;
-	node->data = malloc(sizeof(char) * strlen(data));
+	node->data = malloc(sizeof(char) * (strlen(data) + 1));
 	if (node->data == NULL) {
 		die("Failed to allocate memory for data within node.\n");
 	}
 	strcpy(node->data, data);
+	node->sequence = sequence;
+	node->older = NULL;
+	node->height = 1;
 	node->left_child = NULL;
 	node->right_child = NULL;
 	return node;
@@ -294,29 +515,41 @@ MNode* create_node(int key, char *data) {
 
 /* Keeps memtable, but removes all nodes */
 void clear_memtable(Memtable *memtable) {
-	delete_memtable_nodes(memtable->root);
+	delete_memtable_nodes(memtable);
 	memtable->root = NULL;
+	memtable->tail_count = 0;
+	memtable->high_key = LONG_MIN;
 	memtable->count_keys = 0;
+	memtable->bytes = 0;
+	memtable->num_ranges = 0;
 }
 
 /* Deletes entire memtable from memory */
 void delete_memtable(Memtable *memtable) {
-	delete_memtable_nodes(memtable->root);
+	delete_memtable_nodes(memtable);
+	free(memtable->tail);
+	free(memtable->ranges);
 	free(memtable);
 }
 
-static void delete_memtable_nodes(MNode *root) {
-	if (root == NULL)
-		return;
-
-	if (root->left_child != NULL) {
-		delete_memtable_nodes(root->left_child);
+/* Frees every node, in key order */
+static void delete_memtable_nodes(Memtable *memtable) {
+	MemtableIterator iterator;
+	memtable_iterator_seek(&iterator, memtable, INT_MIN);
+	for (MNode *node; (node = memtable_iterator_next(&iterator)); ) {
+		free(node->data);
+		delete_versions(node->older);
+		free(node);
 	}
-	if (root->right_child != NULL) {
-		delete_memtable_nodes(root->right_child);
+}
+
+static void delete_versions(MVersion *version) {
+	while (version) {
+		MVersion *next = version->next;
+		free(version->data);
+		free(version);
+		version = next;
 	}
-	free(root->data);
-	free(root);
 }
 
 /* Writes a memtable (binary tree) to file, in preorder order */
@@ -328,8 +561,8 @@ int serialize_memtable(Memtable *memtable, char *filename) {
 		return -1;
 	}
 
-	serialize_preorder(memtable->root, fp);
-	if (fclose(fp) != 0) {
+	int error = serialize_preorder(memtable, fp);
+	if (fclose(fp) != 0 || error) {
 		printf("Failed to serialize memtable; could "
 				"not close file.\n");
 		return -1;
@@ -337,16 +570,46 @@ int serialize_memtable(Memtable *memtable, char *filename) {
 	return 0;
 }
 
-/* Writes an entire memtable (binary tree) to file, preorder */
-static void serialize_preorder(MNode *root, FILE *fp) {
-	if (root == NULL) {
-		fprintf(fp, "%d,%d\n", NULL_MARKER, NULL_MARKER);
-		return;
+/* Writes an entire memtable (binary tree) to file, preorder, laid out as a
+ * balanced tree of its nodes in key order (so the tail is written too). The
+ * stack holds the ranges of nodes still to be written as subtrees, next one
+ * on top; empty ones are written as null markers. */
+static int serialize_preorder(Memtable *memtable, FILE *fp) {
+	int count = 0;
+	MemtableIterator iterator;
+	memtable_iterator_seek(&iterator, memtable, INT_MIN);
+	while (memtable_iterator_next(&iterator))
+		count++;
+
+	MNode **nodes = (MNode**) malloc((count ? count : 1) * sizeof(MNode*));
+	if (nodes == NULL) {
+		printf("Failed to serialize memtable; out of memory.\n");
+		return -1;
 	}
-
-	fprintf(fp, "%d,%s\n", root->key, root->data);
-	serialize_preorder(root->left_child, fp);
-	serialize_preorder(root->right_child, fp);
+	memtable_iterator_seek(&iterator, memtable, INT_MIN);
+	for (int i = 0; i < count; i++)
+		nodes[i] = memtable_iterator_next(&iterator);
+
+	int stack[2 * MEMTABLE_MAX_HEIGHT + 2][2];
+	int depth = 0;
+	stack[depth][0] = 0;
+	stack[depth++][1] = count - 1;
+	while (depth > 0) {
+		depth--;
+		int low = stack[depth][0], high = stack[depth][1];
+		if (low > high) {
+			fprintf(fp, "%d,%d\n", NULL_MARKER, NULL_MARKER);
+			continue;
+		}
+		int middle = low + (high - low) / 2;
+		fprintf(fp, "%d,%s\n", nodes[middle]->key, nodes[middle]->data);
+		stack[depth][0] = middle + 1;
+		stack[depth++][1] = high;
+		stack[depth][0] = low;
+		stack[depth++][1] = middle - 1;
+	}
+	free(nodes);
+	return 0;
 }
 
 /* Reads an entire memtable (binary tree) from file, expects preorder layout */
@@ -359,9 +622,10 @@ MNode* deserialize_memtable(FILE *fp, int buffer_size) {
 	}
 
 	printf("Read in: %d, %s", key, buf);
-	MNode *root = create_node(key, buf);
+	MNode *root = create_node(key, buf, 0);
 	root->left_child = deserialize_memtable(fp, buffer_size);
 	root->right_child = deserialize_memtable(fp, buffer_size);
+	update_height(root);
 
 	return root;
 }
@@ -2,34 +2,101 @@
 #define MEMTABLE_H
 
 #include <stdbool.h>
+#include <stdatomic.h>
 
-#define MAX_KEYS_IN_TREE 3     // max # keys held in tree before flush to segment
 #define NULL_MARKER -1
+#define MEMTABLE_MAX_HEIGHT 64 // an AVL tree of 2^31 keys is at most 45 high
 
+/* an older, overwritten version of a key; kept for snapshot reads */
+typedef struct memtable_version {
+	long sequence;
+	char *data;
+	struct memtable_version *next;
+} MVersion;
+
+/* deletes every key in [start_key, end_key] written before sequence; one of
+ * these stands in for what would otherwise be a tombstone per key */
+typedef struct range_tombstone {
+	int start_key;
+	int end_key;
+	long sequence;
+} RangeTombstone;
+
+/* a node of the memtable's AVL tree; height is that of the subtree rooted
+ * here (1 for a leaf) */
 typedef struct memtable_node {
 	int key;
 	char *data;
+	long sequence;
+	MVersion *older;
+	int height;
 	struct memtable_node *left_child;
 	struct memtable_node *right_child;
 } MNode;
 
+/* The memtable is an AVL tree: the heights of every node's two subtrees
+ * differ by at most one, so whatever order keys arrive in, inserts, lookups
+ * and deletes take O(log n) steps, and none of them recurse. A key larger
+ * than any written so far skips the tree and is appended to the tail, an
+ * array of nodes in key order, so a stream of ascending keys costs O(1) per
+ * insert and flushes as one run. Every key lives in either the tree or the
+ * tail; high_key is the largest ever written (a long, so that it can start
+ * below every key). bytes counts
+ * the memory the tree holds (nodes, older versions and their values, range
+ * tombstones); it is full once that reaches capacity. Range
+ * deletes are kept apart from the tree, in the order they were made. */
 typedef struct binary_tree {
 	MNode *root;
+	MNode **tail;
+	int tail_count;
+	int tail_capacity;
+	long high_key;
 	int count_keys;
+	long bytes;
+	long capacity;
+	RangeTombstone *ranges;
+	int num_ranges;
+	int ranges_capacity;
+	long wal;                  // number of the WAL file holding its writes
+	atomic_bool flushed;       // its segment is in the current version
 } Memtable;
 
-Memtable* init_memtable();
+/* walks a memtable's nodes in key order without recursion, merging the
+ * tree with the tail; the stack holds the tree nodes yet to be visited, each
+ * above its left subtree's */
+typedef struct memtable_iterator {
+	MNode *stack[MEMTABLE_MAX_HEIGHT];
+	int depth;
+	MNode **tail;
+	int tail_count;
+	int tail_position;
+} MemtableIterator;
+
+Memtable* init_memtable(long capacity);
 
 bool memtable_is_full(Memtable *memtable);
 
-int memtable_insert(Memtable *memtable, int key, char *data);
+int memtable_insert(Memtable *memtable, int key, char *data, long sequence);
+
+int memtable_delete(Memtable *memtable, int key, bool hard_delete, char *tombstone,
+		long sequence);
+
+int memtable_delete_range(Memtable *memtable, int start_key, int end_key, long sequence);
 
-int memtable_delete(Memtable *memtable, int key, bool hard_delete, char *tombstone);
+long memtable_range_deleted(Memtable *memtable, int key, long sequence);
 
-MNode* create_node(int key, char *data);
+long range_tombstones_cover(RangeTombstone *ranges, int count, int key, long sequence);
+
+MNode* create_node(int key, char *data, long sequence);
 
 MNode* search_memtable(Memtable *memtable, int key);
 
+char* memtable_node_lookup(MNode *node, long sequence, long *found);
+
+void memtable_iterator_seek(MemtableIterator *iterator, Memtable *memtable, int key);
+
+MNode* memtable_iterator_next(MemtableIterator *iterator);
+
 void print_memtable(Memtable *memtable, char *print_type);
 
 void clear_memtable(Memtable *memtable);
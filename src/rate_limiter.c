@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "rate_limiter.h"
+
+// prototypes for static functions
+static void refill(RateLimiter *limiter, struct timespec *now);
+static long elapsed_ns(struct timespec *from, struct timespec *to);
+static long monotonic_ns(struct timespec *now);
+
+
+/* Creates a limiter with a budget of bytes_per_sec; if auto_tune is set,
+ * the budget floats between budget / RATE_FLOOR_DIVISOR and budget to keep
+ * foreground reads near target_latency_us. */
+RateLimiter* init_rate_limiter(long bytes_per_sec, bool auto_tune, long target_latency_us) {
+	RateLimiter *limiter = (RateLimiter*) malloc(sizeof(RateLimiter));
+	if (limiter == NULL) {
+		printf("Allocation of memory for rate limiter failed.\n");
+		return NULL;
+	}
+
+	pthread_condattr_t attributes;
+	pthread_condattr_init(&attributes);
+	pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&limiter->refilled, &attributes);
+	pthread_condattr_destroy(&attributes);
+	pthread_mutex_init(&limiter->lock, NULL);
+
+	limiter->max_rate = bytes_per_sec;
+	limiter->rate = bytes_per_sec;
+	limiter->tokens = 0;
+	limiter->auto_tune = auto_tune;
+	limiter->target_latency_ns = target_latency_us * 1000;
+	atomic_init(&limiter->latency_total_ns, 0);
+	atomic_init(&limiter->latency_samples, 0);
+	clock_gettime(CLOCK_MONOTONIC, &limiter->last_refill);
+	atomic_init(&limiter->tune_due_ns,
+			monotonic_ns(&limiter->last_refill) + RATE_TUNE_MS * 1000000L);
+	atomic_init(&limiter->bytes[IO_PRIORITY_LOW], 0);
+	atomic_init(&limiter->bytes[IO_PRIORITY_HIGH], 0);
+	atomic_init(&limiter->throttled_ns, 0);
+	return limiter;
+}
+
+/* Takes bytes out of the bucket before they are written. Low priority
+ * callers wait until the bucket is out of debt; high priority callers
+ * never wait. */
+void rate_limiter_request(RateLimiter *limiter, long bytes, int priority) {
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	atomic_fetch_add(&limiter->bytes[priority], bytes);
+
+	pthread_mutex_lock(&limiter->lock);
+	refill(limiter, &start);
+
+	if (priority == IO_PRIORITY_LOW && limiter->tokens < 0) {
+		while (limiter->tokens < 0) {
+			// sleep until the debt should be paid off (the rate may change meanwhile)
+			long wait_ns = (long) (-limiter->tokens * 1e9 / limiter->rate) + 1;
+			struct timespec until;
+			clock_gettime(CLOCK_MONOTONIC, &until);
+			until.tv_sec += wait_ns / 1000000000L;
+			until.tv_nsec += wait_ns % 1000000000L;
+			if (until.tv_nsec >= 1000000000L) {
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&limiter->refilled, &limiter->lock, &until);
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			refill(limiter, &now);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		atomic_fetch_add(&limiter->throttled_ns, elapsed_ns(&start, &now));
+	}
+
+	// requests may be larger than the bucket; the debt is paid back over time
+	limiter->tokens -= bytes;
+	pthread_mutex_unlock(&limiter->lock);
+}
+
+/* Feeds a foreground read latency sample into auto-tuning: every
+ * RATE_TUNE_MS, the budget is cut by a quarter if reads averaged slower than
+ * the target, or grown by an eighth (up to the configured budget) if they
+ * averaged under half of it. Only the read that ends a window takes the
+ * lock, and only if nobody holds it; a later read retunes otherwise. */
+void rate_limiter_record_latency(RateLimiter *limiter, long latency_ns) {
+	if (!limiter->auto_tune)
+		return;
+
+	atomic_fetch_add(&limiter->latency_total_ns, latency_ns);
+	atomic_fetch_add(&limiter->latency_samples, 1);
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long now_ns = monotonic_ns(&now);
+	if (now_ns < atomic_load(&limiter->tune_due_ns)
+			|| pthread_mutex_trylock(&limiter->lock) != 0)
+		return;
+
+	// another read may have retuned since the window was checked
+	if (now_ns >= atomic_load(&limiter->tune_due_ns)) {
+		long samples = atomic_exchange(&limiter->latency_samples, 0);
+		long total = atomic_exchange(&limiter->latency_total_ns, 0);
+		long average = samples > 0 ? total / samples : limiter->target_latency_ns;
+		long floor = limiter->max_rate / RATE_FLOOR_DIVISOR;
+
+		if (average > limiter->target_latency_ns)
+			limiter->rate = limiter->rate - limiter->rate / 4;
+		else if (average < limiter->target_latency_ns / 2)
+			limiter->rate = limiter->rate + limiter->rate / 8;
+
+		if (limiter->rate < floor)
+			limiter->rate = floor;
+		if (limiter->rate > limiter->max_rate)
+			limiter->rate = limiter->max_rate;
+
+		atomic_store(&limiter->tune_due_ns, now_ns + RATE_TUNE_MS * 1000000L);
+		pthread_cond_broadcast(&limiter->refilled);
+	}
+	pthread_mutex_unlock(&limiter->lock);
+}
+
+/* The current budget, in bytes/sec */
+long rate_limiter_rate(RateLimiter *limiter) {
+	pthread_mutex_lock(&limiter->lock);
+	long rate = limiter->rate;
+	pthread_mutex_unlock(&limiter->lock);
+	return rate;
+}
+
+void close_rate_limiter(RateLimiter *limiter) {
+	pthread_mutex_destroy(&limiter->lock);
+	pthread_cond_destroy(&limiter->refilled);
+	free(limiter);
+}
+
+/* Adds the tokens earned since the last refill, up to the bucket size;
+ * called with the lock held */
+static void refill(RateLimiter *limiter, struct timespec *now) {
+	double capacity = (double) limiter->rate * RATE_REFILL_MS / 1000;
+
+	limiter->tokens += elapsed_ns(&limiter->last_refill, now) / 1e9 * limiter->rate;
+	if (limiter->tokens > capacity)
+		limiter->tokens = capacity;
+	limiter->last_refill = *now;
+}
+
+static long elapsed_ns(struct timespec *from, struct timespec *to) {
+	return (to->tv_sec - from->tv_sec) * 1000000000L + (to->tv_nsec - from->tv_nsec);
+}
+
+static long monotonic_ns(struct timespec *now) {
+	return now->tv_sec * 1000000000L + now->tv_nsec;
+}
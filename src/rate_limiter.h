@@ -0,0 +1,51 @@
+#ifndef CUSTOM_RATE_LIMITER_H
+#define CUSTOM_RATE_LIMITER_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#define RATE_REFILL_MS 100           // the bucket holds at most this long's worth of bytes
+#define RATE_TUNE_MS 250             // how often auto-tuning revisits the budget
+#define RATE_FLOOR_DIVISOR 16        // auto-tuning never goes below budget / this
+
+enum io_priorities {
+	IO_PRIORITY_LOW = 0, IO_PRIORITY_HIGH = 1
+};
+
+/* A token bucket pacing background writes to a bytes/sec budget. Compaction
+ * writes at low priority and waits for tokens; flushes write at high
+ * priority and are never held up (they only run the bucket into debt, which
+ * compaction then pays back), since a stuck flush stalls every writer. With
+ * auto-tuning, the budget drops while foreground reads are slower than the
+ * target latency and recovers when they are fast again. Reads add their
+ * latencies with atomics and only take the lock when a tuning window ends,
+ * so they neither queue behind each other nor behind compaction. */
+typedef struct rate_limiter {
+	pthread_mutex_t lock;
+	pthread_cond_t refilled;
+	long max_rate;
+	long rate;
+	double tokens;
+	struct timespec last_refill;
+	bool auto_tune;
+	long target_latency_ns;
+	atomic_long latency_total_ns;
+	atomic_long latency_samples;
+	atomic_long tune_due_ns;       // monotonic time the next window ends
+	atomic_long bytes[2];          // written, per priority
+	atomic_long throttled_ns;      // time low priority writes spent waiting
+} RateLimiter;
+
+RateLimiter* init_rate_limiter(long bytes_per_sec, bool auto_tune, long target_latency_us);
+
+void rate_limiter_request(RateLimiter *limiter, long bytes, int priority);
+
+void rate_limiter_record_latency(RateLimiter *limiter, long latency_ns);
+
+long rate_limiter_rate(RateLimiter *limiter);
+
+void close_rate_limiter(RateLimiter *limiter);
+
+#endif
@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "row_cache.h"
+#include "bloom.h"
+
+/* Every shard has its own lock, hash table, LRU list (newest to oldest) and
+ * frequency sketch. Readers that fill the cache after a miss take a shard
+ * generation before reading the tree; writers bump it when they invalidate a
+ * key, so a fill that raced with a write to its shard is dropped rather than
+ * caching a stale value. */
+
+/* prototypes for static functions */
+static RowCacheShard* shard_for(RowCache *cache, uint64_t hash);
+static RowEntry** bucket_for(RowCacheShard *shard, uint64_t hash);
+static RowEntry* find_entry(RowCacheShard *shard, int key, uint64_t hash);
+static void unlink_lru(RowCacheShard *shard, RowEntry *entry);
+static void push_newest(RowCacheShard *shard, RowEntry *entry);
+static void remove_entry(RowCacheShard *shard, RowEntry *entry);
+static int grow_buckets(RowCacheShard *shard);
+static void record_access(RowCacheShard *shard, uint64_t hash);
+static int frequency(RowCacheShard *shard, uint64_t hash);
+
+
+/* Creates a row cache holding up to budget bytes, split evenly over shards */
+RowCache* init_row_cache(long budget) {
+	RowCache *cache = (RowCache*) calloc(1, sizeof(RowCache));
+	if (cache == NULL) {
+		printf("Failed to allocate memory for row cache.\n");
+		return NULL;
+	}
+
+	for (int i = 0; i < ROW_CACHE_SHARDS; i++) {
+		RowCacheShard *shard = cache->shards + i;
+		shard->num_buckets = ROW_CACHE_BUCKETS;
+		shard->buckets = (RowEntry**) calloc(shard->num_buckets, sizeof(RowEntry*));
+		shard->sketch = (uint8_t*) calloc(ROW_CACHE_SKETCH_DEPTH * ROW_CACHE_SKETCH_WIDTH, 1);
+		shard->budget = budget / ROW_CACHE_SHARDS;
+		pthread_mutex_init(&shard->lock, NULL);
+		if (!shard->buckets || !shard->sketch) {
+			printf("Failed to allocate memory for row cache shard.\n");
+			close_row_cache(cache);
+			return NULL;
+		}
+	}
+	atomic_init(&cache->hits, 0);
+	atomic_init(&cache->misses, 0);
+	atomic_init(&cache->admitted, 0);
+	atomic_init(&cache->rejected, 0);
+	return cache;
+}
+
+/* Looks a key up, counting the access for admission. On a hit returns true
+ * and sets value to a copy of the cached value (NULL if the key is known to
+ * be absent), which the caller must free. */
+bool row_cache_lookup(RowCache *cache, int key, char **value) {
+	uint64_t hash = bloom_hash(key);
+	RowCacheShard *shard = shard_for(cache, hash);
+
+	pthread_mutex_lock(&shard->lock);
+	record_access(shard, hash);
+	RowEntry *entry = find_entry(shard, key, hash);
+	bool hit = false;
+	if (entry) {
+		unlink_lru(shard, entry);
+		push_newest(shard, entry);
+		*value = entry->value ? strdup(entry->value) : NULL;
+		hit = entry->value == NULL || *value != NULL;
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	atomic_fetch_add(hit ? &cache->hits : &cache->misses, 1);
+	return hit;
+}
+
+/* Returns the generation of a key's shard; take it before reading the tree,
+ * and pass it to row_cache_insert() with what was read */
+long row_cache_generation(RowCache *cache, int key) {
+	RowCacheShard *shard = shard_for(cache, bloom_hash(key));
+	pthread_mutex_lock(&shard->lock);
+	long generation = shard->generation;
+	pthread_mutex_unlock(&shard->lock);
+	return generation;
+}
+
+/* Offers a key's latest value (NULL if absent) to the cache. Dropped if the
+ * shard was written to since generation was taken, or if making room would
+ * evict a key that has been asked for at least as often. */
+void row_cache_insert(RowCache *cache, int key, char *value, long generation) {
+	uint64_t hash = bloom_hash(key);
+	RowCacheShard *shard = shard_for(cache, hash);
+	long charge = ROW_CACHE_ENTRY_OVERHEAD + (value ? strlen(value) + 1 : 0);
+
+	pthread_mutex_lock(&shard->lock);
+	if (generation != shard->generation || charge > shard->budget
+			|| find_entry(shard, key, hash)) {
+		pthread_mutex_unlock(&shard->lock);
+		return;
+	}
+
+	int wanted = frequency(shard, hash);
+	while (shard->used + charge > shard->budget) {
+		if (frequency(shard, bloom_hash(shard->oldest->key)) >= wanted) {
+			pthread_mutex_unlock(&shard->lock);
+			atomic_fetch_add(&cache->rejected, 1);
+			return;
+		}
+		remove_entry(shard, shard->oldest);
+	}
+
+	RowEntry *entry = (RowEntry*) malloc(sizeof(RowEntry));
+	char *copy = value ? strdup(value) : NULL;
+	if (!entry || (value && !copy) || (shard->count >= shard->num_buckets * 2
+			&& grow_buckets(shard) != 0)) {
+		free(entry);
+		free(copy);
+		pthread_mutex_unlock(&shard->lock);
+		return;
+	}
+
+	entry->key = key;
+	entry->value = copy;
+	entry->charge = charge;
+	RowEntry **bucket = bucket_for(shard, hash);
+	entry->hash_next = *bucket;
+	*bucket = entry;
+	push_newest(shard, entry);
+	shard->count++;
+	shard->used += charge;
+	pthread_mutex_unlock(&shard->lock);
+	atomic_fetch_add(&cache->admitted, 1);
+}
+
+/* Drops a key that is being written, and fences off fills already in flight
+ * for its shard */
+void row_cache_invalidate(RowCache *cache, int key) {
+	uint64_t hash = bloom_hash(key);
+	RowCacheShard *shard = shard_for(cache, hash);
+
+	pthread_mutex_lock(&shard->lock);
+	shard->generation++;
+	RowEntry *entry = find_entry(shard, key, hash);
+	if (entry)
+		remove_entry(shard, entry);
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/* Drops every cached key in [start_key, end_key] for a range delete; keys
+ * hash to every shard, so each one is fenced off and walked */
+void row_cache_invalidate_range(RowCache *cache, int start_key, int end_key) {
+	for (int i = 0; i < ROW_CACHE_SHARDS; i++) {
+		RowCacheShard *shard = cache->shards + i;
+		pthread_mutex_lock(&shard->lock);
+		shard->generation++;
+		RowEntry *entry = shard->newest;
+		while (entry) {
+			RowEntry *older = entry->older;
+			if (entry->key >= start_key && entry->key <= end_key)
+				remove_entry(shard, entry);
+			entry = older;
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+/* Bytes currently charged against the cache's budget */
+long row_cache_used(RowCache *cache) {
+	long used = 0;
+	for (int i = 0; i < ROW_CACHE_SHARDS; i++) {
+		RowCacheShard *shard = cache->shards + i;
+		pthread_mutex_lock(&shard->lock);
+		used += shard->used;
+		pthread_mutex_unlock(&shard->lock);
+	}
+	return used;
+}
+
+void close_row_cache(RowCache *cache) {
+	for (int i = 0; i < ROW_CACHE_SHARDS; i++) {
+		RowCacheShard *shard = cache->shards + i;
+		while (shard->oldest)
+			remove_entry(shard, shard->oldest);
+		free(shard->buckets);
+		free(shard->sketch);
+		pthread_mutex_destroy(&shard->lock);
+	}
+	free(cache);
+}
+
+static RowCacheShard* shard_for(RowCache *cache, uint64_t hash) {
+	return cache->shards + (hash >> 60) % ROW_CACHE_SHARDS;
+}
+
+static RowEntry** bucket_for(RowCacheShard *shard, uint64_t hash) {
+	return shard->buckets + ((hash ^ (hash >> 32)) & (shard->num_buckets - 1));
+}
+
+static RowEntry* find_entry(RowCacheShard *shard, int key, uint64_t hash) {
+	for (RowEntry *entry = *bucket_for(shard, hash); entry; entry = entry->hash_next) {
+		if (entry->key == key)
+			return entry;
+	}
+	return NULL;
+}
+
+static void unlink_lru(RowCacheShard *shard, RowEntry *entry) {
+	if (entry->newer)
+		entry->newer->older = entry->older;
+	else
+		shard->newest = entry->older;
+	if (entry->older)
+		entry->older->newer = entry->newer;
+	else
+		shard->oldest = entry->newer;
+}
+
+static void push_newest(RowCacheShard *shard, RowEntry *entry) {
+	entry->newer = NULL;
+	entry->older = shard->newest;
+	if (shard->newest)
+		shard->newest->newer = entry;
+	shard->newest = entry;
+	if (!shard->oldest)
+		shard->oldest = entry;
+}
+
+static void remove_entry(RowCacheShard *shard, RowEntry *entry) {
+	RowEntry **link = bucket_for(shard, bloom_hash(entry->key));
+	while (*link != entry)
+		link = &(*link)->hash_next;
+	*link = entry->hash_next;
+
+	unlink_lru(shard, entry);
+	shard->count--;
+	shard->used -= entry->charge;
+	free(entry->value);
+	free(entry);
+}
+
+/* Doubles a shard's hash table once its chains get long */
+static int grow_buckets(RowCacheShard *shard) {
+	int num_buckets = shard->num_buckets * 2;
+	RowEntry **buckets = (RowEntry**) calloc(num_buckets, sizeof(RowEntry*));
+	if (buckets == NULL) {
+		printf("Failed to grow row cache.\n");
+		return -1;
+	}
+
+	RowEntry **old = shard->buckets;
+	int old_count = shard->num_buckets;
+	shard->buckets = buckets;
+	shard->num_buckets = num_buckets;
+	for (int i = 0; i < old_count; i++) {
+		RowEntry *entry = *(old + i);
+		while (entry) {
+			RowEntry *next = entry->hash_next;
+			RowEntry **bucket = bucket_for(shard, bloom_hash(entry->key));
+			entry->hash_next = *bucket;
+			*bucket = entry;
+			entry = next;
+		}
+	}
+	free(old);
+	return 0;
+}
+
+/* Counts an access in every row of the sketch; once enough have been
+ * counted, all counters are halved so old popularity fades */
+static void record_access(RowCacheShard *shard, uint64_t hash) {
+	for (int row = 0; row < ROW_CACHE_SKETCH_DEPTH; row++) {
+		uint8_t *counter = shard->sketch + row * ROW_CACHE_SKETCH_WIDTH
+				+ ((hash >> (row * 16)) & (ROW_CACHE_SKETCH_WIDTH - 1));
+		if (*counter < ROW_CACHE_SKETCH_MAX)
+			(*counter)++;
+	}
+
+	if (++shard->accesses >= (long) ROW_CACHE_SAMPLE * ROW_CACHE_SKETCH_WIDTH) {
+		for (int i = 0; i < ROW_CACHE_SKETCH_DEPTH * ROW_CACHE_SKETCH_WIDTH; i++)
+			*(shard->sketch + i) >>= 1;
+		shard->accesses /= 2;
+	}
+}
+
+/* Estimated recent accesses of a key: the smallest of its counters */
+static int frequency(RowCacheShard *shard, uint64_t hash) {
+	int estimate = ROW_CACHE_SKETCH_MAX;
+	for (int row = 0; row < ROW_CACHE_SKETCH_DEPTH; row++) {
+		int count = *(shard->sketch + row * ROW_CACHE_SKETCH_WIDTH
+				+ ((hash >> (row * 16)) & (ROW_CACHE_SKETCH_WIDTH - 1)));
+		if (count < estimate)
+			estimate = count;
+	}
+	return estimate;
+}
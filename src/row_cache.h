@@ -0,0 +1,71 @@
+#ifndef CUSTOM_ROW_CACHE_H
+#define CUSTOM_ROW_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define ROW_CACHE_SHARDS 16             // independently locked parts of the cache
+#define ROW_CACHE_BUCKETS 256           // initial hash buckets per shard
+#define ROW_CACHE_ENTRY_OVERHEAD 64     // bytes charged per entry besides its value
+#define ROW_CACHE_SKETCH_WIDTH 4096     // counters per row of a shard's frequency sketch
+#define ROW_CACHE_SKETCH_DEPTH 4        // rows (hash functions) of the sketch
+#define ROW_CACHE_SKETCH_MAX 15         // counters saturate here
+#define ROW_CACHE_SAMPLE 10             // halve the counters every SAMPLE * WIDTH accesses
+
+/* a cached key and its latest value; a NULL value means the key is known
+ * to be absent */
+typedef struct row_entry {
+	int key;
+	char *value;
+	long charge;
+	struct row_entry *hash_next;
+	struct row_entry *newer;
+	struct row_entry *older;
+} RowEntry;
+
+typedef struct row_cache_shard {
+	pthread_mutex_t lock;
+	RowEntry **buckets;
+	int num_buckets;
+	int count;
+	RowEntry *newest;
+	RowEntry *oldest;
+	long used;
+	long budget;
+	uint8_t *sketch;
+	long accesses;
+	long generation;
+} RowCacheShard;
+
+/* A byte-budgeted cache of key -> latest value, split into shards by key.
+ * Admission follows TinyLFU: every access is counted in a small count-min
+ * sketch (aged by halving), and a new entry only displaces the least
+ * recently used one if its key has been asked for more often, so a stream
+ * of one-off keys can't flush out the hot ones. */
+typedef struct row_cache {
+	RowCacheShard shards[ROW_CACHE_SHARDS];
+	atomic_long hits;
+	atomic_long misses;
+	atomic_long admitted;
+	atomic_long rejected;
+} RowCache;
+
+RowCache* init_row_cache(long budget);
+
+bool row_cache_lookup(RowCache *cache, int key, char **value);
+
+long row_cache_generation(RowCache *cache, int key);
+
+void row_cache_insert(RowCache *cache, int key, char *value, long generation);
+
+void row_cache_invalidate(RowCache *cache, int key);
+
+void row_cache_invalidate_range(RowCache *cache, int start_key, int end_key);
+
+long row_cache_used(RowCache *cache);
+
+void close_row_cache(RowCache *cache);
+
+#endif
@@ -2,81 +2,920 @@
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "segment.h"
 #include "memtable.h"
+#include "compress.h"
 #include "error.h"
+#include "async_io.h"
+#include "key_search.h"
+#include "bloom.h"
+
+/* versions of the key currently being written out, held back until the key
+ * is complete so that retention can consider all of them together. The
+ * last operands lines are merge operands still waiting for the version
+ * they fold over; needed says whether retention would keep a line were it
+ * not for the operands above it. */
+typedef struct version_group {
+	int key;
+	long newer_sequence;
+	char *lines;
+	bool *tombstones;
+	bool *needed;
+	int operands;
+	int count;
+	int capacity;
+	int line_size;
+	bool drop_tombstones;
+	RangeTombstone *ranges;
+	int num_ranges;
+} VersionGroup;
+
+/* a segment file opened for a batch of probes, with its block index */
+typedef struct probe_file {
+	char *filename;
+	int fd;
+	int64_t size;
+	BlockHandle *handles;
+	int num_blocks;
+	int last_key;
+	bool in_memory;
+} ProbeFile;
+
+/* one block read for a batch of probes; several probes may share it */
+typedef struct probe_block {
+	int file;
+	int block;
+	char *data;
+} ProbeBlock;
+
+/* serializes the retention discard hook between subcompactions, since the
+ * hook (value log garbage accounting) isn't safe to call concurrently */
+typedef struct discard_guard {
+	pthread_mutex_t lock;
+	discard_hook hook;
+	void *arg;
+} DiscardGuard;
+
+/* one key range of a compaction, merged from every input on its own thread */
+typedef struct subcompaction {
+	char **segment_files;
+	int num_segments;
+	RangeTombstone *ranges;
+	int num_ranges;
+	CompactionOutput *output;
+	int line_size;
+	int codec;
+	IOOptions *io;
+	SegmentStats *stats;
+	Retention retention;
+	pthread_t thread;
+	int error;
+} Subcompaction;
 
 /* prototypes for static functions */
-static void inorder_to_file(MNode *root, FILE *fp); // @suppress("Unused function declaration")
-static int merge_segments(char *filename_a, char *filename_b,
-						  char *new_segment_name, int line_size, char *tombstone);
-static void merge_lines(char *line_a, char *line_b, FILE *new_fp,
-						bool *incr_a, bool *incr_b, int line_size, char *tombstone);
-static char* do_search_segment(FILE *segment_ptr, int key, int line_size);
-
-
-/* Creates an array of strings to hold segment file names */
-char** init_segment_list(int num_segments) {
-	char **segments = (char**) malloc(num_segments * sizeof(char*));
-	if (segments == NULL) {
-		printf("Allocation of memory for segment files failed.\n");
+static int inorder_to_file(Memtable *memtable, SegmentWriter *writer, VersionGroup *group,
+							Retention *retention); // @suppress("Unused function declaration")
+static int plan_subcompactions(char **segment_files, int num_segments,
+							   CompactionOutput *outputs, int max_outputs, SegmentStats *stats);
+static int compare_keys(const void *a, const void *b);
+static int collect_ranges(char **segment_files, int num_segments, RangeTombstone **ranges,
+						  SegmentStats *stats);
+static void* run_subcompaction(void *arg);
+static int merge_range(Subcompaction *sub);
+static void guarded_discard(void *arg, char *value);
+static bool next_record(SegmentReader *reader, char *line, char *scratch,
+						Record *record, int line_size);
+static bool next_in_range(SegmentReader *reader, char *line, char *scratch,
+						  Record *record, int line_size, int high_key);
+static int init_group(VersionGroup *group, int line_size, bool drop_tombstones);
+static int group_add(VersionGroup *group, char *line, Record *record,
+					 SegmentWriter *writer, Retention *retention);
+static int flush_group(VersionGroup *group, SegmentWriter *writer, Retention *retention);
+static void free_group(VersionGroup *group);
+static bool is_operand(Retention *retention, char *value);
+static bool value_expired(Retention *retention, char *value);
+static bool fold_operands(VersionGroup *group, char *base, Retention *retention);
+static bool version_needed(Retention *retention, long sequence, long newer_sequence);
+static long next_range_delete(VersionGroup *group, int key, long sequence);
+static char* do_search_segment(SegmentReader *reader, int key, long sequence,
+							   int line_size, long *found);
+static int write_block(SegmentWriter *writer);
+static int load_block(SegmentReader *reader, int64_t offset);
+static int set_block(SegmentReader *reader, BlockHeader *header);
+static int decode_block(BlockHeader *header, char *stored, char *raw, SegmentStats *stats);
+static int open_probe_files(SegmentProbe *probes, int count, ProbeFile *files,
+							int *file_of);
+static int read_probe_indexes(IOContext *io, ProbeFile *files, int num_files);
+static int find_block(BlockHandle *handles, int num_blocks, int last_key, int key);
+static void close_probe_files(ProbeFile *files, int num_files);
+static int read_footer(InputFile *in, SegmentFooter *footer);
+static int read_handle(SegmentReader *reader, int block, BlockHandle *handle);
+static int read_into(InputFile *in, int64_t offset, void *dest, long length);
+static int copy_fences(SegmentReader *reader, SegmentFooter *footer,
+					   SegmentFences *fences);
+static int map_fences(SegmentReader *reader, SegmentFooter *footer,
+					  SegmentFences *fences);
+static void map_data_of(SegmentReader *reader, SegmentFences *fences);
+static long elapsed_ns(struct timespec *start);
+
+
+/* Writes a Memtable to a Sorted Strings Table (key-value pairs in which
+ * keys are in sorted order); versions no live snapshot needs are dropped */
+int memtable_to_segment(Memtable *memtable, char *filename, int line_size, int codec,
+		IOOptions *io, SegmentStats *stats, Retention *retention) {
+	SegmentWriter *writer = open_segment_writer(filename, codec, io, stats);
+	if (!writer) {
+		printf("Failed to save memtable to segment.\n");
+		return -1;
+	}
+
+	// tombstones must reach disk, since older segments may hold the key; the
+	// versions the memtable's own range deletes cover need not
+	VersionGroup group;
+	if (init_group(&group, line_size, false) != 0) {
+		close_segment_writer(writer);
+		return -1;
+	}
+	group.ranges = memtable->ranges;
+	group.num_ranges = memtable->num_ranges;
+	int error = 0;
+	for (int i = 0; !error && i < memtable->num_ranges; i++)
+		error = segment_writer_add_range(writer, memtable->ranges + i);
+	if (!error)
+		error = inorder_to_file(memtable, writer, &group, retention);
+	if (!error)
+		error = flush_group(&group, writer, retention);
+
+	free_group(&group);
+	if (close_segment_writer(writer) != 0)
+		error = -1;
+	if (error) {
+		printf("Failed to save memtable to segment.\n");
+		remove(filename);
+		return -1;
+	}
+	return 0;
+}
+
+/* Takes a memtable (tree), traverses tree "inorder" in
+ * order to add data, ordered by key (and then newest version first).
+ * Stops at the first line that can't be written, returning -1. */
+static int inorder_to_file(Memtable *memtable, SegmentWriter *writer, VersionGroup *group,
+							Retention *retention) {
+	char line[group->line_size];
+	MemtableIterator iterator;
+	memtable_iterator_seek(&iterator, memtable, INT_MIN);
+	for (MNode *node; (node = memtable_iterator_next(&iterator)); ) {
+		Record record = { node->key, node->sequence, node->data };
+		snprintf(line, group->line_size, "%d,%ld,%s", node->key, node->sequence, node->data);
+		if (group_add(group, line, &record, writer, retention) != 0)
+			return -1;
+
+		for (MVersion *version = node->older; version; version = version->next) {
+			record.sequence = version->sequence;
+			record.value = version->data;
+			snprintf(line, group->line_size, "%d,%ld,%s", node->key, version->sequence,
+					version->data);
+			if (group_add(group, line, &record, writer, retention) != 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/* Splits a segment line into its fields, in place. Returns 0 on success,
+ * -1 if the line is malformed. */
+int parse_record(char *line, Record *record) {
+	char *saveptr;
+	char *key = strtok_r(line, ",", &saveptr);
+	char *sequence = strtok_r(NULL, ",", &saveptr);
+	char *value = strtok_r(NULL, "", &saveptr);
+
+	if (!key || !sequence) {
+		return -1;
+	}
+	record->key = atoi(key);
+	record->sequence = atol(sequence);
+	record->value = value ? value : "";
+	return 0;
+}
+
+/* The time a value with a TTL expires, or 0 for one that never does */
+long value_expiry(char *value) {
+	if (!value || strncmp(value, EXPIRY_PREFIX, strlen(EXPIRY_PREFIX)) != 0)
+		return 0;
+	char *end;
+	long expires = strtol(value + strlen(EXPIRY_PREFIX), &end, 10);
+	return *end == ':' && expires > 0 ? expires : 0;
+}
+
+/* The value itself, past the expiry time of a value with a TTL */
+char* value_payload(char *value) {
+	return value_expiry(value) ? strchr(value, ':') + 1 : value;
+}
+
+/* Opens a new segment file for writing; blocks are compressed with
+ * the given codec as they fill up, and written out through large
+ * double buffers; io says whether to bypass the page cache and how to pace
+ * the writes. */
+SegmentWriter* open_segment_writer(char *filename, int codec, IOOptions *io,
+		SegmentStats *stats) {
+	SegmentWriter *writer = (SegmentWriter*) malloc(sizeof(SegmentWriter));
+	if (writer == NULL) {
+		printf("Failed to allocate memory for segment writer.\n");
+		return NULL;
+	}
+
+	if ((writer->out = open_output_file(filename, io)) == NULL) {
+		printf("Could not open up new segment: %s\n", filename);
+		free(writer);
 		return NULL;
 	}
 
-	for (int i = 0; i < num_segments; i++)
-		*(segments + i) = NULL;
-	return segments;
+	writer->codec = codec;
+	writer->block_used = 0;
+	writer->block_capacity = BLOCK_SIZE;
+	writer->block = (char*) malloc(writer->block_capacity);
+	writer->scratch_capacity = lz_max_compressed_size(BLOCK_SIZE);
+	writer->scratch = (char*) malloc(writer->scratch_capacity);
+	writer->num_lines = 0;
+	writer->lines_capacity = 64;
+	writer->keys = (int32_t*) malloc(writer->lines_capacity * sizeof(int32_t));
+	writer->line_offsets = (uint32_t*) malloc(writer->lines_capacity * sizeof(uint32_t));
+	writer->num_hashes = 0;
+	writer->hashes_capacity = 64;
+	writer->key_hashes = (uint64_t*) malloc(writer->hashes_capacity * sizeof(uint64_t));
+	writer->first_key = 0;
+	writer->last_key = 0;
+	writer->offset = 0;
+	writer->num_blocks = 0;
+	writer->handles_capacity = 16;
+	writer->handles = (BlockHandle*) malloc(writer->handles_capacity * sizeof(BlockHandle));
+	writer->ranges = NULL;
+	writer->num_ranges = 0;
+	writer->ranges_capacity = 0;
+	writer->expires = 0;
+	writer->never_expires = false;
+	writer->total_lines = 0;
+	writer->num_tombstones = 0;
+	writer->stats = stats;
+
+	if (!writer->block || !writer->scratch || !writer->handles || !writer->keys
+			|| !writer->line_offsets || !writer->key_hashes) {
+		printf("Failed to allocate buffers for segment writer.\n");
+		close_output_file(writer->out);
+		free(writer->block);
+		free(writer->scratch);
+		free(writer->handles);
+		free(writer->keys);
+		free(writer->line_offsets);
+		free(writer->key_hashes);
+		free(writer);
+		return NULL;
+	}
+	return writer;
 }
-/* Frees memory associated with segment file names */
-void free_segment_list(char **segments, int num_segments) {
-	for (int i = 0; i < num_segments; i++) {
-		if (*(segments + i) != NULL) {
-			free(*(segments + i));
+
+/* Appends a single "key,sequence,value" line (no newline) to the segment;
+ * lines must arrive in ascending key order, newest version first. */
+int segment_writer_add(SegmentWriter *writer, char *line) {
+	int len = strlen(line) + 1;
+	int key = atoi(line);
+
+	// the segment expires as a whole once its last version does
+	char *value = strchr(line, ',');
+	value = value ? strchr(value + 1, ',') : NULL;
+	long expires = value ? value_expiry(value + 1) : 0;
+	writer->never_expires |= expires == 0;
+	if (expires > writer->expires)
+		writer->expires = expires;
+
+	// all versions of a key stay within one block, so a search reads one block
+	if (writer->block_used > 0 && writer->block_used + len > BLOCK_SIZE
+			&& key != writer->last_key) {
+		if (write_block(writer) != 0)
+			return -1;
+	}
+
+	// a single oversized key gets a block of its own
+	if (writer->block_used + len > writer->block_capacity) {
+		char *bigger = (char*) realloc(writer->block, writer->block_used + len);
+		if (bigger == NULL) {
+			printf("Failed to grow segment block buffer.\n");
+			return -1;
+		}
+		writer->block = bigger;
+		writer->block_capacity = writer->block_used + len;
+	}
+
+	if (writer->num_lines == writer->lines_capacity) {
+		int capacity = writer->lines_capacity * 2;
+		int32_t *keys = (int32_t*) realloc(writer->keys, capacity * sizeof(int32_t));
+		if (keys)
+			writer->keys = keys;
+		uint32_t *offsets = (uint32_t*) realloc(writer->line_offsets,
+				capacity * sizeof(uint32_t));
+		if (offsets)
+			writer->line_offsets = offsets;
+		if (!keys || !offsets) {
+			printf("Failed to grow segment block key array.\n");
+			return -1;
+		}
+		writer->lines_capacity = capacity;
+	}
+
+	// each distinct key goes into the segment's bloom filter once
+	if (writer->num_hashes == 0 || key != writer->last_key) {
+		if (writer->num_hashes == writer->hashes_capacity) {
+			int capacity = writer->hashes_capacity * 2;
+			uint64_t *hashes = (uint64_t*) realloc(writer->key_hashes,
+					capacity * sizeof(uint64_t));
+			if (hashes == NULL) {
+				printf("Failed to grow segment filter keys.\n");
+				return -1;
+			}
+			writer->key_hashes = hashes;
+			writer->hashes_capacity = capacity;
 		}
+		writer->key_hashes[writer->num_hashes++] = bloom_hash(key);
 	}
-	free(segments);
+
+	if (writer->block_used == 0)
+		writer->first_key = key;
+	writer->last_key = key;
+	writer->keys[writer->num_lines] = key;
+	writer->line_offsets[writer->num_lines++] = writer->block_used;
+	writer->total_lines++;
+
+	memcpy(writer->block + writer->block_used, line, len - 1);
+	writer->block[writer->block_used + len - 1] = '\n';
+	writer->block_used += len;
+	return 0;
 }
 
-/* Writes a Memtable to a Sorted Strings Table
- * (key-value pairs in which keys are in sorted order*/
-int memtable_to_segment(Memtable *memtable, char *filename) {
-	FILE *fp;
-	if ((fp = fopen(filename, "w")) == NULL) {
-		printf("Failed to save memtable to segment.\n");
+/* Adds a range tombstone to the segment; they are written out with the
+ * block index when the segment is closed */
+int segment_writer_add_range(SegmentWriter *writer, RangeTombstone *range) {
+	if (writer->num_ranges == writer->ranges_capacity) {
+		int capacity = writer->ranges_capacity ? writer->ranges_capacity * 2 : 4;
+		RangeTombstone *ranges = (RangeTombstone*) realloc(writer->ranges,
+				capacity * sizeof(RangeTombstone));
+		if (ranges == NULL) {
+			printf("Failed to grow segment range tombstones.\n");
+			return -1;
+		}
+		writer->ranges = ranges;
+		writer->ranges_capacity = capacity;
+	}
+	writer->ranges[writer->num_ranges++] = *range;
+	return 0;
+}
+
+/* Compresses (if worthwhile) and writes out the current block, with its
+ * key and line offset arrays appended to the lines */
+static int write_block(SegmentWriter *writer) {
+	int text_size = writer->block_used;
+	int keys_at = (text_size + 3) & ~3;
+	int raw_size = keys_at + writer->num_lines * (sizeof(int32_t) + sizeof(uint32_t));
+	if (raw_size > writer->block_capacity) {
+		char *bigger = (char*) realloc(writer->block, raw_size);
+		if (bigger == NULL) {
+			printf("Failed to grow segment block buffer.\n");
+			return -1;
+		}
+		writer->block = bigger;
+		writer->block_capacity = raw_size;
+	}
+	memset(writer->block + text_size, 0, keys_at - text_size);
+	memcpy(writer->block + keys_at, writer->keys, writer->num_lines * sizeof(int32_t));
+	memcpy(writer->block + keys_at + writer->num_lines * sizeof(int32_t),
+			writer->line_offsets, writer->num_lines * sizeof(uint32_t));
+	writer->block_used = raw_size;
+
+	BlockHeader header = { raw_size, raw_size, CODEC_NONE, text_size };
+	char *payload = writer->block;
+
+	if (writer->codec == CODEC_LZ) {
+		int needed = lz_max_compressed_size(writer->block_used);
+		if (needed > writer->scratch_capacity) {
+			char *bigger = (char*) realloc(writer->scratch, needed);
+			if (bigger == NULL) {
+				printf("Failed to grow compression buffer.\n");
+				return -1;
+			}
+			writer->scratch = bigger;
+			writer->scratch_capacity = needed;
+		}
+
+		int compressed = lz_compress(writer->block, writer->block_used,
+				writer->scratch, writer->scratch_capacity);
+
+		// poor ratios aren't worth the decode cost; fall back to raw block
+		if (compressed > 0 && compressed * 100
+				<= writer->block_used * (100 - MIN_SAVINGS_PCT)) {
+			header.stored_size = compressed;
+			header.codec = CODEC_LZ;
+			payload = writer->scratch;
+		}
+	}
+
+	if (writer->num_blocks == writer->handles_capacity) {
+		int capacity = writer->handles_capacity * 2;
+		BlockHandle *handles = (BlockHandle*) realloc(writer->handles,
+				capacity * sizeof(BlockHandle));
+		if (handles == NULL) {
+			printf("Failed to grow segment block index.\n");
+			return -1;
+		}
+		writer->handles = handles;
+		writer->handles_capacity = capacity;
+	}
+
+	if (output_write(writer->out, &header, sizeof(BlockHeader)) != 0
+			|| output_write(writer->out, payload, header.stored_size) != 0) {
+		printf("Failed to write block to segment.\n");
 		return -1;
 	}
-	inorder_to_file(memtable->root, fp);
 
-	fclose(fp);
+	BlockHandle *handle = writer->handles + writer->num_blocks++;
+	handle->offset = writer->offset;
+	handle->first_key = writer->first_key;
+	handle->stored_size = header.stored_size;
+	writer->offset += sizeof(BlockHeader) + header.stored_size;
+
+	if (writer->stats) {
+		writer->stats->raw_bytes += header.raw_size;
+		writer->stats->stored_bytes += header.stored_size;
+		if (header.codec == CODEC_NONE)
+			writer->stats->blocks_uncompressed++;
+		else
+			writer->stats->blocks_compressed++;
+	}
+	writer->block_used = 0;
+	writer->num_lines = 0;
 	return 0;
 }
 
-/* Takes a memtable (tree) root, traverses tree "inorder" in
- * order to add data, ordered by key */
-static void inorder_to_file(MNode *root, FILE *fp) {
-	// we've traversed past a root
-	if (root == NULL) {
-		return;
+/* Writes out the last block, bloom filter, range tombstones, block index and
+ * footer; frees the writer regardless of whether an error occurred. */
+int close_segment_writer(SegmentWriter *writer) {
+	int error = 0;
+
+	if (writer->block_used > 0)
+		error = write_block(writer);
+
+	int filter_size = writer->num_hashes ? bloom_filter_size(writer->num_hashes) : 0;
+	uint8_t *filter = (uint8_t*) malloc(filter_size ? filter_size : 1);
+	if (!error && filter == NULL) {
+		printf("Failed to allocate memory for segment filter.\n");
+		error = -1;
 	}
-	inorder_to_file(root->left_child, fp);
-	fprintf(fp, "%d,%s\n", root->key, root->data);
-	inorder_to_file(root->right_child, fp);
+	if (!error) {
+		bloom_build(writer->key_hashes, writer->num_hashes, filter, filter_size);
+		error = output_write(writer->out, filter, filter_size);
+	}
+	free(filter);
+
+	// the ranges and index are aligned so that they can be used in place when mapped
+	int64_t filter_offset = writer->offset;
+	int64_t ranges_offset = (filter_offset + filter_size + 7) & ~7L;
+	int64_t index_offset = ranges_offset + writer->num_ranges * sizeof(RangeTombstone);
+	char padding[8] = { 0 };
+	if (!error)
+		error = output_write(writer->out, padding, ranges_offset - filter_offset - filter_size);
+	if (!error)
+		error = output_write(writer->out, writer->ranges,
+				writer->num_ranges * sizeof(RangeTombstone));
+
+	// range tombstones never expire, and a segment holding one must outlive it
+	bool expires = !writer->never_expires && writer->num_ranges == 0
+			&& writer->expires <= UINT32_MAX;
+	SegmentFooter footer = { index_offset, filter_offset, writer->num_blocks,
+			writer->last_key, filter_size, writer->num_ranges, writer->total_lines,
+			writer->num_tombstones, expires ? (uint32_t) writer->expires : 0,
+			SEGMENT_MAGIC };
+	if (!error && (output_write(writer->out, writer->handles,
+			writer->num_blocks * sizeof(BlockHandle)) != 0
+			|| output_write(writer->out, &footer, sizeof(SegmentFooter)) != 0)) {
+		printf("Failed to write segment block index.\n");
+		error = -1;
+	}
+
+	if (close_output_file(writer->out) != 0) {
+		printf("Failed to close segment file.\n");
+		error = -1;
+	}
+	free(writer->block);
+	free(writer->scratch);
+	free(writer->handles);
+	free(writer->keys);
+	free(writer->line_offsets);
+	free(writer->key_hashes);
+	free(writer->ranges);
+	free(writer);
+	return error;
 }
 
-/* Reads line from an open file, placing it into the string pointed to
- * by 'line'; note that the new line character may be  removed, if specified. */
-char* readline_from_segment(char *line, int buf_size, FILE *fp, bool rm_newline) {
-	fgets(line, buf_size, fp);
+/* Opens an existing segment file for a sequential scan of its lines, read
+ * through a large read-ahead window */
+SegmentReader* open_segment_reader(char *filename, int io_flags, SegmentStats *stats) {
+	SegmentReader *reader = (SegmentReader*) malloc(sizeof(SegmentReader));
+	if (reader == NULL) {
+		printf("Failed to allocate memory for segment reader.\n");
+		return NULL;
+	}
+
+	if (!(reader->in = open_input_file(filename, io_flags))) {
+		printf("Could not open up segment: %s\n", filename);
+		free(reader);
+		return NULL;
+	}
 
-	if (rm_newline) {
-		char *p;
-		if ((p = strchr(line, '\n')) != NULL)
-			*p = '\0';
+	SegmentFooter footer;
+	if (read_footer(reader->in, &footer) != 0) {
+		printf("Segment %s is missing its footer.\n", filename);
+		close_input_file(reader->in);
+		free(reader);
+		return NULL;
 	}
+
+	reader->data_end = footer.filter_offset;
+	reader->index_offset = footer.index_offset;
+	reader->num_blocks = footer.num_blocks;
+	reader->num_ranges = footer.num_ranges;
+	reader->next_offset = 0;
+	reader->block = NULL;
+	reader->block_size = 0;
+	reader->block_capacity = 0;
+	reader->block_pos = 0;
+	reader->keys = NULL;
+	reader->line_offsets = NULL;
+	reader->num_keys = 0;
+	reader->stats = stats;
+	return reader;
+}
+
+/* Positions the reader at the first line for key or a later one: the block
+ * that would hold key (versions of a key never span blocks) is found in the
+ * block index, then the line in the block's key array. Returns -1 if the
+ * block can't be read. */
+int segment_reader_seek(SegmentReader *reader, int key) {
+	int low = 0, high = reader->num_blocks - 1;
+	int64_t offset = 0;
+	BlockHandle handle;
+
+	// the last block starting at or before key, or the first block
+	while (low <= high) {
+		int mid = (low + high) / 2;
+		if (read_handle(reader, mid, &handle) != 0)
+			return -1;
+		if (handle.first_key <= key) {
+			offset = handle.offset;
+			low = mid + 1;
+		} else {
+			high = mid - 1;
+		}
+	}
+
+	reader->block_size = 0;
+	reader->block_pos = 0;
+	reader->next_offset = offset;
+	if (reader->num_blocks == 0)
+		return 0;
+
+	if (load_block(reader, offset) != 0)
+		return -1;
+	int first = key_lower_bound(reader->keys, reader->num_keys, key);
+	reader->block_pos = first < reader->num_keys ? (int) reader->line_offsets[first]
+			: reader->block_size;
+	return 0;
+}
+
+/* Copies the next line of the segment (without newline) into 'line';
+ * returns NULL once every block has been read. */
+char* segment_reader_next(SegmentReader *reader, char *line, int line_size) {
+	while (reader->block_pos >= reader->block_size) {
+		if (reader->next_offset >= reader->data_end)
+			return NULL;
+		if (load_block(reader, reader->next_offset) != 0)
+			return NULL;
+	}
+
+	char *start = reader->block + reader->block_pos;
+	char *end = memchr(start, '\n', reader->block_size - reader->block_pos);
+	int len = end ? end - start : reader->block_size - reader->block_pos;
+
+	reader->block_pos += len + 1;
+	if (len >= line_size)
+		len = line_size - 1;
+	memcpy(line, start, len);
+	line[len] = '\0';
 	return line;
 }
 
+/* Reads the segment's range tombstones into a new array (of
+ * reader->num_ranges), which the caller frees; NULL on failure */
+RangeTombstone* segment_reader_ranges(SegmentReader *reader) {
+	long length = reader->num_ranges * sizeof(RangeTombstone);
+	RangeTombstone *ranges = (RangeTombstone*) malloc(length ? length : 1);
+	if (ranges == NULL) {
+		printf("Failed to allocate memory for range tombstones.\n");
+		return NULL;
+	}
+	if (read_into(reader->in, reader->index_offset - length, ranges, length) != 0) {
+		printf("Failed to read segment range tombstones.\n");
+		free(ranges);
+		return NULL;
+	}
+	return ranges;
+}
+
+void close_segment_reader(SegmentReader *reader) {
+	close_input_file(reader->in);
+	free(reader->block);
+	free(reader);
+}
+
+/* Reads and decodes the block at offset, making it the current block */
+static int load_block(SegmentReader *reader, int64_t offset) {
+	BlockHeader header;
+	char *bytes = input_at(reader->in, offset, sizeof(BlockHeader));
+	if (bytes == NULL) {
+		printf("Failed to read segment block header.\n");
+		return -1;
+	}
+	memcpy(&header, bytes, sizeof(BlockHeader));
+
+	if (header.raw_size > reader->block_capacity) {
+		char *bigger = (char*) realloc(reader->block, header.raw_size);
+		if (bigger == NULL) {
+			printf("Failed to allocate memory for segment block.\n");
+			return -1;
+		}
+		reader->block = bigger;
+		reader->block_capacity = header.raw_size;
+	}
+
+	char *stored = input_at(reader->in, offset + sizeof(BlockHeader), header.stored_size);
+	if (stored == NULL) {
+		printf("Failed to read segment block.\n");
+		return -1;
+	}
+	if (decode_block(&header, stored, reader->block, reader->stats) != 0
+			|| set_block(reader, &header) != 0)
+		return -1;
+
+	reader->next_offset = offset + sizeof(BlockHeader) + header.stored_size;
+	return 0;
+}
+
+/* Makes the decoded block in reader->block current: its lines end at
+ * text_size, and its key and line offset arrays follow them. */
+static int set_block(SegmentReader *reader, BlockHeader *header) {
+	int keys_at = (header->text_size + 3) & ~3;
+	int entry_size = sizeof(int32_t) + sizeof(uint32_t);
+	if (header->text_size > header->raw_size || keys_at > header->raw_size
+			|| (header->raw_size - keys_at) % entry_size != 0) {
+		printf("Segment block is corrupted.\n");
+		return -1;
+	}
+
+	reader->num_keys = (header->raw_size - keys_at) / entry_size;
+	reader->keys = (int32_t*) (reader->block + keys_at);
+	reader->line_offsets = (uint32_t*) (reader->keys + reader->num_keys);
+	reader->block_size = header->text_size;
+	reader->block_pos = 0;
+	return 0;
+}
+
+/* Turns a block's stored bytes into its raw_size bytes of lines at raw;
+ * stored may already be raw for uncompressed blocks. */
+static int decode_block(BlockHeader *header, char *stored, char *raw, SegmentStats *stats) {
+	if (header->codec == CODEC_NONE) {
+		if (stored != raw)
+			memcpy(raw, stored, header->raw_size);
+		return 0;
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	int decoded = lz_decompress(stored, header->stored_size, raw, header->raw_size);
+	if (decoded != header->raw_size) {
+		printf("Segment block is corrupted.\n");
+		return -1;
+	}
+	if (stats) {
+		stats->blocks_decoded++;
+		stats->decode_ns += elapsed_ns(&start);
+	}
+	return 0;
+}
+
+static int read_footer(InputFile *in, SegmentFooter *footer) {
+	char *bytes = input_at(in, in->size - sizeof(SegmentFooter), sizeof(SegmentFooter));
+	if (bytes == NULL)
+		return -1;
+
+	memcpy(footer, bytes, sizeof(SegmentFooter));
+	return footer->magic == SEGMENT_MAGIC ? 0 : -1;
+}
+
+static int read_handle(SegmentReader *reader, int block, BlockHandle *handle) {
+	char *bytes = input_at(reader->in, reader->index_offset
+			+ (int64_t) block * sizeof(BlockHandle), sizeof(BlockHandle));
+	if (bytes == NULL) {
+		printf("Failed to read segment block index.\n");
+		return -1;
+	}
+	memcpy(handle, bytes, sizeof(BlockHandle));
+	return 0;
+}
+
+/* Copies length bytes at offset out of the file, in pieces, since they may
+ * be larger than the input window */
+static int read_into(InputFile *in, int64_t offset, void *dest, long length) {
+	for (long copied = 0; copied < length; ) {
+		long piece = length - copied;
+		if (piece > IO_BUFFER_SIZE / 2)
+			piece = IO_BUFFER_SIZE / 2;
+		char *bytes = input_at(in, offset + copied, piece);
+		if (bytes == NULL)
+			return -1;
+		memcpy((char*) dest + copied, bytes, piece);
+		copied += piece;
+	}
+	return 0;
+}
+
+static long elapsed_ns(struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000L
+			+ (now.tv_nsec - start->tv_nsec);
+}
+
+/* Loads a segment's key range, bloom filter, range tombstones and block
+ * index, to be kept in memory while the segment is live; storage says
+ * whether they are copied to the heap or mapped from the file. With
+ * map_data the whole file is mapped as well, for search_mapped_segment();
+ * if that fails, reads just go through the file. Returns NULL if the
+ * segment can't be read. */
+SegmentFences* load_segment_fences(char *filename, int storage, bool map_data) {
+	SegmentReader *reader = open_segment_reader(filename, IO_BUFFERED, NULL);
+	SegmentFences *fences = reader ? (SegmentFences*) calloc(1, sizeof(SegmentFences)) : NULL;
+	if (!fences) {
+		if (reader)
+			close_segment_reader(reader);
+		return NULL;
+	}
+
+	SegmentFooter footer;
+	int error = read_footer(reader->in, &footer);
+	fences->num_blocks = footer.num_blocks;
+	fences->filter_size = footer.filter_size;
+	fences->num_ranges = footer.num_ranges;
+	fences->num_lines = footer.num_lines;
+	fences->num_tombstones = footer.num_tombstones;
+	fences->expires = footer.expires;
+
+	// an empty segment gets a range no key falls in
+	fences->low_key = INT_MAX;
+	fences->high_key = INT_MIN;
+
+	if (!error && storage == FENCES_MMAP) {
+		error = map_fences(reader, &footer, fences);
+	} else if (!error) {
+		error = copy_fences(reader, &footer, fences);
+	}
+
+	if (!error && footer.num_blocks > 0) {
+		fences->low_key = fences->handles->first_key;
+		fences->high_key = footer.last_key;
+	}
+	if (!error && map_data)
+		map_data_of(reader, fences);
+	close_segment_reader(reader);
+
+	if (error) {
+		printf("Failed to load fence pointers of segment: %s\n", filename);
+		free_segment_fences(fences);
+		return NULL;
+	}
+	return fences;
+}
+
+/* True unless the segment certainly doesn't hold the key: the key is outside
+ * its range, or its bloom filter rules the key out */
+bool fences_may_contain(SegmentFences *fences, int key) {
+	if (key < fences->low_key || key > fences->high_key)
+		return false;
+	return fences->filter_size == 0
+			|| bloom_may_contain(fences->filter, fences->filter_size, key);
+}
+
+/* Bytes of heap a segment's fences take up; mapped fences only cost the
+ * struct itself, the rest being in the page cache */
+long segment_fences_memory(SegmentFences *fences) {
+	if (fences->mapping)
+		return sizeof(SegmentFences);
+	return sizeof(SegmentFences) + (long) fences->num_blocks * sizeof(BlockHandle)
+			+ fences->filter_size + (long) fences->num_ranges * sizeof(RangeTombstone);
+}
+
+void free_segment_fences(SegmentFences *fences) {
+	if (!fences)
+		return;
+	if (fences->data)
+		munmap(fences->data, fences->data_size);
+	if (fences->mapping) {
+		munmap(fences->mapping, fences->mapping_size);
+	} else {
+		free(fences->handles);
+		free(fences->filter);
+		free(fences->ranges);
+	}
+	free(fences);
+}
+
+/* Copies the block index, filter and range tombstones out of the file into
+ * the heap */
+static int copy_fences(SegmentReader *reader, SegmentFooter *footer,
+					   SegmentFences *fences) {
+	fences->handles = (BlockHandle*) malloc((footer->num_blocks ? footer->num_blocks : 1)
+			* sizeof(BlockHandle));
+	fences->filter = (uint8_t*) malloc(footer->filter_size ? footer->filter_size : 1);
+	fences->ranges = segment_reader_ranges(reader);
+	if (!fences->handles || !fences->filter || !fences->ranges) {
+		printf("Failed to allocate memory for segment fence pointers.\n");
+		return -1;
+	}
+
+	for (int b = 0; b < footer->num_blocks; b++) {
+		if (read_handle(reader, b, fences->handles + b) != 0)
+			return -1;
+	}
+
+	return read_into(reader->in, footer->filter_offset, fences->filter, footer->filter_size);
+}
+
+/* Maps the tail of the file holding the filter, range tombstones and block
+ * index, and points the fences into the mapping */
+static int map_fences(SegmentReader *reader, SegmentFooter *footer,
+					  SegmentFences *fences) {
+	long page = sysconf(_SC_PAGESIZE);
+	int64_t start = footer->filter_offset - footer->filter_offset % page;
+	long length = reader->in->size - start;
+
+	void *mapping = mmap(NULL, length, PROT_READ, MAP_SHARED, reader->in->fd, start);
+	if (mapping == MAP_FAILED) {
+		printf("Failed to map segment fence pointers.\n");
+		return -1;
+	}
+	fences->mapping = mapping;
+	fences->mapping_size = length;
+	fences->filter = (uint8_t*) mapping + (footer->filter_offset - start);
+	fences->handles = (BlockHandle*) ((char*) mapping + (footer->index_offset - start));
+	fences->ranges = (RangeTombstone*) fences->handles - footer->num_ranges;
+	return 0;
+}
+
+/* Maps the whole file for reads in place. Lookups land on blocks at random,
+ * so read-ahead would only bring in pages nobody asked for. */
+static void map_data_of(SegmentReader *reader, SegmentFences *fences) {
+	void *data = mmap(NULL, reader->in->size, PROT_READ, MAP_SHARED, reader->in->fd, 0);
+	if (data == MAP_FAILED)
+		return;
+	madvise(data, reader->in->size, MADV_RANDOM);
+	fences->data = (char*) data;
+	fences->data_size = reader->in->size;
+}
+
+/* For a segment dropped whole (every key in it deleted by a newer range
+ * tombstone), reports each of its values to the retention policy's discard
+ * hook, as compaction would have. Nothing is merged or written. */
+int discard_segment_values(char *filename, int line_size, Retention *retention,
+		SegmentStats *stats) {
+	if (!retention->on_discard)
+		return 0;
+	SegmentReader *reader = open_segment_reader(filename, IO_BUFFERED, stats);
+	if (!reader)
+		return -1;
+
+	char line[line_size], scratch[line_size];
+	Record record;
+	while (next_record(reader, line, scratch, &record, line_size))
+		retention->on_discard(retention->discard_arg, record.value);
+	close_segment_reader(reader);
+	return 0;
+}
+
 /* Permanently deletes entire file */
 int delete_segment(char *filename) {
 	int del = remove(filename);
@@ -87,185 +926,878 @@ int delete_segment(char *filename) {
 	return 0;
 }
 
-/* Takes a list of segment file names and compacts two at
- * a time, sequentially; deletes files no longer needed */
-int compact_segments(char **segment_files, int num_segments,
-					 char *new_segment_name, int line_size, char *tombstone) {
+/* Takes a list of segment file names (oldest first) and merges them into up
+ * to max_outputs new segments, whose file names the caller sets in outputs.
+ * Versions deleted by the inputs' range tombstones are dropped along with
+ * overwritten ones, and the tombstones themselves once no snapshot needs them.
+ * Large compactions are split into disjoint key ranges of about equal size
+ * (by the block indexes of the inputs), each merged on its own thread into
+ * its own output; outputs come back in key order with their ranges set.
+ * The input files are left in place, since readers may still be using them.
+ * io applies to every file compaction reads and writes. Returns the number
+ * of outputs used, or -1 on failure (when no output file is left behind). */
+int compact_segments(char **segment_files, int num_segments, CompactionOutput *outputs,
+		int max_outputs, int line_size, int codec, IOOptions *io, SegmentStats *stats,
+		Retention *retention) {
+
+	if (num_segments < 1) {
+		printf("Compaction needs at least one segment.\n");
+		return -1;
+	}
+
+	RangeTombstone *ranges;
+	int num_ranges = collect_ranges(segment_files, num_segments, &ranges, stats);
+	int num_outputs = num_ranges < 0 ? -1 : plan_subcompactions(segment_files,
+			num_segments, outputs, max_outputs, stats);
+	if (num_outputs < 0) {
+		if (num_ranges >= 0)
+			free(ranges);
+		return -1;
+	}
 
-	char *segment_a = *(segment_files);
-	char *segment_b;
+	DiscardGuard guard = { .hook = retention->on_discard, .arg = retention->discard_arg };
+	pthread_mutex_init(&guard.lock, NULL);
 
-	for (int i = 1; i < num_segments; i++) {
-		segment_b = *(segment_files + i);
+	Subcompaction subs[num_outputs];
+	for (int i = 0; i < num_outputs; i++) {
+		Subcompaction *sub = subs + i;
+		*sub = (Subcompaction) { segment_files, num_segments, ranges, num_ranges,
+				outputs + i, line_size, codec, io, stats, *retention };
+		if (retention->on_discard && num_outputs > 1) {
+			sub->retention.on_discard = guarded_discard;
+			sub->retention.discard_arg = &guard;
+		}
+	}
+
+	// the first range is merged on this thread, the rest alongside it
+	bool started[num_outputs];
+	for (int i = 1; i < num_outputs; i++) {
+		started[i] = pthread_create(&(subs + i)->thread, NULL, run_subcompaction,
+				subs + i) == 0;
+		if (!started[i])
+			run_subcompaction(subs + i);
+	}
+	run_subcompaction(subs);
+
+	int error = subs->error;
+	for (int i = 1; i < num_outputs; i++) {
+		if (started[i])
+			pthread_join((subs + i)->thread, NULL);
+		error |= (subs + i)->error;
+	}
+	pthread_mutex_destroy(&guard.lock);
+	free(ranges);
+
+	if (error) {
+		printf("An error occurred on compacting segments.\n");
+		for (int i = 0; i < num_outputs; i++) {
+			if (!(outputs + i)->empty)
+				remove((outputs + i)->filename);
+		}
+		return -1;
+	}
+	return num_outputs;
+}
+
+/* Picks the key ranges of a compaction: the first keys of every input block,
+ * in order, are cut into equal shares, so each range covers about the same
+ * number of blocks. Compactions too small to be worth splitting get a single
+ * range covering every key. Returns the number of ranges. */
+static int plan_subcompactions(char **segment_files, int num_segments,
+							   CompactionOutput *outputs, int max_outputs, SegmentStats *stats) {
+	int num_keys = 0;
+	int capacity = 64;
+	int *keys = (int*) malloc(capacity * sizeof(int));
+	if (keys == NULL) {
+		printf("Failed to allocate memory for compaction ranges.\n");
+		return -1;
+	}
 
-		// will merge segs a and b into new_segment
-		int error = merge_segments(segment_a, segment_b, new_segment_name,
-				line_size, tombstone);
-		if (error) {
-			printf("An error occurred on compacting segments.\n");
+	for (int i = 0; i < num_segments; i++) {
+		SegmentReader *reader = open_segment_reader(*(segment_files + i), IO_BUFFERED, stats);
+		if (!reader) {
+			free(keys);
 			return -1;
 		}
 
-		// if existing file segments fail to delete, this is big problem for disk space.
-		if (delete_segment(segment_a) != 0
-				|| delete_segment(segment_b) != 0) {
-			printf("Failed to delete old segment files");
-			delete_segment(new_segment_name);
-			free(new_segment_name);
+		BlockHandle handle;
+		for (int b = 0; b < reader->num_blocks; b++) {
+			if (num_keys == capacity) {
+				int *bigger = (int*) realloc(keys, capacity * 2 * sizeof(int));
+				if (bigger == NULL) {
+					printf("Failed to allocate memory for compaction ranges.\n");
+					break;
+				}
+				keys = bigger;
+				capacity *= 2;
+			}
+			if (read_handle(reader, b, &handle) != 0)
+				break;
+			*(keys + num_keys++) = handle.first_key;
+		}
+		close_segment_reader(reader);
+	}
+
+	int ranges = num_keys / SUBCOMPACTION_MIN_BLOCKS;
+	if (ranges > max_outputs)
+		ranges = max_outputs;
+	if (ranges < 1)
+		ranges = 1;
+	qsort(keys, num_keys, sizeof(int), compare_keys);
+
+	// range i starts at the first key of its share of blocks; repeated keys
+	// (the same key's blocks in several inputs) can merge neighbouring ranges
+	int num_outputs = 0;
+	for (int i = 0; i < ranges; i++) {
+		int low_key = i == 0 ? INT_MIN : *(keys + (long) i * num_keys / ranges);
+		if (num_outputs > 0 && low_key <= (outputs + num_outputs - 1)->low_key)
+			continue;
+		if (num_outputs > 0)
+			(outputs + num_outputs - 1)->high_key = low_key - 1;
+		(outputs + num_outputs)->low_key = low_key;
+		(outputs + num_outputs)->high_key = INT_MAX;
+		(outputs + num_outputs)->empty = false;
+		num_outputs++;
+	}
+	free(keys);
+	return num_outputs;
+}
+
+static int compare_keys(const void *a, const void *b) {
+	int x = *(const int*) a, y = *(const int*) b;
+	return (x > y) - (x < y);
+}
+
+/* Reads the range tombstones of every input into one array, which the
+ * caller frees. Returns how many there are, or -1 on failure. */
+static int collect_ranges(char **segment_files, int num_segments, RangeTombstone **ranges,
+						  SegmentStats *stats) {
+	int count = 0;
+	*ranges = NULL;
+	for (int i = 0; i < num_segments; i++) {
+		SegmentReader *reader = open_segment_reader(*(segment_files + i), IO_BUFFERED, stats);
+		RangeTombstone *found = reader ? segment_reader_ranges(reader) : NULL;
+		RangeTombstone *all = found ? (RangeTombstone*) realloc(*ranges,
+				(count + reader->num_ranges + 1) * sizeof(RangeTombstone)) : NULL;
+		if (all) {
+			memcpy(all + count, found, reader->num_ranges * sizeof(RangeTombstone));
+			count += reader->num_ranges;
+			*ranges = all;
+		}
+		free(found);
+		if (reader)
+			close_segment_reader(reader);
+		if (!all) {
+			printf("Failed to collect range tombstones for compaction.\n");
+			free(*ranges);
 			return -1;
 		}
+	}
+	return count;
+}
+
+static void* run_subcompaction(void *arg) {
+	Subcompaction *sub = (Subcompaction*) arg;
+	sub->error = merge_range(sub);
+	return NULL;
+}
+
+static void guarded_discard(void *arg, char *value) {
+	DiscardGuard *guard = (DiscardGuard*) arg;
+	pthread_mutex_lock(&guard->lock);
+	guard->hook(guard->arg, value);
+	pthread_mutex_unlock(&guard->lock);
+}
+
+/* Public wrapper function for searching a file specified by filename; finds
+ * the newest version of the key written at or before sequence and returns a
+ * copy of its value, which the caller must free. found is set to that
+ * version's sequence. */
+char* search_segment(char *filename, SegmentFences *fences, int key, long sequence,
+		int line_size, SegmentStats *stats, long *found) {
+	SegmentProbe probe = { filename, key, sequence, NULL, fences, 0 };
+	probe_segments(NULL, &probe, 1, line_size, stats);
+	*found = probe.found;
+	return probe.value;
+}
+
+/* Finds the newest version of key written at or before sequence in a
+ * segment mapped whole (fences->data), without copying anything: value is
+ * pointed at it in the mapping, length bytes long and not terminated, and
+ * found is set to its sequence. The pointer is only good while the fences
+ * are. Returns 1 if a version was found, 0 if the segment has none visible,
+ * or -1 if the key's block can't be read in place: the file isn't mapped,
+ * the block is compressed, or its key array is misaligned (which a block
+ * after a compressed one can be). */
+int search_mapped_segment(SegmentFences *fences, int key, long sequence, char **value,
+		int *length, long *found) {
+	if (fences->data == NULL)
+		return -1;
+	if (!fences_may_contain(fences, key))
+		return 0;
+	int block = find_block(fences->handles, fences->num_blocks, fences->high_key, key);
+	if (block < 0)
+		return 0;
+
+	BlockHandle *handle = fences->handles + block;
+	BlockHeader header;
+	if (handle->offset < 0 || handle->offset + (long) sizeof(BlockHeader)
+			+ handle->stored_size > fences->data_size)
+		return -1;
+	memcpy(&header, fences->data + handle->offset, sizeof(BlockHeader));
+
+	SegmentReader reader;
+	memset(&reader, 0, sizeof(SegmentReader));
+	reader.block = fences->data + handle->offset + sizeof(BlockHeader);
+	if (header.codec != CODEC_NONE || header.raw_size != handle->stored_size
+			|| (uintptr_t) reader.block % sizeof(int32_t) != 0
+			|| set_block(&reader, &header) != 0)
+		return -1;
+
+	// lines are "key,sequence,value\n", newest version of a key first
+	int first = key_lower_bound(reader.keys, reader.num_keys, key);
+	for (int i = first; i < reader.num_keys && reader.keys[i] == key; i++) {
+		if (reader.line_offsets[i] >= reader.block_size)
+			continue;
+		char *line = reader.block + reader.line_offsets[i];
+		int line_size = reader.block_size - reader.line_offsets[i];
+		char *end = memchr(line, '\n', line_size);
+		char *comma = memchr(line, ',', end ? end - line : line_size);
+		if (end == NULL || comma == NULL)
+			continue;
 
-		// new segment will then be merged with consecutive other files
-		segment_a = new_segment_name;
+		char *after;
+		long version = strtol(comma + 1, &after, 10);
+		if (*after != ',' || version > sequence)
+			continue;
+		*value = after + 1;
+		*length = end - *value;
+		*found = version;
+		return 1;
 	}
 	return 0;
 }
 
-/* Public wrapper function for searching a file specified by filename */
-char* search_segment(char *filename, int key, int line_size) {
-	FILE *fp;
-	if (!(fp = fopen(filename, "r"))) {
-		printf("Could not open up segment: %s", filename);
-		return NULL;
+/* Looks up a batch of (segment, key) pairs at once. Rather than reading one
+ * segment after another, every segment's tail (block index and footer) is
+ * read in one batch, then every block that could hold a key in a second, so
+ * the batch costs about two I/O round trips however many segments it
+ * touches. Each probe's value is set to a copy of the newest version of its
+ * key visible at its sequence, or NULL. Returns -1 if any read failed. */
+int probe_segments(IOContext *io, SegmentProbe *probes, int count, int line_size,
+		SegmentStats *stats) {
+	if (count == 0)
+		return 0;
+	ProbeFile files[count];
+	int file_of[count];
+	ProbeBlock blocks[count];
+	int block_of[count];
+	int num_blocks = 0;
+
+	for (int i = 0; i < count; i++)
+		(probes + i)->value = NULL;
+
+	int num_files = open_probe_files(probes, count, files, file_of);
+	int error = read_probe_indexes(io, files, num_files);
+
+	// pick each probe's block; probes of the same block share one read
+	for (int i = 0; i < count; i++) {
+		ProbeFile *file = files + file_of[i];
+		SegmentFences *fences = (probes + i)->fences;
+		bool may_hold = !fences || fences_may_contain(fences, (probes + i)->key);
+		int block = file->handles && may_hold ? find_block(file->handles,
+				file->num_blocks, file->last_key, (probes + i)->key) : -1;
+
+		block_of[i] = -1;
+		for (int b = 0; block >= 0 && b < num_blocks && block_of[i] < 0; b++) {
+			if (blocks[b].file == file_of[i] && blocks[b].block == block)
+				block_of[i] = b;
+		}
+		if (block >= 0 && block_of[i] < 0) {
+			blocks[num_blocks] = (ProbeBlock) { file_of[i], block, NULL };
+			block_of[i] = num_blocks++;
+		}
 	}
-	char *found = do_search_segment(fp, key, line_size);
-	fclose(fp);
 
-	return found;
-}
+	ReadRequest requests[num_blocks ? num_blocks : 1];
+	int num_requests = 0;
+	for (int b = 0; b < num_blocks; b++) {
+		ProbeFile *file = files + blocks[b].file;
+		BlockHandle *handle = file->handles + blocks[b].block;
+		int length = sizeof(BlockHeader) + handle->stored_size;
 
-/* Searches through a segment, if key in segment then return value;
- * uses recursion to look at last line of file first (note that files
- * are assumed to be small and can fit in stack memory. */
-static char* do_search_segment(FILE *segment_ptr, int key, int line_size) {
-	char line[line_size];
+		blocks[b].data = (char*) malloc(length);
+		if (blocks[b].data == NULL) {
+			printf("Failed to allocate memory for segment block.\n");
+			error = -1;
+			continue;
+		}
+		requests[num_requests++] = (ReadRequest) { file->fd, handle->offset, length,
+				blocks[b].data, 0 };
+	}
+	if (num_requests > 0 && submit_reads(io, requests, num_requests) != 0) {
+		printf("Failed to read segment blocks.\n");
+		error = -1;
+	}
 
-	if (fgets(line, line_size, segment_ptr) != NULL) {
-		char *value = do_search_segment(segment_ptr, key, line_size);
-		if (value != NULL) {
-			return value;
+	// decode each block once, then search it for every probe that needs it
+	SegmentReader reader;
+	memset(&reader, 0, sizeof(SegmentReader));
+	reader.stats = stats;
+	for (int b = 0; b < num_blocks; b++) {
+		BlockHeader header;
+		if (!error)
+			memcpy(&header, blocks[b].data, sizeof(BlockHeader));
+
+		if (!error && header.raw_size > reader.block_capacity) {
+			char *bigger = (char*) realloc(reader.block, header.raw_size);
+			if (bigger == NULL) {
+				printf("Failed to allocate memory for segment block.\n");
+				error = -1;
+			} else {
+				reader.block = bigger;
+				reader.block_capacity = header.raw_size;
+			}
+		}
+		if (!error && (decode_block(&header, blocks[b].data + sizeof(BlockHeader),
+				reader.block, stats) != 0 || set_block(&reader, &header) != 0))
+			error = -1;
+
+		for (int i = 0; !error && i < count; i++) {
+			if (block_of[i] != b)
+				continue;
+			(probes + i)->value = do_search_segment(&reader, (probes + i)->key,
+					(probes + i)->sequence, line_size, &(probes + i)->found);
 		}
+		free(blocks[b].data);
+	}
+
+	free(reader.block);
+	close_probe_files(files, num_files);
+	return error;
+}
+
+/* Opens each distinct segment named by the probes; file_of maps each probe
+ * to its file. Returns the number of files. */
+static int open_probe_files(SegmentProbe *probes, int count, ProbeFile *files,
+							int *file_of) {
+	int num_files = 0;
 
-		// split line to get key value, then check if it's the key
-		if (atoi(strtok(line, ",")) == key) {
-			char *value = strtok(NULL, ",");
+	for (int i = 0; i < count; i++) {
+		file_of[i] = -1;
+		for (int f = 0; f < num_files && file_of[i] < 0; f++) {
+			if (strcmp((files + f)->filename, (probes + i)->filename) == 0)
+				file_of[i] = f;
+		}
+		if (file_of[i] >= 0)
+			continue;
 
-			// remove new line character from value before returning
-			char *p;
-			if ((p = strchr(value, '\n')) != NULL)
-				*p = '\0';
+		// fences already in memory spare the read of the block index
+		ProbeFile *file = files + num_files;
+		SegmentFences *fences = (probes + i)->fences;
+		file->filename = (probes + i)->filename;
+		file->handles = fences && fences->num_blocks ? fences->handles : NULL;
+		file->num_blocks = fences ? fences->num_blocks : 0;
+		file->last_key = fences ? fences->high_key : 0;
+		file->in_memory = fences != NULL;
+		file->size = 0;
 
-			return value;
+		struct stat info;
+		file->fd = open(file->filename, O_RDONLY);
+		if (file->fd < 0 || fstat(file->fd, &info) != 0) {
+			printf("Could not open up segment: %s\n", file->filename);
+		} else {
+			file->size = info.st_size;
 		}
+		file_of[i] = num_files++;
 	}
-	return NULL;
+	return num_files;
 }
 
-/* Used to perform compaction step of two segment files. This method is
- * necessary for cleaning up old segment files and keeping read I/O from
- * getting out of control. Merges old segments together into new segments.*/
-static int merge_segments(char *filename_a, char *filename_b,
-						  char *new_segment_name, int line_size, char *tombstone) {
+/* Reads the block index of every open probe file: first the tail of each
+ * file in one batch, which holds the footer and, for all but the largest
+ * segments, the whole index; then any index that didn't fit, in another. */
+static int read_probe_indexes(IOContext *io, ProbeFile *files, int num_files) {
+	ReadRequest requests[num_files ? num_files : 1];
+	int file_of[num_files ? num_files : 1];
+	int num_requests = 0;
+	int error = 0;
 
-	FILE *seg_ptr_a;
-	FILE *seg_ptr_b;
-	FILE *new_fp;
+	for (int f = 0; f < num_files; f++) {
+		ProbeFile *file = files + f;
+		if (file->in_memory || file->size < (int64_t) sizeof(SegmentFooter))
+			continue;
 
-	// open files for segments of interest
-	if (!(seg_ptr_a = fopen(filename_a, "r"))) {
-		printf("Could not open up segment: %s", filename_a);
-		return -1;
+		int length = file->size < PROBE_TAIL_SIZE ? file->size : PROBE_TAIL_SIZE;
+		char *tail = (char*) malloc(length);
+		if (tail == NULL) {
+			printf("Failed to allocate memory for segment index.\n");
+			error = -1;
+			continue;
+		}
+		file_of[num_requests] = f;
+		requests[num_requests++] = (ReadRequest) { file->fd, file->size - length, length,
+				tail, 0 };
 	}
-	if (!(seg_ptr_b = fopen(filename_b, "r"))) {
-		printf("Could not open up segment: %s", filename_b);
-		return -1;
+	if (num_requests > 0 && submit_reads(io, requests, num_requests) != 0)
+		error = -1;
+
+	// requests are reused for the second batch, behind the ones already parsed
+	int num_remaining = 0;
+	for (int r = 0; r < num_requests; r++) {
+		ProbeFile *file = files + file_of[r];
+		ReadRequest tail = *(requests + r);
+		SegmentFooter footer;
+		memcpy(&footer, tail.buffer + tail.length - sizeof(SegmentFooter),
+				sizeof(SegmentFooter));
+
+		int64_t index_size = (int64_t) footer.num_blocks * sizeof(BlockHandle);
+		if (tail.result != tail.length || footer.magic != SEGMENT_MAGIC
+				|| footer.num_blocks == 0) {
+			free(tail.buffer);
+			continue;
+		}
+
+		file->handles = (BlockHandle*) malloc(index_size);
+		if (file->handles == NULL) {
+			printf("Failed to allocate memory for segment index.\n");
+			free(tail.buffer);
+			error = -1;
+			continue;
+		}
+		file->num_blocks = footer.num_blocks;
+		file->last_key = footer.last_key;
+
+		// copy the index out of the tail if it's all there; otherwise read it
+		if (footer.index_offset >= tail.offset) {
+			memcpy(file->handles, tail.buffer + (footer.index_offset - tail.offset),
+					index_size);
+		} else {
+			requests[num_remaining++] = (ReadRequest) { file->fd, footer.index_offset,
+					index_size, (char*) file->handles, 0 };
+		}
+		free(tail.buffer);
+	}
+
+	if (num_remaining > 0 && submit_reads(io, requests, num_remaining) != 0) {
+		printf("Could not read block index of segments.\n");
+		error = -1;
+		for (int f = 0; f < num_files; f++) {
+			for (int r = 0; r < num_remaining; r++) {
+				if ((char*) (files + f)->handles == (requests + r)->buffer
+						&& (requests + r)->result != (requests + r)->length) {
+					free((files + f)->handles);
+					(files + f)->handles = NULL;
+				}
+			}
+		}
 	}
-	if (!(new_fp = fopen(new_segment_name, "w"))) {
-		printf("Could not open up new segment: %s", new_segment_name);
+	return error;
+}
+
+/* Binary search for the last block starting at or before the key; -1 if
+ * the key is outside the segment's key range */
+static int find_block(BlockHandle *handles, int num_blocks, int last_key, int key) {
+	int low = 0, high = num_blocks - 1;
+	if (num_blocks == 0 || key < handles[0].first_key || key > last_key)
 		return -1;
+
+	while (low < high) {
+		int mid = (low + high + 1) / 2;
+		if (handles[mid].first_key <= key)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	return low;
+}
+
+static void close_probe_files(ProbeFile *files, int num_files) {
+	for (int f = 0; f < num_files; f++) {
+		if ((files + f)->fd >= 0)
+			close((files + f)->fd);
+		if (!(files + f)->in_memory)
+			free((files + f)->handles);
 	}
+}
 
-	// setup for merge loop
-	char line_a[line_size];
-	char line_b[line_size];
-	bool keep_merging = true;
-	bool incr_ptr_a = true, incr_ptr_b = true;
+/* Searches through the loaded block of a segment, if a visible version of
+ * key is in the block then return a copy of its value. The block's key
+ * array leads straight to the key's first (newest) line. */
+static char* do_search_segment(SegmentReader *reader, int key, long sequence,
+							   int line_size, long *found) {
+	char line[line_size];
+	Record record;
 
-	// run the merge loop
-	while (keep_merging) {
-		if (incr_ptr_a) {
-			memset(line_a, '\0', line_size);
-			readline_from_segment(line_a, line_size, seg_ptr_a, true);
-		}
-		if (incr_ptr_b) {
-			memset(line_b, '\0', line_size);
-			readline_from_segment(line_b, line_size, seg_ptr_b, true);
+	int first = key_lower_bound(reader->keys, reader->num_keys, key);
+	for (int i = first; i < reader->num_keys && reader->keys[i] == key; i++) {
+		reader->block_pos = reader->line_offsets[i];
+		if (segment_reader_next(reader, line, line_size) == NULL
+				|| parse_record(line, &record) != 0)
+			continue;
+		if (record.sequence <= sequence) {
+			*found = record.sequence;
+			return strdup(record.value);
 		}
+	}
+	return NULL;
+}
 
-		if (!strlen(line_a) && !strlen(line_b))
-			keep_merging = false;
+/* Used to perform one compaction step: merges the versions of every key in
+ * the subcompaction's range from all of its input segments into the output
+ * segment, keeping only the versions the retention policy asks for. This
+ * is necessary for cleaning up old segment files and keeping read I/O from
+ * getting out of control. An output that ends up with no keys is removed. */
+static int merge_range(Subcompaction *sub) {
+	int n = sub->num_segments;
+	int line_size = sub->line_size;
+	CompactionOutput *output = sub->output;
+	SegmentReader *readers[n];
+	SegmentWriter *writer = NULL;
+	VersionGroup group;
+	int opened = 0;
+	int error = -1;
 
-		else if (!strlen(line_a) || !strlen(line_b)) {
-			// add any remaining keys in remaining file to new file
-			FILE *temp_ptr = strlen(line_a) ? seg_ptr_a : seg_ptr_b;
-			char *temp_line = strlen(line_a) ? line_a : line_b;
+	// open files for segments of interest, each positioned at the range start
+	for (; opened < n; opened++) {
+		readers[opened] = open_segment_reader(*(sub->segment_files + opened),
+				sub->io->flags, sub->stats);
+		if (!readers[opened] || segment_reader_seek(readers[opened], output->low_key) != 0)
+			break;
+	}
+	output->empty = true;
+	if (opened == n)
+		writer = open_segment_writer(output->filename, sub->codec, sub->io, sub->stats);
+
+	// range tombstones are cut down to this output's range, and dropped once
+	// no snapshot could still see a version they delete
+	for (int i = 0; writer && i < sub->num_ranges; i++) {
+		RangeTombstone range = *(sub->ranges + i);
+		if (range.end_key < output->low_key || range.start_key > output->high_key
+				|| !range_tombstone_needed(&sub->retention, &range))
+			continue;
+		if (range.start_key < output->low_key)
+			range.start_key = output->low_key;
+		if (range.end_key > output->high_key)
+			range.end_key = output->high_key;
+		if (segment_writer_add_range(writer, &range) != 0) {
+			close_segment_writer(writer);
+			remove(output->filename);
+			writer = NULL;
+		}
+	}
+
+	// every segment takes part in compaction, so deletes can finally be dropped
+	if (writer && init_group(&group, line_size, true) == 0) {
+		group.ranges = sub->ranges;
+		group.num_ranges = sub->num_ranges;
+		char lines[n][line_size], scratch[n][line_size];
+		Record records[n];
+		bool have[n];
+		for (int i = 0; i < n; i++) {
 			do {
-				fputs(temp_line, new_fp);
-				fputs("\n", new_fp);
-			} while (fgets(temp_line, line_size, temp_ptr) != NULL);
+				have[i] = next_in_range(readers[i], lines[i], scratch[i], records + i,
+						line_size, output->high_key);
+			} while (have[i] && records[i].key < output->low_key);
+		}
 
-			keep_merging = false;
+		// run the merge loop, ordering by key and then newest version first
+		error = 0;
+		while (!error) {
+			int next = -1;
+			for (int i = 0; i < n; i++) {
+				if (have[i] && (next < 0 || records[i].key < records[next].key
+						|| (records[i].key == records[next].key
+								&& records[i].sequence > records[next].sequence)))
+					next = i;
+			}
+			if (next < 0)
+				break;
 
-		} else
-			merge_lines(line_a, line_b, new_fp, &incr_ptr_a, &incr_ptr_b,
-					line_size, tombstone);
+			error = group_add(&group, lines[next], records + next, writer, &sub->retention);
+			have[next] = next_in_range(readers[next], lines[next], scratch[next],
+					records + next, line_size, output->high_key);
+		}
+		if (!error)
+			error = flush_group(&group, writer, &sub->retention);
+		free_group(&group);
+	}
+
+	for (int i = 0; i < opened; i++)
+		close_segment_reader(readers[i]);
+	if (opened < n && readers[opened])
+		close_segment_reader(readers[opened]);
+
+	if (writer) {
+		output->empty = writer->num_blocks == 0 && writer->block_used == 0
+				&& writer->num_ranges == 0;
+		if (close_segment_writer(writer) != 0) {
+			printf("Failed to close one or more of the compacting files.\n");
+			error = -1;
+		}
+		if (error || output->empty) {
+			remove(output->filename);
+			output->empty = true;
+		}
 	}
-	// fclose() returns 0 if closing file is successful
-	if (fclose(new_fp) || fclose(seg_ptr_a) || fclose(seg_ptr_b)) {
-		printf("Failed to close one or more of the compacting files.\n");
+	return error;
+}
+
+/* Reads the next line of a segment into 'line', parsing a copy of it
+ * (in 'scratch') into record. Returns false at the end of the segment. */
+static bool next_record(SegmentReader *reader, char *line, char *scratch,
+						Record *record, int line_size) {
+	while (segment_reader_next(reader, line, line_size) != NULL) {
+		strcpy(scratch, line);
+		if (parse_record(scratch, record) == 0)
+			return true;
+		printf("Skipping malformed segment line: %s\n", line);
+	}
+	return false;
+}
+
+/* Like next_record, but false once the reader is past high_key too */
+static bool next_in_range(SegmentReader *reader, char *line, char *scratch,
+						  Record *record, int line_size, int high_key) {
+	return next_record(reader, line, scratch, record, line_size)
+			&& record->key <= high_key;
+}
+
+static int init_group(VersionGroup *group, int line_size, bool drop_tombstones) {
+	group->count = 0;
+	group->operands = 0;
+	group->capacity = 4;
+	group->line_size = line_size;
+	group->drop_tombstones = drop_tombstones;
+	group->ranges = NULL;
+	group->num_ranges = 0;
+	group->lines = (char*) malloc(group->capacity * line_size);
+	group->tombstones = (bool*) malloc(group->capacity * sizeof(bool));
+	group->needed = (bool*) malloc(group->capacity * sizeof(bool));
+	if (!group->lines || !group->tombstones || !group->needed) {
+		printf("Failed to allocate memory for merging versions.\n");
+		free_group(group);
 		return -1;
 	}
 	return 0;
 }
 
-/* Helper function for merging two files together by adding lines from either file a
- * or file b to the new file, then assigning values to determine whether the
- * calling function should increment a or b */
-static void merge_lines(char *line_a, char *line_b, FILE *new_fp,
-						bool *incr_a, bool *incr_b, int line_size, char *tombstone) {
+static void free_group(VersionGroup *group) {
+	free(group->lines);
+	free(group->tombstones);
+	free(group->needed);
+}
 
-	//  need to make copy of lines because strtok() alters char array
-	char line_a_copy[line_size], line_b_copy[line_size];
-	strcpy(line_a_copy, line_a);
-	strcpy(line_b_copy, line_b);
+/* Adds the next version (in key order, newest first) to the group, writing
+ * out the previous key's versions once a new key starts. A range tombstone
+ * covering a version counts as a newer version of its key. Merge operands
+ * above a kept operand are kept too, and once the version beneath them
+ * arrives (a value, a delete, or a range tombstone between them and it) they
+ * are folded over it. A value that has expired is kept, if at all, as a
+ * delete. Versions that are not retained, and the values of expired ones,
+ * are reported to the retention policy's discard hook. */
+static int group_add(VersionGroup *group, char *line, Record *record,
+					 SegmentWriter *writer, Retention *retention) {
+	if (group->count > 0 && record->key != group->key) {
+		if (flush_group(group, writer, retention) != 0)
+			return -1;
+	}
+	if (group->count == 0 || record->key != group->key) {
+		group->key = record->key;
+		group->newer_sequence = LATEST_SEQUENCE;
+		group->operands = 0;
+	}
 
-	int key_a = atoi(strtok(line_a_copy, ","));
-	char *value_a = strtok(NULL, ",");
+	long newer_sequence = next_range_delete(group, record->key, record->sequence);
+	if (group->operands > 0 && newer_sequence < group->newer_sequence)
+		fold_operands(group, NULL, retention);
+	if (group->newer_sequence < newer_sequence)
+		newer_sequence = group->newer_sequence;
+	bool needed = version_needed(retention, record->sequence, newer_sequence);
+	group->newer_sequence = record->sequence;
 
-	int key_b = atoi(strtok(line_b_copy, ","));
-	char *value_b = strtok(NULL, ",");
+	// operands that can't be folded keep the version beneath them
+	bool operand = is_operand(retention, record->value);
+	bool expired = value_expired(retention, record->value);
+	bool deleted = expired || strcmp(record->value, retention->tombstone) == 0;
+	bool kept = needed;
+	if (group->operands > 0 && !operand) {
+		if (!fold_operands(group, deleted ? NULL : record->value, retention))
+			needed = kept = true;
+	} else if (group->operands > 0) {
+		kept = true;
+	}
+	if (!kept || expired) {
+		if (retention->on_discard)
+			retention->on_discard(retention->discard_arg, record->value);
+		if (!kept)
+			return 0;
+	}
 
-	if (key_a == key_b) {
-		if (strcmp(value_b, tombstone) != 0) {
-			fputs(line_b, new_fp);
-			fputs("\n", new_fp);
+	if (group->count == group->capacity) {
+		int capacity = group->capacity * 2;
+		char *lines = (char*) realloc(group->lines, capacity * group->line_size);
+		if (lines == NULL) {
+			printf("Failed to grow version buffer.\n");
+			return -1;
 		}
-		*incr_a = true;
-		*incr_b = true;
-	} else if (key_a > key_b) {
-		if ((strcmp(value_b, tombstone) != 0)) {
-			fputs(line_b, new_fp);
-			fputs("\n", new_fp);
+		group->lines = lines;
+
+		bool *tombstones = (bool*) realloc(group->tombstones, capacity * sizeof(bool));
+		if (tombstones == NULL) {
+			printf("Failed to grow version buffer.\n");
+			return -1;
 		}
-		*incr_a = false;
-		*incr_b = true;
-	} else {  // key_a < key_b
-		if (strcmp(value_a, tombstone) != 0) {
-			fputs(line_a, new_fp);
-			fputs("\n", new_fp);
+		group->tombstones = tombstones;
+
+		bool *needed_lines = (bool*) realloc(group->needed, capacity * sizeof(bool));
+		if (needed_lines == NULL) {
+			printf("Failed to grow version buffer.\n");
+			return -1;
 		}
-		*incr_a = true;
-		*incr_b = false;
+		group->needed = needed_lines;
+		group->capacity = capacity;
+	}
+
+	// an expired value still hides older versions, but only as a delete
+	char *slot = group->lines + group->count * group->line_size;
+	if (expired) {
+		snprintf(slot, group->line_size, "%d,%ld,%s", record->key, record->sequence,
+				retention->tombstone);
+	} else {
+		strncpy(slot, line, group->line_size - 1);
+		slot[group->line_size - 1] = '\0';
+	}
+	group->tombstones[group->count] = deleted;
+	group->needed[group->count] = needed;
+	group->count++;
+	group->operands += operand;
+	return 0;
+}
+
+/* Writes out the retained versions of the current key. When tombstones may be
+ * dropped, every version of the key is at hand, so operands with nothing
+ * beneath them are folded over no value, and deletes with nothing older left
+ * beneath them go. */
+static int flush_group(VersionGroup *group, SegmentWriter *writer, Retention *retention) {
+	if (group->drop_tombstones && group->operands > 0)
+		fold_operands(group, NULL, retention);
+	group->operands = 0;
+
+	if (group->drop_tombstones) {
+		while (group->count > 0 && group->tombstones[group->count - 1])
+			group->count--;
+	}
+
+	for (int i = 0; i < group->count; i++) {
+		if (segment_writer_add(writer, group->lines + i * group->line_size) != 0)
+			return -1;
+		writer->num_tombstones += group->tombstones[i];
 	}
+	group->count = 0;
+	return 0;
+}
+
+static bool is_operand(Retention *retention, char *value) {
+	return retention->merge_prefix
+			&& strncmp(value, retention->merge_prefix, strlen(retention->merge_prefix)) == 0;
 }
 
+static bool value_expired(Retention *retention, char *value) {
+	long expires = value_expiry(value);
+	return expires && expires <= retention->now;
+}
+
+/* Folds the group's trailing merge operands, oldest first, over base (the
+ * value beneath them, or NULL if there is none), rewriting each operand as
+ * the full value it reads as at its own sequence. Those retention doesn't
+ * need on their own are then dropped. Returns false, leaving the operands
+ * as they are, if the merge hook declines one of them or a result doesn't
+ * fit on a line. */
+static bool fold_operands(VersionGroup *group, char *base, Retention *retention) {
+	int first = group->count - group->operands;
+	int count = group->operands;
+	group->operands = 0;
+	if (!retention->merge)
+		return false;
+
+	char **results = (char**) calloc(count, sizeof(char*));
+	if (results == NULL) {
+		printf("Failed to allocate memory for merge results.\n");
+		return false;
+	}
+
+	// each operand folds into the result of the one before it
+	char scratch[group->line_size];
+	Record record;
+	int prefix = strlen(retention->merge_prefix);
+	char *value = base;
+	bool folded = true;
+	for (int i = count - 1; i >= 0 && folded; i--) {
+		strcpy(scratch, group->lines + (first + i) * group->line_size);
+		folded = parse_record(scratch, &record) == 0;
+		results[i] = folded ? retention->merge(retention->merge_arg, group->key, value,
+				record.value + prefix) : NULL;
+		value = results[i];
+		folded = value && snprintf(NULL, 0, "%d,%ld,%s", group->key, record.sequence,
+				value) < group->line_size;
+	}
+
+	// rewrite the operands in place, then close the gaps left by dropped ones
+	int kept = first;
+	for (int i = 0; i < count && folded; i++) {
+		char *slot = group->lines + (first + i) * group->line_size;
+		strcpy(scratch, slot);
+		parse_record(scratch, &record);
+		if (!group->needed[first + i])
+			continue;
+		snprintf(group->lines + kept * group->line_size, group->line_size, "%d,%ld,%s",
+				group->key, record.sequence, results[i]);
+		group->tombstones[kept] = false;
+		group->needed[kept++] = true;
+	}
+	if (folded)
+		group->count = kept;
+
+	for (int i = 0; i < count; i++)
+		free(results[i]);
+	free(results);
+	return folded;
+}
+
+/* The oldest range delete of key newer than sequence, or LATEST_SEQUENCE */
+static long next_range_delete(VersionGroup *group, int key, long sequence) {
+	long next = LATEST_SEQUENCE;
+	for (int i = 0; i < group->num_ranges; i++) {
+		RangeTombstone *range = group->ranges + i;
+		if (range->start_key <= key && key <= range->end_key
+				&& range->sequence > sequence && range->sequence < next)
+			next = range->sequence;
+	}
+	return next;
+}
+
+/* A range tombstone is needed while some live snapshot is older than it:
+ * that snapshot may still keep a version it deletes, which reads as of now
+ * must not see. */
+bool range_tombstone_needed(Retention *retention, RangeTombstone *range) {
+	for (int i = 0; i < retention->num_snapshots; i++) {
+		if (retention->snapshots[i] < range->sequence)
+			return true;
+	}
+	return false;
+}
+
+/* A version must be kept if it is the newest one, or if some live snapshot
+ * falls between it and the next newer version (so that snapshot reads it). */
+static bool version_needed(Retention *retention, long sequence, long newer_sequence) {
+	if (newer_sequence == LATEST_SEQUENCE)
+		return true;
+
+	for (int i = 0; i < retention->num_snapshots; i++) {
+		long snapshot = retention->snapshots[i];
+		if (sequence <= snapshot && snapshot < newer_sequence)
+			return true;
+	}
+	return false;
+}
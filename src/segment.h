@@ -2,26 +2,263 @@
 #define CUSTOM_IO_H
 
 #include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <stdatomic.h>
 
 #include "memtable.h"
+#include "async_io.h"
+#include "buffered_io.h"
 
-char** init_segment_list(int num_segments);
+#define BLOCK_SIZE 4096              // target uncompressed size of a segment block
+#define SEGMENT_MAGIC 0x4C534D36     // marks the footer of a segment file ("LSM6")
+#define MIN_SAVINGS_PCT 12           // store a block raw unless codec saves this much
+#define KEY_DIGITS 11                // widest printed int key, including sign
+#define SEQUENCE_DIGITS 20           // widest printed sequence number
+#define LATEST_SEQUENCE LONG_MAX     // reads at this sequence see every write
+#define PROBE_TAIL_SIZE 4096         // bytes read off a segment's end for its index
+#define SUBCOMPACTION_MIN_BLOCKS 16  // split compaction only if each range gets this many blocks
+#define EXPIRY_PREFIX "*~"           // marks a value with a TTL: "*~<expiry time>:<value>"
 
-void free_segment_list(char **segments, int num_segments);
+/* Segment files are a run of blocks, each holding "key,sequence,value\n" lines
+ * and optionally compressed, followed by a bloom filter of the segment's
+ * keys, the segment's range tombstones and block index (8-byte aligned, the
+ * tombstones ending where the index starts) and a fixed footer:
+ *
+ *   [header|block 0] ... [header|block n-1] [filter] [ranges] [handle 0] ...
+ *   [handle n-1] [footer]
+ *
+ * After its text_size bytes of lines (padded to 4 bytes), a block stores the
+ * key of every line as an int32 array, then every line's starting offset, so
+ * a search finds its line without parsing the ones before it. */
+typedef struct block_header {
+	uint32_t raw_size;
+	uint32_t stored_size;
+	uint32_t codec;
+	uint32_t text_size;
+} BlockHeader;
+
+typedef struct block_handle {
+	int64_t offset;
+	int32_t first_key;
+	int32_t stored_size;
+} BlockHandle;
+
+typedef struct segment_footer {
+	int64_t index_offset;
+	int64_t filter_offset;
+	int32_t num_blocks;
+	int32_t last_key;
+	int32_t filter_size;
+	int32_t num_ranges;
+	int32_t num_lines;
+	int32_t num_tombstones;          // lines that delete their key
+	uint32_t expires;                // every version has expired by then; 0 if some never do
+	uint32_t magic;
+} SegmentFooter;
+
+/* where a live segment's fences live: copied to the heap, or mapped from
+ * the segment file (so the page cache holds them, and they can exceed RAM) */
+enum fence_storage {
+	FENCES_HEAP, FENCES_MMAP
+};
+
+/* what a segment keeps in memory so lookups can be routed without reading
+ * it: its key range, its bloom filter, its fence pointers (the block index,
+ * giving the first key and location of every block) and its range
+ * tombstones. The key range only covers the keys stored in blocks. expires
+ * is the time by which every version in it has expired, or 0. The line
+ * counts tell how much of the segment is deletes. The whole file may also
+ * be mapped, so values in raw blocks can be read in place. */
+typedef struct segment_fences {
+	int low_key;
+	int high_key;
+	long expires;
+	BlockHandle *handles;
+	int num_blocks;
+	uint8_t *filter;
+	int filter_size;
+	RangeTombstone *ranges;
+	int num_ranges;
+	int num_lines;
+	int num_tombstones;
+	void *mapping;
+	long mapping_size;
+	char *data;                      // the whole file, if mapped for in-place reads
+	long data_size;
+} SegmentFences;
+
+/* running totals of block compression, reported with system status; updated
+ * by concurrent readers, hence atomic */
+typedef struct segment_stats {
+	atomic_long raw_bytes;
+	atomic_long stored_bytes;
+	atomic_long blocks_compressed;
+	atomic_long blocks_uncompressed;
+	atomic_long blocks_decoded;
+	atomic_long decode_ns;
+} SegmentStats;
+
+/* one version of a key, as stored on a segment line; lines are ordered by
+ * key, then newest (highest sequence) version first */
+typedef struct segment_record {
+	int key;
+	long sequence;
+	char *value;
+} Record;
+
+/* called with each value that compaction drops (overwritten or deleted) */
+typedef void (*discard_hook)(void *arg, char *value);
+
+/* folds a merge operand into the value before it (NULL for none); returns
+ * the result, or NULL to leave the operands as they are */
+typedef char* (*merge_hook)(void *arg, int key, char *existing, char *operand);
+
+/* decides which versions survive a flush or compaction: the newest version
+ * of every key, plus the newest version visible to each live snapshot.
+ * Values that have expired by now count as deletes. Values starting with
+ * merge_prefix are merge operands; those are folded into full values once
+ * the version beneath them is in hand. */
+typedef struct retention_policy {
+	long *snapshots;
+	int num_snapshots;
+	long now;
+	char *tombstone;
+	discard_hook on_discard;
+	void *discard_arg;
+	char *merge_prefix;
+	merge_hook merge;
+	void *merge_arg;
+} Retention;
+
+/* one output of a compaction: a segment holding the surviving versions of
+ * every key in [low_key, high_key]; empty if none survived (and no file is
+ * left behind) */
+typedef struct compaction_output {
+	char *filename;
+	int low_key;
+	int high_key;
+	bool empty;
+} CompactionOutput;
+
+/* a point lookup of one key in one segment, resolved by probe_segments();
+ * the segment's block index is read from disk unless fences are given.
+ * found is the sequence of the version whose value was returned. */
+typedef struct segment_probe {
+	char *filename;
+	int key;
+	long sequence;
+	char *value;
+	SegmentFences *fences;
+	long found;
+} SegmentProbe;
+
+typedef struct segment_writer {
+	OutputFile *out;
+	int codec;
+	char *block;
+	int block_used;
+	int block_capacity;
+	char *scratch;
+	int scratch_capacity;
+	int32_t *keys;
+	uint32_t *line_offsets;
+	int num_lines;
+	int lines_capacity;
+	uint64_t *key_hashes;
+	int num_hashes;
+	int hashes_capacity;
+	int first_key;
+	int last_key;
+	int64_t offset;
+	BlockHandle *handles;
+	int num_blocks;
+	int handles_capacity;
+	RangeTombstone *ranges;
+	int num_ranges;
+	int ranges_capacity;
+	long expires;
+	bool never_expires;
+	int total_lines;
+	int num_tombstones;
+	SegmentStats *stats;
+} SegmentWriter;
+
+typedef struct segment_reader {
+	InputFile *in;
+	int64_t data_end;
+	int64_t index_offset;
+	int num_blocks;
+	int num_ranges;
+	int64_t next_offset;
+	char *block;
+	int block_size;
+	int block_capacity;
+	int block_pos;
+	int32_t *keys;
+	uint32_t *line_offsets;
+	int num_keys;
+	SegmentStats *stats;
+} SegmentReader;
 
 int serialize_memtable(Memtable *memtable, char *filename);
 
-int compact_segments(char **segment_files, int num_segments,
-		char *new_segment_name, int line_size, char *tombstone);
+int compact_segments(char **segment_files, int num_segments, CompactionOutput *outputs,
+		int max_outputs, int line_size, int codec, IOOptions *io, SegmentStats *stats,
+		Retention *retention);
+
+char* search_segment(char *filename, SegmentFences *fences, int key, long sequence,
+		int line_size, SegmentStats *stats, long *found);
 
-char* search_segment(char *filename, int key, int line_size);
+int probe_segments(IOContext *io, SegmentProbe *probes, int count, int line_size,
+		SegmentStats *stats);
+
+int search_mapped_segment(SegmentFences *fences, int key, long sequence, char **value,
+		int *length, long *found);
 
 MNode* deserialize_preorder(FILE *fp, int buffer_size);
 
-int memtable_to_segment(Memtable *memtable, char *filename);
+int memtable_to_segment(Memtable *memtable, char *filename, int line_size, int codec,
+		IOOptions *io, SegmentStats *stats, Retention *retention);
+
+int parse_record(char *line, Record *record);
+
+long value_expiry(char *value);
+
+char* value_payload(char *value);
+
+SegmentWriter* open_segment_writer(char *filename, int codec, IOOptions *io,
+		SegmentStats *stats);
+
+int segment_writer_add(SegmentWriter *writer, char *line);
+
+int segment_writer_add_range(SegmentWriter *writer, RangeTombstone *range);
+
+int close_segment_writer(SegmentWriter *writer);
+
+SegmentReader* open_segment_reader(char *filename, int io_flags, SegmentStats *stats);
+
+int segment_reader_seek(SegmentReader *reader, int key);
+
+char* segment_reader_next(SegmentReader *reader, char *line, int line_size);
+
+RangeTombstone* segment_reader_ranges(SegmentReader *reader);
+
+void close_segment_reader(SegmentReader *reader);
+
+SegmentFences* load_segment_fences(char *filename, int storage, bool map_data);
+
+bool fences_may_contain(SegmentFences *fences, int key);
+
+long segment_fences_memory(SegmentFences *fences);
+
+void free_segment_fences(SegmentFences *fences);
+
+bool range_tombstone_needed(Retention *retention, RangeTombstone *range);
 
-char* readline_from_segment(char *line, int buf_size, FILE *fp,
-		bool rm_newline);
+int discard_segment_values(char *filename, int line_size, Retention *retention,
+		SegmentStats *stats);
 
 int delete_segment(char *filename);
 
@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "shard.h"
+#include "lsm_tree.h"
+#include "thread_pool.h"
+
+/* work handed to the thread pool for one shard */
+typedef struct shard_job {
+	ShardedLSM *sharded;
+	int shard;
+	Submission *batch;
+	int *positions;
+	int count;
+	int start_key;
+	int end_key;
+	ScanIterator *scan;
+	int error;
+} ShardJob;
+
+// prototypes for static functions
+static void apply_batch(void *arg);
+static void scan_shard(void *arg);
+
+
+/* Opens num_shards LSM trees under directory (ending in '/'), in
+ * subdirectories shard_0/, shard_1/, ..., plus a pool of num_threads
+ * workers for fanning work out to them. Every shard is opened with options
+ * (the defaults if NULL). */
+ShardedLSM* init_sharded_lsm(char *directory, int num_shards, int num_threads,
+		LSM_Options *options) {
+	if (num_shards < 1 || num_shards > MAX_SHARDS) {
+		printf("Number of shards must be between 1 and %d.\n", MAX_SHARDS);
+		return NULL;
+	}
+	if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+		printf("Could not create directory for shards: %s\n", directory);
+		return NULL;
+	}
+
+	ShardedLSM *sharded = (ShardedLSM*) malloc(sizeof(ShardedLSM));
+	if (sharded == NULL) {
+		printf("Allocation of memory for sharded LSM Tree failed.\n");
+		return NULL;
+	}
+
+	sharded->shards = (LSM_Tree**) calloc(num_shards, sizeof(LSM_Tree*));
+	sharded->write_locks = (pthread_mutex_t*) malloc(num_shards * sizeof(pthread_mutex_t));
+	sharded->num_shards = 0;
+	sharded->pool = NULL;
+	if (!sharded->shards || !sharded->write_locks) {
+		printf("Allocation of memory for shards failed.\n");
+		shutdown_sharded_lsm(sharded);
+		return NULL;
+	}
+
+	char shard_directory[FILENAME_SIZE];
+	for (int i = 0; i < num_shards; i++) {
+		snprintf(shard_directory, FILENAME_SIZE, SHARD_DIRECTORY, directory, i);
+		*(sharded->shards + i) = init_lsm_tree(shard_directory, options);
+		if (*(sharded->shards + i) == NULL) {
+			printf("Failed to open shard %d.\n", i);
+			shutdown_sharded_lsm(sharded);
+			return NULL;
+		}
+		pthread_mutex_init(sharded->write_locks + i, NULL);
+		sharded->num_shards++;
+	}
+
+	sharded->pool = init_thread_pool(num_threads);
+	if (sharded->pool == NULL) {
+		shutdown_sharded_lsm(sharded);
+		return NULL;
+	}
+	return sharded;
+}
+
+/* Picks the shard owning a key. Fibonacci hashing spreads runs of
+ * neighbouring keys across all the shards. */
+int shard_for_key(ShardedLSM *sharded, int key) {
+	uint32_t hashed = (uint32_t) key * 2654435769u;
+	return (int) (((uint64_t) hashed * sharded->num_shards) >> 32);
+}
+
+/* Routes a submission to the shard that owns its key, or a range delete to
+ * every shard (hashing scatters a range over all of them); safe to call from
+ * any thread. Returns 0 if all succeeds, otherwise -1. */
+int sharded_submit(ShardedLSM *sharded, Submission *submission) {
+	if (submission->action == DELETE_RANGE) {
+		int error = 0;
+		for (int s = 0; s < sharded->num_shards; s++) {
+			pthread_mutex_lock(sharded->write_locks + s);
+			error |= handle_submission(*(sharded->shards + s), submission);
+			pthread_mutex_unlock(sharded->write_locks + s);
+		}
+		return error ? -1 : 0;
+	}
+
+	int shard = shard_for_key(sharded, submission->key);
+
+	pthread_mutex_lock(sharded->write_locks + shard);
+	int error = handle_submission(*(sharded->shards + shard), submission);
+	pthread_mutex_unlock(sharded->write_locks + shard);
+	return error;
+}
+
+/* Applies a batch of submissions, each shard's share on its own worker; range
+ * deletes are part of every shard's share. Submissions to the same shard are
+ * applied in batch order; there is no ordering between shards. Returns 0 if
+ * every submission succeeded. */
+int sharded_write_batch(ShardedLSM *sharded, Submission *batch, int count) {
+	int num_ranges = 0;
+	for (int i = 0; i < count; i++)
+		num_ranges += (batch + i)->action == DELETE_RANGE;
+	int num_positions = count + num_ranges * (sharded->num_shards - 1);
+	int *positions = (int*) malloc((num_positions ? num_positions : 1) * sizeof(int));
+	ShardJob *jobs = (ShardJob*) calloc(sharded->num_shards, sizeof(ShardJob));
+	if (!positions || !jobs) {
+		printf("Failed to allocate memory for write batch.\n");
+		free(positions);
+		free(jobs);
+		return -1;
+	}
+
+	// group the batch by shard: count each shard's share, then lay them out
+	int shard_of[count ? count : 1];
+	for (int i = 0; i < count; i++) {
+		shard_of[i] = (batch + i)->action == DELETE_RANGE ? -1
+				: shard_for_key(sharded, (batch + i)->key);
+		for (int s = 0; s < sharded->num_shards; s++)
+			(jobs + s)->count += shard_of[i] == -1 || shard_of[i] == s;
+	}
+	int offset = 0;
+	for (int s = 0; s < sharded->num_shards; s++) {
+		(jobs + s)->positions = positions + offset;
+		offset += (jobs + s)->count;
+		(jobs + s)->count = 0;
+	}
+	for (int i = 0; i < count; i++) {
+		for (int s = 0; s < sharded->num_shards; s++) {
+			ShardJob *job = jobs + s;
+			if (shard_of[i] == -1 || shard_of[i] == s)
+				*(job->positions + job->count++) = i;
+		}
+	}
+
+	TaskGroup group;
+	init_task_group(&group);
+	for (int s = 0; s < sharded->num_shards; s++) {
+		ShardJob *job = jobs + s;
+		job->sharded = sharded;
+		job->shard = s;
+		job->batch = batch;
+		if (job->count > 0 && thread_pool_submit(sharded->pool, &group, apply_batch, job) != 0)
+			job->error = -1;
+	}
+	task_group_wait(&group);
+	destroy_task_group(&group);
+
+	int error = 0;
+	for (int s = 0; s < sharded->num_shards; s++)
+		error |= (jobs + s)->error;
+
+	free(positions);
+	free(jobs);
+	return error ? -1 : 0;
+}
+
+/* Reads the latest value of a key from the shard that owns it; returns a
+ * copy the caller must free, or NULL if the key has no value. */
+char* sharded_get(ShardedLSM *sharded, int key) {
+	return lsm_tree_get(*(sharded->shards + shard_for_key(sharded, key)), key, NULL);
+}
+
+/* Checkpoints every shard into directory (ending in '/'), each into its own
+ * shard_<n>/, so init_sharded_lsm() with as many shards opens the copy.
+ * Writes to all shards are held back until every shard is done, so the
+ * checkpoint is of one moment across them. Returns 0 on success, -1 on
+ * failure. */
+int sharded_checkpoint(ShardedLSM *sharded, char *directory) {
+	if (mkdir(directory, 0755) != 0) {
+		printf("Could not create checkpoint directory: %s\n", directory);
+		return -1;
+	}
+
+	for (int s = 0; s < sharded->num_shards; s++)
+		pthread_mutex_lock(sharded->write_locks + s);
+	int error = 0;
+	char shard_directory[FILENAME_SIZE];
+	for (int s = 0; s < sharded->num_shards && !error; s++) {
+		snprintf(shard_directory, FILENAME_SIZE, SHARD_DIRECTORY, directory, s);
+		error = lsm_tree_checkpoint(*(sharded->shards + s), shard_directory);
+	}
+	for (int s = 0; s < sharded->num_shards; s++)
+		pthread_mutex_unlock(sharded->write_locks + s);
+	return error ? -1 : 0;
+}
+
+/* Calls visit for every key in [start_key, end_key] that has a value, in key
+ * order across all shards; stops early if visit returns non-zero. Each shard
+ * is scanned (on the pool) as of one point in time, but the shards are not
+ * synchronized with each other. Returns -1 if a shard could not be scanned. */
+int sharded_scan(ShardedLSM *sharded, int start_key, int end_key, scan_visitor visit,
+		void *arg) {
+	ShardJob jobs[sharded->num_shards];
+	TaskGroup group;
+	init_task_group(&group);
+
+	for (int s = 0; s < sharded->num_shards; s++) {
+		jobs[s].sharded = sharded;
+		jobs[s].shard = s;
+		jobs[s].start_key = start_key;
+		jobs[s].end_key = end_key;
+		jobs[s].scan = NULL;
+		jobs[s].error = 0;
+		if (thread_pool_submit(sharded->pool, &group, scan_shard, jobs + s) != 0)
+			jobs[s].error = -1;
+	}
+	task_group_wait(&group);
+	destroy_task_group(&group);
+
+	int error = 0;
+	for (int s = 0; s < sharded->num_shards; s++)
+		error |= jobs[s].error;
+
+	// k-way merge of the per-shard iterators; each key lives in only one shard
+	KeyValue *heads[sharded->num_shards];
+	for (int s = 0; s < sharded->num_shards; s++)
+		heads[s] = jobs[s].scan ? scan_iterator_next(jobs[s].scan) : NULL;
+
+	while (!error) {
+		int smallest = -1;
+		for (int s = 0; s < sharded->num_shards; s++) {
+			if (heads[s] && (smallest < 0 || heads[s]->key < heads[smallest]->key))
+				smallest = s;
+		}
+		if (smallest < 0 || visit(arg, heads[smallest]->key, heads[smallest]->value) != 0)
+			break;
+		heads[smallest] = scan_iterator_next(jobs[smallest].scan);
+	}
+
+	for (int s = 0; s < sharded->num_shards; s++) {
+		if (jobs[s].scan)
+			close_scan_iterator(jobs[s].scan);
+	}
+	return error ? -1 : 0;
+}
+
+/* Stops the thread pool, then shuts down every shard */
+void shutdown_sharded_lsm(ShardedLSM *sharded) {
+	if (sharded->pool)
+		shutdown_thread_pool(sharded->pool);
+
+	for (int i = 0; i < sharded->num_shards; i++) {
+		shutdown_lsm_system(*(sharded->shards + i));
+		pthread_mutex_destroy(sharded->write_locks + i);
+	}
+	free(sharded->shards);
+	free(sharded->write_locks);
+	free(sharded);
+}
+
+/* Thread pool task: applies one shard's share of a write batch */
+static void apply_batch(void *arg) {
+	ShardJob *job = (ShardJob*) arg;
+	LSM_Tree *shard = *(job->sharded->shards + job->shard);
+	pthread_mutex_t *write_lock = job->sharded->write_locks + job->shard;
+
+	pthread_mutex_lock(write_lock);
+	for (int i = 0; i < job->count; i++) {
+		if (handle_submission(shard, job->batch + *(job->positions + i)) != 0)
+			job->error = -1;
+	}
+	pthread_mutex_unlock(write_lock);
+}
+
+/* Thread pool task: collects one shard's part of a scan */
+static void scan_shard(void *arg) {
+	ShardJob *job = (ShardJob*) arg;
+	job->scan = lsm_tree_scan(*(job->sharded->shards + job->shard), job->start_key,
+			job->end_key, NULL);
+	if (job->scan == NULL)
+		job->error = -1;
+}
@@ -0,0 +1,44 @@
+#ifndef CUSTOM_SHARD_H
+#define CUSTOM_SHARD_H
+
+#include <pthread.h>
+
+#include "lsm_tree.h"
+#include "thread_pool.h"
+
+#define MAX_SHARDS 64                 // upper bound on LSM trees behind one front end
+#define SHARD_DIRECTORY "%sshard_%d/"   // where each shard keeps its files
+
+typedef int (*scan_visitor)(void *arg, int key, char *value);
+
+/* Hash-partitions keys across independent LSM trees, each with its own WAL,
+ * memtable, segments and compaction, so writes to different shards run on
+ * different cores. Any thread may write; each shard still has one writer at
+ * a time, serialized by its write lock. Scans and batches fan out to the
+ * shards on a shared thread pool. */
+typedef struct sharded_lsm_tree {
+	LSM_Tree **shards;
+	pthread_mutex_t *write_locks;
+	int num_shards;
+	ThreadPool *pool;
+} ShardedLSM;
+
+ShardedLSM* init_sharded_lsm(char *directory, int num_shards, int num_threads,
+		LSM_Options *options);
+
+int shard_for_key(ShardedLSM *sharded, int key);
+
+int sharded_submit(ShardedLSM *sharded, Submission *submission);
+
+int sharded_write_batch(ShardedLSM *sharded, Submission *batch, int count);
+
+char* sharded_get(ShardedLSM *sharded, int key);
+
+int sharded_checkpoint(ShardedLSM *sharded, char *directory);
+
+int sharded_scan(ShardedLSM *sharded, int start_key, int end_key, scan_visitor visit,
+		void *arg);
+
+void shutdown_sharded_lsm(ShardedLSM *sharded);
+
+#endif
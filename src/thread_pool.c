@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "thread_pool.h"
+
+// prototypes for static functions
+static void* worker(void *arg);
+static void task_done(TaskGroup *group);
+
+
+/* Starts a pool of num_threads workers */
+ThreadPool* init_thread_pool(int num_threads) {
+	ThreadPool *pool = (ThreadPool*) malloc(sizeof(ThreadPool));
+	if (pool == NULL) {
+		printf("Allocation of memory for thread pool failed.\n");
+		return NULL;
+	}
+
+	pool->threads = (pthread_t*) malloc(num_threads * sizeof(pthread_t));
+	if (pool->threads == NULL) {
+		printf("Allocation of memory for thread pool workers failed.\n");
+		free(pool);
+		return NULL;
+	}
+
+	pool->num_threads = 0;
+	pool->head = NULL;
+	pool->tail = NULL;
+	pool->stopping = false;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->has_work, NULL);
+
+	for (int i = 0; i < num_threads; i++) {
+		if (pthread_create(pool->threads + i, NULL, worker, pool) != 0) {
+			printf("Failed to start thread pool worker.\n");
+			shutdown_thread_pool(pool);
+			return NULL;
+		}
+		pool->num_threads++;
+	}
+	return pool;
+}
+
+/* Queues run(arg) to be run by a worker; if group is not NULL, the task
+ * counts towards it until it finishes. Returns 0 on success, -1 on failure. */
+int thread_pool_submit(ThreadPool *pool, TaskGroup *group, task_function run, void *arg) {
+	Task *task = (Task*) malloc(sizeof(Task));
+	if (task == NULL) {
+		printf("Failed to allocate memory for task.\n");
+		return -1;
+	}
+	task->run = run;
+	task->arg = arg;
+	task->group = group;
+	task->next = NULL;
+
+	if (group) {
+		pthread_mutex_lock(&group->lock);
+		group->pending++;
+		pthread_mutex_unlock(&group->lock);
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail)
+		pool->tail->next = task;
+	else
+		pool->head = task;
+	pool->tail = task;
+	pthread_cond_signal(&pool->has_work);
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+void init_task_group(TaskGroup *group) {
+	group->pending = 0;
+	pthread_mutex_init(&group->lock, NULL);
+	pthread_cond_init(&group->done, NULL);
+}
+
+/* Blocks until every task submitted with this group has finished */
+void task_group_wait(TaskGroup *group) {
+	pthread_mutex_lock(&group->lock);
+	while (group->pending > 0)
+		pthread_cond_wait(&group->done, &group->lock);
+	pthread_mutex_unlock(&group->lock);
+}
+
+void destroy_task_group(TaskGroup *group) {
+	pthread_mutex_destroy(&group->lock);
+	pthread_cond_destroy(&group->done);
+}
+
+/* Lets the workers finish every queued task, then stops them and frees
+ * the pool */
+void shutdown_thread_pool(ThreadPool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = true;
+	pthread_cond_broadcast(&pool->has_work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 0; i < pool->num_threads; i++)
+		pthread_join(*(pool->threads + i), NULL);
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->has_work);
+	free(pool->threads);
+	free(pool);
+}
+
+static void* worker(void *arg) {
+	ThreadPool *pool = (ThreadPool*) arg;
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->head && !pool->stopping)
+			pthread_cond_wait(&pool->has_work, &pool->lock);
+
+		Task *task = pool->head;
+		if (!task) {
+			// stopping, and the queue has drained
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+		pool->head = task->next;
+		if (!pool->head)
+			pool->tail = NULL;
+		pthread_mutex_unlock(&pool->lock);
+
+		task->run(task->arg);
+		if (task->group)
+			task_done(task->group);
+		free(task);
+	}
+}
+
+static void task_done(TaskGroup *group) {
+	pthread_mutex_lock(&group->lock);
+	if (--group->pending == 0)
+		pthread_cond_broadcast(&group->done);
+	pthread_mutex_unlock(&group->lock);
+}
@@ -0,0 +1,46 @@
+#ifndef CUSTOM_THREAD_POOL_H
+#define CUSTOM_THREAD_POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+typedef void (*task_function)(void *arg);
+
+/* a set of tasks whose completion can be waited on together */
+typedef struct task_group {
+	int pending;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+} TaskGroup;
+
+typedef struct task {
+	task_function run;
+	void *arg;
+	TaskGroup *group;
+	struct task *next;
+} Task;
+
+/* A fixed set of worker threads taking tasks off a shared FIFO queue */
+typedef struct thread_pool {
+	pthread_t *threads;
+	int num_threads;
+	Task *head;
+	Task *tail;
+	bool stopping;
+	pthread_mutex_t lock;
+	pthread_cond_t has_work;
+} ThreadPool;
+
+ThreadPool* init_thread_pool(int num_threads);
+
+int thread_pool_submit(ThreadPool *pool, TaskGroup *group, task_function run, void *arg);
+
+void init_task_group(TaskGroup *group);
+
+void task_group_wait(TaskGroup *group);
+
+void destroy_task_group(TaskGroup *group);
+
+void shutdown_thread_pool(ThreadPool *pool);
+
+#endif
@@ -1,10 +1,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <stdbool.h>
 #include "lsm_tree.h"
 #include "user_io.h"
 
 static void get_user_input(char *buf, int buf_size, char *print_message);
+static char* next_token(char **cursor);
+static bool parse_key(char *token, int *key);
+static char* rest_of_line(char *cursor);
+static int apply_writes(LSM_Tree *lsm_tree, Submission *batch, long *line_numbers, int count);
+static int run_read(LSM_Tree *lsm_tree, char *command, char *cursor, FILE *out);
 
 /* Retrieve the next LSM Tree System submission from a user,
  * getting input from the user where necessary and returning a
@@ -29,9 +36,11 @@ Submission* next_submission(void) {
 		return NULL;
 	}
 
-	user_submission->action = user_selection;
+	// adding with a TTL is an ADD that expires
+	user_submission->action = user_selection == 9 ? ADD : user_selection;
 
-	if (user_selection == 1 || user_selection == 2 || user_selection == 3) {
+	if (user_selection == 1 || user_selection == 2 || user_selection == 3
+			|| user_selection == 7 || user_selection == 8 || user_selection == 9) {
 		int key = get_key();
 		if (key <= 0)
 			return NULL;
@@ -40,14 +49,121 @@ Submission* next_submission(void) {
 		user_submission->key = 0;
 	}
 
-	if (user_selection == 1) {
+	// a range delete takes a second key, the last one it removes
+	if (user_selection == 7) {
+		int end_key = get_key();
+		if (end_key <= 0)
+			return NULL;
+		user_submission->end_key = end_key;
+	} else {
+		user_submission->end_key = 0;
+	}
+
+	if (user_selection == 1 || user_selection == 8 || user_selection == 9) {
 		user_submission->value = get_value();
 	} else {
 		user_submission->value = NULL;
 	}
+
+	if (user_selection == 9) {
+		int ttl = get_ttl();
+		if (ttl <= 0) {
+			free(user_submission->value);
+			free(user_submission);
+			return NULL;
+		}
+		user_submission->ttl = ttl;
+	} else {
+		user_submission->ttl = 0;
+	}
 	return user_submission;
 }
 
+/* Runs commands read from in, one per line, without menus or prompts:
+ *
+ *   put <key> <value>    merge <key> <operand>    del <key>
+ *   delrange <start> <end>    get <key>    scan <start> <end>
+ *
+ * Blank lines and lines starting with '#' are skipped. Lines are split in
+ * place, so a write's value points into the line it was read into, and
+ * consecutive writes (up to BATCH_WRITES) keep their lines and go to the
+ * tree as one batch, synced once. A read applies the writes before it
+ * first. get prints the value, or NOT_FOUND; scan prints SCAN <count> and
+ * then a <key> <value> line for each pair. Results go to out; errors name
+ * the line they are on. Returns the number of commands that failed. */
+int run_batch(LSM_Tree *lsm_tree, FILE *in, FILE *out) {
+	char *lines[BATCH_WRITES] = { NULL };
+	size_t sizes[BATCH_WRITES] = { 0 };
+	Submission batch[BATCH_WRITES];
+	long line_numbers[BATCH_WRITES];
+	int pending = 0, errors = 0;
+	long line_number = 0;
+
+	while (getline(&lines[pending], &sizes[pending], in) >= 0) {
+		line_number++;
+		char *cursor = lines[pending];
+		cursor[strcspn(cursor, "\r\n")] = '\0';
+		char *command = next_token(&cursor);
+		if (command == NULL || *command == '#')
+			continue;
+
+		Submission *write = batch + pending;
+		memset(write, 0, sizeof(Submission));
+		if (strcmp(command, "put") == 0 || strcmp(command, "merge") == 0) {
+			write->action = *command == 'p' ? ADD : MERGE;
+			if (!parse_key(next_token(&cursor), &write->key)
+					|| *(write->value = rest_of_line(cursor)) == '\0'
+					|| strlen(write->value) >= MAX_LEN_DATA) {
+				printf("Line %ld: usage: %s <key> <value>, shorter than %d characters\n",
+						line_number, command, MAX_LEN_DATA);
+				errors++;
+				continue;
+			}
+		} else if (strcmp(command, "del") == 0) {
+			write->action = DELETE;
+			if (!parse_key(next_token(&cursor), &write->key)) {
+				printf("Line %ld: usage: del <key>\n", line_number);
+				errors++;
+				continue;
+			}
+		} else if (strcmp(command, "delrange") == 0) {
+			write->action = DELETE_RANGE;
+			if (!parse_key(next_token(&cursor), &write->key)
+					|| !parse_key(next_token(&cursor), &write->end_key)) {
+				printf("Line %ld: usage: delrange <start> <end>\n", line_number);
+				errors++;
+				continue;
+			}
+		} else {
+			// reads see every write before them
+			errors += apply_writes(lsm_tree, batch, line_numbers, pending);
+			pending = 0;
+			if (run_read(lsm_tree, command, cursor, out) != 0) {
+				printf("Line %ld: unknown or malformed command: %s\n", line_number, command);
+				errors++;
+			}
+			continue;
+		}
+
+		// the write keeps its line until the batch is applied
+		line_numbers[pending++] = line_number;
+		if (pending == BATCH_WRITES) {
+			errors += apply_writes(lsm_tree, batch, line_numbers, pending);
+			pending = 0;
+		}
+	}
+	if (ferror(in)) {
+		printf("Failed to read commands after line %ld.\n", line_number);
+		errors++;
+	}
+	errors += apply_writes(lsm_tree, batch, line_numbers, pending);
+
+	for (int i = 0; i < BATCH_WRITES; i++)
+		free(lines[i]);
+	fflush(out);
+	return errors;
+}
+
 /* Print out user options */
 void print_user_options() {
 	printf("\n-----------------------------------------\n");
@@ -58,6 +174,9 @@ void print_user_options() {
 	printf(" 4. SAVE to Disk\n");
 	printf(" 5. PRINT Memtable\n");
 	printf(" 6. EXIT \n");
+	printf(" 7. DELETE a Range of Keys\n");
+	printf(" 8. MERGE a Number into a Key's Value (adds to it)\n");
+	printf(" 9. ADD New Key, Value Pair that Expires\n");
 	printf("-----------------------------------------\n");
 }
 
@@ -74,6 +193,19 @@ int get_key() {
 	return key;
 }
 
+/* Get a time to live, in seconds, from a user */
+int get_ttl() {
+	char ttl_value[MAX_LEN_KEYS];
+	get_user_input(ttl_value, MAX_LEN_KEYS, "Provide the seconds until it expires (> 0):");
+	int ttl = atoi(ttl_value);
+
+	if (ttl <= 0) {
+		printf("Please provide a numeric-only number of seconds >0.\n");
+		return -1;
+	}
+	return ttl;
+}
+
 /* Get a value from a user */
 char* get_value() {
 	char *value = (char*) malloc(sizeof(char) * MAX_LEN_DATA);
@@ -99,3 +231,82 @@ static void get_user_input(char *buf, int buf_size, char *print_message) {
 	}
 }
 
+/* Splits the next space-separated token off *cursor, in place, moving
+ * *cursor past it; NULL if the line holds no more tokens */
+static char* next_token(char **cursor) {
+	char *start = *cursor + strspn(*cursor, " \t");
+	if (*start == '\0') {
+		*cursor = start;
+		return NULL;
+	}
+	char *end = start + strcspn(start, " \t");
+	if (*end != '\0')
+		*end++ = '\0';
+	*cursor = end;
+	return start;
+}
+
+/* A value is the rest of its line, spaces and all, less the leading ones */
+static char* rest_of_line(char *cursor) {
+	return cursor + strspn(cursor, " \t");
+}
+
+/* Reads a key (numeric, > 0) from a whole token */
+static bool parse_key(char *token, int *key) {
+	if (token == NULL)
+		return false;
+	char *end;
+	long value = strtol(token, &end, 10);
+	if (*end != '\0' || value <= 0 || value > INT_MAX)
+		return false;
+	*key = (int) value;
+	return true;
+}
+
+/* Applies a batch of writes, reporting each one that fails by its line and
+ * going on with the rest; returns how many failed */
+static int apply_writes(LSM_Tree *lsm_tree, Submission *batch, long *line_numbers, int count) {
+	int done = 0, errors = 0;
+	while (done < count) {
+		done += lsm_tree_write_batch(lsm_tree, batch + done, count - done);
+		if (done < count) {
+			printf("Line %ld: write failed.\n", *(line_numbers + done));
+			done++;
+			errors++;
+		}
+	}
+	return errors;
+}
+
+/* Runs a get or scan, printing its results to out; -1 if the command is
+ * neither, or malformed */
+static int run_read(LSM_Tree *lsm_tree, char *command, char *cursor, FILE *out) {
+	int key, end_key;
+	if (strcmp(command, "get") == 0) {
+		if (!parse_key(next_token(&cursor), &key) || next_token(&cursor))
+			return -1;
+		// the value is written out from where it lies, without a copy
+		ValueSlice slice;
+		if (lsm_tree_get_slice(lsm_tree, key, NULL, &slice)) {
+			fwrite(slice.data, 1, slice.length, out);
+			fputc('\n', out);
+		} else {
+			fprintf(out, "NOT_FOUND\n");
+		}
+		release_slice(&slice);
+		return 0;
+	}
+
+	if (strcmp(command, "scan") != 0 || !parse_key(next_token(&cursor), &key)
+			|| !parse_key(next_token(&cursor), &end_key) || next_token(&cursor)
+			|| key > end_key)
+		return -1;
+	ScanIterator *scan = lsm_tree_scan(lsm_tree, key, end_key, NULL);
+	if (scan == NULL)
+		return -1;
+	fprintf(out, "SCAN %d\n", scan->count);
+	for (KeyValue *pair; (pair = scan_iterator_next(scan)); )
+		fprintf(out, "%d %s\n", pair->key, pair->value);
+	close_scan_iterator(scan);
+	return 0;
+}
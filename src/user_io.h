@@ -6,6 +6,8 @@
 #include <string.h>
 #include "lsm_tree.h"
 
+#define BATCH_WRITES 256       // consecutive writes batch mode applies at once
+
 void print_user_options();
 
 Submission* next_submission(void);
@@ -14,5 +16,9 @@ int get_key();
 
 char* get_value();
 
+int get_ttl();
+
+int run_batch(LSM_Tree *lsm_tree, FILE *in, FILE *out);
+
 #endif
 
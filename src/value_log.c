@@ -0,0 +1,375 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "value_log.h"
+#include "buffered_io.h"
+
+/* The value log keeps large values out of the memtable and segments, so that
+ * compaction only has to move keys and small pointers around (the approach of
+ * WiscKey). Values are appended to numbered files; a pointer names the file,
+ * offset and length of a value. Compaction reports the pointers it throws away
+ * as garbage, and files that are mostly garbage get rewritten or deleted. */
+
+/* prototypes for static functions */
+static int last_file_number(char *directory);
+static int open_new_file(ValueLog *vlog);
+static VLogFile* find_file(ValueLog *vlog, int number);
+static void file_name(ValueLog *vlog, int number, char *buf, int buf_size);
+static int parse_pointer(char *pointer, int *number, long *offset, int *length);
+
+
+/* Creates a value log with a fresh active file in directory, numbered past
+ * any value log files already there so that none is overwritten */
+ValueLog* init_value_log(char *directory) {
+	ValueLog *vlog = (ValueLog*) malloc(sizeof(ValueLog));
+	if (vlog == NULL) {
+		printf("Allocation of memory for value log failed.\n");
+		return NULL;
+	}
+
+	vlog->directory = strdup(directory);
+	vlog->active = NULL;
+	vlog->num_files = 0;
+	vlog->capacity = 4;
+	vlog->next_number = last_file_number(directory) + 1;
+	vlog->files = (VLogFile*) malloc(vlog->capacity * sizeof(VLogFile));
+	pthread_mutex_init(&vlog->lock, NULL);
+	if (!vlog->directory || !vlog->files) {
+		printf("Allocation of memory for value log files failed.\n");
+		free(vlog->directory);
+		free(vlog->files);
+		pthread_mutex_destroy(&vlog->lock);
+		free(vlog);
+		return NULL;
+	}
+
+	if (open_new_file(vlog) != 0) {
+		close_value_log(vlog);
+		return NULL;
+	}
+	return vlog;
+}
+
+/* Appends a value to the active value log file, writing the pointer that
+ * locates it into 'pointer' (at least VLOG_POINTER_SIZE bytes).
+ * Returns 0 on success, -1 on failure. */
+int value_log_append(ValueLog *vlog, int key, char *value, char *pointer) {
+	pthread_mutex_lock(&vlog->lock);
+	VLogFile *active = vlog->files + vlog->num_files - 1;
+	if (active->size >= VLOG_FILE_SIZE) {
+		if (open_new_file(vlog) != 0) {
+			pthread_mutex_unlock(&vlog->lock);
+			return -1;
+		}
+		active = vlog->files + vlog->num_files - 1;
+	}
+
+	VLogRecordHeader header = { key, strlen(value) };
+	if (fwrite(&header, sizeof(VLogRecordHeader), 1, vlog->active) != 1
+			|| fwrite(value, 1, header.length, vlog->active) != header.length
+			|| fflush(vlog->active) != 0) {
+		pthread_mutex_unlock(&vlog->lock);
+		printf("Failed to append value to value log.\n");
+		return -1;
+	}
+
+	snprintf(pointer, VLOG_POINTER_SIZE, "%s%d:%ld:%d", VLOG_POINTER_PREFIX,
+			active->number, active->size, header.length);
+	active->size += sizeof(VLogRecordHeader) + header.length;
+	pthread_mutex_unlock(&vlog->lock);
+	return 0;
+}
+
+/* Reads the value a pointer refers to; returns a copy that the caller
+ * must free, or NULL if the value could not be read. */
+char* value_log_read(ValueLog *vlog, char *pointer) {
+	int number, length;
+	long offset;
+	if (parse_pointer(pointer, &number, &offset, &length) != 0) {
+		printf("Malformed value log pointer: %s\n", pointer);
+		return NULL;
+	}
+
+	char filename[strlen(vlog->directory) + 32];
+	file_name(vlog, number, filename, sizeof(filename));
+
+	FILE *fp;
+	if (!(fp = fopen(filename, "r"))) {
+		printf("Could not open up value log: %s\n", filename);
+		return NULL;
+	}
+
+	char *value = (char*) malloc(length + 1);
+	if (value == NULL) {
+		printf("Failed to allocate memory for value.\n");
+		fclose(fp);
+		return NULL;
+	}
+
+	if (fseek(fp, offset + sizeof(VLogRecordHeader), SEEK_SET) != 0
+			|| fread(value, 1, length, fp) != length) {
+		printf("Failed to read value from value log: %s\n", filename);
+		free(value);
+		fclose(fp);
+		return NULL;
+	}
+	value[length] = '\0';
+	fclose(fp);
+	return value;
+}
+
+/* True if a value stored in the memtable or a segment is a value log pointer */
+bool is_value_pointer(char *value) {
+	return value != NULL && strncmp(value, VLOG_POINTER_PREFIX,
+			strlen(VLOG_POINTER_PREFIX)) == 0;
+}
+
+/* Records that a stored value was discarded (overwritten or deleted), so the
+ * bytes it points at are garbage. Non-pointer values are ignored. */
+void value_log_discard(ValueLog *vlog, char *value) {
+	int number, length;
+	long offset;
+	if (!is_value_pointer(value) || parse_pointer(value, &number, &offset, &length) != 0)
+		return;
+
+	// pointers into files that have already been collected are stale
+	pthread_mutex_lock(&vlog->lock);
+	VLogFile *file = find_file(vlog, number);
+	if (file)
+		file->garbage += sizeof(VLogRecordHeader) + length;
+	pthread_mutex_unlock(&vlog->lock);
+}
+
+/* Finds the inactive value log file with the most garbage, if it has
+ * crossed the VLOG_GC_PCT threshold, and copies it into candidate (the
+ * file list may change while the caller works on it). Returns false if
+ * no file needs collecting. */
+bool value_log_gc_candidate(ValueLog *vlog, VLogFile *candidate) {
+	VLogFile *best = NULL;
+
+	// the last file is the active one and is never collected
+	pthread_mutex_lock(&vlog->lock);
+	for (int i = 0; i < vlog->num_files - 1; i++) {
+		VLogFile *file = vlog->files + i;
+		if (file->garbage * 100 >= file->size * VLOG_GC_PCT
+				&& (!best || file->garbage > best->garbage))
+			best = file;
+	}
+	if (best)
+		*candidate = *best;
+	pthread_mutex_unlock(&vlog->lock);
+	return best != NULL;
+}
+
+/* Calls visit for every record in a value log file, passing the key, the value
+ * and the pointer that refers to it. Stops early if visit returns non-zero. */
+int value_log_scan(ValueLog *vlog, VLogFile *file,
+		int (*visit)(void *arg, int key, char *value, char *pointer), void *arg) {
+	char filename[strlen(vlog->directory) + 32];
+	file_name(vlog, file->number, filename, sizeof(filename));
+
+	FILE *fp;
+	if (!(fp = fopen(filename, "r"))) {
+		printf("Could not open up value log: %s\n", filename);
+		return -1;
+	}
+
+	VLogRecordHeader header;
+	long offset = 0;
+	int error = 0;
+
+	while (!error && offset < file->size
+			&& fread(&header, sizeof(VLogRecordHeader), 1, fp) == 1) {
+		char *value = (char*) malloc(header.length + 1);
+		if (value == NULL || fread(value, 1, header.length, fp) != header.length) {
+			printf("Failed to read record from value log: %s\n", filename);
+			free(value);
+			error = -1;
+			break;
+		}
+		value[header.length] = '\0';
+
+		char pointer[VLOG_POINTER_SIZE];
+		snprintf(pointer, VLOG_POINTER_SIZE, "%s%d:%ld:%d", VLOG_POINTER_PREFIX,
+				file->number, offset, header.length);
+		error = visit(arg, header.key, value, pointer);
+
+		free(value);
+		offset += sizeof(VLogRecordHeader) + header.length;
+	}
+	fclose(fp);
+	return error;
+}
+
+/* Deletes a value log file once nothing live points into it */
+int value_log_remove_file(ValueLog *vlog, VLogFile *file) {
+	char filename[strlen(vlog->directory) + 32];
+	file_name(vlog, file->number, filename, sizeof(filename));
+
+	if (remove(filename) != 0) {
+		printf("Value log file did not delete properly: %s\n", filename);
+		return -1;
+	}
+
+	pthread_mutex_lock(&vlog->lock);
+	VLogFile *listed = find_file(vlog, file->number);
+	if (listed) {
+		int position = listed - vlog->files;
+		memmove(listed, listed + 1, (vlog->num_files - position - 1) * sizeof(VLogFile));
+		vlog->num_files--;
+	}
+	pthread_mutex_unlock(&vlog->lock);
+	return 0;
+}
+
+/* Takes an existing value log file in the directory, such as one a
+ * checkpoint holds, into the log, so values can be read from it and it can
+ * be collected like any other. Returns 0 on success, -1 on failure. */
+int value_log_adopt(ValueLog *vlog, int number) {
+	char filename[strlen(vlog->directory) + 32];
+	file_name(vlog, number, filename, sizeof(filename));
+	struct stat info;
+	if (stat(filename, &info) != 0) {
+		printf("Missing value log file: %s\n", filename);
+		return -1;
+	}
+
+	pthread_mutex_lock(&vlog->lock);
+	if (vlog->num_files == vlog->capacity) {
+		int capacity = vlog->capacity * 2;
+		VLogFile *files = (VLogFile*) realloc(vlog->files, capacity * sizeof(VLogFile));
+		if (files == NULL) {
+			pthread_mutex_unlock(&vlog->lock);
+			printf("Failed to grow value log file list.\n");
+			return -1;
+		}
+		vlog->files = files;
+		vlog->capacity = capacity;
+	}
+
+	// the active file stays last
+	VLogFile *file = vlog->files + vlog->num_files - 1;
+	memmove(file + 1, file, sizeof(VLogFile));
+	file->number = number;
+	file->size = info.st_size;
+	file->garbage = 0;
+	vlog->num_files++;
+	pthread_mutex_unlock(&vlog->lock);
+	return 0;
+}
+
+/* Puts every value log file into a checkpoint in directory: inactive files
+ * are never written again and are hard linked, while the active file is
+ * copied up to its last value. Sets numbers to the files' numbers (for the
+ * caller to free) and returns how many there are, or -1 on failure. Called
+ * from the writer, so that no value is appended meanwhile. */
+int value_log_checkpoint(ValueLog *vlog, char *directory, int **numbers) {
+	pthread_mutex_lock(&vlog->lock);
+	int count = vlog->num_files;
+	VLogFile files[count];
+	memcpy(files, vlog->files, count * sizeof(VLogFile));
+	pthread_mutex_unlock(&vlog->lock);
+
+	if (!(*numbers = (int*) malloc(count * sizeof(int)))) {
+		printf("Failed to allocate memory for value log checkpoint.\n");
+		return -1;
+	}
+
+	for (int i = 0; i < count; i++) {
+		char from[strlen(vlog->directory) + 32], to[strlen(directory) + 32];
+		file_name(vlog, files[i].number, from, sizeof(from));
+		snprintf(to, sizeof(to), "%svlog_%d.log", directory, files[i].number);
+		int error = i < count - 1 ? link_file(from, to) : copy_file(from, to, files[i].size);
+		if (error != 0) {
+			free(*numbers);
+			return -1;
+		}
+		*(*numbers + i) = files[i].number;
+	}
+	return count;
+}
+
+/* Closes the active file and frees the value log */
+void close_value_log(ValueLog *vlog) {
+	if (vlog->active)
+		fclose(vlog->active);
+	free(vlog->directory);
+	free(vlog->files);
+	pthread_mutex_destroy(&vlog->lock);
+	free(vlog);
+}
+
+/* Starts a new active file, numbered one past the current one */
+static int open_new_file(ValueLog *vlog) {
+	int number = vlog->next_number;
+
+	if (vlog->num_files == vlog->capacity) {
+		int capacity = vlog->capacity * 2;
+		VLogFile *files = (VLogFile*) realloc(vlog->files, capacity * sizeof(VLogFile));
+		if (files == NULL) {
+			printf("Failed to grow value log file list.\n");
+			return -1;
+		}
+		vlog->files = files;
+		vlog->capacity = capacity;
+	}
+
+	char filename[strlen(vlog->directory) + 32];
+	file_name(vlog, number, filename, sizeof(filename));
+
+	FILE *fp;
+	if (!(fp = fopen(filename, "w"))) {
+		printf("Failed to open value log: %s\n", filename);
+		return -1;
+	}
+	if (vlog->active)
+		fclose(vlog->active);
+	vlog->active = fp;
+	vlog->next_number++;
+
+	VLogFile *file = vlog->files + vlog->num_files++;
+	file->number = number;
+	file->size = 0;
+	file->garbage = 0;
+	return 0;
+}
+
+/* The highest number of a value log file in directory, or -1 if there is none */
+static int last_file_number(char *directory) {
+	int last = -1;
+	DIR *dir = opendir(directory);
+	if (dir == NULL)
+		return last;
+
+	for (struct dirent *entry; (entry = readdir(dir)); ) {
+		int number, end = 0;
+		if (sscanf(entry->d_name, "vlog_%d.log%n", &number, &end) == 1 && end > 0
+				&& entry->d_name[end] == '\0' && number > last)
+			last = number;
+	}
+	closedir(dir);
+	return last;
+}
+
+static VLogFile* find_file(ValueLog *vlog, int number) {
+	for (int i = 0; i < vlog->num_files; i++) {
+		if (vlog->files[i].number == number)
+			return vlog->files + i;
+	}
+	return NULL;
+}
+
+static void file_name(ValueLog *vlog, int number, char *buf, int buf_size) {
+	snprintf(buf, buf_size, "%svlog_%d.log", vlog->directory, number);
+}
+
+static int parse_pointer(char *pointer, int *number, long *offset, int *length) {
+	int prefix = strlen(VLOG_POINTER_PREFIX);
+	if (sscanf(pointer + prefix, "%d:%ld:%d", number, offset, length) != 3)
+		return -1;
+	return 0;
+}
@@ -0,0 +1,61 @@
+#ifndef CUSTOM_VALUE_LOG_H
+#define CUSTOM_VALUE_LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define VLOG_POINTER_PREFIX "*@"       // marks a value that lives in the value log
+#define VLOG_POINTER_SIZE 40           // room for "*@<file>:<offset>:<length>"
+#define VLOG_FILE_SIZE (1 << 20)       // start a new value log file past this many bytes
+#define VLOG_GC_PCT 50                 // rewrite a value log file once this % is garbage
+
+/* each value log record is a small header followed by the raw value bytes */
+typedef struct vlog_record_header {
+	int32_t key;
+	int32_t length;
+} VLogRecordHeader;
+
+typedef struct value_log_file {
+	int number;
+	long size;
+	long garbage;
+} VLogFile;
+
+/* the file list is shared with background compaction, which reports
+ * garbage from its own thread, so it is guarded by lock */
+typedef struct value_log {
+	char *directory;
+	FILE *active;
+	VLogFile *files;
+	int num_files;
+	int capacity;
+	int next_number;               // of the next file to be started
+	pthread_mutex_t lock;
+} ValueLog;
+
+ValueLog* init_value_log(char *directory);
+
+int value_log_append(ValueLog *vlog, int key, char *value, char *pointer);
+
+char* value_log_read(ValueLog *vlog, char *pointer);
+
+bool is_value_pointer(char *value);
+
+void value_log_discard(ValueLog *vlog, char *value);
+
+bool value_log_gc_candidate(ValueLog *vlog, VLogFile *candidate);
+
+int value_log_scan(ValueLog *vlog, VLogFile *file,
+		int (*visit)(void *arg, int key, char *value, char *pointer), void *arg);
+
+int value_log_remove_file(ValueLog *vlog, VLogFile *file);
+
+int value_log_adopt(ValueLog *vlog, int number);
+
+int value_log_checkpoint(ValueLog *vlog, char *directory, int **numbers);
+
+void close_value_log(ValueLog *vlog);
+
+#endif
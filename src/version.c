@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#include "version.h"
+#include "segment.h"
+
+
+/* Wraps a segment file name (ownership of which passes to the segment),
+ * loading its fence pointers into fence_storage, and mapping the whole file
+ * with map_data; if they can't be read, lookups fall back to reading the
+ * segment's block index, and the segment may hold any key */
+Segment* new_segment(char *filename, int fence_storage, bool map_data) {
+	Segment *segment = (Segment*) malloc(sizeof(Segment));
+	if (segment == NULL) {
+		printf("Failed to allocate memory for segment.\n");
+		return NULL;
+	}
+
+	segment->filename = filename;
+	atomic_init(&segment->refs, 1);
+	atomic_init(&segment->obsolete, false);
+	atomic_init(&segment->compacted, false);
+	atomic_init(&segment->probes, 0);
+	atomic_init(&segment->wasted_probes, 0);
+	struct stat info;
+	segment->size = stat(filename, &info) == 0 ? info.st_size : 0;
+	segment->fences = load_segment_fences(filename, fence_storage, map_data);
+	segment->low_key = segment->fences ? segment->fences->low_key : INT_MIN;
+	segment->high_key = segment->fences ? segment->fences->high_key : INT_MAX;
+	return segment;
+}
+
+void ref_segment(Segment *segment) {
+	atomic_fetch_add(&segment->refs, 1);
+}
+
+/* Drops a reference to a segment; the last reference to an obsolete
+ * segment deletes its file. */
+void unref_segment(Segment *segment) {
+	if (atomic_fetch_sub(&segment->refs, 1) != 1)
+		return;
+
+	if (atomic_load(&segment->obsolete))
+		delete_segment(segment->filename);
+	free_segment_fences(segment->fences);
+	free(segment->filename);
+	free(segment);
+}
+
+/* Creates a version holding (and referencing) the given segments; the
+ * caller owns the version's first reference. */
+Version* new_version(Segment **segments, int num_segments) {
+	Version *version = (Version*) malloc(sizeof(Version));
+	if (version == NULL) {
+		printf("Failed to allocate memory for version.\n");
+		return NULL;
+	}
+
+	version->segments = (Segment**) malloc((num_segments ? num_segments : 1)
+			* sizeof(Segment*));
+	if (version->segments == NULL) {
+		printf("Failed to allocate memory for version segments.\n");
+		free(version);
+		return NULL;
+	}
+
+	for (int i = 0; i < num_segments; i++) {
+		*(version->segments + i) = *(segments + i);
+		ref_segment(*(segments + i));
+	}
+	version->num_segments = num_segments;
+	atomic_init(&version->refs, 1);
+	return version;
+}
+
+/* Builds the version that follows a flush: base plus one newer segment */
+Version* version_with_segment(Version *base, Segment *segment) {
+	Segment *segments[base->num_segments + 1];
+	for (int i = 0; i < base->num_segments; i++)
+		segments[i] = *(base->segments + i);
+	segments[base->num_segments] = segment;
+
+	return new_version(segments, base->num_segments + 1);
+}
+
+void ref_version(Version *version) {
+	atomic_fetch_add(&version->refs, 1);
+}
+
+/* Drops a reference to a version, releasing its segments with the last one */
+void unref_version(Version *version) {
+	if (atomic_fetch_sub(&version->refs, 1) != 1)
+		return;
+
+	for (int i = 0; i < version->num_segments; i++)
+		unref_segment(*(version->segments + i));
+	free(version->segments);
+	free(version);
+}
@@ -0,0 +1,56 @@
+#ifndef CUSTOM_VERSION_H
+#define CUSTOM_VERSION_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "segment.h"
+
+/* A segment file on disk. Segments are shared by every version that lists
+ * them (and by readers pinning them through a version); once compaction has
+ * replaced a segment it is marked obsolete, and the file is deleted when the
+ * last reference goes away. A live segment keeps its fence pointers in
+ * memory, and lookups skip it for keys outside [low_key, high_key].
+ * Compaction outputs hold disjoint key ranges and together count as a
+ * single sorted run; a segment that overlaps no other joins the run as it
+ * is, so compacted can change while readers hold it. A reader can also pin
+ * a single segment, for a value it reads in place from the mapped file.
+ * Readers count the lookups that read a block of the segment, and those
+ * that found no version of their key there, for the compaction scheduler. */
+typedef struct segment {
+	char *filename;
+	atomic_int refs;
+	atomic_bool obsolete;
+	atomic_bool compacted;
+	long size;
+	int low_key;
+	int high_key;
+	SegmentFences *fences;
+	atomic_long probes;
+	atomic_long wasted_probes;
+} Segment;
+
+/* An immutable set of segments, oldest first. The LSM tree always has one
+ * current version; flush and compaction build a new one and swap it in,
+ * while readers keep whichever version they acquired alive until released. */
+typedef struct version {
+	Segment **segments;
+	int num_segments;
+	atomic_int refs;
+} Version;
+
+Segment* new_segment(char *filename, int fence_storage, bool map_data);
+
+void ref_segment(Segment *segment);
+
+void unref_segment(Segment *segment);
+
+Version* new_version(Segment **segments, int num_segments);
+
+Version* version_with_segment(Version *base, Segment *segment);
+
+void ref_version(Version *version);
+
+void unref_version(Version *version);
+
+#endif
@@ -1,38 +1,280 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
 
 #include "wal.h"
 
+// prototypes for static functions
+static long last_file_number(char *directory);
+static int open_file(WAL *wal, long number);
+static void file_name(WAL *wal, long number, char *buf, int buf_size);
+static void sync_directory(WAL *wal);
+static bool next_record(FILE *fp, long number, char *line, int line_size, long *sequence,
+		int *action, int *key, char **value);
 
-/* Initializes the WAL log*/
-FILE * init_wal(char *filename) {
-	FILE *wal;
 
-	if (!(wal = fopen(filename, "a"))) {
+/* Initializes the WAL in directory, starting a file numbered past any
+ * already there, so that earlier logs are left as they were */
+WAL* init_wal(char *directory) {
+	WAL *wal = (WAL*) malloc(sizeof(WAL));
+	if (wal == NULL) {
+		printf("Allocation of memory for WAL failed.\n");
+		return NULL;
+	}
+
+	wal->directory = strdup(directory);
+	wal->file = NULL;
+	wal->num_recycled = 0;
+	wal->written = 0;
+	pthread_mutex_init(&wal->lock, NULL);
+	if (!wal->directory || open_file(wal, last_file_number(directory) + 1) != 0) {
 		printf("Failed to open WAL log.\n");
+		close_wal(wal);
 		return NULL;
 	}
 	return wal;
 }
 
-/* Writes key, value pair to write ahead log */
-int submission_to_wal(FILE *wal, int action, int key,
-		              char *value, int max_line_size, bool flush_immediately) {
+/* Writes key, value pair to write ahead log, with the sequence number
+ * the write was assigned, syncing it as the policy asks */
+int submission_to_wal(WAL *wal, long sequence, int action, int key,
+		              char *value, int max_line_size, int sync) {
 
 	char to_write[max_line_size];
-	sprintf(to_write, "%d - %d:%d,%s", (int) time(0), action, key, value);
-	fprintf(wal, "%s\n", to_write);
+	snprintf(to_write, max_line_size, "%d - %ld %ld %d:%d,%s", (int) time(0), wal->number,
+			sequence, action, key, value);
+	int length = fprintf(wal->file, "%s\n", to_write);
+	wal->written += length > 0 ? length : 0;
+	return wal_sync(wal, sync);
+}
 
+/* Pushes the records appended so far as far as the sync policy asks: to
+ * the OS, or on to stable storage. A batch of writes is logged without
+ * syncing and then synced once. Returns 0 on success. */
+int wal_sync(WAL *wal, int sync) {
 	// if user specifies, flush immediately to disk
-	if (flush_immediately) {
-		int error = fflush(wal);
+	if (sync >= WAL_SYNC_FLUSH) {
+		int error = fflush(wal->file);
 		if (error) {
 			printf("Could not flush WAL to disk (Error: %d).\n", error);
 			return error;
 		}
 	}
+
+	// the file is written within its preallocated size, so only its data
+	// needs syncing
+	if (sync == WAL_SYNC_FSYNC && fdatasync(fileno(wal->file)) != 0) {
+		printf("Could not sync WAL to disk.\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Starts the next WAL file, for the writes of a new memtable; the file
+ * being closed holds the writes of the one just filled. It is synced as the
+ * policy asks first, as a batch may have left its last records unsynced.
+ * Returns 0 on success, -1 on failure. */
+int wal_rotate(WAL *wal, int sync) {
+	if (wal_sync(wal, sync > WAL_SYNC_FLUSH ? sync : WAL_SYNC_FLUSH) != 0)
+		return -1;
+	return open_file(wal, wal->number + 1);
+}
+
+/* Retires a WAL file whose writes are all durable in a segment: it is kept
+ * to be written over as a later file, or deleted if enough already are. */
+int wal_retire(WAL *wal, long number) {
+	char filename[strlen(wal->directory) + 32];
+	file_name(wal, number, filename, sizeof(filename));
+
+	pthread_mutex_lock(&wal->lock);
+	if (wal->num_recycled < WAL_RECYCLE_FILES) {
+		wal->recycled[wal->num_recycled++] = number;
+		pthread_mutex_unlock(&wal->lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&wal->lock);
+
+	if (remove(filename) != 0) {
+		printf("Could not delete WAL file: %s\n", filename);
+		return -1;
+	}
+	return 0;
+}
+
+/* Copies the records of WAL files first up to the one being written into
+ * a checkpoint in directory, under the same names. Only whole records of
+ * each file's own are copied, so preallocated space and what a recycled
+ * file held before are left behind. Called from the writer, so that no
+ * record is appended meanwhile. Returns 0 on success, -1 on failure. */
+int wal_checkpoint(WAL *wal, long first, char *directory, int max_line_size) {
+	if (fflush(wal->file) != 0) {
+		printf("Could not flush WAL to disk.\n");
+		return -1;
+	}
+
+	for (long number = first; number <= wal->number; number++) {
+		char from[strlen(wal->directory) + 32], to[strlen(directory) + 32];
+		file_name(wal, number, from, sizeof(from));
+		snprintf(to, sizeof(to), "%swal_%ld.log", directory, number);
+
+		FILE *in = fopen(from, "r");
+		FILE *out = fopen(to, "w");
+		int error = in && out ? 0 : -1;
+		char line[max_line_size + 1];
+		long sequence;
+		int action, key;
+		char *value;
+		while (!error && next_record(in, number, line, sizeof(line), &sequence, &action,
+				&key, &value))
+			error = fprintf(out, "%s\n", line) < 0 ? -1 : 0;
+		if (out && (fflush(out) != 0 || fsync(fileno(out)) != 0))
+			error = -1;
+		if (in)
+			fclose(in);
+		if (out)
+			fclose(out);
+		if (error) {
+			printf("Could not copy WAL file %s to checkpoint.\n", from);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Calls visit with every write WAL file number holds, such as one a
+ * checkpoint left, stopping at the first record that is torn or was left
+ * over from the file's earlier life, or early if visit returns non-zero.
+ * The file must not be the one being written. */
+int wal_replay(WAL *wal, long number, int max_line_size, wal_visitor visit, void *arg) {
+	char filename[strlen(wal->directory) + 32];
+	file_name(wal, number, filename, sizeof(filename));
+	FILE *fp = fopen(filename, "r");
+	if (fp == NULL) {
+		printf("Could not open WAL file: %s\n", filename);
+		return -1;
+	}
+
+	char line[max_line_size + 1];
+	long sequence;
+	int action, key, error = 0;
+	char *value;
+	while (!error && next_record(fp, number, line, sizeof(line), &sequence, &action, &key,
+			&value))
+		error = visit(arg, sequence, action, key, value);
+	fclose(fp);
+	return error;
+}
+
+/* Closes the WAL. The file being written stays behind; retired files held
+ * for reuse only ever held writes that are durable elsewhere, so they go. */
+void close_wal(WAL *wal) {
+	if (wal->file)
+		fclose(wal->file);
+	for (int i = 0; i < wal->num_recycled && wal->directory; i++) {
+		char filename[strlen(wal->directory) + 32];
+		file_name(wal, wal->recycled[i], filename, sizeof(filename));
+		remove(filename);
+	}
+	pthread_mutex_destroy(&wal->lock);
+	free(wal->directory);
+	free(wal);
+}
+
+/* The highest number of a WAL file in directory, or -1 if there is none */
+static long last_file_number(char *directory) {
+	long last = -1;
+	DIR *dir = opendir(directory);
+	if (dir == NULL)
+		return last;
+
+	for (struct dirent *entry; (entry = readdir(dir)); ) {
+		long number;
+		int end = 0;
+		if (sscanf(entry->d_name, "wal_%ld.log%n", &number, &end) == 1 && end > 0
+				&& entry->d_name[end] == '\0' && number > last)
+			last = number;
+	}
+	closedir(dir);
+	return last;
+}
+
+/* Makes file number the one being written: a retired file is renamed to
+ * it and written over from the start, or else a new file is preallocated */
+static int open_file(WAL *wal, long number) {
+	char filename[strlen(wal->directory) + 32];
+	file_name(wal, number, filename, sizeof(filename));
+
+	long reused = -1;
+	pthread_mutex_lock(&wal->lock);
+	if (wal->num_recycled > 0)
+		reused = wal->recycled[--wal->num_recycled];
+	pthread_mutex_unlock(&wal->lock);
+
+	FILE *fp = NULL;
+	if (reused >= 0) {
+		char old_name[strlen(wal->directory) + 32];
+		file_name(wal, reused, old_name, sizeof(old_name));
+		if (rename(old_name, filename) == 0)
+			fp = fopen(filename, "r+");
+		else
+			remove(old_name);
+	}
+	if (fp == NULL) {
+		int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			printf("Failed to open WAL file: %s\n", filename);
+			return -1;
+		}
+
+		// preallocation only saves work later, so a file system without it is fine
+		posix_fallocate(fd, 0, WAL_FILE_SIZE);
+		if (!(fp = fdopen(fd, "r+"))) {
+			printf("Failed to open WAL file: %s\n", filename);
+			close(fd);
+			return -1;
+		}
+	}
+	sync_directory(wal);
+
+	if (wal->file)
+		fclose(wal->file);
+	wal->file = fp;
+	wal->number = number;
 	return 0;
 }
 
+/* Reads the next record of WAL file number into line (without its newline),
+ * pointing value into it; false at the end of the file's own records */
+static bool next_record(FILE *fp, long number, char *line, int line_size, long *sequence,
+		int *action, int *key, char **value) {
+	if (!fgets(line, line_size, fp))
+		return false;
+	int length = strlen(line), start = 0;
+	long written;
+	if (length == 0 || line[length - 1] != '\n'
+			|| sscanf(line, "%*d - %ld %ld %d:%d,%n", &written, sequence, action, key,
+					&start) != 4 || start == 0 || written != number)
+		return false;
+
+	line[length - 1] = '\0';
+	*value = line + start;
+	return true;
+}
+
+static void file_name(WAL *wal, long number, char *buf, int buf_size) {
+	snprintf(buf, buf_size, "%swal_%ld.log", wal->directory, number);
+}
+
+/* Makes a created or renamed WAL file's name durable */
+static void sync_directory(WAL *wal) {
+	int fd = open(wal->directory, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return;
+	fsync(fd);
+	close(fd);
+}
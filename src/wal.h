@@ -1,9 +1,55 @@
 #ifndef CUSTOM_WAL_H
 #define CUSTOM_WAL_H
 
-FILE * init_wal(char *filename);
+#include <stdio.h>
+#include <pthread.h>
 
-int submission_to_wal(FILE *wal, int action, int key,
-		              char *value, int max_line_size, bool flush_immediately);
+#define WAL_FILE_SIZE (4L << 20)       // bytes a new WAL file is preallocated to
+#define WAL_RECYCLE_FILES 2            // retired WAL files kept around for reuse
+
+/* how far a WAL record is pushed before the write is acknowledged: left in
+ * the stdio buffer, handed to the OS, or forced to stable storage */
+enum wal_sync_policies {
+	WAL_SYNC_NONE, WAL_SYNC_FLUSH, WAL_SYNC_FSYNC
+};
+
+/* The WAL is a series of numbered files, wal_<number>.log; writes go to
+ * the newest. A file is started whenever a memtable fills up, so each
+ * memtable's writes sit in one file, which is retired once the memtable's
+ * segment is durable. Retired files are renamed and written over in place
+ * of new ones, and new files are preallocated, so appends rarely change a
+ * file's size or allocation. Every record carries the number of the file
+ * it was written to, which tells it apart from the leftovers of a file's
+ * earlier life. The writer appends and rotates; the flush thread retires,
+ * so the recycled list is guarded by lock. */
+typedef struct write_ahead_log {
+	char *directory;
+	FILE *file;
+	long number;                   // of the file being written
+	long written;                  // bytes of records appended, across every file
+	long recycled[WAL_RECYCLE_FILES];
+	int num_recycled;
+	pthread_mutex_t lock;
+} WAL;
+
+/* called with each write a WAL file holds, in the order they were made */
+typedef int (*wal_visitor)(void *arg, long sequence, int action, int key, char *value);
+
+WAL* init_wal(char *directory);
+
+int submission_to_wal(WAL *wal, long sequence, int action, int key,
+		              char *value, int max_line_size, int sync);
+
+int wal_sync(WAL *wal, int sync);
+
+int wal_rotate(WAL *wal, int sync);
+
+int wal_retire(WAL *wal, long number);
+
+int wal_checkpoint(WAL *wal, long first, char *directory, int max_line_size);
+
+int wal_replay(WAL *wal, long number, int max_line_size, wal_visitor visit, void *arg);
+
+void close_wal(WAL *wal);
 
 #endif
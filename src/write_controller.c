@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "write_controller.h"
+
+// prototypes for static functions
+static double pressure(WriteController *controller);
+static double fraction(double value, double slowdown, double stop);
+static long elapsed_ns(struct timespec *from, struct timespec *to);
+
+
+/* Creates a controller that starts delaying writes once any measure of debt
+ * reaches its slowdown threshold and stops them at its stop threshold */
+WriteController* init_write_controller(WriteDebt *slowdown, WriteDebt *stop,
+		long max_delay_us) {
+	WriteController *controller = (WriteController*) malloc(sizeof(WriteController));
+	if (controller == NULL) {
+		printf("Allocation of memory for write controller failed.\n");
+		return NULL;
+	}
+
+	pthread_mutex_init(&controller->lock, NULL);
+	pthread_cond_init(&controller->relieved, NULL);
+	controller->slowdown = *slowdown;
+	controller->stop = *stop;
+	controller->max_delay_ns = max_delay_us * 1000;
+	controller->debt = (WriteDebt) { 0, 0, 0 };
+	controller->released = false;
+	atomic_init(&controller->delayed_writes, 0);
+	atomic_init(&controller->delayed_ns, 0);
+	atomic_init(&controller->stopped_writes, 0);
+	atomic_init(&controller->stopped_ns, 0);
+	return controller;
+}
+
+/* Records the latest debt, waking stopped writers if it has come down */
+void write_controller_update(WriteController *controller, WriteDebt *debt) {
+	pthread_mutex_lock(&controller->lock);
+	controller->debt = *debt;
+	pthread_cond_broadcast(&controller->relieved);
+	pthread_mutex_unlock(&controller->lock);
+}
+
+/* Called before every write: waits while the debt is at a stop threshold,
+ * then sleeps for the delay the current debt calls for */
+void write_controller_admit(WriteController *controller) {
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pthread_mutex_lock(&controller->lock);
+	if (pressure(controller) >= 1 && !controller->released) {
+		while (pressure(controller) >= 1 && !controller->released)
+			pthread_cond_wait(&controller->relieved, &controller->lock);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		atomic_fetch_add(&controller->stopped_writes, 1);
+		atomic_fetch_add(&controller->stopped_ns, elapsed_ns(&start, &now));
+	}
+	long delay_ns = controller->released ? 0
+			: (long) (pressure(controller) * controller->max_delay_ns);
+	pthread_mutex_unlock(&controller->lock);
+
+	if (delay_ns > 0) {
+		struct timespec delay = { delay_ns / 1000000000L, delay_ns % 1000000000L };
+		nanosleep(&delay, NULL);
+		atomic_fetch_add(&controller->delayed_writes, 1);
+		atomic_fetch_add(&controller->delayed_ns, delay_ns);
+	}
+}
+
+/* How hard writes are being held back: 0 when free, 1 when stopped */
+double write_controller_pressure(WriteController *controller) {
+	pthread_mutex_lock(&controller->lock);
+	double current = pressure(controller);
+	pthread_mutex_unlock(&controller->lock);
+	return current;
+}
+
+/* Lets every waiting and future writer through; for shutdown, once the
+ * background work that would relieve the debt has stopped */
+void write_controller_release(WriteController *controller) {
+	pthread_mutex_lock(&controller->lock);
+	controller->released = true;
+	pthread_cond_broadcast(&controller->relieved);
+	pthread_mutex_unlock(&controller->lock);
+}
+
+void close_write_controller(WriteController *controller) {
+	pthread_mutex_destroy(&controller->lock);
+	pthread_cond_destroy(&controller->relieved);
+	free(controller);
+}
+
+/* The largest fraction of the way from slowdown to stop over every measure */
+static double pressure(WriteController *controller) {
+	WriteDebt *debt = &controller->debt;
+	WriteDebt *slowdown = &controller->slowdown, *stop = &controller->stop;
+
+	// counts take a step per unit, so one at its slowdown threshold is
+	// already delayed and one at its stop threshold is stopped
+	double most = fraction(debt->immutable_memtables + 1,
+			slowdown->immutable_memtables, stop->immutable_memtables + 1);
+	double l0 = fraction(debt->l0_segments + 1, slowdown->l0_segments,
+			stop->l0_segments + 1);
+	double bytes = fraction(debt->pending_compaction_bytes,
+			slowdown->pending_compaction_bytes, stop->pending_compaction_bytes);
+	if (l0 > most)
+		most = l0;
+	if (bytes > most)
+		most = bytes;
+	return most;
+}
+
+static double fraction(double value, double slowdown, double stop) {
+	if (value < slowdown)
+		return 0;
+	if (value >= stop || stop <= slowdown)
+		return 1;
+	return (value - slowdown) / (stop - slowdown);
+}
+
+static long elapsed_ns(struct timespec *from, struct timespec *to) {
+	return (to->tv_sec - from->tv_sec) * 1000000000L + (to->tv_nsec - from->tv_nsec);
+}
@@ -0,0 +1,48 @@
+#ifndef CUSTOM_WRITE_CONTROLLER_H
+#define CUSTOM_WRITE_CONTROLLER_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* the work background flush and compaction have yet to catch up on */
+typedef struct write_debt {
+	int immutable_memtables;       // full memtables waiting to be flushed
+	int l0_segments;               // flushed segments not yet compacted
+	long pending_compaction_bytes; // bytes in those segments
+} WriteDebt;
+
+/* Holds writers back while flush and compaction fall behind. Below every
+ * slowdown threshold writes pass freely; between the slowdown and stop
+ * thresholds of any measure, each write is delayed in proportion to how far
+ * along that range the debt is (up to max_delay_ns); at a stop threshold
+ * writes wait until background work brings the debt back under it. The
+ * time writers spend delayed and stopped is counted for the status report. */
+typedef struct write_controller {
+	pthread_mutex_t lock;
+	pthread_cond_t relieved;
+	WriteDebt slowdown;
+	WriteDebt stop;
+	long max_delay_ns;
+	WriteDebt debt;
+	bool released;                 // shutting down; nobody is left to relieve debt
+	atomic_long delayed_writes;
+	atomic_long delayed_ns;
+	atomic_long stopped_writes;
+	atomic_long stopped_ns;
+} WriteController;
+
+WriteController* init_write_controller(WriteDebt *slowdown, WriteDebt *stop,
+		long max_delay_us);
+
+void write_controller_update(WriteController *controller, WriteDebt *debt);
+
+void write_controller_admit(WriteController *controller);
+
+double write_controller_pressure(WriteController *controller);
+
+void write_controller_release(WriteController *controller);
+
+void close_write_controller(WriteController *controller);
+
+#endif